@@ -48,6 +48,7 @@
 #include "kvm-cpus.h"
 #include "sysemu/dirtylimit.h"
 #include "qemu/range.h"
+#include "qemu/xxhash.h"
 
 #include "hw/boards.h"
 #include "sysemu/stats.h"
@@ -281,7 +282,13 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram,
     return ret;
 }
 
-static int kvm_set_user_memory_region(KVMMemoryListener *kml, KVMSlot *slot, bool new)
+/*
+ * With @move, the slot is being moved to another guest address.  Older
+ * kernels refuse that with EINVAL, which the caller handles, so it is
+ * not reported.
+ */
+static int kvm_do_set_user_memory_region(KVMMemoryListener *kml,
+                                         KVMSlot *slot, bool new, bool move)
 {
     KVMState *s = kvm_state;
     struct kvm_userspace_memory_region2 mem;
@@ -320,7 +327,7 @@ err:
                               mem.guest_phys_addr, mem.memory_size,
                               mem.userspace_addr, mem.guest_memfd,
                               mem.guest_memfd_offset, ret);
-    if (ret < 0) {
+    if (ret < 0 && !(move && ret == -EINVAL)) {
         if (kvm_guest_memfd_supported) {
                 error_report("%s: KVM_SET_USER_MEMORY_REGION2 failed, slot=%d,"
                         " start=0x%" PRIx64 ", size=0x%" PRIx64 ","
@@ -340,6 +347,12 @@ err:
     return ret;
 }
 
+static int kvm_set_user_memory_region(KVMMemoryListener *kml, KVMSlot *slot,
+                                      bool new)
+{
+    return kvm_do_set_user_memory_region(kml, slot, new, false);
+}
+
 void kvm_park_vcpu(CPUState *cpu)
 {
     struct KVMParkedVcpu *vcpu;
@@ -411,6 +424,12 @@ int kvm_create_and_park_vcpu(CPUState *cpu)
     return ret;
 }
 
+static struct KVMDirtyRingReaper *kvm_dirty_ring_reaper_of(KVMState *s,
+                                                           CPUState *cpu)
+{
+    return &s->reapers[cpu->cpu_index % s->nr_reapers];
+}
+
 static int do_kvm_destroy_vcpu(CPUState *cpu)
 {
     KVMState *s = kvm_state;
@@ -437,7 +456,13 @@ static int do_kvm_destroy_vcpu(CPUState *cpu)
     }
 
     if (cpu->kvm_dirty_gfns) {
+        struct KVMDirtyRingReaper *r = kvm_dirty_ring_reaper_of(s, cpu);
+
+        /* Make sure that no reaper is walking the ring */
+        qemu_mutex_lock(&r->lock);
         ret = munmap(cpu->kvm_dirty_gfns, s->kvm_dirty_ring_bytes);
+        cpu->kvm_dirty_gfns = NULL;
+        qemu_mutex_unlock(&r->lock);
         if (ret < 0) {
             goto err;
         }
@@ -744,11 +769,19 @@ static void dirty_gfn_set_collected(struct kvm_dirty_gfn *gfn)
     qatomic_store_release(&gfn->flags, KVM_DIRTY_GFN_F_RESET);
 }
 
+/* A dirty gfn collected from a ring, as found in struct kvm_dirty_gfn */
+typedef struct KVMDirtyGFN {
+    uint32_t slot;
+    uint64_t offset;
+} KVMDirtyGFN;
+
 /*
- * Should be with all slots_lock held for the address spaces.  It returns the
- * dirty page we've collected on this dirty ring.
+ * Should be with the lock of the reaper owning @cpu held.  The dirty
+ * gfns are only collected into the reaper, see kvm_dirty_ring_publish().
+ * It returns the dirty page we've collected on this dirty ring.
  */
-static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu,
+                                        struct KVMDirtyRingReaper *r)
 {
     struct kvm_dirty_gfn *dirty_gfns = cpu->kvm_dirty_gfns, *cur;
     uint32_t ring_size = s->kvm_dirty_ring_size;
@@ -757,22 +790,26 @@ static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
     /*
      * It's possible that we race with vcpu creation code where the vcpu is
      * put onto the vcpus list but not yet initialized the dirty ring
-     * structures.  If so, skip it.
+     * structures, or with vcpu destruction that already unmapped the
+     * ring.  If so, skip it.
      */
-    if (!cpu->created) {
+    if (!cpu->created || !dirty_gfns) {
         return 0;
     }
 
-    assert(dirty_gfns && ring_size);
+    assert(ring_size);
     trace_kvm_dirty_ring_reap_vcpu(cpu->cpu_index);
 
     while (true) {
+        KVMDirtyGFN gfn;
+
         cur = &dirty_gfns[fetch % ring_size];
         if (!dirty_gfn_is_dirtied(cur)) {
             break;
         }
-        kvm_dirty_ring_mark_page(s, cur->slot >> 16, cur->slot & 0xffff,
-                                 cur->offset);
+        gfn.slot = cur->slot;
+        gfn.offset = cur->offset;
+        g_array_append_val(r->collected, gfn);
         dirty_gfn_set_collected(cur);
         trace_kvm_dirty_ring_page(cpu->cpu_index, fetch, cur->offset);
         fetch++;
@@ -784,31 +821,83 @@ static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
     return count;
 }
 
-/* Must be with slots_lock held */
-static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState* cpu)
+/*
+ * Collect the rings owned by @r, or only the one of @cpu if not NULL,
+ * and give the collected entries back to KVM.  Must be with r->lock
+ * held, so that every gfn in r->collected has been re-protected by the
+ * time the lock is released.
+ */
+static uint64_t kvm_dirty_ring_collect(KVMState *s,
+                                       struct KVMDirtyRingReaper *r,
+                                       CPUState *cpu)
 {
-    int ret;
     uint64_t total = 0;
-    int64_t stamp;
-
-    stamp = get_clock();
+    int ret;
 
     if (cpu) {
-        total = kvm_dirty_ring_reap_one(s, cpu);
+        total = kvm_dirty_ring_reap_one(s, cpu, r);
     } else {
-        CPU_FOREACH(cpu) {
-            total += kvm_dirty_ring_reap_one(s, cpu);
+        WITH_RCU_READ_LOCK_GUARD() {
+            CPU_FOREACH(cpu) {
+                if (kvm_dirty_ring_reaper_of(s, cpu) == r) {
+                    total += kvm_dirty_ring_reap_one(s, cpu, r);
+                }
+            }
         }
     }
 
     if (total) {
+        /*
+         * The reset covers the rings of all vcpus, so it may also give
+         * back entries collected concurrently by other reapers, and
+         * find some of ours already given back.
+         */
         ret = kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
-        assert(ret == total);
+        assert(ret >= 0);
+    }
+
+    return total;
+}
+
+/*
+ * Publish the dirty gfns collected by @r to the KVMSlot dirty bitmaps.
+ * Must be with all slots_lock held for the address spaces, and r->lock.
+ */
+static void kvm_dirty_ring_publish(KVMState *s, struct KVMDirtyRingReaper *r)
+{
+    guint i;
+
+    for (i = 0; i < r->collected->len; i++) {
+        KVMDirtyGFN *gfn = &g_array_index(r->collected, KVMDirtyGFN, i);
+
+        kvm_dirty_ring_mark_page(s, gfn->slot >> 16, gfn->slot & 0xffff,
+                                 gfn->offset);
+    }
+    g_array_set_size(r->collected, 0);
+}
+
+/* Must be with slots_lock held */
+static uint64_t kvm_dirty_ring_reap_locked(KVMState *s)
+{
+    uint64_t total = 0;
+    int64_t stamp;
+    uint32_t i;
+
+    stamp = get_clock();
+
+    for (i = 0; i < s->nr_reapers; i++) {
+        struct KVMDirtyRingReaper *r = &s->reapers[i];
+
+        qemu_mutex_lock(&r->lock);
+        total += kvm_dirty_ring_collect(s, r, NULL);
+        kvm_dirty_ring_publish(s, r);
+        qemu_mutex_unlock(&r->lock);
     }
 
     stamp = get_clock() - stamp;
 
     if (total) {
+        qatomic_add(&s->dirty_ring_reaped_pages, total);
         trace_kvm_dirty_ring_reap(total, stamp / 1000);
     }
 
@@ -816,12 +905,25 @@ static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState* cpu)
 }
 
 /*
- * Currently for simplicity, we must hold BQL before calling this.  We can
- * consider to drop the BQL if we're clear with all the race conditions.
+ * Reap the rings owned by @r, or only the one of @cpu if not NULL.  This
+ * doesn't need the BQL, and only serializes with the reapers of other
+ * vcpus while publishing the dirty bits.
  */
-static uint64_t kvm_dirty_ring_reap(KVMState *s, CPUState *cpu)
+static uint64_t kvm_dirty_ring_reap(KVMState *s, struct KVMDirtyRingReaper *r,
+                                    CPUState *cpu)
 {
     uint64_t total;
+    int64_t stamp;
+
+    stamp = get_clock();
+
+    qemu_mutex_lock(&r->lock);
+    total = kvm_dirty_ring_collect(s, r, cpu);
+    qemu_mutex_unlock(&r->lock);
+
+    if (!total) {
+        return 0;
+    }
 
     /*
      * We need to lock all kvm slots for all address spaces here,
@@ -831,20 +933,37 @@ static uint64_t kvm_dirty_ring_reap(KVMState *s, CPUState *cpu)
      *     and for tons of pages, so it's better to take the lock here
      *     once rather than once per page.  And more importantly,
      *
-     * (2) We must _NOT_ publish dirty bits to the other threads
-     *     (e.g., the migration thread) via the kvm memory slot dirty
-     *     bitmaps before correctly re-protect those dirtied pages.
-     *     Otherwise we can have potential risk of data corruption if
-     *     the page data is read in the other thread before we do
-     *     reset below.
+     * (2) The slots must not go away while we set bits in their dirty
+     *     bitmaps.
+     *
+     * The dirty bits were re-protected by kvm_dirty_ring_collect()
+     * already, so it's safe to publish them to the other threads
+     * (e.g., the migration thread) now.
      */
     kvm_slots_lock();
-    total = kvm_dirty_ring_reap_locked(s, cpu);
+    qemu_mutex_lock(&r->lock);
+    kvm_dirty_ring_publish(s, r);
+    qemu_mutex_unlock(&r->lock);
     kvm_slots_unlock();
 
+    qatomic_add(&s->dirty_ring_reaped_pages, total);
+    stamp = get_clock() - stamp;
+    trace_kvm_dirty_ring_reap(total, stamp / 1000);
+
     return total;
 }
 
+/* Wake up all the reapers, without waiting for them */
+static void kvm_dirty_ring_reaper_kick_all(KVMState *s, const char *reason)
+{
+    uint32_t i;
+
+    trace_kvm_dirty_ring_reaper_kick(reason);
+    for (i = 0; i < s->nr_reapers; i++) {
+        qemu_sem_post(&s->reapers[i].reaper_sem);
+    }
+}
+
 static void do_kvm_cpu_synchronize_kick(CPUState *cpu, run_on_cpu_data arg)
 {
     /* No need to do anything */
@@ -874,6 +993,9 @@ static void kvm_cpu_synchronize_kick_all(void)
  */
 static void kvm_dirty_ring_flush(void)
 {
+    KVMState *s = kvm_state;
+    uint32_t i;
+
     trace_kvm_dirty_ring_flush(0);
     /*
      * The function needs to be serialized.  Since this function
@@ -886,7 +1008,14 @@ static void kvm_dirty_ring_flush(void)
      * vcpus out in a synchronous way.
      */
     kvm_cpu_synchronize_kick_all();
-    kvm_dirty_ring_reap(kvm_state, NULL);
+    /* Then let all the reapers collect their own rings in parallel */
+    for (i = 0; i < s->nr_reapers; i++) {
+        qatomic_set(&s->reapers[i].flush_requested, true);
+    }
+    kvm_dirty_ring_reaper_kick_all(s, "flush");
+    for (i = 0; i < s->nr_reapers; i++) {
+        qemu_sem_wait(&s->reaper_flush_done);
+    }
     trace_kvm_dirty_ring_flush(1);
 }
 
@@ -1369,6 +1498,41 @@ int kvm_set_memory_attributes_shared(hwaddr start, uint64_t size)
     return kvm_set_memory_attributes(start, size, 0);
 }
 
+/*
+ * Collect the dirty bits of a slot that is about to be removed or moved.
+ * Called with KVMMemoryListener.slots_lock held.
+ */
+static void kvm_slot_final_dirty_sync(KVMSlot *mem)
+{
+    if (!(mem->flags & KVM_MEM_LOG_DIRTY_PAGES)) {
+        return;
+    }
+
+    /*
+     * NOTE: We should be aware of the fact that here we're only
+     * doing a best effort to sync dirty bits.  No matter whether
+     * we're using dirty log or dirty ring, we ignored two facts:
+     *
+     * (1) dirty bits can reside in hardware buffers (PML)
+     *
+     * (2) after we collected dirty bits here, pages can be dirtied
+     * again before we do the final KVM_SET_USER_MEMORY_REGION to
+     * remove the slot.
+     *
+     * Not easy.  Let's cross the fingers until it's fixed.
+     */
+    if (kvm_state->kvm_dirty_ring_size) {
+        kvm_dirty_ring_reap_locked(kvm_state);
+        if (kvm_state->kvm_dirty_ring_with_bitmap) {
+            kvm_slot_sync_dirty_pages(mem);
+            kvm_slot_get_dirty_log(kvm_state, mem);
+        }
+    } else {
+        kvm_slot_get_dirty_log(kvm_state, mem);
+    }
+    kvm_slot_sync_dirty_pages(mem);
+}
+
 /* Called with KVMMemoryListener.slots_lock held */
 static void kvm_set_phys_mem(KVMMemoryListener *kml,
                              MemoryRegionSection *section, bool add)
@@ -1411,31 +1575,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             if (!mem) {
                 return;
             }
-            if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
-                /*
-                 * NOTE: We should be aware of the fact that here we're only
-                 * doing a best effort to sync dirty bits.  No matter whether
-                 * we're using dirty log or dirty ring, we ignored two facts:
-                 *
-                 * (1) dirty bits can reside in hardware buffers (PML)
-                 *
-                 * (2) after we collected dirty bits here, pages can be dirtied
-                 * again before we do the final KVM_SET_USER_MEMORY_REGION to
-                 * remove the slot.
-                 *
-                 * Not easy.  Let's cross the fingers until it's fixed.
-                 */
-                if (kvm_state->kvm_dirty_ring_size) {
-                    kvm_dirty_ring_reap_locked(kvm_state, NULL);
-                    if (kvm_state->kvm_dirty_ring_with_bitmap) {
-                        kvm_slot_sync_dirty_pages(mem);
-                        kvm_slot_get_dirty_log(kvm_state, mem);
-                    }
-                } else {
-                    kvm_slot_get_dirty_log(kvm_state, mem);
-                }
-                kvm_slot_sync_dirty_pages(mem);
-            }
+            kvm_slot_final_dirty_sync(mem);
 
             /* unregister the slot */
             g_free(mem->dirty_bmap);
@@ -1493,36 +1633,71 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     } while (size);
 }
 
+/*
+ * Called by all the reapers after reaping.  dirty_ring_reaped_pages
+ * counts the pages of all of them, so whichever reaper comes first once
+ * a second has elapsed computes the rate for the whole VM.
+ */
+static void kvm_dirty_ring_update_rate(KVMState *s)
+{
+    int64_t now, elapsed;
+    uint64_t pages;
+
+    if (qemu_mutex_trylock(&s->dirty_ring_rate_lock)) {
+        /* Another reaper is updating it */
+        return;
+    }
+
+    now = get_clock();
+    elapsed = now - s->dirty_ring_rate_stamp;
+    if (elapsed >= NANOSECONDS_PER_SECOND) {
+        pages = qatomic_read(&s->dirty_ring_reaped_pages);
+        qatomic_set(&s->dirty_ring_reap_rate,
+                    (pages - s->dirty_ring_rate_pages) * 1000 /
+                    (elapsed / SCALE_MS));
+        s->dirty_ring_rate_pages = pages;
+        s->dirty_ring_rate_stamp = now;
+    }
+
+    qemu_mutex_unlock(&s->dirty_ring_rate_lock);
+}
+
 static void *kvm_dirty_ring_reaper_thread(void *data)
 {
-    KVMState *s = data;
-    struct KVMDirtyRingReaper *r = &s->reaper;
+    struct KVMDirtyRingReaper *r = data;
+    KVMState *s = kvm_state;
 
     rcu_register_thread();
 
     trace_kvm_dirty_ring_reaper("init");
 
     while (true) {
+        bool flush;
+
         r->reaper_state = KVM_DIRTY_RING_REAPER_WAIT;
         trace_kvm_dirty_ring_reaper("wait");
         /*
          * TODO: provide a smarter timeout rather than a constant?
          */
-        sleep(1);
+        qemu_sem_timedwait(&r->reaper_sem, 1000);
+        flush = qatomic_xchg(&r->flush_requested, false);
 
         /* keep sleeping so that dirtylimit not be interfered by reaper */
-        if (dirtylimit_in_service()) {
+        if (!flush && dirtylimit_in_service()) {
             continue;
         }
 
         trace_kvm_dirty_ring_reaper("wakeup");
         r->reaper_state = KVM_DIRTY_RING_REAPER_REAPING;
 
-        bql_lock();
-        kvm_dirty_ring_reap(s, NULL);
-        bql_unlock();
+        kvm_dirty_ring_reap(s, r, NULL);
 
         r->reaper_iteration++;
+
+        if (flush) {
+            qemu_sem_post(&s->reaper_flush_done);
+        }
+        kvm_dirty_ring_update_rate(s);
     }
 
     g_assert_not_reached();
@@ -1530,11 +1705,25 @@ static void *kvm_dirty_ring_reaper_thread(void *data)
 
 static void kvm_dirty_ring_reaper_init(KVMState *s)
 {
-    struct KVMDirtyRingReaper *r = &s->reaper;
+    uint32_t i;
+
+    s->reapers = g_new0(struct KVMDirtyRingReaper, s->nr_reapers);
+    qemu_sem_init(&s->reaper_flush_done, 0);
+    qemu_mutex_init(&s->dirty_ring_rate_lock);
+    s->dirty_ring_rate_stamp = get_clock();
+
+    for (i = 0; i < s->nr_reapers; i++) {
+        struct KVMDirtyRingReaper *r = &s->reapers[i];
+        g_autofree char *name = g_strdup_printf("kvm-reaper/%u", i);
 
-    qemu_thread_create(&r->reaper_thr, "kvm-reaper",
-                       kvm_dirty_ring_reaper_thread,
-                       s, QEMU_THREAD_JOINABLE);
+        r->index = i;
+        qemu_sem_init(&r->reaper_sem, 0);
+        qemu_mutex_init(&r->lock);
+        r->collected = g_array_new(false, false, sizeof(KVMDirtyGFN));
+        qemu_thread_create(&r->reaper_thr, s->nr_reapers > 1 ? name :
+                           "kvm-reaper", kvm_dirty_ring_reaper_thread,
+                           r, QEMU_THREAD_JOINABLE);
+    }
 }
 
 static int kvm_dirty_ring_init(KVMState *s)
@@ -1600,6 +1789,127 @@ static int kvm_dirty_ring_init(KVMState *s)
     return 0;
 }
 
+static void *kvm_section_ram_ptr(MemoryRegionSection *section,
+                                 hwaddr start_addr)
+{
+    return memory_region_get_ram_ptr(section->mr) +
+        section->offset_within_region + start_addr -
+        section->offset_within_address_space;
+}
+
+/*
+ * Return the slot that maps @del, if it can be turned into @add with a
+ * single KVM_SET_USER_MEMORY_REGION: both must be backed by the same
+ * host memory, fit in one slot, and not differ in KVM_MEM_READONLY,
+ * which KVM cannot change in place.  Slots backed by guest_memfd cannot
+ * be moved.
+ *
+ * Called with KVMMemoryListener.slots_lock held.
+ */
+static KVMSlot *kvm_lookup_updatable_slot(KVMMemoryListener *kml,
+                                          MemoryRegionSection *del,
+                                          MemoryRegionSection *add,
+                                          hwaddr *add_start)
+{
+    hwaddr del_start, size;
+    KVMSlot *mem;
+
+    if (!memory_region_is_ram(del->mr) || !memory_region_is_ram(add->mr) ||
+        memory_region_has_guest_memfd(del->mr) ||
+        memory_region_has_guest_memfd(add->mr)) {
+        return NULL;
+    }
+
+    size = kvm_align_section(del, &del_start);
+    if (!size || size > kvm_max_slot_size ||
+        kvm_align_section(add, add_start) != size ||
+        kvm_section_ram_ptr(del, del_start) !=
+        kvm_section_ram_ptr(add, *add_start)) {
+        return NULL;
+    }
+
+    mem = kvm_lookup_matching_slot(kml, del_start, size);
+    if (!mem || (mem->flags ^ kvm_mem_flags(add->mr)) & KVM_MEM_READONLY) {
+        return NULL;
+    }
+    return mem;
+}
+
+static bool kvm_sections_overlap(MemoryRegionSection *a,
+                                 MemoryRegionSection *b)
+{
+    Range r1, r2;
+
+    range_init_nofail(&r1, a->offset_within_address_space,
+                      int128_get64(a->size));
+    range_init_nofail(&r2, b->offset_within_address_space,
+                      int128_get64(b->size));
+    return range_overlaps_range(&r1, &r2);
+}
+
+/*
+ * Slots are moved one after the other, so a slot must not be moved where
+ * another one that is also being moved still lives, and vice versa.
+ * @moves holds pairs of (removed, added) updates.
+ */
+static bool kvm_move_conflicts(GPtrArray *moves, MemoryRegionSection *del,
+                               MemoryRegionSection *add)
+{
+    KVMMemoryUpdate *u1, *u2;
+    guint i;
+
+    for (i = 0; i < moves->len; i += 2) {
+        u1 = g_ptr_array_index(moves, i);
+        u2 = g_ptr_array_index(moves, i + 1);
+        if (kvm_sections_overlap(&u1->section, add) ||
+            kvm_sections_overlap(&u2->section, del)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Cleared if the kernel refuses to move a slot */
+static bool kvm_slot_move_allowed = true;
+
+/*
+ * Move a slot to the address of @section, keeping its backing memory.
+ * Called with KVMMemoryListener.slots_lock held.
+ */
+static void kvm_slot_move(KVMMemoryListener *kml, KVMSlot *mem,
+                          MemoryRegionSection *section, hwaddr start_addr)
+{
+    hwaddr old_start_addr = mem->start_addr;
+    int err;
+
+    kvm_slot_final_dirty_sync(mem);
+    g_free(mem->dirty_bmap);
+    mem->dirty_bmap = NULL;
+
+    mem->start_addr = start_addr;
+    mem->flags = kvm_mem_flags(section->mr);
+    kvm_slot_init_dirty_bitmap(mem);
+    if (!kvm_do_set_user_memory_region(kml, mem, false, true)) {
+        return;
+    }
+
+    /* Remove the slot and add it back instead */
+    kvm_slot_move_allowed = false;
+    g_free(mem->dirty_bmap);
+    mem->dirty_bmap = NULL;
+    mem->start_addr = old_start_addr;
+    mem->memory_size = 0;
+    mem->flags = 0;
+    err = kvm_set_user_memory_region(kml, mem, false);
+    if (err) {
+        fprintf(stderr, "%s: error unregistering slot: %s\n", __func__,
+                strerror(-err));
+        abort();
+    }
+    kml->nr_used_slots--;
+    kvm_set_phys_mem(kml, section, true);
+}
+
 static void kvm_region_add(MemoryListener *listener,
                            MemoryRegionSection *section)
 {
@@ -1624,18 +1934,119 @@ static void kvm_region_del(MemoryListener *listener,
     QSIMPLEQ_INSERT_TAIL(&kml->transaction_del, update, next);
 }
 
+/*
+ * Sections to add are indexed by the host memory that backs them, so
+ * that a section to remove finds where it moved without a scan of all
+ * the additions.  Only sections that kvm_lookup_updatable_slot() could
+ * accept are indexed.
+ */
+static bool kvm_section_movable(MemoryRegionSection *section)
+{
+    return memory_region_is_ram(section->mr) &&
+           !memory_region_has_guest_memfd(section->mr);
+}
+
+static void *kvm_update_host_key(const KVMMemoryUpdate *u, hwaddr *size)
+{
+    MemoryRegionSection *section = (MemoryRegionSection *)&u->section;
+    hwaddr start;
+
+    *size = kvm_align_section(section, &start);
+    return kvm_section_ram_ptr(section, start);
+}
+
+static guint kvm_update_host_hash(gconstpointer key)
+{
+    hwaddr size;
+    void *ram = kvm_update_host_key(key, &size);
+
+    return qemu_xxhash2((uintptr_t)ram, size);
+}
+
+static gboolean kvm_update_host_equal(gconstpointer a, gconstpointer b)
+{
+    hwaddr size_a, size_b;
+    void *ram_a = kvm_update_host_key(a, &size_a);
+    void *ram_b = kvm_update_host_key(b, &size_b);
+
+    return ram_a == ram_b && size_a == size_b;
+}
+
 static void kvm_region_commit(MemoryListener *listener)
 {
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener,
                                           listener);
+    QSIMPLEQ_HEAD(, KVMMemoryUpdate) dels = QSIMPLEQ_HEAD_INITIALIZER(dels);
+    QSIMPLEQ_HEAD(, KVMMemoryUpdate) adds = QSIMPLEQ_HEAD_INITIALIZER(adds);
+    g_autoptr(GPtrArray) moves = g_ptr_array_new();
+    unsigned int nr_del = 0, nr_add = 0, nr_update = 0;
     KVMMemoryUpdate *u1, *u2;
+    GHashTable *adds_by_host = NULL;
     bool need_inhibit = false;
+    guint i;
+    int64_t stamp;
+    KVMSlot *mem;
+    hwaddr start;
 
     if (QSIMPLEQ_EMPTY(&kml->transaction_add) &&
         QSIMPLEQ_EMPTY(&kml->transaction_del)) {
         return;
     }
 
+    stamp = get_clock();
+    kvm_slots_lock();
+
+    /*
+     * KVM has no way to apply several slot changes at once, so avoid
+     * deleting and re-adding slots whose backing memory did not change.
+     * A section that is removed and added back at the same address
+     * (e.g. because the MemoryRegion that maps the RAM changed) only
+     * needs its flags updated, which the guest never notices.  The lists
+     * are ordered by addresses, so such pairs are easy to find.
+     */
+    while (!QSIMPLEQ_EMPTY(&kml->transaction_del) &&
+           !QSIMPLEQ_EMPTY(&kml->transaction_add)) {
+        u1 = QSIMPLEQ_FIRST(&kml->transaction_del);
+        u2 = QSIMPLEQ_FIRST(&kml->transaction_add);
+
+        if (u1->section.offset_within_address_space <
+            u2->section.offset_within_address_space) {
+            QSIMPLEQ_REMOVE_HEAD(&kml->transaction_del, next);
+            QSIMPLEQ_INSERT_TAIL(&dels, u1, next);
+            continue;
+        }
+        if (u1->section.offset_within_address_space >
+            u2->section.offset_within_address_space) {
+            QSIMPLEQ_REMOVE_HEAD(&kml->transaction_add, next);
+            QSIMPLEQ_INSERT_TAIL(&adds, u2, next);
+            continue;
+        }
+
+        QSIMPLEQ_REMOVE_HEAD(&kml->transaction_del, next);
+        QSIMPLEQ_REMOVE_HEAD(&kml->transaction_add, next);
+        mem = kvm_lookup_updatable_slot(kml, &u1->section, &u2->section,
+                                        &start);
+        if (!mem) {
+            QSIMPLEQ_INSERT_TAIL(&dels, u1, next);
+            QSIMPLEQ_INSERT_TAIL(&adds, u2, next);
+            continue;
+        }
+
+        if (kvm_slot_update_flags(kml, mem, u2->section.mr)) {
+            fprintf(stderr, "%s: error updating slot\n", __func__);
+            abort();
+        }
+        memory_region_ref(u2->section.mr);
+        memory_region_unref(u1->section.mr);
+        g_free(u1);
+        g_free(u2);
+        nr_update++;
+    }
+    QSIMPLEQ_CONCAT(&dels, &kml->transaction_del);
+    QSIMPLEQ_CONCAT(&adds, &kml->transaction_add);
+    QSIMPLEQ_CONCAT(&kml->transaction_del, &dels);
+    QSIMPLEQ_CONCAT(&kml->transaction_add, &adds);
+
     /*
      * We have to be careful when regions to add overlap with ranges to remove.
      * We have to simulate atomic KVM memslot updates by making sure no ioctl()
@@ -1664,27 +2075,95 @@ static void kvm_region_commit(MemoryListener *listener)
         }
     }
 
-    kvm_slots_lock();
     if (need_inhibit) {
         accel_ioctl_inhibit_begin();
     }
 
-    /* Remove all memslots before adding the new ones. */
+    /*
+     * Memory that only moved (e.g. a RAM BAR being relocated) keeps its
+     * slot, which is moved with a single ioctl once everything else has
+     * been removed from its new location.
+     */
+    if (kvm_slot_move_allowed && !QSIMPLEQ_EMPTY(&kml->transaction_del)) {
+        adds_by_host = g_hash_table_new_full(kvm_update_host_hash,
+                                             kvm_update_host_equal, NULL,
+                                             (GDestroyNotify)g_queue_free);
+        QSIMPLEQ_FOREACH(u2, &kml->transaction_add, next) {
+            GQueue *same_host;
+
+            if (!kvm_section_movable(&u2->section)) {
+                continue;
+            }
+            same_host = g_hash_table_lookup(adds_by_host, u2);
+            if (!same_host) {
+                same_host = g_queue_new();
+                g_hash_table_insert(adds_by_host, u2, same_host);
+            }
+            g_queue_push_tail(same_host, u2);
+        }
+    }
+
     while (!QSIMPLEQ_EMPTY(&kml->transaction_del)) {
+        GQueue *same_host = NULL;
+        GList *l;
+
         u1 = QSIMPLEQ_FIRST(&kml->transaction_del);
         QSIMPLEQ_REMOVE_HEAD(&kml->transaction_del, next);
 
+        if (adds_by_host && kvm_section_movable(&u1->section)) {
+            same_host = g_hash_table_lookup(adds_by_host, u1);
+        }
+        for (l = same_host ? same_host->head : NULL; l; l = l->next) {
+            u2 = l->data;
+            if (kvm_lookup_updatable_slot(kml, &u1->section, &u2->section,
+                                          &start) &&
+                !kvm_move_conflicts(moves, &u1->section, &u2->section)) {
+                break;
+            }
+        }
+        if (l) {
+            /* u2 stays in transaction_add until the moves are done */
+            g_queue_delete_link(same_host, l);
+            g_ptr_array_add(moves, u1);
+            g_ptr_array_add(moves, u2);
+            continue;
+        }
+
         kvm_set_phys_mem(kml, &u1->section, false);
         memory_region_unref(u1->section.mr);
+        nr_del++;
 
         g_free(u1);
     }
+    if (adds_by_host) {
+        g_hash_table_destroy(adds_by_host);
+    }
+    for (i = 0; i < moves->len; i += 2) {
+        u1 = g_ptr_array_index(moves, i);
+        u2 = g_ptr_array_index(moves, i + 1);
+
+        mem = kvm_lookup_updatable_slot(kml, &u1->section, &u2->section,
+                                        &start);
+        memory_region_ref(u2->section.mr);
+        kvm_slot_move(kml, mem, &u2->section, start);
+        memory_region_unref(u1->section.mr);
+        nr_update++;
+
+        g_free(u1);
+        /* Only freed with the other additions, which skip it */
+        u2->section.mr = NULL;
+    }
     while (!QSIMPLEQ_EMPTY(&kml->transaction_add)) {
         u1 = QSIMPLEQ_FIRST(&kml->transaction_add);
         QSIMPLEQ_REMOVE_HEAD(&kml->transaction_add, next);
 
+        if (!u1->section.mr) {
+            g_free(u1);
+            continue;
+        }
         memory_region_ref(u1->section.mr);
         kvm_set_phys_mem(kml, &u1->section, true);
+        nr_add++;
 
         g_free(u1);
     }
@@ -1693,6 +2172,9 @@ static void kvm_region_commit(MemoryListener *listener)
         accel_ioctl_inhibit_end();
     }
     kvm_slots_unlock();
+
+    trace_kvm_region_commit(kml->as_id, nr_del, nr_add, nr_update,
+                            need_inhibit, (get_clock() - stamp) / 1000);
 }
 
 static void kvm_log_sync(MemoryListener *listener,
@@ -3096,19 +3578,20 @@ int kvm_cpu_exec(CPUState *cpu)
              * still full.  Got kicked by KVM_RESET_DIRTY_RINGS.
              */
             trace_kvm_dirty_ring_full(cpu->cpu_index);
-            bql_lock();
+            qatomic_inc(&kvm_state->dirty_ring_full_exits);
+            kvm_dirty_ring_reap(kvm_state,
+                                kvm_dirty_ring_reaper_of(kvm_state, cpu), cpu);
             /*
              * We throttle vCPU by making it sleep once it exit from kernel
              * due to dirty ring full. In the dirtylimit scenario, reaping
              * all vCPUs after a single vCPU dirty ring get full result in
              * the miss of sleep, so just reap the ring-fulled vCPU.
+             * Otherwise, let the reapers catch up with the other rings
+             * before they get full too.
              */
-            if (dirtylimit_in_service()) {
-                kvm_dirty_ring_reap(kvm_state, cpu);
-            } else {
-                kvm_dirty_ring_reap(kvm_state, NULL);
+            if (!dirtylimit_in_service()) {
+                kvm_dirty_ring_reaper_kick_all(kvm_state, "ring full");
             }
-            bql_unlock();
             dirtylimit_vcpu_execute(cpu);
             ret = 0;
             break;
@@ -3767,6 +4250,39 @@ static void kvm_set_dirty_ring_size(Object *obj, Visitor *v,
     s->kvm_dirty_ring_size = value;
 }
 
+static void kvm_get_dirty_ring_reapers(Object *obj, Visitor *v,
+                                       const char *name, void *opaque,
+                                       Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    uint32_t value = s->nr_reapers;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void kvm_set_dirty_ring_reapers(Object *obj, Visitor *v,
+                                       const char *name, void *opaque,
+                                       Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    uint32_t value;
+
+    if (s->fd != -1) {
+        error_setg(errp, "Cannot set properties after the accelerator has been initialized");
+        return;
+    }
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (!value) {
+        error_setg(errp, "dirty-ring-reapers must be at least 1.");
+        return;
+    }
+
+    s->nr_reapers = value;
+}
+
 static char *kvm_get_device(Object *obj,
                             Error **errp G_GNUC_UNUSED)
 {
@@ -3812,6 +4328,7 @@ static void kvm_accel_instance_init(Object *obj)
     /* KVM dirty ring is by default off */
     s->kvm_dirty_ring_size = 0;
     s->kvm_dirty_ring_with_bitmap = false;
+    s->nr_reapers = 1;
     s->kvm_eager_split_size = 0;
     s->notify_vmexit = NOTIFY_VMEXIT_OPTION_RUN;
     s->notify_window = 0;
@@ -3860,6 +4377,12 @@ static void kvm_accel_class_init(ObjectClass *oc, void *data)
     object_class_property_set_description(oc, "dirty-ring-size",
         "Size of KVM dirty page ring buffer (default: 0, i.e. use bitmap)");
 
+    object_class_property_add(oc, "dirty-ring-reapers", "uint32",
+        kvm_get_dirty_ring_reapers, kvm_set_dirty_ring_reapers,
+        NULL, NULL);
+    object_class_property_set_description(oc, "dirty-ring-reapers",
+        "Number of threads collecting the KVM dirty rings (default: 1)");
+
     object_class_property_add_str(oc, "device", kvm_get_device, kvm_set_device);
     object_class_property_set_description(oc, "device",
         "Path to the device node to use (default: /dev/kvm)");
@@ -4109,6 +4632,67 @@ static StatsDescriptors *find_stats_descriptors(StatsTarget target, int stats_fd
     return descriptors;
 }
 
+/* Statistics of the dirty ring reapers, which are maintained by QEMU */
+static const struct {
+    const char *name;
+    StatsType type;
+    size_t offset;
+} dirty_ring_stats[] = {
+    { "dirty_ring_reaped_pages", STATS_TYPE_CUMULATIVE,
+      offsetof(KVMState, dirty_ring_reaped_pages) },
+    { "dirty_ring_full_exits", STATS_TYPE_CUMULATIVE,
+      offsetof(KVMState, dirty_ring_full_exits) },
+    { "dirty_ring_reap_rate", STATS_TYPE_INSTANT,
+      offsetof(KVMState, dirty_ring_reap_rate) },
+};
+
+static StatsList *add_dirty_ring_stats(KVMState *s, StatsList *stats_list,
+                                       strList *names)
+{
+    int i;
+
+    if (!s->kvm_dirty_ring_size) {
+        return stats_list;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(dirty_ring_stats); i++) {
+        uint64_t *value = (void *)s + dirty_ring_stats[i].offset;
+        Stats *stats;
+
+        if (!apply_str_list_filter(dirty_ring_stats[i].name, names)) {
+            continue;
+        }
+        stats = g_new0(Stats, 1);
+        stats->name = g_strdup(dirty_ring_stats[i].name);
+        stats->value = g_new0(StatsValue, 1);
+        stats->value->u.scalar = qatomic_read(value);
+        stats->value->type = QTYPE_QNUM;
+        QAPI_LIST_PREPEND(stats_list, stats);
+    }
+
+    return stats_list;
+}
+
+static StatsSchemaValueList *add_dirty_ring_schema(KVMState *s,
+                                                   StatsSchemaValueList *list)
+{
+    int i;
+
+    if (!s->kvm_dirty_ring_size) {
+        return list;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(dirty_ring_stats); i++) {
+        StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+        value->name = g_strdup(dirty_ring_stats[i].name);
+        value->type = dirty_ring_stats[i].type;
+        QAPI_LIST_PREPEND(list, value);
+    }
+
+    return list;
+}
+
 static void query_stats(StatsResultList **result, StatsTarget target,
                         strList *names, int stats_fd, CPUState *cpu,
                         Error **errp)
@@ -4159,6 +4743,10 @@ static void query_stats(StatsResultList **result, StatsTarget target,
         stats_list = add_kvmstat_entry(pdesc, stats, stats_list, errp);
     }
 
+    if (target == STATS_TARGET_VM) {
+        stats_list = add_dirty_ring_stats(kvm_state, stats_list, names);
+    }
+
     if (!stats_list) {
         return;
     }
@@ -4203,6 +4791,10 @@ static void query_stats_schema(StatsSchemaList **result, StatsTarget target,
         stats_list = add_kvmschema_entry(pdesc, stats_list, errp);
     }
 
+    if (target == STATS_TARGET_VM) {
+        stats_list = add_dirty_ring_schema(kvm_state, stats_list);
+    }
+
     add_stats_schema(result, STATS_PROVIDER_KVM, target, stats_list);
 }
 
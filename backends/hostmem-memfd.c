@@ -16,6 +16,7 @@
 #include "qemu/memfd.h"
 #include "qemu/module.h"
 #include "qapi/error.h"
+#include "migration/cpr.h"
 #include "qom/object.h"
 
 #define TYPE_MEMORY_BACKEND_MEMFD "memory-backend-memfd"
@@ -44,21 +45,42 @@ memfd_backend_memory_alloc(HostMemoryBackend *backend, Error **errp)
         return false;
     }
 
-    fd = qemu_memfd_create(TYPE_MEMORY_BACKEND_MEMFD, backend->size,
-                           m->hugetlb, m->hugetlbsize, m->seal ?
-                           F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL : 0,
-                           errp);
-    if (fd == -1) {
-        return false;
+    name = host_memory_backend_get_name(backend);
+
+    /*
+     * Shared memory survives a cpr-transfer: reuse the memfd of the old
+     * QEMU, so that guest RAM does not have to be copied.
+     */
+    fd = backend->share ? cpr_find_fd(name, 0) : -1;
+    if (fd < 0) {
+        if (backend->share && cpr_is_incoming()) {
+            error_setg(errp, "memory backend %s was not passed by the old "
+                       "QEMU", name);
+            return false;
+        }
+        fd = qemu_memfd_create(TYPE_MEMORY_BACKEND_MEMFD, backend->size,
+                               m->hugetlb, m->hugetlbsize, m->seal ?
+                               F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL : 0,
+                               errp);
+        if (fd == -1) {
+            return false;
+        }
+        if (backend->share) {
+            cpr_save_fd(name, 0, fd);
+        }
     }
 
     backend->aligned = true;
-    name = host_memory_backend_get_name(backend);
     ram_flags = backend->share ? RAM_SHARED : 0;
     ram_flags |= backend->reserve ? 0 : RAM_NORESERVE;
     ram_flags |= backend->guest_memfd ? RAM_GUEST_MEMFD : 0;
-    return memory_region_init_ram_from_fd(&backend->mr, OBJECT(backend), name,
-                                          backend->size, ram_flags, fd, 0, errp);
+    if (!memory_region_init_ram_from_fd(&backend->mr, OBJECT(backend), name,
+                                        backend->size, ram_flags, fd, 0,
+                                        errp)) {
+        cpr_delete_fd(name, 0);
+        return false;
+    }
+    return true;
 }
 
 static bool
@@ -128,6 +150,16 @@ memfd_backend_instance_init(Object *obj)
     MEMORY_BACKEND(m)->share = true;
 }
 
+static void
+memfd_backend_instance_finalize(Object *obj)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    if (host_memory_backend_mr_inited(backend)) {
+        cpr_delete_fd(memory_region_name(&backend->mr), 0);
+    }
+}
+
 static void
 memfd_backend_class_init(ObjectClass *oc, void *data)
 {
@@ -159,6 +191,7 @@ static const TypeInfo memfd_backend_info = {
     .name = TYPE_MEMORY_BACKEND_MEMFD,
     .parent = TYPE_MEMORY_BACKEND,
     .instance_init = memfd_backend_instance_init,
+    .instance_finalize = memfd_backend_instance_finalize,
     .class_init = memfd_backend_class_init,
     .instance_size = sizeof(HostMemoryBackendMemfd),
 };
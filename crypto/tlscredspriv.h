@@ -35,6 +35,7 @@ struct QCryptoTLSCreds {
     gnutls_dh_params_t dh_params;
 #endif
     bool verifyPeer;
+    bool kernelOffload;
     char *priority;
 };
 
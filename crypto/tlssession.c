@@ -33,6 +33,27 @@
 
 #include <gnutls/x509.h>
 
+#ifdef HAVE_LINUX_TLS_H
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+#define TLS_RECORD_TYPE_HANDSHAKE 22
+#define TLS_HANDSHAKE_KEY_UPDATE 24
+
+/*
+ * GnuTLS only hands out the TLS 1.3 traffic secrets through the
+ * secret callback, which is needed to follow key updates once the
+ * kernel owns the records.
+ */
+#if GNUTLS_VERSION_NUMBER >= 0x030700
+#define QCRYPTO_TLS_KTLS_KEY_UPDATE
+#endif
+#endif
+
 
 struct QCryptoTLSSession {
     QCryptoTLSCreds *creds;
@@ -51,6 +72,12 @@ struct QCryptoTLSSession {
      */
     Error *rerr;
     Error *werr;
+
+#ifdef QCRYPTO_TLS_KTLS_KEY_UPDATE
+    /* Application traffic secrets, indexed by direction (read = 1) */
+    unsigned char ktlsSecret[2][64];
+    size_t ktlsSecretSize;
+#endif
 };
 
 
@@ -64,6 +91,9 @@ qcrypto_tls_session_free(QCryptoTLSSession *session)
     error_free(session->rerr);
     error_free(session->werr);
 
+#ifdef QCRYPTO_TLS_KTLS_KEY_UPDATE
+    memset(session->ktlsSecret, 0, sizeof(session->ktlsSecret));
+#endif
     gnutls_deinit(session->handle);
     g_free(session->hostname);
     g_free(session->peername);
@@ -126,6 +156,32 @@ qcrypto_tls_session_pull(void *opaque, void *buf, size_t len)
     }
 }
 
+#ifdef QCRYPTO_TLS_KTLS_KEY_UPDATE
+static int
+qcrypto_tls_session_secret(gnutls_session_t handle,
+                           gnutls_record_encryption_level_t level,
+                           const void *secret_read,
+                           const void *secret_write,
+                           size_t secret_size)
+{
+    QCryptoTLSSession *session = gnutls_session_get_ptr(handle);
+
+    if (level != GNUTLS_ENCRYPTION_LEVEL_APPLICATION ||
+        secret_size > sizeof(session->ktlsSecret[0])) {
+        return 0;
+    }
+
+    session->ktlsSecretSize = secret_size;
+    if (secret_write) {
+        memcpy(session->ktlsSecret[0], secret_write, secret_size);
+    }
+    if (secret_read) {
+        memcpy(session->ktlsSecret[1], secret_read, secret_size);
+    }
+    return 0;
+}
+#endif
+
 #define TLS_PRIORITY_ADDITIONAL_ANON "+ANON-DH"
 #define TLS_PRIORITY_ADDITIONAL_PSK "+ECDHE-PSK:+DHE-PSK:+PSK"
 
@@ -282,6 +338,14 @@ qcrypto_tls_session_new(QCryptoTLSCreds *creds,
     gnutls_transport_set_pull_function(session->handle,
                                        qcrypto_tls_session_pull);
 
+#ifdef QCRYPTO_TLS_KTLS_KEY_UPDATE
+    if (creds->kernelOffload) {
+        gnutls_session_set_ptr(session->handle, session);
+        gnutls_handshake_set_secret_function(session->handle,
+                                             qcrypto_tls_session_secret);
+    }
+#endif
+
     return session;
 
  error:
@@ -502,6 +566,39 @@ qcrypto_tls_session_write(QCryptoTLSSession *session,
 }
 
 
+int
+qcrypto_tls_session_update_key(QCryptoTLSSession *session,
+                               bool requestPeer,
+                               Error **errp)
+{
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+    int ret = gnutls_session_key_update(session->handle,
+                                        requestPeer ? GNUTLS_KU_PEER : 0);
+
+    if (ret < 0) {
+        if (ret == GNUTLS_E_AGAIN) {
+            return QCRYPTO_TLS_SESSION_ERR_BLOCK;
+        } else {
+            if (session->werr) {
+                error_propagate(errp, session->werr);
+                session->werr = NULL;
+            } else {
+                error_setg(errp,
+                           "Cannot update TLS session key: %s",
+                           gnutls_strerror(ret));
+            }
+            return -1;
+        }
+    }
+
+    return 0;
+#else
+    error_setg(errp, "TLS key updates require GnuTLS 3.6.3 or newer");
+    return -1;
+#endif
+}
+
+
 ssize_t
 qcrypto_tls_session_read(QCryptoTLSSession *session,
                          char *buf,
@@ -613,6 +710,328 @@ qcrypto_tls_session_get_peer_name(QCryptoTLSSession *session)
 }
 
 
+#ifdef HAVE_LINUX_TLS_H
+
+/*
+ * Fill the kernel crypto info of one direction from the GnuTLS record
+ * state.  AES-GCM splits the nonce in an implicit salt and an explicit
+ * part, which TLS 1.2 derives from the record sequence number.
+ */
+static bool
+qcrypto_tls_session_ktls_fill(uint16_t version,
+                              const gnutls_datum_t *iv,
+                              const gnutls_datum_t *key,
+                              const unsigned char *seq,
+                              unsigned char *info_iv, size_t iv_size,
+                              unsigned char *info_salt, size_t salt_size,
+                              unsigned char *info_key, size_t key_size,
+                              unsigned char *info_seq)
+{
+    if (key->size != key_size) {
+        return false;
+    }
+
+    if (salt_size) {
+        if (version == TLS_1_2_VERSION) {
+            if (iv->size < salt_size) {
+                return false;
+            }
+            memcpy(info_iv, seq, iv_size);
+        } else {
+            if (iv->size != salt_size + iv_size) {
+                return false;
+            }
+            memcpy(info_iv, iv->data + salt_size, iv_size);
+        }
+        memcpy(info_salt, iv->data, salt_size);
+    } else {
+        if (iv->size != iv_size) {
+            return false;
+        }
+        memcpy(info_iv, iv->data, iv_size);
+    }
+
+    memcpy(info_key, key->data, key_size);
+    memcpy(info_seq, seq, 8);
+    return true;
+}
+
+#define QCRYPTO_TLS_KTLS_FILL(ci, version, iv, key, seq)                  \
+    qcrypto_tls_session_ktls_fill(version, iv, key, seq,                \
+                                  (ci).iv, sizeof((ci).iv),             \
+                                  (ci).salt, sizeof((ci).salt),         \
+                                  (ci).key, sizeof((ci).key),           \
+                                  (ci).rec_seq)
+
+static uint16_t
+qcrypto_tls_session_ktls_version(QCryptoTLSSession *session)
+{
+    switch (gnutls_protocol_get_version(session->handle)) {
+    case GNUTLS_TLS1_2:
+        return TLS_1_2_VERSION;
+    case GNUTLS_TLS1_3:
+        return TLS_1_3_VERSION;
+    default:
+        return 0;
+    }
+}
+
+static bool
+qcrypto_tls_session_ktls_install(QCryptoTLSSession *session,
+                                 int fd, bool read, uint16_t version,
+                                 const gnutls_datum_t *iv,
+                                 const gnutls_datum_t *key,
+                                 const unsigned char *seq)
+{
+    union {
+        struct tls12_crypto_info_aes_gcm_128 aes128;
+        struct tls12_crypto_info_aes_gcm_256 aes256;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+        struct tls12_crypto_info_chacha20_poly1305 chacha;
+#endif
+    } info;
+    socklen_t len = 0;
+    bool ok;
+
+    memset(&info, 0, sizeof(info));
+    switch (gnutls_cipher_get(session->handle)) {
+    case GNUTLS_CIPHER_AES_128_GCM:
+        info.aes128.info.version = version;
+        info.aes128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        ok = QCRYPTO_TLS_KTLS_FILL(info.aes128, version, iv, key, seq);
+        len = sizeof(info.aes128);
+        break;
+    case GNUTLS_CIPHER_AES_256_GCM:
+        info.aes256.info.version = version;
+        info.aes256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        ok = QCRYPTO_TLS_KTLS_FILL(info.aes256, version, iv, key, seq);
+        len = sizeof(info.aes256);
+        break;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+    case GNUTLS_CIPHER_CHACHA20_POLY1305:
+        info.chacha.info.version = version;
+        info.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+        ok = QCRYPTO_TLS_KTLS_FILL(info.chacha, version, iv, key, seq);
+        len = sizeof(info.chacha);
+        break;
+#endif
+    default:
+        ok = false;
+        break;
+    }
+
+    if (ok && setsockopt(fd, SOL_TLS, read ? TLS_RX : TLS_TX,
+                         &info, len) < 0) {
+        trace_qcrypto_tls_session_ktls_fail(session, read, errno);
+        ok = false;
+    }
+
+    memset(&info, 0, sizeof(info));
+    return ok;
+}
+
+static bool
+qcrypto_tls_session_ktls_set_keys(QCryptoTLSSession *session,
+                                  int fd, bool read)
+{
+    gnutls_datum_t mac_key, iv, key;
+    unsigned char seq[8];
+    uint16_t version = qcrypto_tls_session_ktls_version(session);
+
+    if (!version) {
+        return false;
+    }
+
+    if (gnutls_record_get_state(session->handle, read,
+                                &mac_key, &iv, &key, seq) < 0) {
+        return false;
+    }
+
+    return qcrypto_tls_session_ktls_install(session, fd, read, version,
+                                            &iv, &key, seq);
+}
+
+int
+qcrypto_tls_session_enable_ktls(QCryptoTLSSession *session, int fd)
+{
+    int dirs = 0;
+
+    if (!session->creds->kernelOffload || !session->handshakeComplete) {
+        return 0;
+    }
+
+    if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+        trace_qcrypto_tls_session_ktls_fail(session, false, errno);
+        return 0;
+    }
+
+    if (qcrypto_tls_session_ktls_set_keys(session, fd, false)) {
+        dirs |= QCRYPTO_TLS_KTLS_SEND;
+    }
+
+    /*
+     * Records that GnuTLS has already pulled from the socket could not
+     * be decrypted anymore once the kernel owns the receive side.
+     */
+    if (!gnutls_record_check_pending(session->handle) &&
+        qcrypto_tls_session_ktls_set_keys(session, fd, true)) {
+        dirs |= QCRYPTO_TLS_KTLS_RECV;
+    }
+
+    trace_qcrypto_tls_session_ktls(session, dirs);
+    return dirs;
+}
+
+#ifdef QCRYPTO_TLS_KTLS_KEY_UPDATE
+
+/* HKDF-Expand-Label from RFC 8446, section 7.1, with an empty context */
+static bool
+qcrypto_tls_session_expand_label(QCryptoTLSSession *session,
+                                 const unsigned char *secret,
+                                 size_t secret_size,
+                                 const char *label,
+                                 unsigned char *out, size_t out_size)
+{
+    gnutls_mac_algorithm_t mac =
+        (gnutls_mac_algorithm_t)gnutls_prf_hash_get(session->handle);
+    gnutls_datum_t key = { (unsigned char *)secret, secret_size };
+    unsigned char info_data[2 + 1 + 255 + 1];
+    gnutls_datum_t info = { info_data, 0 };
+    size_t label_len = strlen("tls13 ") + strlen(label);
+
+    info_data[info.size++] = out_size >> 8;
+    info_data[info.size++] = out_size & 0xff;
+    info_data[info.size++] = label_len;
+    memcpy(info_data + info.size, "tls13 ", strlen("tls13 "));
+    info.size += strlen("tls13 ");
+    memcpy(info_data + info.size, label, strlen(label));
+    info.size += strlen(label);
+    info_data[info.size++] = 0;
+
+    return gnutls_hkdf_expand(mac, &key, &info, out, out_size) == 0;
+}
+
+
+int
+qcrypto_tls_session_ktls_update_key(QCryptoTLSSession *session,
+                                    int fd, bool read, Error **errp)
+{
+    static const unsigned char key_update[] = {
+        TLS_HANDSHAKE_KEY_UPDATE, 0, 0, 1, 0 /* update_not_requested */
+    };
+    unsigned char *secret = session->ktlsSecret[read];
+    size_t secret_size = session->ktlsSecretSize;
+    size_t key_size = gnutls_cipher_get_key_size(
+        gnutls_cipher_get(session->handle));
+    unsigned char next[sizeof(session->ktlsSecret[0])];
+    unsigned char key_data[32], iv_data[12], seq[8] = { 0 };
+    gnutls_datum_t key = { key_data, key_size };
+    gnutls_datum_t iv = { iv_data, sizeof(iv_data) };
+    bool ok;
+
+    if (qcrypto_tls_session_ktls_version(session) != TLS_1_3_VERSION ||
+        !secret_size || key_size > sizeof(key_data)) {
+        error_setg(errp, "Cannot update the kernel TLS %s key",
+                   read ? "receive" : "send");
+        return -1;
+    }
+
+    if (!qcrypto_tls_session_expand_label(session, secret, secret_size,
+                                          "traffic upd", next, secret_size) ||
+        !qcrypto_tls_session_expand_label(session, next, secret_size,
+                                          "key", key_data, key_size) ||
+        !qcrypto_tls_session_expand_label(session, next, secret_size,
+                                          "iv", iv_data, sizeof(iv_data))) {
+        error_setg(errp, "Cannot derive the next TLS %s key",
+                   read ? "receive" : "send");
+        ok = false;
+        goto out;
+    }
+
+    /* Our KeyUpdate message itself is still protected by the old key */
+    if (!read) {
+        char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+        struct iovec iov = {
+            .iov_base = (void *)key_update,
+            .iov_len = sizeof(key_update),
+        };
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = cbuf,
+            .msg_controllen = sizeof(cbuf),
+        };
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+        cmsg->cmsg_level = SOL_TLS;
+        cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+        *CMSG_DATA(cmsg) = TLS_RECORD_TYPE_HANDSHAKE;
+
+        if (sendmsg(fd, &msg, 0) != sizeof(key_update)) {
+            error_setg_errno(errp, errno, "Unable to send TLS key update");
+            ok = false;
+            goto out;
+        }
+    }
+
+    ok = qcrypto_tls_session_ktls_install(session, fd, read, TLS_1_3_VERSION,
+                                          &iv, &key, seq);
+    if (!ok) {
+        error_setg(errp, "The kernel cannot update the TLS %s key, it may "
+                   "be too old for TLS 1.3 key updates with kernel-offload",
+                   read ? "receive" : "send");
+        goto out;
+    }
+
+    memcpy(secret, next, secret_size);
+    trace_qcrypto_tls_session_ktls_update_key(session, read);
+
+ out:
+    memset(next, 0, sizeof(next));
+    memset(key_data, 0, sizeof(key_data));
+    memset(iv_data, 0, sizeof(iv_data));
+    return ok ? 0 : -1;
+}
+
+#else /* ! QCRYPTO_TLS_KTLS_KEY_UPDATE */
+
+int
+qcrypto_tls_session_ktls_update_key(QCryptoTLSSession *session G_GNUC_UNUSED,
+                                    int fd G_GNUC_UNUSED,
+                                    bool read G_GNUC_UNUSED,
+                                    Error **errp)
+{
+    error_setg(errp, "TLS key updates with kernel-offload require "
+               "GnuTLS 3.7.0 or newer");
+    return -1;
+}
+
+#endif /* QCRYPTO_TLS_KTLS_KEY_UPDATE */
+
+#else /* ! HAVE_LINUX_TLS_H */
+
+int
+qcrypto_tls_session_enable_ktls(QCryptoTLSSession *session G_GNUC_UNUSED,
+                                int fd G_GNUC_UNUSED)
+{
+    return 0;
+}
+
+
+int
+qcrypto_tls_session_ktls_update_key(QCryptoTLSSession *session G_GNUC_UNUSED,
+                                    int fd G_GNUC_UNUSED,
+                                    bool read G_GNUC_UNUSED,
+                                    Error **errp)
+{
+    error_setg(errp, "TLS kernel offload is not supported");
+    return -1;
+}
+
+#endif /* HAVE_LINUX_TLS_H */
+
+
 #else /* ! CONFIG_GNUTLS */
 
 
@@ -676,6 +1095,16 @@ qcrypto_tls_session_read(QCryptoTLSSession *sess,
 }
 
 
+int
+qcrypto_tls_session_update_key(QCryptoTLSSession *sess G_GNUC_UNUSED,
+                               bool requestPeer G_GNUC_UNUSED,
+                               Error **errp)
+{
+    error_setg(errp, "TLS requires GNUTLS support");
+    return -1;
+}
+
+
 size_t
 qcrypto_tls_session_check_pending(QCryptoTLSSession *session)
 {
@@ -714,4 +1143,23 @@ qcrypto_tls_session_get_peer_name(QCryptoTLSSession *sess)
     return NULL;
 }
 
+
+int
+qcrypto_tls_session_enable_ktls(QCryptoTLSSession *sess G_GNUC_UNUSED,
+                                int fd G_GNUC_UNUSED)
+{
+    return 0;
+}
+
+
+int
+qcrypto_tls_session_ktls_update_key(QCryptoTLSSession *sess G_GNUC_UNUSED,
+                                    int fd G_GNUC_UNUSED,
+                                    bool read G_GNUC_UNUSED,
+                                    Error **errp)
+{
+    error_setg(errp, "TLS requires GNUTLS support");
+    return -1;
+}
+
 #endif
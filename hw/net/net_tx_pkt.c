@@ -387,6 +387,25 @@ bool net_tx_pkt_build_vheader(struct NetTxPkt *pkt, bool tso_enable,
     return true;
 }
 
+bool net_tx_pkt_build_vheader_uso(struct NetTxPkt *pkt, uint32_t gso_size)
+{
+    assert(pkt);
+
+    if (pkt->l4proto != IP_PROTO_UDP ||
+        pkt->payload_len < sizeof(struct udp_hdr) || !gso_size) {
+        return false;
+    }
+
+    pkt->virt_hdr.gso_type = VIRTIO_NET_HDR_GSO_UDP_L4;
+    pkt->virt_hdr.hdr_len = pkt->hdr_len + sizeof(struct udp_hdr);
+    pkt->virt_hdr.gso_size = gso_size;
+    pkt->virt_hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    pkt->virt_hdr.csum_start = pkt->hdr_len;
+    pkt->virt_hdr.csum_offset = offsetof(struct udp_hdr, uh_sum);
+
+    return true;
+}
+
 void net_tx_pkt_setup_vlan_header_ex(struct NetTxPkt *pkt,
     uint16_t vlan, uint16_t vlan_ethtype)
 {
@@ -589,13 +608,14 @@ static void net_tx_pkt_sendv(
     }
 }
 
-static bool net_tx_pkt_tcp_fragment_init(struct NetTxPkt *pkt,
-                                         struct iovec *fragment,
-                                         int *pl_idx,
-                                         size_t *l4hdr_len,
-                                         int *src_idx,
-                                         size_t *src_offset,
-                                         size_t *src_len)
+static bool net_tx_pkt_l4_fragment_init(struct NetTxPkt *pkt,
+                                        struct iovec *fragment,
+                                        uint8_t gso_type,
+                                        int *pl_idx,
+                                        size_t *l4hdr_len,
+                                        int *src_idx,
+                                        size_t *src_offset,
+                                        size_t *src_len)
 {
     struct iovec *l4 = fragment + NET_TX_PKT_PL_START_FRAG;
     size_t bytes_read = 0;
@@ -626,8 +646,10 @@ static bool net_tx_pkt_tcp_fragment_init(struct NetTxPkt *pkt,
     memcpy((char *)l4->iov_base + bytes_read, pkt->vec[*src_idx].iov_base,
            *src_offset);
 
-    th = l4->iov_base;
-    th->th_flags &= ~(TH_FIN | TH_PUSH);
+    if (gso_type != VIRTIO_NET_HDR_GSO_UDP_L4) {
+        th = l4->iov_base;
+        th->th_flags &= ~(TH_FIN | TH_PUSH);
+    }
 
     *pl_idx = NET_TX_PKT_PL_START_FRAG + 1;
     *l4hdr_len = l4->iov_len;
@@ -636,22 +658,29 @@ static bool net_tx_pkt_tcp_fragment_init(struct NetTxPkt *pkt,
     return true;
 }
 
-static void net_tx_pkt_tcp_fragment_deinit(struct iovec *fragment)
+static void net_tx_pkt_l4_fragment_deinit(struct iovec *fragment)
 {
     g_free(fragment[NET_TX_PKT_PL_START_FRAG].iov_base);
 }
 
-static void net_tx_pkt_tcp_fragment_fix(struct NetTxPkt *pkt,
-                                        struct iovec *fragment,
-                                        size_t fragment_len,
-                                        uint8_t gso_type)
+static void net_tx_pkt_l4_fragment_fix(struct NetTxPkt *pkt,
+                                       struct iovec *fragment,
+                                       size_t fragment_len,
+                                       uint8_t gso_type)
 {
     struct iovec *l3hdr = fragment + NET_TX_PKT_L3HDR_FRAG;
     struct iovec *l4hdr = fragment + NET_TX_PKT_PL_START_FRAG;
     struct ip_header *ip = l3hdr->iov_base;
     struct ip6_header *ip6 = l3hdr->iov_base;
+    struct udp_hdr *uh = l4hdr->iov_base;
     size_t len = l3hdr->iov_len + l4hdr->iov_len + fragment_len;
 
+    if (gso_type == VIRTIO_NET_HDR_GSO_UDP_L4) {
+        uh->uh_ulen = cpu_to_be16(l4hdr->iov_len + fragment_len);
+        gso_type = IP_HEADER_VERSION(ip) == IP_HEADER_VERSION_4 ?
+                   VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6;
+    }
+
     switch (gso_type) {
     case VIRTIO_NET_HDR_GSO_TCPV4:
         ip->ip_len = cpu_to_be16(len);
@@ -665,22 +694,24 @@ static void net_tx_pkt_tcp_fragment_fix(struct NetTxPkt *pkt,
     }
 }
 
-static void net_tx_pkt_tcp_fragment_advance(struct NetTxPkt *pkt,
-                                            struct iovec *fragment,
-                                            size_t fragment_len,
-                                            uint8_t gso_type)
+static void net_tx_pkt_l4_fragment_advance(struct NetTxPkt *pkt,
+                                           struct iovec *fragment,
+                                           size_t fragment_len,
+                                           uint8_t gso_type)
 {
     struct iovec *l3hdr = fragment + NET_TX_PKT_L3HDR_FRAG;
     struct iovec *l4hdr = fragment + NET_TX_PKT_PL_START_FRAG;
     struct ip_header *ip = l3hdr->iov_base;
     struct tcp_hdr *th = l4hdr->iov_base;
 
-    if (gso_type == VIRTIO_NET_HDR_GSO_TCPV4) {
+    if (IP_HEADER_VERSION(ip) == IP_HEADER_VERSION_4) {
         ip->ip_id = cpu_to_be16(be16_to_cpu(ip->ip_id) + 1);
     }
 
-    th->th_seq = cpu_to_be32(be32_to_cpu(th->th_seq) + fragment_len);
-    th->th_flags &= ~TH_CWR;
+    if (gso_type != VIRTIO_NET_HDR_GSO_UDP_L4) {
+        th->th_seq = cpu_to_be32(be32_to_cpu(th->th_seq) + fragment_len);
+        th->th_flags &= ~TH_CWR;
+    }
 }
 
 static void net_tx_pkt_udp_fragment_init(struct NetTxPkt *pkt,
@@ -747,8 +778,10 @@ static bool net_tx_pkt_do_sw_fragmentation(struct NetTxPkt *pkt,
     switch (gso_type) {
     case VIRTIO_NET_HDR_GSO_TCPV4:
     case VIRTIO_NET_HDR_GSO_TCPV6:
-        if (!net_tx_pkt_tcp_fragment_init(pkt, fragment, &pl_idx, &l4hdr_len,
-                                          &src_idx, &src_offset, &src_len)) {
+    case VIRTIO_NET_HDR_GSO_UDP_L4:
+        if (!net_tx_pkt_l4_fragment_init(pkt, fragment, gso_type, &pl_idx,
+                                         &l4hdr_len, &src_idx, &src_offset,
+                                         &src_len)) {
             return false;
         }
         break;
@@ -777,7 +810,8 @@ static bool net_tx_pkt_do_sw_fragmentation(struct NetTxPkt *pkt,
         switch (gso_type) {
         case VIRTIO_NET_HDR_GSO_TCPV4:
         case VIRTIO_NET_HDR_GSO_TCPV6:
-            net_tx_pkt_tcp_fragment_fix(pkt, fragment, fragment_len, gso_type);
+        case VIRTIO_NET_HDR_GSO_UDP_L4:
+            net_tx_pkt_l4_fragment_fix(pkt, fragment, fragment_len, gso_type);
             net_tx_pkt_do_sw_csum(pkt, fragment + NET_TX_PKT_L2HDR_FRAG,
                                   dst_idx - NET_TX_PKT_L2HDR_FRAG,
                                   l4hdr_len + fragment_len);
@@ -793,18 +827,16 @@ static bool net_tx_pkt_do_sw_fragmentation(struct NetTxPkt *pkt,
                  fragment + NET_TX_PKT_L2HDR_FRAG, dst_idx - NET_TX_PKT_L2HDR_FRAG,
                  fragment + NET_TX_PKT_VHDR_FRAG, dst_idx - NET_TX_PKT_VHDR_FRAG);
 
-        if (gso_type == VIRTIO_NET_HDR_GSO_TCPV4 ||
-            gso_type == VIRTIO_NET_HDR_GSO_TCPV6) {
-            net_tx_pkt_tcp_fragment_advance(pkt, fragment, fragment_len,
-                                            gso_type);
+        if (gso_type != VIRTIO_NET_HDR_GSO_UDP) {
+            net_tx_pkt_l4_fragment_advance(pkt, fragment, fragment_len,
+                                           gso_type);
         }
 
         fragment_offset += fragment_len;
     }
 
-    if (gso_type == VIRTIO_NET_HDR_GSO_TCPV4 ||
-        gso_type == VIRTIO_NET_HDR_GSO_TCPV6) {
-        net_tx_pkt_tcp_fragment_deinit(fragment);
+    if (gso_type != VIRTIO_NET_HDR_GSO_UDP) {
+        net_tx_pkt_l4_fragment_deinit(fragment);
     }
 
     return true;
@@ -65,6 +65,17 @@ struct virtio_net_hdr *net_tx_pkt_get_vhdr(struct NetTxPkt *pkt);
 bool net_tx_pkt_build_vheader(struct NetTxPkt *pkt, bool tso_enable,
     bool csum_enable, uint32_t gso_size);
 
+/**
+ * build virtio header for UDP segmentation offload (will be stored in
+ * module context)
+ *
+ * @pkt:            packet
+ * @gso_size:       payload size of each UDP datagram
+ * @ret:            operation result
+ *
+ */
+bool net_tx_pkt_build_vheader_uso(struct NetTxPkt *pkt, uint32_t gso_size);
+
 /**
 * updates vlan tag, and adds vlan header with custom ethernet type
 * in case it is missing.
@@ -14,6 +14,7 @@
 #include "qemu/osdep.h"
 #include "qemu/atomic.h"
 #include "qemu/iov.h"
+#include "qemu/defer-call.h"
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
@@ -48,6 +49,9 @@
 #include "net_rx_pkt.h"
 #include "hw/virtio/vhost.h"
 #include "sysemu/qtest.h"
+#include "sysemu/iothread.h"
+#include "block/aio-wait.h"
+#include "hw/virtio/iothread-vq-mapping.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -59,6 +63,9 @@
 #define VIRTIO_NET_RX_QUEUE_MIN_SIZE VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE
 #define VIRTIO_NET_TX_QUEUE_MIN_SIZE VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE
 
+/* Maximum number of packets popped at once from a TX virtqueue */
+#define VIRTIO_NET_TX_BATCH 64
+
 #define VIRTIO_NET_IP4_ADDR_SIZE   8        /* ipv4 saddr + daddr */
 
 #define VIRTIO_NET_TCP_FLAG         0x3F
@@ -189,6 +196,9 @@ static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
     }
 }
 
+static void virtio_net_drained_begin(VirtIONet *n);
+static void virtio_net_drained_end(VirtIONet *n);
+
 static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -200,7 +210,10 @@ static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
     if (!virtio_vdev_has_feature(vdev, VIRTIO_NET_F_CTRL_MAC_ADDR) &&
         !virtio_vdev_has_feature(vdev, VIRTIO_F_VERSION_1) &&
         memcmp(netcfg.mac, n->mac, ETH_ALEN)) {
+        /* The receive filter of the datapath uses the MAC address */
+        virtio_net_drained_begin(n);
         memcpy(n->mac, netcfg.mac, ETH_ALEN);
+        virtio_net_drained_end(n);
         qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     }
 
@@ -374,11 +387,22 @@ static void virtio_net_vnet_endian_status(VirtIONet *n, uint8_t status)
     }
 }
 
+static void virtio_net_notify(VirtIONet *n, VirtQueue *vq)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+
+    if (qemu_in_iothread()) {
+        virtio_notify_irqfd(vdev, vq);
+    } else {
+        virtio_notify(vdev, vq);
+    }
+}
+
 static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
 {
     unsigned int dropped = virtqueue_drop_all(vq);
     if (dropped) {
-        virtio_notify(vdev, vq);
+        virtio_net_notify(VIRTIO_NET(vdev), vq);
     }
 }
 
@@ -389,6 +413,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     int i;
     uint8_t queue_status;
 
+    virtio_net_drained_begin(n);
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
 
@@ -437,6 +462,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             }
         }
     }
+    virtio_net_drained_end(n);
 }
 
 static void virtio_net_set_link_status(NetClientState *nc)
@@ -791,6 +817,11 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_USO6);
     }
 
+    if (n->net_conf.iothread_vq_mapping_list) {
+        /* Resetting a queue is not synchronized with its IOThread */
+        virtio_clear_feature(&features, VIRTIO_F_RING_RESET);
+    }
+
     if (!get_vhost_net(nc->peer)) {
         return features;
     }
@@ -1585,8 +1616,11 @@ size_t virtio_net_handle_ctrl_iov(VirtIODevice *vdev,
 
 static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
+    VirtIONet *n = VIRTIO_NET(vdev);
     VirtQueueElement *elem;
 
+    /* Commands change state that is used by the datapath */
+    virtio_net_drained_begin(n);
     for (;;) {
         size_t written;
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
@@ -1606,6 +1640,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
             break;
         }
     }
+    virtio_net_drained_end(n);
 }
 
 /* RX */
@@ -1912,7 +1947,14 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
         if (index >= 0) {
             NetClientState *nc2 =
                 qemu_get_subqueue(n->nic, index % n->curr_queue_pairs);
-            return virtio_net_receive_rcu(nc2, buf, size, true);
+
+            /*
+             * A queue pair that is processed in another IOThread cannot be
+             * used from here, keep the packet on this one.
+             */
+            if (nc2->aio_context == nc->aio_context) {
+                return virtio_net_receive_rcu(nc2, buf, size, true);
+            }
         }
     }
 
@@ -2023,7 +2065,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    virtio_net_notify(n, q->rx_vq);
 
     return size;
 
@@ -2044,6 +2086,129 @@ static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
     return virtio_net_receive_rcu(nc, buf, size, false);
 }
 
+/*
+ * Direct receive: the backend reads the next packet, vnet header included,
+ * into the guest buffer returned by virtio_net_receive_direct_begin(),
+ * instead of handing a copy to virtio_net_receive().  This needs the vnet
+ * header of the backend to be the one of the guest, and nothing that has
+ * to look at the packet before it is in guest memory.
+ */
+static bool virtio_net_can_receive_direct(VirtIONet *n)
+{
+    return n->has_vnet_hdr && n->host_hdr_len == n->guest_hdr_len &&
+           !n->rss_data.enabled && !n->rss_data.populate_hash &&
+           !n->rsc4_enabled && !n->rsc6_enabled;
+}
+
+/* Give back the lent buffer */
+static void virtio_net_rx_direct_unpop(VirtIONetQueue *q)
+{
+    virtqueue_unpop(q->rx_vq, q->rx_direct.elem, 0);
+    g_free(q->rx_direct.elem);
+    q->rx_direct.elem = NULL;
+}
+
+/*
+ * Only one buffer is lent, whatever the size of the packets that the guest
+ * expects: a packet that does not fit is given back by the backend, which
+ * then sends it through virtio_net_receive() to be spread over mergeable
+ * buffers.
+ */
+static int virtio_net_receive_direct_begin(NetClientState *nc,
+                                           struct iovec *iov, int iovcnt)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtQueueElement *elem;
+
+    assert(!q->rx_direct.elem);
+
+    if (!virtio_net_can_receive(nc) || !virtio_net_can_receive_direct(n)) {
+        return 0;
+    }
+
+    /*
+     * Anything unusual, such as running out of buffers, is left to
+     * virtio_net_receive(), which also takes care of notifications.
+     */
+    elem = virtqueue_pop(q->rx_vq, sizeof(VirtQueueElement));
+    if (!elem) {
+        return 0;
+    }
+    q->rx_direct.elem = elem;
+
+    if (elem->in_num < 1 || elem->in_num > MIN(iovcnt, VIRTQUEUE_MAX_SIZE)) {
+        virtio_net_rx_direct_unpop(q);
+        return 0;
+    }
+    memcpy(iov, elem->in_sg, elem->in_num * sizeof(*iov));
+    return elem->in_num;
+}
+
+static void virtio_net_receive_direct_end(NetClientState *nc, ssize_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtQueueElement *elem = q->rx_direct.elem;
+    union {
+        struct virtio_net_hdr hdr;
+        uint8_t buf[sizeof(struct virtio_net_hdr_v1_hash) + ETH_MAX_L2_HDR_LEN];
+    } head = { };
+    size_t hdr_len = n->guest_hdr_len;
+    bool hdr_changed = false;
+
+    /* No packet, one that did not fit, or one too short to be received */
+    if (size < (ssize_t)(hdr_len + ETH_HLEN) ||
+        (size_t)size > iov_size(elem->in_sg, elem->in_num)) {
+        virtio_net_rx_direct_unpop(q);
+        return;
+    }
+
+    iov_to_buf(elem->in_sg, elem->in_num, 0, head.buf,
+               MIN(size, sizeof(head.buf)));
+    if (!receive_filter(n, head.buf, size)) {
+        virtio_net_rx_direct_unpop(q);
+        return;
+    }
+
+    /* What receive_header() does, but on the packet in guest memory */
+    if ((head.hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) &&
+        size - hdr_len < ETH_MTU) {
+        uint8_t pkt[sizeof(struct virtio_net_hdr_v1_hash) + ETH_MTU];
+
+        iov_to_buf(elem->in_sg, elem->in_num, 0, pkt, size);
+        work_around_broken_dhclient(&head.hdr, pkt + hdr_len, size - hdr_len);
+        if (!(head.hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+            iov_from_buf(elem->in_sg, elem->in_num, hdr_len, pkt + hdr_len,
+                         size - hdr_len);
+            hdr_changed = true;
+        }
+    }
+    if (n->needs_vnet_hdr_swap) {
+        virtio_net_hdr_swap(vdev, &head.hdr);
+        hdr_changed = true;
+    }
+    if (hdr_changed) {
+        iov_from_buf(elem->in_sg, elem->in_num, 0, &head.hdr,
+                     sizeof(head.hdr));
+    }
+
+    if (n->mergeable_rx_bufs) {
+        uint16_t num_buffers;
+
+        virtio_stw_p(vdev, &num_buffers, 1);
+        iov_from_buf(elem->in_sg, elem->in_num,
+                     offsetof(struct virtio_net_hdr_mrg_rxbuf, num_buffers),
+                     &num_buffers, sizeof(num_buffers));
+    }
+
+    virtqueue_push(q->rx_vq, elem, size);
+    g_free(elem);
+    q->rx_direct.elem = NULL;
+    virtio_net_notify(n, q->rx_vq);
+}
+
 static void virtio_net_rsc_extract_unit4(VirtioNetRscChain *chain,
                                          const uint8_t *buf,
                                          VirtioNetRscUnit *unit)
@@ -2654,11 +2819,10 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
     int ret;
 
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(n, q->tx_vq);
 
     g_free(q->async_tx.elem);
     q->async_tx.elem = NULL;
@@ -2682,14 +2846,91 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     }
 }
 
+/*
+ * Send the packet in @elem.  Returns 0 if the packet was sent or dropped,
+ * -EBUSY if it is queued by the peer, which calls virtio_net_tx_complete()
+ * once it is sent, or -EINVAL if the device is broken.
+ */
+static int virtio_net_tx_one(VirtIONetQueue *q, VirtQueueElement *elem)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    ssize_t ret;
+    unsigned int out_num;
+    struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
+    struct virtio_net_hdr vhdr;
+
+    out_num = elem->out_num;
+    out_sg = elem->out_sg;
+    if (out_num < 1) {
+        virtio_error(vdev, "virtio-net header not in first element");
+        return -EINVAL;
+    }
+
+    if (n->needs_vnet_hdr_swap) {
+        if (iov_to_buf(out_sg, out_num, 0, &vhdr, sizeof(vhdr)) <
+            sizeof(vhdr)) {
+            virtio_error(vdev, "virtio-net header incorrect");
+            return -EINVAL;
+        }
+        virtio_net_hdr_swap(vdev, &vhdr);
+        sg2[0].iov_base = &vhdr;
+        sg2[0].iov_len = sizeof(vhdr);
+        out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1, out_sg, out_num,
+                           sizeof(vhdr), -1);
+        if (out_num == VIRTQUEUE_MAX_SIZE) {
+            return 0;
+        }
+        out_num += 1;
+        out_sg = sg2;
+    }
+    /*
+     * If host wants to see the guest header as is, we can
+     * pass it on unchanged. Otherwise, copy just the parts
+     * that host is interested in.
+     */
+    assert(n->host_hdr_len <= n->guest_hdr_len);
+    if (n->host_hdr_len != n->guest_hdr_len) {
+        if (iov_size(out_sg, out_num) < n->guest_hdr_len) {
+            virtio_error(vdev, "virtio-net header is invalid");
+            return -EINVAL;
+        }
+        unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
+                                   out_sg, out_num,
+                                   0, n->host_hdr_len);
+        sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
+                         out_sg, out_num,
+                         n->guest_hdr_len, -1);
+        out_num = sg_num;
+        out_sg = sg;
+
+        if (out_num < 1) {
+            virtio_error(vdev, "virtio-net nothing to send");
+            return -EINVAL;
+        }
+    }
+
+    ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
+                                  out_sg, out_num, virtio_net_tx_complete);
+    if (ret == 0) {
+        q->async_tx.elem = elem;
+        return -EBUSY;
+    }
+    return 0;
+}
+
 /* TX */
-static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+static int32_t virtio_net_do_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement *elem;
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
+    unsigned int lens[VIRTIO_NET_TX_BATCH] = { 0 };
+    unsigned int i, j, num;
     int32_t num_packets = 0;
-    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    int ret = 0;
+
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
@@ -2699,90 +2940,61 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
-    for (;;) {
-        ssize_t ret;
-        unsigned int out_num;
-        struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
-        struct virtio_net_hdr vhdr;
-
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
+    while (num_packets < n->tx_burst) {
+        num = virtqueue_pop_batch(q->tx_vq, sizeof(VirtQueueElement),
+                                  (void **)elems,
+                                  MIN(ARRAY_SIZE(elems),
+                                      n->tx_burst - num_packets));
+        if (!num) {
             break;
         }
 
-        out_num = elem->out_num;
-        out_sg = elem->out_sg;
-        if (out_num < 1) {
-            virtio_error(vdev, "virtio-net header not in first element");
-            goto detach;
-        }
-
-        if (n->needs_vnet_hdr_swap) {
-            if (iov_to_buf(out_sg, out_num, 0, &vhdr, sizeof(vhdr)) <
-                sizeof(vhdr)) {
-                virtio_error(vdev, "virtio-net header incorrect");
-                goto detach;
+        for (i = 0; i < num; i++) {
+            ret = virtio_net_tx_one(q, elems[i]);
+            if (ret < 0) {
+                break;
             }
-            virtio_net_hdr_swap(vdev, &vhdr);
-            sg2[0].iov_base = &vhdr;
-            sg2[0].iov_len = sizeof(vhdr);
-            out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1, out_sg, out_num,
-                               sizeof(vhdr), -1);
-            if (out_num == VIRTQUEUE_MAX_SIZE) {
-                goto drop;
-            }
-            out_num += 1;
-            out_sg = sg2;
         }
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
-         */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            if (iov_size(out_sg, out_num) < n->guest_hdr_len) {
-                virtio_error(vdev, "virtio-net header is invalid");
-                goto detach;
-            }
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
-                                       out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
-
-            if (out_num < 1) {
-                virtio_error(vdev, "virtio-net nothing to send");
-                goto detach;
+
+        /* Packets that were sent or dropped are completed together */
+        if (i) {
+            virtqueue_push_batch(q->tx_vq, elems, lens, i);
+            virtio_net_notify(n, q->tx_vq);
+            for (j = 0; j < i; j++) {
+                g_free(elems[j]);
             }
+            num_packets += i;
         }
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
-        if (ret == 0) {
+        if (ret == -EBUSY) {
+            /* Give back the packets after the queued one, latest first */
+            for (j = num - 1; j > i; j--) {
+                virtqueue_unpop(q->tx_vq, elems[j], 0);
+                g_free(elems[j]);
+            }
             virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
             return -EBUSY;
         }
-
-drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
-
-        if (++num_packets >= n->tx_burst) {
-            break;
+        if (ret == -EINVAL) {
+            for (j = i; j < num; j++) {
+                virtqueue_detach_element(q->tx_vq, elems[j], 0);
+                g_free(elems[j]);
+            }
+            return -EINVAL;
         }
     }
     return num_packets;
+}
 
-detach:
-    virtqueue_detach_element(q->tx_vq, elem, 0);
-    g_free(elem);
-    return -EINVAL;
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+{
+    int32_t ret;
+
+    /* Let the backend submit the packets of a flush together */
+    defer_call_begin();
+    ret = virtio_net_do_flush_tx(q);
+    defer_call_end();
+    return ret;
 }
 
 static void virtio_net_tx_timer(void *opaque);
@@ -2987,6 +3199,278 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
     virtio_del_queue(vdev, index * 2 + 1);
 }
 
+static void virtio_net_tx_bh_set_aio_context(VirtIONetQueue *q,
+                                             AioContext *ctx)
+{
+    qemu_bh_delete(q->tx_bh);
+    q->tx_bh = aio_bh_new_guarded(ctx, virtio_net_tx_bh, q,
+                                  &DEVICE(q->n)->mem_reentrancy_guard);
+}
+
+/*
+ * Hand queue pair @q over to its IOThread: the TX bottom half, the NIC queue
+ * and its peer, and finally the host notifiers, which also kicks the
+ * virtqueues.
+ *
+ * Context: BQL held
+ */
+static void virtio_net_queue_attach(VirtIONetQueue *q)
+{
+    VirtIONet *n = q->n;
+    int index = q - n->vqs;
+    NetClientState *nc = qemu_get_subqueue(n->nic, index);
+    AioContext *ctx = q->aio_context;
+
+    if (!ctx || nc->aio_context || n->nic->peer_deleted) {
+        return;
+    }
+
+    if (nc->peer && !QTAILQ_EMPTY(&nc->peer->filters)) {
+        warn_report_once("virtio-net: netdev '%s' has filters, its queues "
+                         "are processed in the main loop", nc->peer->name);
+        return;
+    }
+
+    trace_virtio_net_queue_attach(n, index, ctx);
+
+    virtio_net_tx_bh_set_aio_context(q, ctx);
+    qemu_set_aio_context(nc, ctx);
+    qemu_set_aio_context(nc->peer, ctx);
+    if (q->tx_waiting) {
+        replay_bh_schedule_event(q->tx_bh);
+    }
+
+    event_notifier_set_handler(virtio_queue_get_host_notifier(q->rx_vq), NULL);
+    event_notifier_set_handler(virtio_queue_get_host_notifier(q->tx_vq), NULL);
+    virtio_queue_aio_attach_host_notifier(q->rx_vq, ctx);
+    virtio_queue_aio_attach_host_notifier(q->tx_vq, ctx);
+}
+
+/* Context: BH in IOThread */
+static void virtio_net_queue_detach_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    NetClientState *nc = qemu_get_subqueue(q->n->nic, q - q->n->vqs);
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    virtio_queue_aio_detach_host_notifier(q->rx_vq, ctx);
+    virtio_queue_aio_detach_host_notifier(q->tx_vq, ctx);
+
+    /*
+     * Test and clear notifiers after disabling event, in case poll callback
+     * didn't have time to run.
+     */
+    virtio_queue_host_notifier_read(virtio_queue_get_host_notifier(q->rx_vq));
+    virtio_queue_host_notifier_read(virtio_queue_get_host_notifier(q->tx_vq));
+
+    /* q->tx_waiting is still set if a flush is pending */
+    qemu_bh_cancel(q->tx_bh);
+
+    qemu_set_aio_context(nc->peer, NULL);
+    qemu_set_aio_context(nc, NULL);
+}
+
+/*
+ * Bring queue pair @q back to the main loop, where it is processed like
+ * without an IOThread.
+ *
+ * Context: BQL held
+ */
+static void virtio_net_queue_detach(VirtIONetQueue *q)
+{
+    VirtIONet *n = q->n;
+    int index = q - n->vqs;
+    NetClientState *nc = qemu_get_subqueue(n->nic, index);
+
+    if (!nc->aio_context) {
+        return;
+    }
+
+    trace_virtio_net_queue_detach(n, index);
+
+    aio_wait_bh_oneshot(nc->aio_context, virtio_net_queue_detach_bh, q);
+
+    event_notifier_set_handler(virtio_queue_get_host_notifier(q->rx_vq),
+                               virtio_queue_host_notifier_read);
+    event_notifier_set_handler(virtio_queue_get_host_notifier(q->tx_vq),
+                               virtio_queue_host_notifier_read);
+
+    virtio_net_tx_bh_set_aio_context(q, qemu_get_aio_context());
+    if (q->tx_waiting) {
+        replay_bh_schedule_event(q->tx_bh);
+    }
+}
+
+static void virtio_net_attach_queues(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < (n->multiqueue ? n->max_queue_pairs : 1); i++) {
+        virtio_net_queue_attach(&n->vqs[i]);
+    }
+}
+
+static void virtio_net_detach_queues(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < (n->multiqueue ? n->max_queue_pairs : 1); i++) {
+        virtio_net_queue_detach(&n->vqs[i]);
+    }
+}
+
+/*
+ * Suspend processing in IOThreads while the main loop changes state that the
+ * datapath uses, such as the status, the number of queue pairs or the receive
+ * filters.  Queue pairs are processed in the main loop meanwhile.
+ *
+ * Context: BQL held
+ */
+static void virtio_net_drained_begin(VirtIONet *n)
+{
+    if (n->drain_count++ == 0 && n->ioeventfd_started) {
+        virtio_net_detach_queues(n);
+    }
+}
+
+/* Context: BQL held */
+static void virtio_net_drained_end(VirtIONet *n)
+{
+    assert(n->drain_count > 0);
+    if (--n->drain_count == 0 && n->ioeventfd_started) {
+        virtio_net_attach_queues(n);
+    }
+}
+
+/* Context: BQL held */
+static int virtio_net_start_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int nvqs = virtio_get_num_queues(vdev);
+    int r;
+
+    if (!n->net_conf.iothread_vq_mapping_list) {
+        return virtio_device_start_ioeventfd_impl(vdev);
+    }
+
+    /* Set up guest notifier (irq), virtio_notify_irqfd() needs it */
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
+    if (r != 0) {
+        error_report("virtio-net failed to set guest notifier (%d), "
+                     "ensure -accel kvm is set.", r);
+        return r;
+    }
+
+    r = virtio_device_start_ioeventfd_impl(vdev);
+    if (r < 0) {
+        k->set_guest_notifiers(qbus->parent, nvqs, false);
+        return r;
+    }
+
+    n->ioeventfd_started = true;
+    if (!n->drain_count) {
+        virtio_net_attach_queues(n);
+    }
+    return 0;
+}
+
+/* Context: BQL held */
+static void virtio_net_stop_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+
+    if (!n->net_conf.iothread_vq_mapping_list) {
+        virtio_device_stop_ioeventfd_impl(vdev);
+        return;
+    }
+
+    if (!n->drain_count) {
+        virtio_net_detach_queues(n);
+    }
+    n->ioeventfd_started = false;
+
+    virtio_device_stop_ioeventfd_impl(vdev);
+    k->set_guest_notifiers(qbus->parent, virtio_get_num_queues(vdev), false);
+}
+
+/* Context: BQL held */
+static bool virtio_net_vq_aio_context_init(VirtIONet *n, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    g_autofree AioContext **vq_aio_context = NULL;
+    int i;
+
+    if (!n->net_conf.iothread_vq_mapping_list) {
+        return true;
+    }
+
+    if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
+        error_setg(errp,
+                   "device is incompatible with iothread-vq-mapping "
+                   "(transport does not support notifiers)");
+        return false;
+    }
+    if (!virtio_device_ioeventfd_enabled(vdev)) {
+        error_setg(errp, "ioeventfd is required for iothread-vq-mapping");
+        return false;
+    }
+    if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
+        error_setg(errp, "iothread-vq-mapping is incompatible with tx=timer");
+        return false;
+    }
+    if (virtio_has_feature(n->host_features, VIRTIO_NET_F_RSC_EXT)) {
+        error_setg(errp,
+                   "iothread-vq-mapping is incompatible with guest_rsc_ext");
+        return false;
+    }
+
+    for (i = 0; i < n->nic_conf.peers.queues; i++) {
+        NetClientState *peer = n->nic_conf.peers.ncs[i];
+
+        if (get_vhost_net(peer)) {
+            error_setg(errp,
+                       "iothread-vq-mapping is incompatible with vhost");
+            return false;
+        }
+        if (!peer->info->set_aio_context) {
+            error_setg(errp, "netdev '%s' cannot be processed in an IOThread",
+                       peer->name);
+            return false;
+        }
+    }
+
+    /* The mapping is per queue pair, the control virtqueue is not mapped */
+    vq_aio_context = g_new(AioContext *, n->max_queue_pairs);
+    if (!iothread_vq_mapping_apply(n->net_conf.iothread_vq_mapping_list,
+                                   vq_aio_context, n->max_queue_pairs,
+                                   errp)) {
+        return false;
+    }
+    for (i = 0; i < n->max_queue_pairs; i++) {
+        n->vqs[i].aio_context = vq_aio_context[i];
+    }
+
+    /* Guest notifiers are only masked by vhost */
+    vdev->use_guest_notifier_mask = false;
+    return true;
+}
+
+/* Context: BQL held */
+static void virtio_net_vq_aio_context_cleanup(VirtIONet *n)
+{
+    assert(!n->ioeventfd_started);
+
+    if (n->net_conf.iothread_vq_mapping_list) {
+        iothread_vq_mapping_cleanup(n->net_conf.iothread_vq_mapping_list);
+    }
+}
+
 static void virtio_net_change_num_queue_pairs(VirtIONet *n, int new_max_queue_pairs)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
@@ -3357,6 +3841,8 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_direct_begin = virtio_net_receive_direct_begin,
+    .receive_direct_end = virtio_net_receive_direct_end,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
     .announce = virtio_net_announce,
@@ -3685,6 +4171,11 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         return;
     }
     n->vqs = g_new0(VirtIONetQueue, n->max_queue_pairs);
+    if (!virtio_net_vq_aio_context_init(n, errp)) {
+        g_free(n->vqs);
+        virtio_cleanup(vdev);
+        return;
+    }
     n->curr_queue_pairs = 1;
     n->tx_timeout = n->net_conf.txtimer;
 
@@ -3800,6 +4291,7 @@ static void virtio_net_device_unrealize(DeviceState *dev)
     /* delete also control vq */
     virtio_del_queue(vdev, max_queue_pairs * 2);
     qemu_announce_timer_del(&n->announce_timer, false);
+    virtio_net_vq_aio_context_cleanup(n);
     g_free(n->vqs);
     qemu_del_nic(n->nic);
     virtio_net_rsc_cleanup(n);
@@ -4000,6 +4492,8 @@ static Property virtio_net_properties[] = {
                       VIRTIO_NET_F_GUEST_USO6, true),
     DEFINE_PROP_BIT64("host_uso", VirtIONet, host_features,
                       VIRTIO_NET_F_HOST_USO, true),
+    DEFINE_PROP_IOTHREAD_VQ_MAPPING_LIST("iothread-vq-mapping", VirtIONet,
+                                         net_conf.iothread_vq_mapping_list),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -4022,6 +4516,8 @@ static void virtio_net_class_init(ObjectClass *klass, void *data)
     vdc->queue_reset = virtio_net_queue_reset;
     vdc->queue_enable = virtio_net_queue_enable;
     vdc->set_status = virtio_net_set_status;
+    vdc->start_ioeventfd = virtio_net_start_ioeventfd;
+    vdc->stop_ioeventfd = virtio_net_stop_ioeventfd;
     vdc->guest_notifier_mask = virtio_net_guest_notifier_mask;
     vdc->guest_notifier_pending = virtio_net_guest_notifier_pending;
     vdc->legacy_features |= (0x1 << VIRTIO_NET_F_GSO);
@@ -194,6 +194,8 @@
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
 #include "qemu/log.h"
+#include "qemu/lockable.h"
+#include "qemu/main-loop.h"
 #include "qemu/units.h"
 #include "qemu/range.h"
 #include "qapi/error.h"
@@ -4733,7 +4735,9 @@ static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
     uint16_t offset = sq->sqid << 3;
 
-    n->sq[sq->sqid] = NULL;
+    WITH_QEMU_LOCK_GUARD(&n->db_lock) {
+        n->sq[sq->sqid] = NULL;
+    }
     qemu_bh_delete(sq->bh);
     if (sq->ioeventfd_enabled) {
         memory_region_del_eventfd(&n->iomem,
@@ -4826,7 +4830,9 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
-    n->sq[sqid] = sq;
+    WITH_QEMU_LOCK_GUARD(&n->db_lock) {
+        n->sq[sqid] = sq;
+    }
 }
 
 static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeRequest *req)
@@ -7749,6 +7755,8 @@ static uint64_t nvme_mmio_read(void *opaque, hwaddr addr, unsigned size)
     NvmeCtrl *n = (NvmeCtrl *)opaque;
     uint8_t *ptr = (uint8_t *)&n->bar;
 
+    BQL_LOCK_GUARD();
+
     trace_pci_nvme_mmio_read(addr, size);
 
     if (unlikely(addr & (sizeof(uint32_t) - 1))) {
@@ -7940,6 +7948,44 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
     }
 }
 
+/*
+ * Fast path for submission queue tail doorbell writes to I/O queues, which
+ * only need to update the tail and kick the queue and are therefore done
+ * without the BQL.  Returns false if the write must go through
+ * nvme_process_db(), including for all errors.
+ */
+static bool nvme_process_sq_db_lockless(NvmeCtrl *n, hwaddr addr, int val)
+{
+    uint16_t new_tail = val & 0xffff;
+    NvmeSQueue *sq;
+    uint32_t qid;
+
+    if (addr & ((1 << 2) - 1) || ((addr - 0x1000) >> 2) & 1) {
+        return false;
+    }
+
+    qid = (addr - 0x1000) >> 3;
+    if (!qid) {
+        /* The admin queue may need to update the shadow doorbell */
+        return false;
+    }
+
+    QEMU_LOCK_GUARD(&n->db_lock);
+    if (!n->sq || qid > n->conf_ioqpairs) {
+        return false;
+    }
+    sq = n->sq[qid];
+    if (!sq || new_tail >= sq->size) {
+        return false;
+    }
+
+    trace_pci_nvme_mmio_doorbell_sq(sq->sqid, new_tail);
+
+    qatomic_set(&sq->tail, new_tail);
+    qemu_bh_schedule(sq->bh);
+    return true;
+}
+
 static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
                             unsigned size)
 {
@@ -7947,6 +7993,13 @@ static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
 
     trace_pci_nvme_mmio_write(addr, data, size);
 
+    if (addr >= sizeof(n->bar) && !pci_is_vf(PCI_DEVICE(n)) &&
+        nvme_process_sq_db_lockless(n, addr, data)) {
+        return;
+    }
+
+    BQL_LOCK_GUARD();
+
     if (pci_is_vf(PCI_DEVICE(n)) && !nvme_sctrl(n)->scs &&
         addr != NVME_REG_CSTS) {
         trace_pci_nvme_err_ignored_mmio_vf_offline(addr, size);
@@ -8363,6 +8416,7 @@ static bool nvme_init_pci(NvmeCtrl *n, PCIDevice *pci_dev, Error **errp)
         bar_size = nvme_mbar_size(n->params.max_ioqpairs + 1, 0, NULL, NULL);
         memory_region_init_io(&n->iomem, OBJECT(n), &nvme_mmio_ops, n, "nvme",
                               bar_size);
+        memory_region_enable_lockless_io(&n->iomem);
         pci_register_bar(pci_dev, 0, PCI_BASE_ADDRESS_SPACE_MEMORY |
                          PCI_BASE_ADDRESS_MEM_TYPE_64, &n->iomem);
         ret = msix_init_exclusive_bar(pci_dev, n->params.msix_qsize, 4, errp);
@@ -8387,6 +8441,7 @@ static bool nvme_init_pci(NvmeCtrl *n, PCIDevice *pci_dev, Error **errp)
         memory_region_init(&n->bar0, OBJECT(n), "nvme-bar0", bar_size);
         memory_region_init_io(&n->iomem, OBJECT(n), &nvme_mmio_ops, n, "nvme",
                               msix_table_offset);
+        memory_region_enable_lockless_io(&n->iomem);
         memory_region_add_subregion(&n->bar0, 0, &n->iomem);
 
         if (pci_is_vf(pci_dev)) {
@@ -8676,7 +8731,10 @@ static void nvme_exit(PCIDevice *pci_dev)
     }
 
     g_free(n->cq);
-    g_free(n->sq);
+    WITH_QEMU_LOCK_GUARD(&n->db_lock) {
+        g_free(n->sq);
+        n->sq = NULL;
+    }
     g_free(n->aer_reqs);
 
     if (n->params.cmb_size_mb) {
@@ -8852,6 +8910,8 @@ static void nvme_instance_init(Object *obj)
 {
     NvmeCtrl *n = NVME(obj);
 
+    qemu_mutex_init(&n->db_lock);
+
     device_add_bootindex_property(obj, &n->namespace.blkconf.bootindex,
                                   "bootindex", "/namespace@1,0",
                                   DEVICE(obj));
@@ -8861,11 +8921,19 @@ static void nvme_instance_init(Object *obj)
                         nvme_set_smart_warning, NULL, NULL);
 }
 
+static void nvme_instance_finalize(Object *obj)
+{
+    NvmeCtrl *n = NVME(obj);
+
+    qemu_mutex_destroy(&n->db_lock);
+}
+
 static const TypeInfo nvme_info = {
     .name          = TYPE_NVME,
     .parent        = TYPE_PCI_DEVICE,
     .instance_size = sizeof(NvmeCtrl),
     .instance_init = nvme_instance_init,
+    .instance_finalize = nvme_instance_finalize,
     .class_init    = nvme_class_init,
     .interfaces = (InterfaceInfo[]) {
         { INTERFACE_PCIE_DEVICE },
@@ -596,6 +596,11 @@ typedef struct NvmeCtrl {
 
     NvmeNamespace   namespace;
     NvmeNamespace   *namespaces[NVME_MAX_NAMESPACES + 1];
+    /*
+     * Submission queue tail doorbells of I/O queues are written without
+     * the BQL; db_lock protects n->sq against them.
+     */
+    QemuMutex       db_lock;
     NvmeSQueue      **sq;
     NvmeCQueue      **cq;
     NvmeSQueue      admin_sq;
@@ -1522,6 +1522,11 @@ static void pci_update_mappings(PCIDevice *d)
     int i;
     pcibus_t new_addr;
 
+    /*
+     * Commit each BAR change as a whole, so that listeners see a move
+     * rather than an unmapping followed by a new mapping.
+     */
+    memory_region_transaction_begin();
     for(i = 0; i < PCI_NUM_REGIONS; i++) {
         r = &d->io_regions[i];
 
@@ -1556,6 +1561,7 @@ static void pci_update_mappings(PCIDevice *d)
                                                 r->addr, r->memory, 1);
         }
     }
+    memory_region_transaction_commit();
 
     pci_update_vga(d);
 }
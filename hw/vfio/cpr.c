@@ -7,6 +7,7 @@
 
 #include "qemu/osdep.h"
 #include "hw/vfio/vfio-common.h"
+#include "migration/blocker.h"
 #include "migration/misc.h"
 #include "qapi/error.h"
 #include "sysemu/runstate.h"
@@ -27,6 +28,17 @@ static int vfio_cpr_reboot_notifier(NotifierWithReturn *notifier,
 
 bool vfio_cpr_register_container(VFIOContainerBase *bcontainer, Error **errp)
 {
+    /*
+     * Handing the container over would also require updating the vaddr
+     * of every DMA mapping in the new QEMU, which is not supported.
+     */
+    error_setg(&bcontainer->cpr_transfer_blocker,
+               "VFIO device does not support cpr-transfer");
+    if (migrate_add_blocker_modes(&bcontainer->cpr_transfer_blocker, errp,
+                                  MIG_MODE_CPR_TRANSFER, -1) < 0) {
+        return false;
+    }
+
     migration_add_notifier_mode(&bcontainer->cpr_reboot_notifier,
                                 vfio_cpr_reboot_notifier,
                                 MIG_MODE_CPR_REBOOT);
@@ -36,4 +48,5 @@ bool vfio_cpr_register_container(VFIOContainerBase *bcontainer, Error **errp)
 void vfio_cpr_unregister_container(VFIOContainerBase *bcontainer)
 {
     migration_remove_notifier(&bcontainer->cpr_reboot_notifier);
+    migrate_del_blocker(&bcontainer->cpr_transfer_blocker);
 }
@@ -1891,6 +1891,17 @@ static void virtio_pci_modern_regions_init(VirtIOPCIProxy *proxy,
                           proxy,
                           name->str,
                           proxy->notify_pio.size);
+
+    /*
+     * Queue notifications are by far the most frequent accesses, and
+     * virtio_queue_notify() only takes the BQL if it has to run the
+     * device's handler itself; a per-queue lock keeps kicks from racing
+     * with the host notifier being disabled and drained.  The device is
+     * only unplugged together with the proxy, which the memory core keeps
+     * alive during accesses.
+     */
+    memory_region_enable_lockless_io(&proxy->notify.mr);
+    memory_region_enable_lockless_io(&proxy->notify_pio.mr);
 }
 
 static void virtio_pci_modern_region_map(VirtIOPCIProxy *proxy,
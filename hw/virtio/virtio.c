@@ -17,6 +17,7 @@
 #include "trace.h"
 #include "qemu/defer-call.h"
 #include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
@@ -32,6 +33,7 @@
 #include "hw/virtio/virtio-access.h"
 #include "sysemu/dma.h"
 #include "sysemu/runstate.h"
+#include "sysemu/xen.h"
 #include "virtio-qmp.h"
 
 #include "standard-headers/linux/virtio_ids.h"
@@ -117,6 +119,29 @@ typedef struct VRingPackedDescEvent {
     uint16_t flags;
 } VRingPackedDescEvent ;
 
+/*
+ * Number of RAM ranges that each virtqueue remembers to map descriptors
+ * without going through address_space_translate().
+ */
+#define VIRTQUEUE_MAP_CACHE_SIZE 4
+
+typedef struct VirtQueueMapCacheEntry {
+    hwaddr addr;
+    hwaddr len;         /* 0 if the entry is unused */
+    void *host;
+    MemoryRegion *mr;
+    unsigned int gen;   /* VirtIODevice.map_cache_gen when filled */
+    bool is_write;
+} VirtQueueMapCacheEntry;
+
+struct VirtIOIOMMUNotifier {
+    IOMMUNotifier n;
+    MemoryRegion *mr;
+    VirtIODevice *vdev;
+    QLIST_ENTRY(VirtIOIOMMUNotifier) next;
+};
+typedef struct VirtIOIOMMUNotifier VirtIOIOMMUNotifier;
+
 struct VirtQueue
 {
     VRing vring;
@@ -151,8 +176,17 @@ struct VirtQueue
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
+    /*
+     * Protects host_notifier_enabled against virtio_queue_notify() running
+     * without the BQL, so that no kick goes to a notifier being torn down.
+     */
+    QemuMutex host_notifier_lock;
     bool host_notifier_enabled;
     QLIST_ENTRY(VirtQueue) node;
+
+    /* Only accessed by the thread that pops elements */
+    VirtQueueMapCacheEntry map_cache[VIRTQUEUE_MAP_CACHE_SIZE];
+    unsigned int map_cache_next;
 };
 
 const char *virtio_device_names[] = {
@@ -867,7 +901,7 @@ void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
 {
 
     if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
-        virtqueue_packed_rewind(vq, 1);
+        virtqueue_packed_rewind(vq, elem->ndescs);
     } else {
         virtqueue_split_rewind(vq, 1);
     }
@@ -1168,6 +1202,22 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
     virtqueue_flush(vq, 1);
 }
 
+void virtqueue_push_batch(VirtQueue *vq, VirtQueueElement *const *elems,
+                          const unsigned int *lens, unsigned int num)
+{
+    unsigned int i;
+
+    if (!num) {
+        return;
+    }
+
+    RCU_READ_LOCK_GUARD();
+    for (i = 0; i < num; i++) {
+        virtqueue_fill(vq, elems[i], lens[i], i);
+    }
+    virtqueue_flush(vq, num);
+}
+
 /* Called within rcu_read_lock().  */
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
@@ -1552,11 +1602,97 @@ int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
     return in_bytes <= in_total && out_bytes <= out_total;
 }
 
-static bool virtqueue_map_desc(VirtIODevice *vdev, unsigned int *p_num_sg,
+/*
+ * Guests keep reusing the same few buffer areas, so each virtqueue caches
+ * the RAM ranges it recently mapped descriptors from.  Entries are valid
+ * as long as the device's map_cache_gen does not change.
+ *
+ * The generation is odd while the memory topology is being updated, from
+ * the begin callback of the memory listener to its commit callback, and
+ * the cache is bypassed then.  It becomes even again only after the new
+ * FlatView has been published, so an entry filled during the update, from
+ * either FlatView, is never used afterwards.  Entries of the current
+ * generation were filled, and are used, by readers that read the
+ * generation before the update started, i.e. before the old FlatView was
+ * handed to call_rcu(): their MemoryRegion stays alive for the whole RCU
+ * critical section.
+ *
+ * An IOMMU in front of the device invalidating translations also bumps
+ * the generation, by two so that an update in progress stays visible.
+ */
+static void virtio_map_cache_invalidate(VirtIODevice *vdev)
+{
+    qatomic_add(&vdev->map_cache_gen, 2);
+}
+
+/*
+ * Same as dma_memory_map(), but looks up the translation in the cache of
+ * @vq first.
+ *
+ * Called within rcu_read_lock().
+ */
+static void *virtqueue_map_cached(VirtQueue *vq, hwaddr pa, hwaddr *plen,
+                                  bool is_write)
+{
+    VirtIODevice *vdev = vq->vdev;
+    /* Read the generation before looking at the FlatView */
+    unsigned int gen = qatomic_load_acquire(&vdev->map_cache_gen);
+    VirtQueueMapCacheEntry *e;
+    MemoryRegion *mr;
+    hwaddr xlat, len;
+    int i;
+
+    if (xen_enabled() || (gen & 1) ||
+        qatomic_read(&vdev->map_cache_disabled)) {
+        goto slow;
+    }
+
+    for (i = 0; i < VIRTQUEUE_MAP_CACHE_SIZE; i++) {
+        e = &vq->map_cache[i];
+        if (e->len && e->gen == gen && e->is_write == is_write &&
+            pa - e->addr < e->len) {
+            goto hit;
+        }
+    }
+
+    /* Find out how far RAM extends from @pa */
+    len = HWADDR_MAX - pa;
+    mr = address_space_translate(vdev->dma_as, pa, &xlat, &len, is_write,
+                                 MEMTXATTRS_UNSPECIFIED);
+    if (!len || !memory_access_is_direct(mr, is_write)) {
+        goto slow;
+    }
+
+    e = &vq->map_cache[vq->map_cache_next++ % VIRTQUEUE_MAP_CACHE_SIZE];
+    e->addr = pa;
+    e->len = len;
+    e->host = memory_region_get_ram_ptr(mr) + xlat;
+    e->mr = mr;
+    e->gen = gen;
+    e->is_write = is_write;
+    trace_virtqueue_map_cache_fill(vq, pa, len, is_write);
+
+hit:
+    *plen = MIN(*plen, e->len - (pa - e->addr));
+    if (!is_write) {
+        fuzz_dma_read_cb(pa, *plen, e->mr);
+    }
+    memory_region_ref(e->mr);
+    return e->host + (pa - e->addr);
+
+slow:
+    return dma_memory_map(vdev->dma_as, pa, plen,
+                          is_write ? DMA_DIRECTION_FROM_DEVICE :
+                                     DMA_DIRECTION_TO_DEVICE,
+                          MEMTXATTRS_UNSPECIFIED);
+}
+
+static bool virtqueue_map_desc(VirtQueue *vq, unsigned int *p_num_sg,
                                hwaddr *addr, struct iovec *iov,
                                unsigned int max_num_sg, bool is_write,
                                hwaddr pa, size_t sz)
 {
+    VirtIODevice *vdev = vq->vdev;
     bool ok = false;
     unsigned num_sg = *p_num_sg;
     assert(num_sg <= max_num_sg);
@@ -1575,11 +1711,7 @@ static bool virtqueue_map_desc(VirtIODevice *vdev, unsigned int *p_num_sg,
             goto out;
         }
 
-        iov[num_sg].iov_base = dma_memory_map(vdev->dma_as, pa, &len,
-                                              is_write ?
-                                              DMA_DIRECTION_FROM_DEVICE :
-                                              DMA_DIRECTION_TO_DEVICE,
-                                              MEMTXATTRS_UNSPECIFIED);
+        iov[num_sg].iov_base = virtqueue_map_cached(vq, pa, &len, is_write);
         if (!iov[num_sg].iov_base) {
             virtio_error(vdev, "virtio: bogus descriptor or out of resources");
             goto out;
@@ -1670,10 +1802,17 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     return elem;
 }
 
-static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+/*
+ * Pop the element at vq->last_avail_idx, which the caller knows to be
+ * available.  The caller updates the avail event.
+ *
+ * Called within rcu_read_lock().
+ */
+static VirtQueueElement *
+virtqueue_split_pop_one(VirtQueue *vq, size_t sz,
+                        VRingMemoryRegionCaches *caches)
 {
     unsigned int i, head, max, idx;
-    VRingMemoryRegionCaches *caches;
     MemoryRegionCache indirect_desc_cache;
     MemoryRegionCache *desc_cache;
     int64_t len;
@@ -1687,14 +1826,6 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
 
     address_space_cache_init_empty(&indirect_desc_cache);
 
-    RCU_READ_LOCK_GUARD();
-    if (virtio_queue_empty_rcu(vq)) {
-        goto done;
-    }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
-    smp_rmb();
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
 
@@ -1709,18 +1840,8 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
         goto done;
     }
 
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
-
     i = head;
 
-    caches = vring_get_region_caches(vq);
-    if (!caches) {
-        virtio_error(vdev, "Region caches not initialized");
-        goto done;
-    }
-
     if (caches->desc.len < max * sizeof(VRingDesc)) {
         virtio_error(vdev, "Cannot map descriptor ring");
         goto done;
@@ -1753,7 +1874,7 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
         bool map_ok;
 
         if (desc.flags & VRING_DESC_F_WRITE) {
-            map_ok = virtqueue_map_desc(vdev, &in_num, addr + out_num,
+            map_ok = virtqueue_map_desc(vq, &in_num, addr + out_num,
                                         iov + out_num,
                                         VIRTQUEUE_MAX_SIZE - out_num, true,
                                         desc.addr, desc.len);
@@ -1762,7 +1883,7 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
                 virtio_error(vdev, "Incorrect order for descriptors");
                 goto err_undo_map;
             }
-            map_ok = virtqueue_map_desc(vdev, &out_num, addr, iov,
+            map_ok = virtqueue_map_desc(vq, &out_num, addr, iov,
                                         VIRTQUEUE_MAX_SIZE, false,
                                         desc.addr, desc.len);
         }
@@ -1816,10 +1937,82 @@ err_undo_map:
     goto done;
 }
 
-static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
 {
-    unsigned int i, max;
     VRingMemoryRegionCaches *caches;
+    VirtQueueElement *elem;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_empty_rcu(vq)) {
+        return NULL;
+    }
+    /* Needed after virtio_queue_empty(), see comment in
+     * virtqueue_num_heads(). */
+    smp_rmb();
+
+    caches = vring_get_region_caches(vq);
+    if (!caches) {
+        virtio_error(vq->vdev, "Region caches not initialized");
+        return NULL;
+    }
+
+    elem = virtqueue_split_pop_one(vq, sz, caches);
+    if (elem && virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+    return elem;
+}
+
+static unsigned int virtqueue_split_pop_batch(VirtQueue *vq, size_t sz,
+                                              void **elems, unsigned int max)
+{
+    VRingMemoryRegionCaches *caches;
+    unsigned int n = 0;
+    int num_heads;
+
+    RCU_READ_LOCK_GUARD();
+    if (unlikely(!vq->vring.avail)) {
+        return 0;
+    }
+
+    /* A single read of the avail index for the whole batch */
+    num_heads = virtqueue_num_heads(vq, vq->last_avail_idx);
+    if (num_heads <= 0) {
+        return 0;
+    }
+
+    caches = vring_get_region_caches(vq);
+    if (!caches) {
+        virtio_error(vq->vdev, "Region caches not initialized");
+        return 0;
+    }
+
+    max = MIN(max, num_heads);
+    while (n < max) {
+        elems[n] = virtqueue_split_pop_one(vq, sz, caches);
+        if (!elems[n]) {
+            break;
+        }
+        n++;
+    }
+
+    if (n && virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+    return n;
+}
+
+/*
+ * Pop the element at vq->last_avail_idx, which the caller knows to be
+ * available.
+ *
+ * Called within rcu_read_lock().
+ */
+static VirtQueueElement *
+virtqueue_packed_pop_one(VirtQueue *vq, size_t sz,
+                         VRingMemoryRegionCaches *caches)
+{
+    unsigned int i, max;
     MemoryRegionCache indirect_desc_cache;
     MemoryRegionCache *desc_cache;
     int64_t len;
@@ -1834,11 +2027,6 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
 
     address_space_cache_init_empty(&indirect_desc_cache);
 
-    RCU_READ_LOCK_GUARD();
-    if (virtio_queue_packed_empty_rcu(vq)) {
-        goto done;
-    }
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
 
@@ -1851,12 +2039,6 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
 
     i = vq->last_avail_idx;
 
-    caches = vring_get_region_caches(vq);
-    if (!caches) {
-        virtio_error(vdev, "Region caches not initialized");
-        goto done;
-    }
-
     if (caches->desc.len < max * sizeof(VRingDesc)) {
         virtio_error(vdev, "Cannot map descriptor ring");
         goto done;
@@ -1890,7 +2072,7 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
         bool map_ok;
 
         if (desc.flags & VRING_DESC_F_WRITE) {
-            map_ok = virtqueue_map_desc(vdev, &in_num, addr + out_num,
+            map_ok = virtqueue_map_desc(vq, &in_num, addr + out_num,
                                         iov + out_num,
                                         VIRTQUEUE_MAX_SIZE - out_num, true,
                                         desc.addr, desc.len);
@@ -1899,7 +2081,7 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
                 virtio_error(vdev, "Incorrect order for descriptors");
                 goto err_undo_map;
             }
-            map_ok = virtqueue_map_desc(vdev, &out_num, addr, iov,
+            map_ok = virtqueue_map_desc(vq, &out_num, addr, iov,
                                         VIRTQUEUE_MAX_SIZE, false,
                                         desc.addr, desc.len);
         }
@@ -1965,6 +2147,51 @@ err_undo_map:
     goto done;
 }
 
+static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+{
+    VRingMemoryRegionCaches *caches;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_packed_empty_rcu(vq)) {
+        return NULL;
+    }
+
+    caches = vring_get_region_caches(vq);
+    if (!caches) {
+        virtio_error(vq->vdev, "Region caches not initialized");
+        return NULL;
+    }
+
+    return virtqueue_packed_pop_one(vq, sz, caches);
+}
+
+static unsigned int virtqueue_packed_pop_batch(VirtQueue *vq, size_t sz,
+                                               void **elems, unsigned int max)
+{
+    VRingMemoryRegionCaches *caches;
+    unsigned int n = 0;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_packed_empty_rcu(vq)) {
+        return 0;
+    }
+
+    caches = vring_get_region_caches(vq);
+    if (!caches) {
+        virtio_error(vq->vdev, "Region caches not initialized");
+        return 0;
+    }
+
+    while (n < max && !virtio_queue_packed_empty_rcu(vq)) {
+        elems[n] = virtqueue_packed_pop_one(vq, sz, caches);
+        if (!elems[n]) {
+            break;
+        }
+        n++;
+    }
+    return n;
+}
+
 void *virtqueue_pop(VirtQueue *vq, size_t sz)
 {
     if (virtio_device_disabled(vq->vdev)) {
@@ -1978,6 +2205,24 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     }
 }
 
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    unsigned int n;
+
+    if (virtio_device_disabled(vq->vdev)) {
+        return 0;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        n = virtqueue_packed_pop_batch(vq, sz, elems, max);
+    } else {
+        n = virtqueue_split_pop_batch(vq, sz, elems, max);
+    }
+    trace_virtqueue_pop_batch(vq, n, max);
+    return n;
+}
+
 static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
 {
     VRingMemoryRegionCaches *caches;
@@ -2498,6 +2743,15 @@ void virtio_queue_notify(VirtIODevice *vdev, int n)
     }
 
     trace_virtio_queue_notify(vdev, vq - vdev->vq, vq);
+    WITH_QEMU_LOCK_GUARD(&vq->host_notifier_lock) {
+        if (vq->host_notifier_enabled) {
+            event_notifier_set(&vq->host_notifier);
+            return;
+        }
+    }
+
+    /* Can be called without the BQL, see virtio_pci_notify_write() */
+    BQL_LOCK_GUARD();
     if (vq->host_notifier_enabled) {
         event_notifier_set(&vq->host_notifier);
     } else if (vq->handle_output) {
@@ -3472,6 +3726,7 @@ void virtio_init(VirtIODevice *vdev, uint16_t device_id, size_t config_size)
         vdev->vq[i].vdev = vdev;
         vdev->vq[i].queue_index = i;
         vdev->vq[i].host_notifier_enabled = false;
+        qemu_mutex_init(&vdev->vq[i].host_notifier_lock);
     }
 
     vdev->name = virtio_id_to_name(device_id);
@@ -3873,8 +4128,13 @@ EventNotifier *virtio_config_get_guest_notifier(VirtIODevice *vdev)
     return &vdev->config_notifier;
 }
 
+/*
+ * Once this returns with @enabled false, virtio_queue_notify() no longer
+ * touches the host notifier, and pending kicks can be drained from it.
+ */
 void virtio_queue_set_host_notifier_enabled(VirtQueue *vq, bool enabled)
 {
+    QEMU_LOCK_GUARD(&vq->host_notifier_lock);
     vq->host_notifier_enabled = enabled;
 }
 
@@ -3913,11 +4173,92 @@ void G_GNUC_PRINTF(2, 3) virtio_error(VirtIODevice *vdev, const char *fmt, ...)
     vdev->broken = true;
 }
 
+static void virtio_memory_listener_begin(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+
+    /* Bypass the map caches until the new FlatView is published */
+    qatomic_inc(&vdev->map_cache_gen);
+}
+
+static void virtio_iommu_unmap_notify(IOMMUNotifier *n, IOMMUTLBEntry *iotlb)
+{
+    VirtIOIOMMUNotifier *vin = container_of(n, VirtIOIOMMUNotifier, n);
+
+    virtio_map_cache_invalidate(vin->vdev);
+}
+
+static void virtio_memory_listener_region_add(MemoryListener *listener,
+                                              MemoryRegionSection *section)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+    VirtIOIOMMUNotifier *vin;
+    IOMMUMemoryRegion *iommu_mr;
+    Error *local_err = NULL;
+    Int128 end;
+    int iommu_idx;
+
+    if (!memory_region_is_iommu(section->mr)) {
+        return;
+    }
+
+    iommu_mr = IOMMU_MEMORY_REGION(section->mr);
+    end = int128_add(int128_make64(section->offset_within_region),
+                     section->size);
+    end = int128_sub(end, int128_one());
+    iommu_idx = memory_region_iommu_attrs_to_index(iommu_mr,
+                                                   MEMTXATTRS_UNSPECIFIED);
+
+    vin = g_new0(VirtIOIOMMUNotifier, 1);
+    iommu_notifier_init(&vin->n, virtio_iommu_unmap_notify,
+                        vdev->device_iotlb_enabled ?
+                            IOMMU_NOTIFIER_DEVIOTLB_UNMAP :
+                            IOMMU_NOTIFIER_UNMAP,
+                        section->offset_within_region,
+                        int128_get64(end),
+                        iommu_idx);
+    vin->mr = section->mr;
+    vin->vdev = vdev;
+    if (memory_region_register_iommu_notifier(section->mr, &vin->n,
+                                              &local_err)) {
+        /* Translations of this IOMMU cannot be cached */
+        error_free(local_err);
+        g_free(vin);
+        qatomic_set(&vdev->map_cache_disabled, true);
+        return;
+    }
+    QLIST_INSERT_HEAD(&vdev->iommu_list, vin, next);
+}
+
+static void virtio_memory_listener_region_del(MemoryListener *listener,
+                                              MemoryRegionSection *section)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+    VirtIOIOMMUNotifier *vin;
+
+    if (!memory_region_is_iommu(section->mr)) {
+        return;
+    }
+
+    QLIST_FOREACH(vin, &vdev->iommu_list, next) {
+        if (vin->mr == section->mr &&
+            vin->n.start == section->offset_within_region) {
+            memory_region_unregister_iommu_notifier(vin->mr, &vin->n);
+            QLIST_REMOVE(vin, next);
+            g_free(vin);
+            break;
+        }
+    }
+}
+
 static void virtio_memory_listener_commit(MemoryListener *listener)
 {
     VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
     int i;
 
+    /* The new FlatView is visible, entries filled until now are stale */
+    qatomic_inc(&vdev->map_cache_gen);
+
     for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
         if (vdev->vq[i].vring.num == 0) {
             break;
@@ -3958,6 +4299,9 @@ static void virtio_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    vdev->listener.begin = virtio_memory_listener_begin;
+    vdev->listener.region_add = virtio_memory_listener_region_add;
+    vdev->listener.region_del = virtio_memory_listener_region_del;
     vdev->listener.commit = virtio_memory_listener_commit;
     vdev->listener.name = "virtio";
     memory_listener_register(&vdev->listener, vdev->dma_as);
@@ -3992,6 +4336,9 @@ static void virtio_device_free_virtqueues(VirtIODevice *vdev)
         }
         virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
     }
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        qemu_mutex_destroy(&vdev->vq[i].host_notifier_lock);
+    }
     g_free(vdev->vq);
 }
 
@@ -4014,7 +4361,7 @@ static Property virtio_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
-static int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
+int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int i, n, r, err;
@@ -4084,7 +4431,7 @@ int virtio_device_start_ioeventfd(VirtIODevice *vdev)
     return virtio_bus_start_ioeventfd(vbus);
 }
 
-static void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
+void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int n, r;
@@ -269,6 +269,26 @@ ssize_t qcrypto_tls_session_read(QCryptoTLSSession *sess,
                                  bool gracefulTermination,
                                  Error **errp);
 
+/**
+ * qcrypto_tls_session_update_key:
+ * @sess: the TLS session object
+ * @requestPeer: ask the peer to update its own sending key too
+ * @errp: pointer to hold returned error object
+ *
+ * Send a TLS 1.3 KeyUpdate message to the remote peer and
+ * switch to the next sending key. This only applies to the
+ * sending direction when it is handled by GnuTLS, see
+ * qcrypto_tls_session_ktls_update_key() otherwise.
+ *
+ * Returns: 0 on success,
+ * or QCRYPTO_TLS_SESSION_ERR_BLOCK if the send would block,
+ * in which case it must be called again with the same
+ * arguments, or -1 on error.
+ */
+int qcrypto_tls_session_update_key(QCryptoTLSSession *sess,
+                                   bool requestPeer,
+                                   Error **errp);
+
 /**
  * qcrypto_tls_session_check_pending:
  * @sess: the TLS session object
@@ -353,4 +373,56 @@ int qcrypto_tls_session_get_key_size(QCryptoTLSSession *sess,
  */
 char *qcrypto_tls_session_get_peer_name(QCryptoTLSSession *sess);
 
+#define QCRYPTO_TLS_KTLS_SEND (1 << 0)
+#define QCRYPTO_TLS_KTLS_RECV (1 << 1)
+
+/**
+ * qcrypto_tls_session_enable_ktls:
+ * @sess: the TLS session object
+ * @fd: the TCP socket that carries the session
+ *
+ * If the credentials of the session ask for kernel offload,
+ * hand the keys negotiated by the handshake over to the
+ * kernel TLS implementation of @fd, so that records are
+ * encrypted and decrypted by the kernel (or by the NIC)
+ * instead of GnuTLS. This is only possible with the AES-GCM
+ * and ChaCha20-Poly1305 ciphers of TLS 1.2 and 1.3.
+ *
+ * This must be called once the handshake is complete and
+ * before any payload data is transferred. Afterwards, data
+ * in the offloaded directions must be sent and received with
+ * plain socket I/O on @fd rather than with
+ * qcrypto_tls_session_write() and qcrypto_tls_session_read().
+ * When received with recvmsg(), records other than application
+ * data are flagged with a TLS_GET_RECORD_TYPE control message.
+ *
+ * Returns: a mask of QCRYPTO_TLS_KTLS_SEND and
+ * QCRYPTO_TLS_KTLS_RECV for the directions now handled by
+ * the kernel, 0 if the session stays in user space
+ */
+int qcrypto_tls_session_enable_ktls(QCryptoTLSSession *sess, int fd);
+
+/**
+ * qcrypto_tls_session_ktls_update_key:
+ * @sess: the TLS session object
+ * @fd: the TCP socket that carries the session
+ * @read: the direction to update
+ * @errp: pointer to hold returned error object
+ *
+ * Switch a direction handled by the kernel to the next TLS 1.3
+ * traffic key.  For the receiving direction, this must be called
+ * once a KeyUpdate message has been received from the peer, as
+ * the kernel does not decrypt any further record until then.  For
+ * the sending direction, a KeyUpdate message is sent to the peer
+ * with the current key before the kernel switches to the next one.
+ *
+ * This requires a kernel that supports rekeying (Linux 6.14 or
+ * newer) and GnuTLS 3.7.0 or newer.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int qcrypto_tls_session_ktls_update_key(QCryptoTLSSession *sess,
+                                        int fd, bool read,
+                                        Error **errp);
+
 #endif /* QCRYPTO_TLSSESSION_H */
@@ -765,6 +765,7 @@ struct MemoryRegion {
     bool nonvolatile;
     bool rom_device;
     bool flush_coalesced_mmio;
+    bool lockless_io;
     bool unmergeable;
     uint8_t dirty_log_mask;
     bool is_iommu;
@@ -788,6 +789,9 @@ struct MemoryRegion {
     uint8_t vga_logging_count;
     MemoryRegion *alias;
     hwaddr alias_offset;
+    /* Aliases whose target is this region */
+    QLIST_HEAD(, MemoryRegion) aliases;
+    QLIST_ENTRY(MemoryRegion) aliases_link;
     int32_t priority;
     QTAILQ_HEAD(, MemoryRegion) subregions;
     QTAILQ_ENTRY(MemoryRegion) subregions_link;
@@ -2093,6 +2097,28 @@ DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty(MemoryRegion *mr,
                                                             hwaddr size,
                                                             unsigned client);
 
+/**
+ * memory_region_count_and_clear_dirty: count and clear the dirty pages of
+ *                                      a range of a memory region
+ *
+ * Clears the dirty bitmap of @client in the range, and adds the number
+ * of dirty pages found in each chunk of 2^@shift target pages, starting
+ * at @addr, to the corresponding element of @counts.  Unlike
+ * memory_region_snapshot_and_clear_dirty(), this neither syncs the dirty
+ * log nor touches pages outside the range; the caller usually syncs it
+ * first with memory_global_dirty_log_sync().
+ *
+ * @mr: the memory region being queried.
+ * @addr: the address (relative to the start of the region) being queried.
+ * @size: the size of the range being queried.
+ * @client: the user of the logging information.
+ * @shift: log2 of the number of target pages per element of @counts.
+ * @counts: the array of dirty page counts to update.
+ */
+void memory_region_count_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
+                                         hwaddr size, unsigned client,
+                                         unsigned shift, uint32_t *counts);
+
 /**
  * memory_region_snapshot_get_dirty: Check whether a range of bytes is dirty
  *                                   in the specified dirty bitmap snapshot.
@@ -2224,6 +2250,24 @@ void memory_region_clear_coalescing(MemoryRegion *mr);
  */
 void memory_region_set_flush_coalesced(MemoryRegion *mr);
 
+/**
+ * memory_region_enable_lockless_io: Dispatch accesses without the BQL.
+ *
+ * By default the BQL is taken around the callbacks of MMIO and PIO regions.
+ * Devices whose callbacks do their own locking, or only touch state that
+ * is safe to access concurrently, can use this to let vCPU threads access
+ * the region in parallel.  The callbacks may then run in any vCPU thread
+ * at the same time, and must take the BQL themselves before touching
+ * anything that is protected by it (e.g. raising an interrupt).  The
+ * device's re-entrancy guard is not thread safe and is disabled for the
+ * region.
+ *
+ * Must be called before the region is made visible to the guest.
+ *
+ * @mr: the memory region to be updated.
+ */
+void memory_region_enable_lockless_io(MemoryRegion *mr);
+
 /**
  * memory_region_clear_flush_coalesced: Disable memory coalescing flush before
  *                                      accesses.
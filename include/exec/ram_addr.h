@@ -457,6 +457,17 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
                                               ram_addr_t length,
                                               unsigned client);
 
+/*
+ * Clear the dirty bits of @client in [@start, @start + @length), adding
+ * the number of dirty pages found in each chunk of 2^@shift pages to the
+ * corresponding element of @counts.
+ */
+void cpu_physical_memory_count_and_clear_dirty(ram_addr_t start,
+                                              ram_addr_t length,
+                                              unsigned client,
+                                              unsigned shift,
+                                              uint32_t *counts);
+
 DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
     (MemoryRegion *mr, hwaddr offset, hwaddr length, unsigned client);
 
@@ -507,6 +518,10 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                 dest[k] |= bits;
                 new_dirty &= bits;
                 num_dirty += ctpopl(new_dirty);
+                if (rb->dirty_heat_bmap && bits) {
+                    set_bit((k * BITS_PER_LONG) >> DIRTY_HEAT_SHIFT,
+                            rb->dirty_heat_bmap);
+                }
             }
 
             if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
@@ -542,6 +557,9 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                 if (!test_and_set_bit(k, dest)) {
                     num_dirty++;
                 }
+                if (rb->dirty_heat_bmap) {
+                    set_bit(k >> DIRTY_HEAT_SHIFT, rb->dirty_heat_bmap);
+                }
             }
         }
     }
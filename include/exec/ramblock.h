@@ -24,6 +24,12 @@
 #include "qemu/rcu.h"
 #include "exec/ramlist.h"
 
+/*
+ * 1<<9=512 pages -> 2M region when page size is 4K.  Must be at least
+ * 6 so that each word of the dirty bitmap falls into a single region.
+ */
+#define DIRTY_HEAT_SHIFT 9
+
 struct RAMBlock {
     struct rcu_head rcu;
     struct MemoryRegion *mr;
@@ -80,6 +86,27 @@ struct RAMBlock {
     unsigned long *clear_bmap;
     uint8_t clear_bmap_shift;
 
+    /*
+     * Dirty frequency of the block, only allocated on the migration
+     * source when hot pages are deferred.  Each bit of dirty_heat_bmap
+     * and each counter of dirty_heat cover (1 << DIRTY_HEAT_SHIFT)
+     * pages.  The bit is set by the bitmap sync when any page of the
+     * region was dirtied since the previous sync; the counter is the
+     * number of consecutive syncs that found the region dirtied.
+     * Protected by the global ram_state.bitmap_mutex.
+     */
+    unsigned long *dirty_heat_bmap;
+    uint8_t *dirty_heat;
+
+    /*
+     * Host pages already taken care of by a background snapshot, one bit
+     * per host page.  Whoever sets the bit first saves the page: either
+     * the migration thread from guest memory, or a write fault thread
+     * from a copy taken before letting the guest write to it.  Protected
+     * by the global ram_state.wp_mutex.
+     */
+    unsigned long *wp_bmap;
+
     /*
      * RAM block length that corresponds to the used_length on the migration
      * source (after RAM block sizes were synchronized). Especially, after
@@ -22,6 +22,7 @@
 #include "qom/object.h"
 
 #include "ebpf/ebpf_rss.h"
+#include "qapi/qapi-types-virtio.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 OBJECT_DECLARE_SIMPLE_TYPE(VirtIONet, VIRTIO_NET)
@@ -56,6 +57,7 @@ typedef struct virtio_net_conf
     char *duplex_str;
     uint8_t duplex;
     char *primary_id_str;
+    IOThreadVirtQueueMappingList *iothread_vq_mapping_list;
 } virtio_net_conf;
 
 /* Coalesced packets type & status */
@@ -160,6 +162,12 @@ typedef struct VirtIONetQueue {
     struct {
         VirtQueueElement *elem;
     } async_tx;
+    /* RX buffer lent to the backend, see virtio_net_receive_direct_begin() */
+    struct {
+        VirtQueueElement *elem;
+    } rx_direct;
+    /* IOThread that processes the queue pair, NULL for the main loop */
+    AioContext *aio_context;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -191,6 +199,9 @@ struct VirtIONet {
     uint8_t nouni;
     uint8_t nobcast;
     uint8_t vhost_started;
+    bool ioeventfd_started;
+    /* Queue pairs are kept in the main loop while drain_count > 0 */
+    unsigned int drain_count;
     struct {
         uint32_t in_use;
         uint32_t first_multi;
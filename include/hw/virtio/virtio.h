@@ -167,6 +167,18 @@ struct VirtIODevice
      */
     EventNotifier config_notifier;
     bool device_iotlb_enabled;
+    /**
+     * @map_cache_gen: bumped whenever guest addresses may be translated
+     * differently, which invalidates the descriptor mapping caches of the
+     * virtqueues.  Odd while the memory topology is being updated.
+     */
+    unsigned int map_cache_gen;
+    /**
+     * @map_cache_disabled: set if the device sits behind an IOMMU that
+     * does not report invalidations.
+     */
+    bool map_cache_disabled;
+    QLIST_HEAD(, VirtIOIOMMUNotifier) iommu_list;
 };
 
 struct VirtioDeviceClass {
@@ -257,6 +269,19 @@ void virtio_delete_queue(VirtQueue *vq);
 
 void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len);
+/**
+ * virtqueue_push_batch:
+ * @vq: the virtqueue
+ * @elems: the elements to return to the guest
+ * @lens: the number of bytes written to each element
+ * @num: the number of elements
+ *
+ * Same as calling virtqueue_fill() for each element and then
+ * virtqueue_flush() once: the guest sees all the elements at once, with a
+ * single update of the used index.  The caller still owns the elements.
+ */
+void virtqueue_push_batch(VirtQueue *vq, VirtQueueElement *const *elems,
+                          const unsigned int *lens, unsigned int num);
 void virtqueue_flush(VirtQueue *vq, unsigned int count);
 void virtqueue_detach_element(VirtQueue *vq, const VirtQueueElement *elem,
                               unsigned int len);
@@ -268,6 +293,22 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
 
 void virtqueue_map(VirtIODevice *vdev, VirtQueueElement *elem);
 void *virtqueue_pop(VirtQueue *vq, size_t sz);
+/**
+ * virtqueue_pop_batch:
+ * @vq: the virtqueue
+ * @sz: the size of the structure to allocate for each element, as for
+ *      virtqueue_pop()
+ * @elems: array of at least @max entries that receives the elements
+ * @max: maximum number of elements to pop
+ *
+ * Pop up to @max elements, as virtqueue_pop() would one after the other,
+ * but reading the available index and setting up the ring caches only
+ * once.  Each element must be freed with g_free().
+ *
+ * Returns: the number of elements stored in @elems.
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max);
 unsigned int virtqueue_drop_all(VirtQueue *vq);
 void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz);
 void qemu_put_virtqueue_element(VirtIODevice *vdev, QEMUFile *f,
@@ -411,6 +452,12 @@ EventNotifier *virtio_queue_get_guest_notifier(VirtQueue *vq);
 void virtio_queue_set_guest_notifier_fd_handler(VirtQueue *vq, bool assign,
                                                 bool with_irqfd);
 int virtio_device_start_ioeventfd(VirtIODevice *vdev);
+/*
+ * Default ->start_ioeventfd() and ->stop_ioeventfd() implementations, which
+ * process all virtqueues in the main loop.
+ */
+int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev);
+void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev);
 int virtio_device_grab_ioeventfd(VirtIODevice *vdev);
 void virtio_device_release_ioeventfd(VirtIODevice *vdev);
 bool virtio_device_ioeventfd_enabled(VirtIODevice *vdev);
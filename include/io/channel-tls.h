@@ -49,6 +49,8 @@ struct QIOChannelTLS {
     QCryptoTLSSession *session;
     QIOChannelShutdown shutdown;
     guint hs_ioc_tag;
+    int ktls; /* QCRYPTO_TLS_KTLS_* directions handled by the kernel */
+    bool ktls_key_update; /* the peer asked for a key update */
 };
 
 /**
@@ -0,0 +1,34 @@
+/*
+ * CheckPoint and Restart (CPR) state transfer
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef MIGRATION_CPR_H
+#define MIGRATION_CPR_H
+
+#include "io/channel.h"
+#include "qapi/qapi-types-migration.h"
+
+#define MIG_MODE_NONE           -1
+
+/*
+ * File descriptors that survive a cpr-transfer, keyed by the name of
+ * their owner and an index within the owner (e.g. a tap queue).
+ */
+void cpr_save_fd(const char *name, int id, int fd);
+void cpr_delete_fd(const char *name, int id);
+void cpr_delete_fd_all(const char *name);
+int cpr_find_fd(const char *name, int id);
+
+MigMode cpr_get_incoming_mode(void);
+void cpr_set_incoming_mode(MigMode mode);
+bool cpr_is_incoming(void);
+
+int cpr_state_save(MigrationChannel *channel, Error **errp);
+int cpr_state_load(const char *uri, Error **errp);
+void cpr_state_close(void);
+QIOChannel *cpr_state_ioc(void);
+
+#endif
@@ -63,10 +63,14 @@ typedef void (SetVnetHdrLen)(NetClientState *, int);
 typedef int (SetVnetLE)(NetClientState *, bool);
 typedef int (SetVnetBE)(NetClientState *, bool);
 typedef struct SocketReadState SocketReadState;
+typedef struct NetOffloadState NetOffloadState;
 typedef void (SocketReadStateFinalize)(SocketReadState *rs);
 typedef void (NetAnnounce)(NetClientState *);
 typedef bool (SetSteeringEBPF)(NetClientState *, int);
 typedef bool (NetCheckPeerType)(NetClientState *, ObjectClass *, Error **);
+typedef void (NetSetAioContext)(NetClientState *, AioContext *);
+typedef int (NetReceiveDirectBegin)(NetClientState *, struct iovec *, int);
+typedef void (NetReceiveDirectEnd)(NetClientState *, ssize_t);
 
 typedef struct NetClientInfo {
     NetClientDriver type;
@@ -92,6 +96,9 @@ typedef struct NetClientInfo {
     NetAnnounce *announce;
     SetSteeringEBPF *set_steering_ebpf;
     NetCheckPeerType *check_peer_type;
+    NetSetAioContext *set_aio_context;
+    NetReceiveDirectBegin *receive_direct_begin;
+    NetReceiveDirectEnd *receive_direct_end;
 } NetClientInfo;
 
 struct NetClientState {
@@ -112,6 +119,8 @@ struct NetClientState {
     bool is_netdev;
     bool do_not_pad; /* do not pad to the minimum ethernet frame length */
     bool is_datapath;
+    AioContext *aio_context; /* NULL if processed in the main loop */
+    NetOffloadState *offload; /* see net/offload.c */
     QTAILQ_HEAD(, NetFilterState) filters;
 };
 
@@ -166,6 +175,9 @@ typedef void (*qemu_nic_foreach)(NICState *nic, void *opaque);
 void qemu_foreach_nic(qemu_nic_foreach func, void *opaque);
 int qemu_can_receive_packet(NetClientState *nc);
 int qemu_can_send_packet(NetClientState *nc);
+int qemu_receive_direct_begin(NetClientState *sender, struct iovec *iov,
+                              int iovcnt);
+void qemu_receive_direct_end(NetClientState *sender, ssize_t size);
 ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
                           int iovcnt);
 ssize_t qemu_sendv_packet_async(NetClientState *nc, const struct iovec *iov,
@@ -194,6 +206,7 @@ int qemu_get_vnet_hdr_len(NetClientState *nc);
 void qemu_set_vnet_hdr_len(NetClientState *nc, int len);
 int qemu_set_vnet_le(NetClientState *nc, bool is_le);
 int qemu_set_vnet_be(NetClientState *nc, bool is_be);
+void qemu_set_aio_context(NetClientState *nc, AioContext *ctx);
 void qemu_macaddr_default_if_unset(MACAddr *macaddr);
 /**
  * qemu_find_nic_info: Obtain NIC configuration information
@@ -370,6 +370,15 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC(BQLLockAuto, bql_auto_unlock)
     g_autoptr(BQLLockAuto) _bql_lock_auto __attribute__((unused)) \
         = bql_auto_lock(__FILE__, __LINE__)
 
+/**
+ * BQL_LOCK_GUARD_IF
+ *
+ * Like BQL_LOCK_GUARD(), but only if @cond is true.
+ */
+#define BQL_LOCK_GUARD_IF(cond) \
+    g_autoptr(BQLLockAuto) _bql_lock_auto __attribute__((unused)) \
+        = (cond) ? bql_auto_lock(__FILE__, __LINE__) : NULL
+
 /*
  * qemu_cond_wait_bql: Wait on condition for the Big QEMU Lock (BQL)
  *
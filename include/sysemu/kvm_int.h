@@ -91,13 +91,27 @@ enum KVMDirtyRingReaperState {
 
 /*
  * KVM reaper instance, responsible for collecting the KVM dirty bits
- * via the dirty ring.
+ * via the dirty ring.  There can be several of them, each one owning
+ * the rings of the vCPUs whose cpu_index modulo the number of reapers
+ * is its index.
  */
 struct KVMDirtyRingReaper {
     /* The reaper thread */
     QemuThread reaper_thr;
     volatile uint64_t reaper_iteration; /* iteration number of reaper thr */
     volatile enum KVMDirtyRingReaperState reaper_state; /* reap thr state */
+    uint32_t index;
+    /* Wakes the reaper up before its periodic timeout */
+    QemuSemaphore reaper_sem;
+    /* Set by kvm_dirty_ring_flush() before posting reaper_sem */
+    bool flush_requested;
+    /*
+     * Protects the rings of the vCPUs owned by this reaper, and the
+     * dirty gfns collected from them that are not yet published to the
+     * KVMSlot dirty bitmaps.  Nests inside the slots_lock.
+     */
+    QemuMutex lock;
+    GArray *collected;
 };
 struct KVMState
 {
@@ -156,7 +170,17 @@ struct KVMState
     uint32_t kvm_dirty_ring_size;   /* Number of dirty GFNs per ring */
     bool kvm_dirty_ring_with_bitmap;
     uint64_t kvm_eager_split_size;  /* Eager Page Splitting chunk size */
-    struct KVMDirtyRingReaper reaper;
+    struct KVMDirtyRingReaper *reapers;
+    uint32_t nr_reapers;            /* Number of dirty ring reaper threads */
+    QemuSemaphore reaper_flush_done;
+    /* Dirty ring statistics, reported by query-stats */
+    uint64_t dirty_ring_reaped_pages;
+    uint64_t dirty_ring_full_exits;
+    uint64_t dirty_ring_reap_rate;  /* Pages per second */
+    /* Taken by the reaper that updates dirty_ring_reap_rate */
+    QemuMutex dirty_ring_rate_lock;
+    int64_t dirty_ring_rate_stamp;
+    uint64_t dirty_ring_rate_pages;
     struct KVMMsrEnergy msr_energy;
     NotifyVmexitOption notify_vmexit;
     uint32_t notify_window;
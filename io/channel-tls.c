@@ -22,8 +22,30 @@
 #include "qapi/error.h"
 #include "qemu/module.h"
 #include "io/channel-tls.h"
+#include "io/channel-socket.h"
 #include "trace.h"
 #include "qemu/atomic.h"
+#include "qemu/iov.h"
+
+#ifdef HAVE_LINUX_TLS_H
+#include <linux/tls.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+#define TLS_RECORD_TYPE_ALERT           21
+#define TLS_RECORD_TYPE_HANDSHAKE       22
+#define TLS_RECORD_TYPE_DATA            23
+
+#define TLS_ALERT_CLOSE_NOTIFY          0
+#define TLS_HANDSHAKE_NEW_SESSION_TICKET 4
+#define TLS_HANDSHAKE_KEY_UPDATE        24
+#define TLS_KEY_UPDATE_REQUESTED        1
+
+/* Largest plaintext of a record */
+#define TLS_MAX_PAYLOAD                 (16 * 1024)
+#endif
 
 
 static ssize_t qio_channel_tls_write_handler(const char *buf,
@@ -147,6 +169,27 @@ qio_channel_tls_new_client(QIOChannel *master,
     return NULL;
 }
 
+/*
+ * Once the session is established, let the kernel handle the records
+ * of a TCP connection if the credentials ask for it.
+ */
+static void qio_channel_tls_enable_ktls(QIOChannelTLS *ioc)
+{
+    QIOChannelSocket *sioc;
+
+    if (!object_dynamic_cast(OBJECT(ioc->master), TYPE_QIO_CHANNEL_SOCKET)) {
+        return;
+    }
+    sioc = QIO_CHANNEL_SOCKET(ioc->master);
+    if (sioc->localAddr.ss_family != AF_INET &&
+        sioc->localAddr.ss_family != AF_INET6) {
+        return;
+    }
+
+    ioc->ktls = qcrypto_tls_session_enable_ktls(ioc->session, sioc->fd);
+    trace_qio_channel_tls_ktls(ioc, ioc->ktls);
+}
+
 struct QIOChannelTLSData {
     QIOTask *task;
     GMainContext *context;
@@ -180,6 +223,7 @@ static void qio_channel_tls_handshake_task(QIOChannelTLS *ioc,
             qio_task_set_error(task, err);
         } else {
             trace_qio_channel_tls_credentials_allow(ioc);
+            qio_channel_tls_enable_ktls(ioc);
         }
         qio_task_complete(task);
     } else {
@@ -262,6 +306,205 @@ static void qio_channel_tls_finalize(Object *obj)
 }
 
 
+#ifdef HAVE_LINUX_TLS_H
+/*
+ * Receive from a kTLS socket into @iov, retrying on EINTR; *@type is the
+ * type of the record that the data comes from.
+ */
+static ssize_t qio_channel_tls_ktls_recv(int fd, const struct iovec *iov,
+                                         size_t niov, int flags,
+                                         unsigned char *type)
+{
+    char control[CMSG_SPACE(sizeof(unsigned char))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    do {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = (struct iovec *)iov;
+        msg.msg_iovlen = niov;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ret = recvmsg(fd, &msg, flags);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret <= 0) {
+        return ret;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_TLS &&
+        cmsg->cmsg_type == TLS_GET_RECORD_TYPE) {
+        *type = *(unsigned char *)CMSG_DATA(cmsg);
+    } else {
+        *type = TLS_RECORD_TYPE_DATA;
+    }
+    return ret;
+}
+
+/*
+ * Read the whole record of @type that the caller's buffer had room for
+ * only @len bytes of, and that were copied to @rec.  The kernel returns
+ * other records one at a time and keeps the rest of one that does not
+ * fit at the head of the queue.  Peek first: if the caller's buffer
+ * happened to end with the record, the next one must stay queued.
+ *
+ * Returns the length of the record.
+ */
+static ssize_t qio_channel_tls_ktls_drain(QIOChannelTLS *tioc,
+                                          unsigned char type,
+                                          uint8_t *rec, size_t len,
+                                          Error **errp)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(tioc->master);
+    struct iovec iov = {
+        .iov_base = rec + len,
+        .iov_len = TLS_MAX_PAYLOAD - len,
+    };
+    unsigned char next;
+    ssize_t ret;
+
+    if (!iov.iov_len) {
+        return len;
+    }
+
+    /*
+     * After a key update, the kernel refuses to go on until it has the
+     * new key; that also means the record was complete.
+     */
+    ret = qio_channel_tls_ktls_recv(sioc->fd, &iov, 1,
+                                    MSG_PEEK | MSG_DONTWAIT, &next);
+    if (ret > 0 && next == type) {
+        ret = qio_channel_tls_ktls_recv(sioc->fd, &iov, 1, 0, &next);
+    } else if (ret >= 0 || errno == EAGAIN || errno == EKEYEXPIRED) {
+        return len;
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, errno, "Unable to read from kTLS socket");
+        return -1;
+    }
+    return len + ret;
+}
+
+/*
+ * With kernel TLS the socket returns decrypted application data.  Other
+ * records are returned one at a time, flagged with their type: only
+ * session tickets, which we never use, TLS 1.3 key updates and
+ * close_notify are expected.  They are read into a buffer of our own,
+ * since the caller's may be too small for them.
+ */
+static ssize_t qio_channel_tls_ktls_readv(QIOChannelTLS *tioc,
+                                          const struct iovec *iov,
+                                          size_t niov,
+                                          Error **errp)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(tioc->master);
+    g_autofree uint8_t *rec = NULL;
+    unsigned char type;
+    size_t len, off;
+    ssize_t ret;
+
+ retry:
+    ret = qio_channel_tls_ktls_recv(sioc->fd, iov, niov, 0, &type);
+    if (ret < 0) {
+        if (errno == EAGAIN) {
+            return QIO_CHANNEL_ERR_BLOCK;
+        }
+        error_setg_errno(errp, errno, "Unable to read from kTLS socket");
+        return -1;
+    }
+    if (!ret || type == TLS_RECORD_TYPE_DATA) {
+        return ret;
+    }
+
+    if (!rec) {
+        rec = g_malloc(TLS_MAX_PAYLOAD);
+    }
+    len = iov_to_buf(iov, niov, 0, rec, MIN(ret, TLS_MAX_PAYLOAD));
+    if (len == iov_size(iov, niov)) {
+        ret = qio_channel_tls_ktls_drain(tioc, type, rec, len, errp);
+        if (ret < 0) {
+            return -1;
+        }
+        len = ret;
+    }
+
+    switch (type) {
+    case TLS_RECORD_TYPE_ALERT:
+        if (len >= 2 && rec[1] == TLS_ALERT_CLOSE_NOTIFY) {
+            return 0;
+        }
+        error_setg(errp, "TLS alert received on kTLS socket");
+        return -1;
+    case TLS_RECORD_TYPE_HANDSHAKE:
+        /* Each message has a type and a 24-bit length */
+        for (off = 0; off + 4 <= len;
+             off += 4 + ((rec[off + 1] << 16) | (rec[off + 2] << 8) |
+                         rec[off + 3])) {
+            if (rec[off] == TLS_HANDSHAKE_NEW_SESSION_TICKET) {
+                trace_qio_channel_tls_ktls_ticket(tioc);
+                continue;
+            }
+            if (rec[off] == TLS_HANDSHAKE_KEY_UPDATE && off + 5 <= len) {
+                /*
+                 * The kernel holds back the following records until it
+                 * gets the next receive key.  If the peer asks for it,
+                 * our own send key is updated before the next write.
+                 */
+                bool requested = rec[off + 4] == TLS_KEY_UPDATE_REQUESTED;
+
+                trace_qio_channel_tls_ktls_key_update(tioc, requested);
+                if (qcrypto_tls_session_ktls_update_key(tioc->session,
+                                                        sioc->fd, true,
+                                                        errp) < 0) {
+                    return -1;
+                }
+                if (requested) {
+                    qatomic_set(&tioc->ktls_key_update, true);
+                }
+                continue;
+            }
+            error_setg(errp, "Unsupported TLS handshake message %u on kTLS "
+                       "socket", rec[off]);
+            return -1;
+        }
+        goto retry;
+    default:
+        error_setg(errp, "Unexpected TLS record type %u on kTLS socket",
+                   type);
+        return -1;
+    }
+}
+
+/*
+ * Answer a key update requested by the peer, which must happen
+ * before we send anything else.
+ */
+static int qio_channel_tls_ktls_update_send_key(QIOChannelTLS *tioc,
+                                                Error **errp)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(tioc->master);
+    int ret;
+
+    if (tioc->ktls & QCRYPTO_TLS_KTLS_SEND) {
+        ret = qcrypto_tls_session_ktls_update_key(tioc->session, sioc->fd,
+                                                  false, errp);
+    } else {
+        ret = qcrypto_tls_session_update_key(tioc->session, false, errp);
+        if (ret == QCRYPTO_TLS_SESSION_ERR_BLOCK) {
+            return QIO_CHANNEL_ERR_BLOCK;
+        }
+    }
+    if (ret < 0) {
+        return -1;
+    }
+
+    qatomic_set(&tioc->ktls_key_update, false);
+    return 0;
+}
+#endif
+
 static ssize_t qio_channel_tls_readv(QIOChannel *ioc,
                                      const struct iovec *iov,
                                      size_t niov,
@@ -274,6 +517,12 @@ static ssize_t qio_channel_tls_readv(QIOChannel *ioc,
     size_t i;
     ssize_t got = 0;
 
+#ifdef HAVE_LINUX_TLS_H
+    if (tioc->ktls & QCRYPTO_TLS_KTLS_RECV) {
+        return qio_channel_tls_ktls_readv(tioc, iov, niov, errp);
+    }
+#endif
+
     for (i = 0 ; i < niov ; i++) {
         ssize_t ret = qcrypto_tls_session_read(
             tioc->session,
@@ -311,6 +560,20 @@ static ssize_t qio_channel_tls_writev(QIOChannel *ioc,
     size_t i;
     ssize_t done = 0;
 
+#ifdef HAVE_LINUX_TLS_H
+    if (qatomic_read(&tioc->ktls_key_update)) {
+        int ret = qio_channel_tls_ktls_update_send_key(tioc, errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+#endif
+
+    if (tioc->ktls & QCRYPTO_TLS_KTLS_SEND) {
+        return qio_channel_writev_full(tioc->master, iov, niov,
+                                       NULL, 0, flags, errp);
+    }
+
     for (i = 0 ; i < niov ; i++) {
         ssize_t ret = qcrypto_tls_session_write(tioc->session,
                                                 iov[i].iov_base,
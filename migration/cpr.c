@@ -0,0 +1,317 @@
+/*
+ * CheckPoint and Restart (CPR) state transfer
+ *
+ * In cpr-transfer mode the old QEMU hands the file descriptors that back
+ * guest RAM and host devices over to the new QEMU on the same host, through
+ * a UNIX socket, before the main migration stream starts.  The new QEMU
+ * receives them before creating any backend, so that backends can reuse
+ * them instead of creating new ones; the main stream then only carries
+ * device state.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/queue.h"
+#include "qemu/bswap.h"
+#include "io/channel-socket.h"
+#include "qapi/error.h"
+#include "migration/cpr.h"
+#include "migration.h"
+#include "trace.h"
+
+#define CPR_STATE_MAGIC         0x51435052      /* "QCPR" */
+#define CPR_STATE_VERSION       1
+
+typedef struct CprFd {
+    char *name;
+    int id;
+    int fd;
+    QLIST_ENTRY(CprFd) next;
+} CprFd;
+
+typedef struct CprStateHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t mode;
+    uint32_t nr_fds;
+} CprStateHeader;
+
+typedef struct CprFdHeader {
+    uint32_t name_len;
+    int32_t id;
+} CprFdHeader;
+
+static QLIST_HEAD(, CprFd) cpr_fds = QLIST_HEAD_INITIALIZER(cpr_fds);
+static unsigned int cpr_nr_fds;
+static MigMode incoming_mode = MIG_MODE_NONE;
+static QIOChannel *cpr_ioc;
+
+/****************************************************************************/
+
+static CprFd *cpr_find_entry(const char *name, int id)
+{
+    CprFd *elem;
+
+    QLIST_FOREACH(elem, &cpr_fds, next) {
+        if (elem->id == id && !strcmp(elem->name, name)) {
+            return elem;
+        }
+    }
+    return NULL;
+}
+
+static void cpr_free_entry(CprFd *elem)
+{
+    QLIST_REMOVE(elem, next);
+    cpr_nr_fds--;
+    g_free(elem->name);
+    g_free(elem);
+}
+
+void cpr_save_fd(const char *name, int id, int fd)
+{
+    CprFd *elem = cpr_find_entry(name, id);
+
+    trace_cpr_save_fd(name, id, fd);
+    if (elem) {
+        elem->fd = fd;
+        return;
+    }
+
+    elem = g_new0(CprFd, 1);
+    elem->name = g_strdup(name);
+    elem->id = id;
+    elem->fd = fd;
+    QLIST_INSERT_HEAD(&cpr_fds, elem, next);
+    cpr_nr_fds++;
+}
+
+void cpr_delete_fd(const char *name, int id)
+{
+    CprFd *elem = cpr_find_entry(name, id);
+
+    trace_cpr_delete_fd(name, id);
+    if (elem) {
+        cpr_free_entry(elem);
+    }
+}
+
+void cpr_delete_fd_all(const char *name)
+{
+    CprFd *elem, *next;
+
+    QLIST_FOREACH_SAFE(elem, &cpr_fds, next, next) {
+        if (!strcmp(elem->name, name)) {
+            trace_cpr_delete_fd(name, elem->id);
+            cpr_free_entry(elem);
+        }
+    }
+}
+
+int cpr_find_fd(const char *name, int id)
+{
+    CprFd *elem = cpr_find_entry(name, id);
+    int fd = elem ? elem->fd : -1;
+
+    trace_cpr_find_fd(name, id, fd);
+    return fd;
+}
+
+/****************************************************************************/
+
+MigMode cpr_get_incoming_mode(void)
+{
+    return incoming_mode;
+}
+
+void cpr_set_incoming_mode(MigMode mode)
+{
+    incoming_mode = mode;
+}
+
+bool cpr_is_incoming(void)
+{
+    return incoming_mode != MIG_MODE_NONE;
+}
+
+QIOChannel *cpr_state_ioc(void)
+{
+    return cpr_ioc;
+}
+
+void cpr_state_close(void)
+{
+    if (cpr_ioc) {
+        object_unref(OBJECT(cpr_ioc));
+        cpr_ioc = NULL;
+    }
+}
+
+/*
+ * The cpr channel must be able to pass file descriptors, so it can only
+ * be a UNIX domain socket.
+ */
+static SocketAddress *cpr_channel_address(MigrationAddress *addr,
+                                          Error **errp)
+{
+    if (addr->transport != MIGRATION_ADDRESS_TYPE_SOCKET ||
+        addr->u.socket.type != SOCKET_ADDRESS_TYPE_UNIX) {
+        error_setg(errp, "The cpr channel must be a UNIX socket");
+        return NULL;
+    }
+    return &addr->u.socket;
+}
+
+int cpr_state_save(MigrationChannel *channel, Error **errp)
+{
+    g_autoptr(QIOChannelSocket) sioc = qio_channel_socket_new();
+    QIOChannel *ioc = QIO_CHANNEL(sioc);
+    CprStateHeader hdr;
+    SocketAddress *saddr;
+    CprFd *elem;
+
+    saddr = cpr_channel_address(channel->addr, errp);
+    if (!saddr) {
+        return -1;
+    }
+
+    qio_channel_set_name(ioc, "cpr-out");
+    if (qio_channel_socket_connect_sync(sioc, saddr, errp) < 0) {
+        return -1;
+    }
+
+    hdr.magic = cpu_to_be32(CPR_STATE_MAGIC);
+    hdr.version = cpu_to_be32(CPR_STATE_VERSION);
+    hdr.mode = cpu_to_be32(MIG_MODE_CPR_TRANSFER);
+    hdr.nr_fds = cpu_to_be32(cpr_nr_fds);
+    if (qio_channel_write_all(ioc, (char *)&hdr, sizeof(hdr), errp)) {
+        return -1;
+    }
+
+    QLIST_FOREACH(elem, &cpr_fds, next) {
+        CprFdHeader fdhdr = {
+            .name_len = cpu_to_be32(strlen(elem->name)),
+            .id = cpu_to_be32(elem->id),
+        };
+        struct iovec fdiov[2] = {
+            { .iov_base = &fdhdr, .iov_len = sizeof(fdhdr) },
+            { .iov_base = elem->name, .iov_len = strlen(elem->name) },
+        };
+
+        trace_cpr_state_save_fd(elem->name, elem->id, elem->fd);
+        if (qio_channel_writev_full_all(ioc, fdiov, 2, &elem->fd, 1, 0,
+                                        errp)) {
+            return -1;
+        }
+    }
+
+    /*
+     * Keep the channel open: the new QEMU closes it once it is ready to
+     * accept the main migration stream.
+     */
+    cpr_state_close();
+    cpr_ioc = QIO_CHANNEL(g_steal_pointer(&sioc));
+    trace_cpr_state_save(cpr_nr_fds);
+    return 0;
+}
+
+int cpr_state_load(const char *uri, Error **errp)
+{
+    g_autoptr(MigrationChannel) channel = NULL;
+    g_autoptr(QIOChannelSocket) lsioc = qio_channel_socket_new();
+    QIOChannelSocket *sioc;
+    QIOChannel *ioc;
+    CprStateHeader hdr;
+    SocketAddress *saddr;
+    uint32_t i;
+
+    if (!migrate_uri_parse(uri, &channel, errp)) {
+        return -1;
+    }
+    saddr = cpr_channel_address(channel->addr, errp);
+    if (!saddr) {
+        return -1;
+    }
+
+    qio_channel_set_name(QIO_CHANNEL(lsioc), "cpr-listen");
+    if (qio_channel_socket_listen_sync(lsioc, saddr, 1, errp) < 0) {
+        return -1;
+    }
+
+    /* Nothing can be created before the old QEMU shows up, so block here */
+    qio_channel_wait(QIO_CHANNEL(lsioc), G_IO_IN);
+    sioc = qio_channel_socket_accept(lsioc, errp);
+    if (!sioc) {
+        return -1;
+    }
+    ioc = QIO_CHANNEL(sioc);
+    qio_channel_set_name(ioc, "cpr-in");
+
+    if (qio_channel_read_all(ioc, (char *)&hdr, sizeof(hdr), errp)) {
+        goto fail;
+    }
+    hdr.magic = be32_to_cpu(hdr.magic);
+    hdr.version = be32_to_cpu(hdr.version);
+    hdr.mode = be32_to_cpu(hdr.mode);
+    hdr.nr_fds = be32_to_cpu(hdr.nr_fds);
+
+    if (hdr.magic != CPR_STATE_MAGIC) {
+        error_setg(errp, "cpr: bad magic 0x%x", hdr.magic);
+        goto fail;
+    }
+    if (hdr.version != CPR_STATE_VERSION) {
+        error_setg(errp, "cpr: unsupported version %u", hdr.version);
+        goto fail;
+    }
+    if (hdr.mode != MIG_MODE_CPR_TRANSFER) {
+        error_setg(errp, "cpr: unsupported mode %u", hdr.mode);
+        goto fail;
+    }
+
+    for (i = 0; i < hdr.nr_fds; i++) {
+        CprFdHeader fdhdr;
+        struct iovec iov = { .iov_base = &fdhdr, .iov_len = sizeof(fdhdr) };
+        g_autofree int *fds = NULL;
+        g_autofree char *name = NULL;
+        size_t nfds = 0;
+        uint32_t name_len;
+
+        if (qio_channel_readv_full_all(ioc, &iov, 1, &fds, &nfds, errp)) {
+            goto fail;
+        }
+        if (nfds != 1) {
+            error_setg(errp, "cpr: expected one file descriptor, got %zu",
+                       nfds);
+            for (; nfds; nfds--) {
+                close(fds[nfds - 1]);
+            }
+            goto fail;
+        }
+
+        name_len = be32_to_cpu(fdhdr.name_len);
+        if (!name_len || name_len > PATH_MAX) {
+            error_setg(errp, "cpr: bad name length %u", name_len);
+            close(fds[0]);
+            goto fail;
+        }
+        name = g_malloc0(name_len + 1);
+        if (qio_channel_read_all(ioc, name, name_len, errp)) {
+            close(fds[0]);
+            goto fail;
+        }
+
+        trace_cpr_state_load_fd(name, (int32_t)be32_to_cpu(fdhdr.id), fds[0]);
+        cpr_save_fd(name, (int32_t)be32_to_cpu(fdhdr.id), fds[0]);
+    }
+
+    cpr_set_incoming_mode(hdr.mode);
+    cpr_ioc = ioc;
+    trace_cpr_state_load(hdr.nr_fds);
+    return 0;
+
+fail:
+    object_unref(OBJECT(sioc));
+    return -1;
+}
@@ -11,6 +11,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/cutils.h"
 #include "qemu/error-report.h"
 #include "hw/core/cpu.h"
 #include "qapi/error.h"
@@ -27,6 +28,7 @@
 #include "qapi/qmp/qdict.h"
 #include "sysemu/kvm.h"
 #include "sysemu/runstate.h"
+#include "migration/misc.h"
 #include "exec/memory.h"
 #include "qemu/xxhash.h"
 
@@ -44,6 +46,7 @@ typedef struct DirtyPageRecord {
 
 static int CalculatingState = DIRTY_RATE_STATUS_UNSTARTED;
 static struct DirtyRateStat DirtyStat;
+static HeatmapStat Heatmap;
 static DirtyRateMeasureMode dirtyrate_mode =
                 DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
 
@@ -267,6 +270,11 @@ query_dirty_rate_info(TimeUnit calc_time_unit)
     info->sample_pages = DirtyStat.sample_pages;
     info->mode = dirtyrate_mode;
 
+    if (Heatmap.intervals) {
+        info->has_heatmap_intervals = true;
+        info->heatmap_intervals = Heatmap.intervals;
+    }
+
     if (qatomic_read(&CalculatingState) == DIRTY_RATE_STATUS_MEASURED) {
         info->has_dirty_rate = true;
         info->dirty_rate = dirty_rate;
@@ -656,6 +664,204 @@ static void calculate_dirtyrate_dirty_bitmap(struct DirtyRateConfig config)
                                                   DirtyStat.calc_time_ms);
 }
 
+static void free_dirty_heatmap(void)
+{
+    int i;
+
+    for (i = 0; i < Heatmap.nr_blocks; i++) {
+        g_free(Heatmap.blocks[i].counts);
+    }
+    g_free(Heatmap.blocks);
+    g_free(Heatmap.vcpu_pages);
+    g_free(Heatmap.error);
+    memset(&Heatmap, 0, sizeof(Heatmap));
+}
+
+/* Called with BQL held */
+static void init_dirty_heatmap(struct DirtyRateConfig config)
+{
+    RAMBlock *block;
+    int i = 0;
+
+    Heatmap.intervals = config.heatmap_intervals;
+    Heatmap.interval_ms = config.calc_time_ms;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_MIGRATABLE(block) {
+            Heatmap.nr_blocks++;
+        }
+
+        Heatmap.blocks = g_new0(HeatmapBlock, Heatmap.nr_blocks);
+        RAMBLOCK_FOREACH_MIGRATABLE(block) {
+            HeatmapBlock *hb = &Heatmap.blocks[i++];
+
+            pstrcpy(hb->idstr, sizeof(hb->idstr), qemu_ram_get_idstr(block));
+            hb->used_length = qemu_ram_get_used_length(block);
+            hb->nr_regions = DIV_ROUND_UP(hb->used_length,
+                                          DIRTY_HEATMAP_REGION_SIZE);
+            hb->counts = g_new0(uint32_t, hb->nr_regions);
+        }
+    }
+}
+
+static HeatmapBlock *find_heatmap_block(RAMBlock *block)
+{
+    int i;
+
+    for (i = 0; i < Heatmap.nr_blocks; i++) {
+        if (!strcmp(Heatmap.blocks[i].idstr, qemu_ram_get_idstr(block))) {
+            return &Heatmap.blocks[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Account the pages dirtied since the last call in the heatmap, and
+ * re-protect them.  Called with BQL held, after a dirty log sync.
+ */
+static void dirty_heatmap_collect(void)
+{
+    unsigned shift = DIRTY_HEATMAP_REGION_BITS - qemu_target_page_bits();
+    RAMBlock *block;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_MIGRATABLE(block) {
+            HeatmapBlock *hb = find_heatmap_block(block);
+
+            if (!hb) {
+                continue;
+            }
+            memory_region_count_and_clear_dirty(
+                block->mr, 0, MIN(hb->used_length,
+                                  qemu_ram_get_used_length(block)),
+                DIRTY_MEMORY_MIGRATION, shift, hb->counts);
+        }
+    }
+
+    dirtyrate_manual_reset_protect();
+}
+
+/* Called with BQL and qemu_cpu_list_lock held */
+static void dirty_heatmap_record_vcpus(DirtyPageRecord *records,
+                                       int64_t interval)
+{
+    int i;
+
+    vcpu_dirty_stat_collect(records, false);
+    for (i = 0; i < Heatmap.nvcpu; i++) {
+        Heatmap.vcpu_pages[i * Heatmap.intervals + interval] =
+            records[i].end_pages - records[i].start_pages;
+        records[i].start_pages = records[i].end_pages;
+    }
+}
+
+/*
+ * Record where the guest writes over several intervals, on top of the
+ * dirty bitmap or dirty ring modes.  The per-page dirty bits are taken
+ * from the migration dirty bitmap, which is why this cannot run during
+ * migration.
+ */
+static void calculate_dirtyrate_heatmap(struct DirtyRateConfig config)
+{
+    bool dirty_ring = config.mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING;
+    DirtyPageRecord *records = NULL;
+    DirtyPageRecord dirty_pages;
+    unsigned int gen_id = 0;
+    Error *local_err = NULL;
+    int64_t start_time;
+    int64_t i;
+    int j;
+
+    bql_lock();
+    if (!memory_global_dirty_log_start(GLOBAL_DIRTY_DIRTY_RATE, &local_err)) {
+        /* Without the dirty log, the heatmap would only show zeroes */
+        Heatmap.error = g_strdup(error_get_pretty(local_err));
+        error_report_err(local_err);
+        bql_unlock();
+        return;
+    }
+
+    /*
+     * As in the dirty bitmap mode, skip the first round of log sync, and
+     * drop whatever is left in the migration dirty bitmap.
+     */
+    memory_global_dirty_log_sync(false);
+    dirty_heatmap_collect();
+    for (j = 0; j < Heatmap.nr_blocks; j++) {
+        memset(Heatmap.blocks[j].counts, 0,
+               Heatmap.blocks[j].nr_regions * sizeof(uint32_t));
+    }
+
+    if (dirty_ring) {
+        WITH_QEMU_LOCK_GUARD(&qemu_cpu_list_lock) {
+            gen_id = cpu_list_generation_id_get();
+            records = vcpu_dirty_stat_alloc(&DirtyStat.dirty_ring);
+            vcpu_dirty_stat_collect(records, true);
+            Heatmap.nvcpu = DirtyStat.dirty_ring.nvcpu;
+            Heatmap.vcpu_pages = g_new0(uint64_t,
+                                        Heatmap.nvcpu * Heatmap.intervals);
+        }
+    }
+    bql_unlock();
+
+    record_dirtypages_bitmap(&dirty_pages, true);
+
+    start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    DirtyStat.start_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) / 1000;
+
+    for (i = 0; i < Heatmap.intervals; i++) {
+        dirty_stat_wait(config.calc_time_ms,
+                        qemu_clock_get_ms(QEMU_CLOCK_REALTIME));
+
+        bql_lock();
+        memory_global_dirty_log_sync(false);
+        dirty_heatmap_collect();
+        if (records) {
+            WITH_QEMU_LOCK_GUARD(&qemu_cpu_list_lock) {
+                if (gen_id != cpu_list_generation_id_get()) {
+                    /* vCPUs were added or removed, stop recording them */
+                    g_free(records);
+                    records = NULL;
+                    g_free(Heatmap.vcpu_pages);
+                    Heatmap.vcpu_pages = NULL;
+                    Heatmap.nvcpu = 0;
+                    DirtyStat.dirty_ring.nvcpu = 0;
+                } else {
+                    dirty_heatmap_record_vcpus(records, i);
+                }
+            }
+        }
+        Heatmap.recorded++;
+        trace_dirty_heatmap_interval(i);
+        bql_unlock();
+    }
+
+    record_dirtypages_bitmap(&dirty_pages, false);
+    global_dirty_log_change(GLOBAL_DIRTY_DIRTY_RATE, false);
+
+    DirtyStat.calc_time_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                             start_time;
+    DirtyStat.dirty_rate = do_calculate_dirtyrate(dirty_pages,
+                                                  DirtyStat.calc_time_ms);
+
+    /* Average the per-vCPU rates over the whole measurement */
+    for (j = 0; j < Heatmap.nvcpu; j++) {
+        DirtyPageRecord vcpu_pages = { 0, 0 };
+
+        for (i = 0; i < Heatmap.intervals; i++) {
+            vcpu_pages.end_pages +=
+                Heatmap.vcpu_pages[j * Heatmap.intervals + i];
+        }
+        DirtyStat.dirty_ring.rates[j].id = j;
+        DirtyStat.dirty_ring.rates[j].dirty_rate =
+            do_calculate_dirtyrate(vcpu_pages, DirtyStat.calc_time_ms);
+    }
+
+    g_free(records);
+}
+
 static void calculate_dirtyrate_dirty_ring(struct DirtyRateConfig config)
 {
     uint64_t dirtyrate = 0;
@@ -714,7 +920,9 @@ out:
 
 static void calculate_dirtyrate(struct DirtyRateConfig config)
 {
-    if (config.mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP) {
+    if (config.heatmap_intervals) {
+        calculate_dirtyrate_heatmap(config);
+    } else if (config.mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP) {
         calculate_dirtyrate_dirty_bitmap(config);
     } else if (config.mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING) {
         calculate_dirtyrate_dirty_ring(config);
@@ -757,6 +965,8 @@ void qmp_calc_dirty_rate(int64_t calc_time,
                          int64_t sample_pages,
                          bool has_mode,
                          DirtyRateMeasureMode mode,
+                         bool has_heatmap_intervals,
+                         int64_t heatmap_intervals,
                          Error **errp)
 {
     static struct DirtyRateConfig config;
@@ -803,6 +1013,28 @@ void qmp_calc_dirty_rate(int64_t calc_time,
         sample_pages = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
     }
 
+    if (has_heatmap_intervals) {
+        if (mode == DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING) {
+            error_setg(errp, "heatmap-intervals is not used in "
+                       "page-sampling mode");
+            return;
+        }
+        if (heatmap_intervals < 1 ||
+            heatmap_intervals > MAX_HEATMAP_INTERVALS) {
+            error_setg(errp, "heatmap-intervals is out of range[1, %d].",
+                       MAX_HEATMAP_INTERVALS);
+            return;
+        }
+        /* The heatmap consumes the migration dirty bitmap */
+        if (migration_is_running()) {
+            error_setg(errp, "Cannot record a dirty heatmap during "
+                       "migration");
+            return;
+        }
+    } else {
+        heatmap_intervals = 0;
+    }
+
     /*
      * dirty ring mode only works when kvm dirty ring is enabled.
      * on the contrary, dirty bitmap mode is not.
@@ -829,8 +1061,10 @@ void qmp_calc_dirty_rate(int64_t calc_time,
     config.calc_time_ms = calc_time_ms;
     config.sample_pages_per_gigabytes = sample_pages;
     config.mode = mode;
+    config.heatmap_intervals = heatmap_intervals;
 
     cleanup_dirtyrate_stat(config);
+    free_dirty_heatmap();
 
     /*
      * update dirty rate mode so that we can figure out what mode has
@@ -839,6 +1073,9 @@ void qmp_calc_dirty_rate(int64_t calc_time,
     dirtyrate_mode = mode;
 
     init_dirtyrate_stat(config);
+    if (heatmap_intervals) {
+        init_dirty_heatmap(config);
+    }
 
     qemu_thread_create(&thread, "get_dirtyrate", get_dirtyrate_thread,
                        (void *)&config, QEMU_THREAD_DETACHED);
@@ -853,6 +1090,90 @@ struct DirtyRateInfo *qmp_query_dirty_rate(bool has_calc_time_unit,
         has_calc_time_unit ? calc_time_unit : TIME_UNIT_SECOND);
 }
 
+bool dirty_heatmap_is_measuring(void)
+{
+    /* The measurement thread may not have started yet */
+    return Heatmap.intervals &&
+           qatomic_read(&CalculatingState) != DIRTY_RATE_STATUS_MEASURED;
+}
+
+/* Run-length encode the dirty page counts of a heatmap block */
+static uint64List *dirty_heatmap_block_runs(HeatmapBlock *hb)
+{
+    uint64List *head = NULL, **tail = &head;
+    uint64_t i, start = 0;
+
+    for (i = 1; i <= hb->nr_regions; i++) {
+        if (i == hb->nr_regions || hb->counts[i] != hb->counts[start]) {
+            QAPI_LIST_APPEND(tail, i - start);
+            QAPI_LIST_APPEND(tail, hb->counts[start]);
+            start = i;
+        }
+    }
+
+    return head;
+}
+
+DirtyHeatmap *qmp_query_dirty_heatmap(Error **errp)
+{
+    DirtyHeatmap *info;
+    DirtyHeatmapBlockList **btail;
+    DirtyHeatmapVcpuList **vtail;
+    int i;
+
+    if (!Heatmap.intervals) {
+        error_setg(errp, "No dirty heatmap was requested, see "
+                   "calc-dirty-rate");
+        return NULL;
+    }
+
+    if (Heatmap.error) {
+        error_setg(errp, "Dirty heatmap measurement failed: %s",
+                   Heatmap.error);
+        return NULL;
+    }
+
+    info = g_new0(DirtyHeatmap, 1);
+    info->status = qatomic_read(&CalculatingState);
+    info->region_size = DIRTY_HEATMAP_REGION_SIZE;
+    info->interval = Heatmap.interval_ms;
+    info->intervals = Heatmap.recorded;
+
+    if (!Heatmap.recorded) {
+        return info;
+    }
+
+    info->has_blocks = true;
+    btail = &info->blocks;
+    for (i = 0; i < Heatmap.nr_blocks; i++) {
+        DirtyHeatmapBlock *block = g_new0(DirtyHeatmapBlock, 1);
+
+        block->id = g_strdup(Heatmap.blocks[i].idstr);
+        block->regions = Heatmap.blocks[i].nr_regions;
+        block->runs = dirty_heatmap_block_runs(&Heatmap.blocks[i]);
+        QAPI_LIST_APPEND(btail, block);
+    }
+
+    if (Heatmap.nvcpu) {
+        info->has_vcpus = true;
+        vtail = &info->vcpus;
+        for (i = 0; i < Heatmap.nvcpu; i++) {
+            DirtyHeatmapVcpu *vcpu = g_new0(DirtyHeatmapVcpu, 1);
+            uint64List **ptail = &vcpu->dirty_pages;
+            int64_t j;
+
+            vcpu->id = i;
+            for (j = 0; j < Heatmap.recorded; j++) {
+                QAPI_LIST_APPEND(ptail,
+                                 Heatmap.vcpu_pages[i * Heatmap.intervals + j]);
+            }
+            QAPI_LIST_APPEND(vtail, vcpu);
+        }
+    }
+
+    return info;
+}
+
 void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
 {
     DirtyRateInfo *info = query_dirty_rate_info(TIME_UNIT_SECOND);
@@ -919,6 +1240,7 @@ void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
                         false, TIME_UNIT_SECOND, /* calc-time-unit */
                         has_sample_pages, sample_pages,
                         true, mode,
+                        false, 0, /* heatmap-intervals */
                         &err);
     if (err) {
         hmp_handle_error(mon, err);
@@ -44,10 +44,18 @@
 #define MIN_SAMPLE_PAGE_COUNT                     128
 #define MAX_SAMPLE_PAGE_COUNT                     16384
 
+/*
+ * Granularity of the dirty heatmap, and allowed number of intervals.
+ */
+#define DIRTY_HEATMAP_REGION_BITS                 21
+#define DIRTY_HEATMAP_REGION_SIZE   (1ULL << DIRTY_HEATMAP_REGION_BITS)
+#define MAX_HEATMAP_INTERVALS                     1000
+
 struct DirtyRateConfig {
     uint64_t sample_pages_per_gigabytes; /* sample pages per GB */
     int64_t calc_time_ms; /* desired calculation time (in milliseconds) */
     DirtyRateMeasureMode mode; /* mode of dirtyrate measurement */
+    int64_t heatmap_intervals; /* intervals of a dirty heatmap, or 0 */
 };
 
 /*
@@ -83,5 +91,30 @@ struct DirtyRateStat {
     };
 };
 
+/*
+ * Dirty page counts of each region of a ramblock, for the heatmap.
+ */
+typedef struct HeatmapBlock {
+    char idstr[RAMBLOCK_INFO_MAX_LEN]; /* idstr of the ramblock */
+    uint64_t used_length; /* size of the ramblock when recording started */
+    uint64_t nr_regions; /* number of regions of the ramblock */
+    uint32_t *counts; /* dirty pages of each region over all intervals */
+} HeatmapBlock;
+
+/*
+ * Dirty heatmap of the most recent measurement; protected by the BQL.
+ */
+typedef struct HeatmapStat {
+    int64_t intervals; /* number of intervals requested */
+    int64_t recorded; /* number of intervals recorded so far */
+    int64_t interval_ms; /* length of an interval (in milliseconds) */
+    int nr_blocks;
+    HeatmapBlock *blocks;
+    int nvcpu; /* number of vCPUs recorded, or 0 */
+    uint64_t *vcpu_pages; /* dirty pages per vCPU and interval */
+    char *error; /* why the measurement failed, or NULL */
+} HeatmapStat;
+
 void *get_dirtyrate_thread(void *arg);
+bool dirty_heatmap_is_measuring(void);
 #endif
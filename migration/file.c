@@ -17,6 +17,7 @@
 #include "io/channel-socket.h"
 #include "io/channel-util.h"
 #include "options.h"
+#include "ram.h"
 #include "trace.h"
 
 #define OFFSET_OPTION ",offset="
@@ -25,6 +26,10 @@ static struct FileOutgoingArgs {
     char *fname;
 } outgoing_args;
 
+static struct FileIncomingArgs {
+    char *fname;
+} incoming_args;
+
 /* Remove the offset option from @filespec and return it in @offsetp. */
 
 int file_parse_offset(char *filespec, uint64_t *offsetp, Error **errp)
@@ -50,6 +55,12 @@ void file_cleanup_outgoing_migration(void)
     outgoing_args.fname = NULL;
 }
 
+void file_cleanup_incoming_migration(void)
+{
+    g_free(incoming_args.fname);
+    incoming_args.fname = NULL;
+}
+
 static void file_enable_direct_io(int *flags)
 {
 #ifdef O_DIRECT
@@ -108,7 +119,9 @@ void file_start_outgoing_migration(MigrationState *s,
         return;
     }
 
-    if (ftruncate(fioc->fd, offset)) {
+    /* An incremental checkpoint is written over the previous one */
+    if (!ram_checkpoint_prepare(filename, offset) &&
+        ftruncate(fioc->fd, offset)) {
         error_setg_errno(errp, errno,
                          "failed to truncate migration file to offset %" PRIx64,
                          offset);
@@ -186,6 +199,9 @@ void file_start_incoming_migration(FileMigrationArgs *file_args, Error **errp)
         return;
     }
 
+    g_free(incoming_args.fname);
+    incoming_args.fname = g_strdup(filename);
+
     if (offset &&
         qio_channel_io_seek(QIO_CHANNEL(fioc), offset, SEEK_SET, errp) < 0) {
         object_unref(OBJECT(fioc));
@@ -195,6 +211,35 @@ void file_start_incoming_migration(FileMigrationArgs *file_args, Error **errp)
     file_create_incoming_channels(QIO_CHANNEL(fioc), filename, errp);
 }
 
+/*
+ * Open one more channel on the file of the current incoming migration,
+ * for reading RAM pages after the main channel is done (lazy-restore).
+ * Reads are done with O_DIRECT if direct-io is enabled, so they must be
+ * aligned like those of the multifd channels.
+ */
+QIOChannel *file_open_incoming_channel(Error **errp)
+{
+    QIOChannelFile *fioc;
+    int flags = O_RDONLY;
+
+    if (!incoming_args.fname) {
+        error_setg(errp, "Incoming migration is not from a file");
+        return NULL;
+    }
+
+    if (migrate_direct_io()) {
+        file_enable_direct_io(&flags);
+    }
+
+    fioc = qio_channel_file_new_path(incoming_args.fname, flags, 0, errp);
+    if (!fioc) {
+        return NULL;
+    }
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-incoming");
+    return QIO_CHANNEL(fioc);
+}
+
 int file_write_ramblock_iov(QIOChannel *ioc, const struct iovec *iov,
                             int niov, MultiFDPages_t *pages, Error **errp)
 {
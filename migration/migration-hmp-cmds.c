@@ -82,6 +82,17 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "expected downtime: %" PRIu64 " ms\n",
                            info->expected_downtime);
         }
+        if (info->has_expected_downtime_breakdown) {
+            DowntimeBreakdownEntryList *item;
+
+            for (item = info->expected_downtime_breakdown; item;
+                 item = item->next) {
+                monitor_printf(mon, "  %s (%" PRIu32 "): %" PRIu64
+                               " kbytes, %" PRIu64 " ms\n",
+                               item->value->name, item->value->instance_id,
+                               item->value->size >> 10, item->value->time);
+            }
+        }
         if (info->has_downtime) {
             monitor_printf(mon, "downtime: %" PRIu64 " ms\n",
                            info->downtime);
@@ -160,6 +171,27 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->multifd_autotune) {
+        monitor_printf(mon, "multifd active channels: %" PRId64 "\n",
+                       info->multifd_autotune->active_channels);
+        if (info->multifd_autotune->has_compression_level) {
+            monitor_printf(mon, "multifd compression level: %" PRId64 "\n",
+                           info->multifd_autotune->compression_level);
+        }
+        monitor_printf(mon, "multifd channel throughput: %" PRIu64
+                       " bytes/s\n",
+                       info->multifd_autotune->channel_throughput);
+        monitor_printf(mon, "multifd channel busy: %" PRId64 " %%\n",
+                       info->multifd_autotune->channel_busy);
+        monitor_printf(mon, "multifd compression time: %" PRId64 " %%\n",
+                       info->multifd_autotune->compression_time);
+        monitor_printf(mon, "multifd autotune decision: %s\n",
+                       MultifdAutotuneDecision_str(
+                           info->multifd_autotune->last_decision));
+        monitor_printf(mon, "multifd autotune adjustments: %" PRIu64 "\n",
+                       info->multifd_autotune->adjustments);
+    }
+
     if (info->has_cpu_throttle_percentage) {
         monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
                        info->cpu_throttle_percentage);
@@ -358,6 +390,17 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
                                MIGRATION_PARAMETER_DIRECT_IO),
                            params->direct_io ? "on" : "off");
         }
+
+        assert(params->has_postcopy_prefetch_window);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_PREFETCH_WINDOW),
+            params->postcopy_prefetch_window);
+
+        assert(params->has_background_snapshot_threads);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(
+                MIGRATION_PARAMETER_BACKGROUND_SNAPSHOT_THREADS),
+            params->background_snapshot_threads);
     }
 
     qapi_free_MigrationParameters(params);
@@ -639,6 +682,14 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_direct_io = true;
         visit_type_bool(v, param, &p->direct_io, &err);
         break;
+    case MIGRATION_PARAMETER_POSTCOPY_PREFETCH_WINDOW:
+        p->has_postcopy_prefetch_window = true;
+        visit_type_uint32(v, param, &p->postcopy_prefetch_window, &err);
+        break;
+    case MIGRATION_PARAMETER_BACKGROUND_SNAPSHOT_THREADS:
+        p->has_background_snapshot_threads = true;
+        visit_type_uint8(v, param, &p->background_snapshot_threads, &err);
+        break;
     default:
         assert(0);
     }
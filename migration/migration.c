@@ -53,6 +53,7 @@
 #include "io/channel-tls.h"
 #include "migration/colo.h"
 #include "hw/boards.h"
+#include "dirtyrate.h"
 #include "monitor/monitor.h"
 #include "net/announce.h"
 #include "qemu/queue.h"
@@ -66,6 +67,7 @@
 #include "sysemu/dirtylimit.h"
 #include "qemu/sockets.h"
 #include "sysemu/kvm.h"
+#include "migration/cpr.h"
 
 #define NOTIFIER_ELEM_INIT(array, elem)    \
     [elem] = NOTIFIER_WITH_RETURN_LIST_INITIALIZER((array)[elem])
@@ -75,6 +77,7 @@
 static NotifierWithReturnList migration_state_notifiers[] = {
     NOTIFIER_ELEM_INIT(migration_state_notifiers, MIG_MODE_NORMAL),
     NOTIFIER_ELEM_INIT(migration_state_notifiers, MIG_MODE_CPR_REBOOT),
+    NOTIFIER_ELEM_INIT(migration_state_notifiers, MIG_MODE_CPR_TRANSFER),
 };
 
 /* Messages sent on the return path from destination to source */
@@ -377,6 +380,8 @@ void migration_incoming_state_destroy(void)
 {
     struct MigrationIncomingState *mis = migration_incoming_get_current();
 
+    /* Stops using the received bitmap and the file, so goes first */
+    ram_lazy_restore_cleanup(mis);
     multifd_recv_cleanup();
     /*
      * RAM state cleanup needs to happen after multifd cleanup, because
@@ -402,6 +407,7 @@ void migration_incoming_state_destroy(void)
     }
 
     migration_incoming_transport_cleanup(mis);
+    file_cleanup_incoming_migration();
     qemu_event_reset(&mis->main_thread_load_event);
 
     if (mis->page_requested) {
@@ -453,21 +459,24 @@ static int migrate_send_rp_message(MigrationIncomingState *mis,
     return qemu_fflush(mis->to_src_file);
 }
 
-/* Request one page from the source VM at the given start address.
+/* Request pages from the source VM at the given start address.
  *   rb: the RAMBlock to request the page in
  *   Start: Address offset within the RB
  *   Len: Length in bytes required - must be a multiple of pagesize
  */
 int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
-                                      RAMBlock *rb, ram_addr_t start)
+                                      RAMBlock *rb, ram_addr_t start,
+                                      size_t len)
 {
     uint8_t bufc[12 + 1 + 255]; /* start (8), len (4), rbname up to 256 */
     size_t msglen = 12; /* start + len */
-    size_t len = qemu_ram_pagesize(rb);
     enum mig_rp_message_type msg_type;
     const char *rbname;
     int rbname_len;
 
+    assert(len <= UINT32_MAX);
+    assert(QEMU_IS_ALIGNED(len, qemu_ram_pagesize(rb)));
+
     *(uint64_t *)bufc = cpu_to_be64((uint64_t)start);
     *(uint32_t *)(bufc + 8) = cpu_to_be32((uint32_t)len);
 
@@ -523,7 +532,8 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis,
         return 0;
     }
 
-    return migrate_send_rp_message_req_pages(mis, rb, start);
+    return migrate_send_rp_message_req_pages(mis, rb, start,
+                                             qemu_ram_pagesize(rb));
 }
 
 static bool migration_colo_enabled;
@@ -668,6 +678,11 @@ static void qemu_start_incoming_migration(const char *uri, bool has_channels,
             error_setg(errp, "Channel list has more than one entries");
             return;
         }
+        if (channels->value->channel_type != MIGRATION_CHANNEL_TYPE_MAIN) {
+            error_setg(errp, "Only the main channel can be given here; "
+                       "the cpr channel is given with -cpr-uri");
+            return;
+        }
         addr = channels->value->addr;
     }
 
@@ -770,11 +785,26 @@ static void process_incoming_migration_bh(void *opaque)
         runstate_set(global_state_get_runstate());
     }
     trace_vmstate_downtime_checkpoint("dst-precopy-bh-vm-started");
+
+    if (ram_lazy_restore_wait_loaded()) {
+        /*
+         * The guest runs while the rest of its RAM is loaded from the
+         * file; the migration completes when that is done.
+         */
+        return;
+    }
+
+    migration_incoming_complete(mis);
+}
+
+void migration_incoming_complete(MigrationIncomingState *mis)
+{
     /*
      * This must happen after any state changes since as soon as an external
      * observer sees this event they might start to prod at the VM assuming
      * it's ready to use.
      */
+    cpr_set_incoming_mode(MIG_MODE_NONE);
     migrate_set_state(&mis->state, MIGRATION_STATUS_ACTIVE,
                       MIGRATION_STATUS_COMPLETED);
     migration_incoming_state_destroy();
@@ -1186,6 +1216,11 @@ static void populate_time_info(MigrationInfo *info, MigrationState *s)
     } else {
         info->has_expected_downtime = true;
         info->expected_downtime = s->expected_downtime;
+        if (s->expected_bw_per_ms > 0) {
+            info->has_expected_downtime_breakdown = true;
+            qemu_savevm_state_downtime_estimate(
+                s->expected_bw_per_ms, &info->expected_downtime_breakdown);
+        }
     }
 }
 
@@ -1235,6 +1270,12 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
            stat64_get(&mig_stats.dirty_pages_rate);
     }
 
+    if (migrate_multifd_autotune() &&
+        s->multifd_autotune.info.active_channels) {
+        info->multifd_autotune = QAPI_CLONE(MultifdAutotuneInfo,
+                                            &s->multifd_autotune.info);
+    }
+
     if (migrate_dirty_limit() && dirtylimit_in_service()) {
         info->has_dirty_limit_throttle_time_per_round = true;
         info->dirty_limit_throttle_time_per_round =
@@ -1696,7 +1737,8 @@ bool migration_thread_is_self(void)
 
 bool migrate_mode_is_cpr(MigrationState *s)
 {
-    return s->parameters.mode == MIG_MODE_CPR_REBOOT;
+    return s->parameters.mode == MIG_MODE_CPR_REBOOT ||
+           s->parameters.mode == MIG_MODE_CPR_TRANSFER;
 }
 
 int migrate_init(MigrationState *s, Error **errp)
@@ -1734,6 +1776,8 @@ int migrate_init(MigrationState *s, Error **errp)
     s->vm_old_state = -1;
     s->iteration_initial_bytes = 0;
     s->threshold_size = 0;
+    s->expected_bw_per_ms = 0;
+    memset(&s->multifd_autotune, 0, sizeof(s->multifd_autotune));
     s->switchover_acked = false;
     s->rdma_migration = false;
     /*
@@ -1882,6 +1926,12 @@ void qmp_migrate_incoming(const char *uri, bool has_channels,
         return;
     }
 
+    /*
+     * Closing the cpr channel tells the old QEMU that we are listening
+     * for the main migration stream.
+     */
+    cpr_state_close();
+
     once = false;
 }
 
@@ -2031,6 +2081,12 @@ static bool migrate_prepare(MigrationState *s, bool resume, Error **errp)
         return false;
     }
 
+    if (dirty_heatmap_is_measuring()) {
+        error_setg(errp, "Can't migrate while a dirty heatmap is being "
+                   "measured");
+        return false;
+    }
+
     if (migration_is_blocked(errp)) {
         return false;
     }
@@ -2071,15 +2127,44 @@ static bool migrate_prepare(MigrationState *s, bool resume, Error **errp)
     return true;
 }
 
+static void qmp_migrate_finish(MigrationAddress *addr, bool resume_requested,
+                               Error **errp);
+
+typedef struct CprTransferHup {
+    MigrationAddress *addr;
+    bool resume_requested;
+} CprTransferHup;
+
+/*
+ * The new QEMU closes the cpr channel once it has created its backends
+ * from our file descriptors and is listening for the main stream.
+ */
+static gboolean qmp_migrate_cpr_hup(QIOChannel *ioc, GIOCondition cond,
+                                    gpointer opaque)
+{
+    CprTransferHup *hup = opaque;
+    Error *local_err = NULL;
+
+    trace_cpr_transfer_hup();
+    cpr_state_close();
+    qmp_migrate_finish(hup->addr, hup->resume_requested, &local_err);
+    if (local_err) {
+        error_report_err(local_err);
+    }
+    qapi_free_MigrationAddress(hup->addr);
+    g_free(hup);
+    return G_SOURCE_REMOVE;
+}
+
 void qmp_migrate(const char *uri, bool has_channels,
                  MigrationChannelList *channels, bool has_detach, bool detach,
                  bool has_resume, bool resume, Error **errp)
 {
     bool resume_requested;
-    Error *local_err = NULL;
     MigrationState *s = migrate_get_current();
     g_autoptr(MigrationChannel) channel = NULL;
     MigrationAddress *addr = NULL;
+    MigrationChannel *cpr_channel = NULL;
 
     /*
      * Having preliminary checks for uri and channel
@@ -2089,13 +2174,19 @@ void qmp_migrate(const char *uri, bool has_channels,
         return;
     }
 
-    if (channels) {
-        /* To verify that Migrate channel list has only item */
-        if (channels->next) {
-            error_setg(errp, "Channel list has more than one entries");
+    for (; channels; channels = channels->next) {
+        MigrationChannel *ch = channels->value;
+
+        if (ch->channel_type == MIGRATION_CHANNEL_TYPE_MAIN && !addr) {
+            addr = ch->addr;
+        } else if (ch->channel_type == MIGRATION_CHANNEL_TYPE_CPR &&
+                   !cpr_channel) {
+            cpr_channel = ch;
+        } else {
+            error_setg(errp, "Channel list has more than one %s entry",
+                       MigrationChannelType_str(ch->channel_type));
             return;
         }
-        addr = channels->value->addr;
     }
 
     if (uri) {
@@ -2106,12 +2197,36 @@ void qmp_migrate(const char *uri, bool has_channels,
         addr = channel->addr;
     }
 
+    if (!addr) {
+        error_setg(errp, "Channel list has no main entry");
+        return;
+    }
+
+    if (migrate_mode() == MIG_MODE_CPR_TRANSFER) {
+        if (!cpr_channel) {
+            error_setg(errp, "cpr-transfer mode requires a cpr channel");
+            return;
+        }
+    } else if (cpr_channel) {
+        error_setg(errp, "The cpr channel requires cpr-transfer mode");
+        return;
+    }
+
     /* transport mechanism not suitable for migration? */
     if (!migration_channels_and_transport_compatible(addr, errp)) {
         return;
     }
 
     resume_requested = has_resume && resume;
+    if (cpr_channel && resume_requested) {
+        error_setg(errp, "Cannot resume a cpr-transfer migration");
+        return;
+    }
+    if (cpr_state_ioc()) {
+        error_setg(errp, "A cpr-transfer migration is already waiting "
+                   "for the new QEMU");
+        return;
+    }
     if (!migrate_prepare(s, resume_requested, errp)) {
         /* Error detected, put into errp */
         return;
@@ -2123,6 +2238,40 @@ void qmp_migrate(const char *uri, bool has_channels,
         }
     }
 
+    if (cpr_channel) {
+        CprTransferHup *hup;
+        Error *local_err = NULL;
+
+        if (cpr_state_save(cpr_channel, &local_err)) {
+            yank_unregister_instance(MIGRATION_YANK_INSTANCE);
+            migrate_set_state(&s->state, MIGRATION_STATUS_NONE,
+                              MIGRATION_STATUS_FAILED);
+            migrate_set_error(s, local_err);
+            error_propagate(errp, local_err);
+            return;
+        }
+
+        /*
+         * The new QEMU cannot accept the main channel until it has
+         * received our state, so connect it asynchronously.
+         */
+        hup = g_new0(CprTransferHup, 1);
+        hup->addr = QAPI_CLONE(MigrationAddress, addr);
+        hup->resume_requested = resume_requested;
+        qio_channel_add_watch(cpr_state_ioc(), G_IO_HUP | G_IO_IN | G_IO_ERR,
+                              qmp_migrate_cpr_hup, hup, NULL);
+        return;
+    }
+
+    qmp_migrate_finish(addr, resume_requested, errp);
+}
+
+static void qmp_migrate_finish(MigrationAddress *addr, bool resume_requested,
+                               Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    Error *local_err = NULL;
+
     if (addr->transport == MIGRATION_ADDRESS_TYPE_SOCKET) {
         SocketAddress *saddr = &addr->u.socket;
         if (saddr->type == SOCKET_ADDRESS_TYPE_INET ||
@@ -3162,6 +3311,127 @@ static void update_iteration_initial_status(MigrationState *s)
     s->iteration_initial_pages = ram_get_total_transferred_pages();
 }
 
+/* Interval between two evaluations of the multifd autotune controller */
+#define MULTIFD_AUTOTUNE_INTERVAL 1000 /* ms */
+/*
+ * The active channels are the bottleneck when they are busy more than
+ * this percentage of the time, and are under used below the low mark.
+ */
+#define MULTIFD_AUTOTUNE_BUSY_HIGH 90
+#define MULTIFD_AUTOTUNE_BUSY_LOW 30
+
+/*
+ * Adjust the number of active multifd channels and the compression level,
+ * one step at a time, from what the channels did during the last
+ * interval:
+ *
+ * - channels busy compressing: use more channels, or a lower level when
+ *   all channels are in use already;
+ * - channels busy writing: the link is the limit, so trade CPU for
+ *   bandwidth with a higher level, or try more channels;
+ * - channels mostly idle: give channels back, unless the guest dirties
+ *   memory faster than we send it.
+ */
+static void migration_multifd_autotune(MigrationState *s,
+                                       int64_t current_time)
+{
+    MultifdAutotuneInfo *info = &s->multifd_autotune.info;
+    MultifdAutotuneDecision decision = MULTIFD_AUTOTUNE_DECISION_NONE;
+    MultiFDSendStats stats;
+    uint64_t busy_ns, prepare_ns, interval_ms, dirty_rate;
+    int active, level;
+
+    if (!migrate_multifd() || !migrate_multifd_autotune() ||
+        s->state != MIGRATION_STATUS_ACTIVE) {
+        return;
+    }
+
+    active = multifd_send_active_channels();
+    if (!active) {
+        return;
+    }
+
+    multifd_send_get_stats(&stats);
+    level = multifd_send_compression_level();
+
+    if (!s->multifd_autotune.time) {
+        /* First call, only take the reference point */
+        s->multifd_autotune.max_level = level;
+        info->active_channels = active;
+        info->has_compression_level = level >= 0;
+        info->compression_level = level;
+        goto out;
+    }
+
+    interval_ms = current_time - s->multifd_autotune.time;
+    if (interval_ms < MULTIFD_AUTOTUNE_INTERVAL) {
+        return;
+    }
+
+    prepare_ns = stats.prepare_ns - s->multifd_autotune.prepare_ns;
+    busy_ns = prepare_ns + stats.write_ns - s->multifd_autotune.write_ns;
+    info->channel_throughput = (stats.bytes - s->multifd_autotune.bytes) *
+                               1000 / interval_ms / active;
+    info->channel_busy = MIN(100, busy_ns * 100 /
+                                  (interval_ms * SCALE_MS * active));
+    info->compression_time = busy_ns ? prepare_ns * 100 / busy_ns : 0;
+    dirty_rate = stat64_get(&mig_stats.dirty_pages_rate) *
+                 qemu_target_page_size();
+
+    if (info->channel_busy >= MULTIFD_AUTOTUNE_BUSY_HIGH) {
+        if (info->compression_time >= 50) {
+            if (active < migrate_multifd_channels()) {
+                decision = MULTIFD_AUTOTUNE_DECISION_ADD_CHANNEL;
+            } else if (level > 1) {
+                decision = MULTIFD_AUTOTUNE_DECISION_LOWER_LEVEL;
+            }
+        } else if (info->compression_time < 25 && level >= 0 &&
+                   level < s->multifd_autotune.max_level) {
+            decision = MULTIFD_AUTOTUNE_DECISION_RAISE_LEVEL;
+        } else if (active < migrate_multifd_channels()) {
+            decision = MULTIFD_AUTOTUNE_DECISION_ADD_CHANNEL;
+        }
+    } else if (info->channel_busy <= MULTIFD_AUTOTUNE_BUSY_LOW &&
+               active > 1 && dirty_rate < info->channel_throughput * active) {
+        decision = MULTIFD_AUTOTUNE_DECISION_REMOVE_CHANNEL;
+    }
+
+    switch (decision) {
+    case MULTIFD_AUTOTUNE_DECISION_ADD_CHANNEL:
+        multifd_send_set_active_channels(++active);
+        break;
+    case MULTIFD_AUTOTUNE_DECISION_REMOVE_CHANNEL:
+        multifd_send_set_active_channels(--active);
+        break;
+    case MULTIFD_AUTOTUNE_DECISION_RAISE_LEVEL:
+        multifd_send_set_compression_level(++level);
+        break;
+    case MULTIFD_AUTOTUNE_DECISION_LOWER_LEVEL:
+        multifd_send_set_compression_level(--level);
+        break;
+    default:
+        break;
+    }
+
+    trace_migration_multifd_autotune(info->channel_throughput,
+                                     info->channel_busy,
+                                     info->compression_time, dirty_rate,
+                                     MultifdAutotuneDecision_str(decision));
+
+    info->active_channels = active;
+    info->compression_level = level;
+    info->last_decision = decision;
+    if (decision != MULTIFD_AUTOTUNE_DECISION_NONE) {
+        info->adjustments++;
+    }
+
+out:
+    s->multifd_autotune.time = current_time;
+    s->multifd_autotune.bytes = stats.bytes;
+    s->multifd_autotune.prepare_ns = stats.prepare_ns;
+    s->multifd_autotune.write_ns = stats.write_ns;
+}
+
 static void migration_update_counters(MigrationState *s,
                                       int64_t current_time)
 {
@@ -3171,6 +3441,8 @@ static void migration_update_counters(MigrationState *s,
     /* Expected bandwidth when switching over to destination QEMU */
     double expected_bw_per_ms;
     double bandwidth;
+    uint64_t downtime_limit = migrate_downtime_limit();
+    uint64_t device_downtime;
 
     if (current_time < s->iteration_start_time + BUFFER_DELAY) {
         return;
@@ -3193,7 +3465,24 @@ static void migration_update_counters(MigrationState *s,
         expected_bw_per_ms = bandwidth;
     }
 
-    s->threshold_size = expected_bw_per_ms * migrate_downtime_limit();
+    s->expected_bw_per_ms = expected_bw_per_ms;
+
+    /*
+     * Part of the downtime is spent on device state that is only saved
+     * at switchover, or that can't be sent at link speed; only the rest
+     * of the budget is available for the pending data.  If the devices
+     * alone are predicted to exceed the limit, keep the whole budget so
+     * that the migration can still converge as it did without the
+     * prediction.
+     */
+    device_downtime = qemu_savevm_state_downtime_estimate(expected_bw_per_ms,
+                                                          NULL);
+    if (device_downtime < downtime_limit) {
+        s->threshold_size = expected_bw_per_ms *
+                            (downtime_limit - device_downtime);
+    } else {
+        s->threshold_size = expected_bw_per_ms * downtime_limit;
+    }
 
     s->mbps = (((double) transferred * 8.0) /
                ((double) time_spent / 1000.0)) / 1000.0 / 1000.0;
@@ -3210,17 +3499,20 @@ static void migration_update_counters(MigrationState *s,
     if (stat64_get(&mig_stats.dirty_pages_rate) &&
         transferred > 10000) {
         s->expected_downtime =
-            stat64_get(&mig_stats.dirty_bytes_last_sync) / expected_bw_per_ms;
+            stat64_get(&mig_stats.dirty_bytes_last_sync) / expected_bw_per_ms +
+            device_downtime;
     }
 
     migration_rate_reset();
 
     update_iteration_initial_status(s);
 
+    migration_multifd_autotune(s, current_time);
+
     trace_migrate_transferred(transferred, time_spent,
                               /* Both in unit bytes/ms */
                               bandwidth, switchover_bw / 1000,
-                              s->threshold_size);
+                              s->threshold_size, device_downtime);
 }
 
 static bool migration_can_switchover(MigrationState *s)
@@ -3625,6 +3917,10 @@ static void *bg_migration_thread(void *opaque)
 
     update_iteration_initial_status(s);
 
+    if (!multifd_send_setup()) {
+        goto fail_setup;
+    }
+
     /*
      * Prepare for tracking memory writes with UFFD-WP - populate
      * RAM pages before protecting.
@@ -234,6 +234,7 @@ struct MigrationIncomingState {
 
 MigrationIncomingState *migration_incoming_get_current(void);
 void migration_incoming_state_destroy(void);
+void migration_incoming_complete(MigrationIncomingState *mis);
 void migration_incoming_transport_cleanup(MigrationIncomingState *mis);
 /*
  * Functions to work with blocktime context
@@ -294,9 +295,25 @@ struct MigrationState {
     /*
      * The final stage happens when the remaining data is smaller than
      * this threshold; it's calculated from the requested downtime and
-     * measured bandwidth, or avail-switchover-bandwidth if specified.
+     * measured bandwidth, or avail-switchover-bandwidth if specified,
+     * minus the predicted time to save the device state.
      */
     uint64_t threshold_size;
+    /* Bandwidth expected at switchover, in bytes/ms */
+    double expected_bw_per_ms;
+
+    /* State of the multifd autotune controller */
+    struct {
+        /* What query-migrate reports */
+        MultifdAutotuneInfo info;
+        /* Time (ms) and channel statistics at the last evaluation */
+        int64_t time;
+        uint64_t bytes;
+        uint64_t prepare_ns;
+        uint64_t write_ns;
+        /* Configured compression level, the upper bound when tuning */
+        int max_level;
+    } multifd_autotune;
 
     /* params from 'migrate-set-parameters' */
     MigrationParameters parameters;
@@ -432,6 +449,14 @@ struct MigrationState {
      * Default value is false. (since 8.1)
      */
     bool multifd_flush_after_each_section;
+    /*
+     * Allow multifd autotune to change the zstd compression level while
+     * migrating.  zstd can only do that at frame boundaries, so the
+     * source ends the frame in the middle of the stream; destinations
+     * before 9.2 reject the extra end-of-frame data in the packet.
+     * Default value is true. (since 9.2)
+     */
+    bool multifd_zstd_level_switch;
     /*
      * This decides the size of guest memory chunk that will be used
      * to track dirty bitmap clearing.  The size of memory chunk will
@@ -495,7 +520,8 @@ void migrate_send_rp_pong(MigrationIncomingState *mis,
 int migrate_send_rp_req_pages(MigrationIncomingState *mis, RAMBlock *rb,
                               ram_addr_t start, uint64_t haddr);
 int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
-                                      RAMBlock *rb, ram_addr_t start);
+                                      RAMBlock *rb, ram_addr_t start,
+                                      size_t len);
 void migrate_send_rp_recv_bitmap(MigrationIncomingState *mis,
                                  char *block_name);
 void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value);
@@ -0,0 +1,52 @@
+/*
+ * Multifd COLO support
+ *
+ * On the secondary side of COLO, incoming pages are not loaded into the
+ * guest RAM directly but into the RAM cache (colo_cache), which is only
+ * flushed to the guest RAM once a whole checkpoint has been received.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "exec/ramblock.h"
+#include "migration/colo.h"
+#include "multifd.h"
+#include "ram.h"
+
+void multifd_colo_prepare_recv(MultiFDRecvParams *p)
+{
+    assert(p->block->colo_cache);
+    p->host = p->block->colo_cache;
+}
+
+void multifd_colo_process_recv(MultiFDRecvParams *p)
+{
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t i;
+
+    if (migration_incoming_in_colo_state()) {
+        /* Tell colo_flush_ram_cache() which pages to apply */
+        colo_record_bitmap(p->block, p->normal, p->normal_num);
+        colo_record_bitmap(p->block, p->zero, p->zero_num);
+        return;
+    }
+
+    /*
+     * Before the first checkpoint, the guest RAM and the cache are kept
+     * in sync, so that COLO can start without copying the whole RAM.
+     */
+    for (i = 0; i < p->normal_num; i++) {
+        memcpy(p->block->host + p->normal[i], p->host + p->normal[i],
+               page_size);
+    }
+    for (i = 0; i < p->zero_num; i++) {
+        void *page = p->block->host + p->zero[i];
+
+        if (!buffer_is_zero(page, page_size)) {
+            memset(page, 0, page_size);
+        }
+    }
+}
@@ -0,0 +1,235 @@
+/*
+ * Multifd lz4 compression implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <lz4.h>
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "trace.h"
+#include "options.h"
+#include "multifd.h"
+
+struct lz4_data {
+    /* compression state, see LZ4_sizeofState() */
+    void *state;
+    /* compressed buffer */
+    uint8_t *zbuff;
+    /* size of compressed buffer */
+    uint32_t zbuff_len;
+    /* uncompressed buffer holding all the pages of one packet */
+    uint8_t *buf;
+};
+
+/* Multifd lz4 compression */
+
+static int multifd_lz4_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+    const char *err_msg;
+
+    z->state = g_try_malloc(LZ4_sizeofState());
+    if (!z->state) {
+        err_msg = "out of memory for state";
+        goto err_free_z;
+    }
+    /* This is the maximum size of the compressed buffer */
+    z->zbuff_len = LZ4_compressBound(MULTIFD_PACKET_SIZE);
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->zbuff) {
+        err_msg = "out of memory for zbuff";
+        goto err_free_state;
+    }
+    z->buf = g_try_malloc(MULTIFD_PACKET_SIZE);
+    if (!z->buf) {
+        err_msg = "out of memory for buf";
+        goto err_free_zbuff;
+    }
+    p->compress_data = z;
+
+    /* Needs 2 IOVs, one for packet header and one for compressed data */
+    p->iov = g_new0(struct iovec, 2);
+
+    return 0;
+
+err_free_zbuff:
+    g_free(z->zbuff);
+err_free_state:
+    g_free(z->state);
+err_free_z:
+    g_free(z);
+    error_setg(errp, "multifd %u: %s", p->id, err_msg);
+    return -1;
+}
+
+static void multifd_lz4_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct lz4_data *z = p->compress_data;
+
+    g_free(z->state);
+    z->state = NULL;
+    g_free(z->zbuff);
+    z->zbuff = NULL;
+    g_free(z->buf);
+    z->buf = NULL;
+    g_free(p->compress_data);
+    p->compress_data = NULL;
+
+    g_free(p->iov);
+    p->iov = NULL;
+}
+
+static int multifd_lz4_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    struct lz4_data *z = p->compress_data;
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t in_size = pages->normal_num * page_size;
+    int out_size;
+    uint32_t i;
+
+    if (!multifd_send_prepare_common(p)) {
+        goto out;
+    }
+
+    /*
+     * Since the VM might be running, the pages may be changing
+     * concurrently with compression.  Gather them in one buffer first;
+     * this also lets lz4 find matches across page boundaries, which
+     * it wouldn't do if each page was compressed separately.
+     */
+    for (i = 0; i < pages->normal_num; i++) {
+        memcpy(z->buf + i * page_size, pages->block->host + pages->offset[i],
+               page_size);
+    }
+
+    out_size = LZ4_compress_fast_extState(z->state, (const char *)z->buf,
+                                          (char *)z->zbuff, in_size,
+                                          z->zbuff_len, 1);
+    if (out_size <= 0) {
+        error_setg(errp, "multifd %u: LZ4_compress_fast failed", p->id);
+        return -1;
+    }
+
+    p->iov[p->iovs_num].iov_base = z->zbuff;
+    p->iov[p->iovs_num].iov_len = out_size;
+    p->iovs_num++;
+    p->next_packet_size = out_size;
+
+out:
+    p->flags |= MULTIFD_FLAG_LZ4;
+    multifd_send_fill_packet(p);
+    return 0;
+}
+
+static int multifd_lz4_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+
+    z->zbuff_len = LZ4_compressBound(MULTIFD_PACKET_SIZE);
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->zbuff) {
+        g_free(z);
+        error_setg(errp, "multifd %u: out of memory for zbuff", p->id);
+        return -1;
+    }
+    z->buf = g_try_malloc(MULTIFD_PACKET_SIZE);
+    if (!z->buf) {
+        g_free(z->zbuff);
+        g_free(z);
+        error_setg(errp, "multifd %u: out of memory for buf", p->id);
+        return -1;
+    }
+    p->compress_data = z;
+
+    return 0;
+}
+
+static void multifd_lz4_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct lz4_data *z = p->compress_data;
+
+    g_free(z->zbuff);
+    z->zbuff = NULL;
+    g_free(z->buf);
+    z->buf = NULL;
+    g_free(p->compress_data);
+    p->compress_data = NULL;
+}
+
+static int multifd_lz4_recv(MultiFDRecvParams *p, Error **errp)
+{
+    struct lz4_data *z = p->compress_data;
+    uint32_t in_size = p->next_packet_size;
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t expected_size = p->normal_num * page_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    int out_size;
+    int ret;
+    int i;
+
+    if (flags != MULTIFD_FLAG_LZ4) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_LZ4);
+        return -1;
+    }
+
+    multifd_recv_zero_page_process(p);
+
+    if (!p->normal_num) {
+        assert(in_size == 0);
+        return 0;
+    }
+
+    if (in_size > z->zbuff_len) {
+        error_setg(errp, "multifd %u: packet size received %u "
+                   "exceeds maximum %u", p->id, in_size, z->zbuff_len);
+        return -1;
+    }
+
+    ret = qio_channel_read_all(p->c, (void *)z->zbuff, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    out_size = LZ4_decompress_safe((const char *)z->zbuff, (char *)z->buf,
+                                   in_size, MULTIFD_PACKET_SIZE);
+    if (out_size < 0) {
+        error_setg(errp, "multifd %u: LZ4_decompress_safe returned %d",
+                   p->id, out_size);
+        return -1;
+    }
+    if (out_size != expected_size) {
+        error_setg(errp, "multifd %u: packet size received %d size expected %u",
+                   p->id, out_size, expected_size);
+        return -1;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+        memcpy(p->host + p->normal[i], z->buf + i * page_size, page_size);
+    }
+
+    return 0;
+}
+
+static const MultiFDMethods multifd_lz4_ops = {
+    .send_setup = multifd_lz4_send_setup,
+    .send_cleanup = multifd_lz4_send_cleanup,
+    .send_prepare = multifd_lz4_send_prepare,
+    .recv_setup = multifd_lz4_recv_setup,
+    .recv_cleanup = multifd_lz4_recv_cleanup,
+    .recv = multifd_lz4_recv
+};
+
+static void multifd_lz4_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_LZ4, &multifd_lz4_ops);
+}
+
+migration_init(multifd_lz4_register);
@@ -14,6 +14,7 @@
 #include "exec/ramblock.h"
 #include "exec/target_page.h"
 #include "file.h"
+#include "migration/colo.h"
 #include "multifd.h"
 #include "options.h"
 #include "qapi/error.h"
@@ -258,7 +259,11 @@ int multifd_ram_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
-    p->host = p->block->host;
+    if (migration_incoming_colo_enabled()) {
+        multifd_colo_prepare_recv(p);
+    } else {
+        p->host = p->block->host;
+    }
     for (i = 0; i < p->normal_num; i++) {
         uint64_t offset = be64_to_cpu(packet->offset[i]);
 
@@ -0,0 +1,406 @@
+/*
+ * Multifd XBZRLE delta encoding implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "migration-stats.h"
+#include "options.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+#include "trace.h"
+#include "multifd.h"
+
+/*
+ * The page cache is shared by all send channels, because the channel
+ * that picks up a page is not fixed.  Access to it is serialized with
+ * a set of striped locks, indexed by the low bits of the page frame
+ * number.  As long as the number of locks does not exceed the number
+ * of cache slots, all addresses that map to one slot also map to the
+ * same lock.
+ */
+#define MULTIFD_XBZRLE_CACHE_LOCKS 64
+
+static struct {
+    PageCache *cache;
+    QemuMutex locks[MULTIFD_XBZRLE_CACHE_LOCKS];
+    unsigned int nr_locks;
+    uint8_t *zero_page;
+    /* number of send channels using the cache */
+    int users;
+} multifd_xbzrle;
+
+/*
+ * Packet payload layout, after the multifd packet header:
+ *
+ *   be32 len[normal_num]
+ *   data
+ *
+ * For each normal page len tells how the page was encoded:
+ *   0:                 page did not change since it was last sent
+ *   page_size:         raw page follows
+ *   anything else:     XBZRLE delta of len bytes follows
+ */
+struct xbzrle_data {
+    /* encoded length for each normal page, big endian */
+    uint32_t *lens;
+    /* encoded (or raw) page data */
+    uint8_t *buf;
+    /* size of buf */
+    uint32_t buf_len;
+    /* scratch buffer for the delta encoder */
+    uint8_t *encoded_buf;
+};
+
+static QemuMutex *multifd_xbzrle_lock(ram_addr_t addr)
+{
+    uint64_t pfn = addr / multifd_ram_page_size();
+
+    return &multifd_xbzrle.locks[pfn & (multifd_xbzrle.nr_locks - 1)];
+}
+
+static int multifd_xbzrle_cache_get(Error **errp)
+{
+    uint64_t cache_size = migrate_xbzrle_cache_size();
+    uint32_t page_size = multifd_ram_page_size();
+    unsigned int i;
+
+    if (multifd_xbzrle.users++) {
+        return 0;
+    }
+
+    multifd_xbzrle.cache = cache_init(cache_size, page_size, errp);
+    if (!multifd_xbzrle.cache) {
+        multifd_xbzrle.users--;
+        return -1;
+    }
+
+    multifd_xbzrle.nr_locks = MIN(MULTIFD_XBZRLE_CACHE_LOCKS,
+                                  cache_size / page_size);
+    for (i = 0; i < multifd_xbzrle.nr_locks; i++) {
+        qemu_mutex_init(&multifd_xbzrle.locks[i]);
+    }
+    multifd_xbzrle.zero_page = g_malloc0(page_size);
+
+    return 0;
+}
+
+static void multifd_xbzrle_cache_put(void)
+{
+    unsigned int i;
+
+    assert(multifd_xbzrle.users > 0);
+    if (--multifd_xbzrle.users) {
+        return;
+    }
+
+    cache_fini(multifd_xbzrle.cache);
+    multifd_xbzrle.cache = NULL;
+    for (i = 0; i < multifd_xbzrle.nr_locks; i++) {
+        qemu_mutex_destroy(&multifd_xbzrle.locks[i]);
+    }
+    multifd_xbzrle.nr_locks = 0;
+    g_free(multifd_xbzrle.zero_page);
+    multifd_xbzrle.zero_page = NULL;
+}
+
+/* Multifd xbzrle encoding */
+
+static int multifd_xbzrle_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    uint32_t page_count = multifd_ram_page_count();
+    uint32_t page_size = multifd_ram_page_size();
+    struct xbzrle_data *x;
+
+    if (multifd_xbzrle_cache_get(errp) < 0) {
+        error_prepend(errp, "multifd %u: ", p->id);
+        return -1;
+    }
+
+    x = g_new0(struct xbzrle_data, 1);
+    x->lens = g_new0(uint32_t, page_count);
+    x->buf_len = page_count * page_size;
+    x->buf = g_malloc(x->buf_len);
+    x->encoded_buf = g_malloc(page_size);
+    p->compress_data = x;
+
+    /*
+     * Needs 3 IOVs, one for packet header, one for the lengths and one
+     * for the encoded data
+     */
+    p->iov = g_new0(struct iovec, 3);
+
+    return 0;
+}
+
+static void multifd_xbzrle_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct xbzrle_data *x = p->compress_data;
+
+    if (x) {
+        g_free(x->lens);
+        g_free(x->buf);
+        g_free(x->encoded_buf);
+        g_free(x);
+        p->compress_data = NULL;
+        multifd_xbzrle_cache_put();
+    }
+
+    g_free(p->iov);
+    p->iov = NULL;
+}
+
+/*
+ * Encode one page into @dst.  Returns the number of bytes written,
+ * which also is the length stored in the packet for the page.
+ */
+static uint32_t multifd_xbzrle_encode_page(struct xbzrle_data *x,
+                                           ram_addr_t addr,
+                                           const uint8_t *host,
+                                           uint8_t *dst,
+                                           uint64_t generation)
+{
+    PageCache *cache = multifd_xbzrle.cache;
+    QemuMutex *lock = multifd_xbzrle_lock(addr);
+    uint32_t page_size = multifd_ram_page_size();
+    uint8_t *cached;
+    int encoded_len;
+
+    /*
+     * The guest may be writing to the page while we encode it, take a
+     * snapshot first so that the cache and the stream always agree.
+     */
+    memcpy(dst, host, page_size);
+
+    qemu_mutex_lock(lock);
+    if (!cache_is_cached(cache, addr, generation)) {
+        /* We don't care if the insertion fails, the page goes out raw */
+        cache_insert(cache, addr, dst, generation);
+        qemu_mutex_unlock(lock);
+        return page_size;
+    }
+
+    cached = get_cached_data(cache, addr);
+    /* Limit the delta so that it can't be confused with a raw page */
+    encoded_len = xbzrle_encode_buffer(cached, dst, page_size,
+                                       x->encoded_buf, page_size - 1);
+    if (encoded_len != 0) {
+        memcpy(cached, dst, page_size);
+    }
+    qemu_mutex_unlock(lock);
+
+    if (encoded_len == 0) {
+        trace_multifd_xbzrle_page_skipping(addr);
+        return 0;
+    } else if (encoded_len < 0) {
+        trace_multifd_xbzrle_page_overflow(addr);
+        return page_size;
+    }
+
+    memcpy(dst, x->encoded_buf, encoded_len);
+    return encoded_len;
+}
+
+/*
+ * Pages detected as zero are sent without payload; make sure the cache
+ * does not keep stale contents for them.
+ */
+static void multifd_xbzrle_cache_zero_pages(MultiFDPages_t *pages,
+                                            uint64_t generation)
+{
+    for (uint32_t i = pages->normal_num; i < pages->num; i++) {
+        ram_addr_t addr = pages->block->offset + pages->offset[i];
+        QemuMutex *lock = multifd_xbzrle_lock(addr);
+
+        qemu_mutex_lock(lock);
+        cache_insert(multifd_xbzrle.cache, addr, multifd_xbzrle.zero_page,
+                     generation);
+        qemu_mutex_unlock(lock);
+    }
+}
+
+/*
+ * With zero-page-detection=legacy, zero pages are sent on the main
+ * migration stream and never reach the channels; the RAM code calls
+ * this so that the cache entry of the page is zeroed all the same.
+ */
+void multifd_xbzrle_cache_zero_page(ram_addr_t addr)
+{
+    QemuMutex *lock;
+
+    if (!multifd_xbzrle.cache) {
+        return;
+    }
+
+    lock = multifd_xbzrle_lock(addr);
+    qemu_mutex_lock(lock);
+    cache_insert(multifd_xbzrle.cache, addr, multifd_xbzrle.zero_page,
+                 stat64_get(&mig_stats.dirty_sync_count));
+    qemu_mutex_unlock(lock);
+}
+
+static int multifd_xbzrle_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    struct xbzrle_data *x = p->compress_data;
+    uint64_t generation = stat64_get(&mig_stats.dirty_sync_count);
+    uint32_t out_size = 0;
+    uint32_t i;
+
+    if (!multifd_send_prepare_common(p)) {
+        goto out;
+    }
+
+    for (i = 0; i < pages->normal_num; i++) {
+        ram_addr_t offset = pages->offset[i];
+        uint32_t len;
+
+        len = multifd_xbzrle_encode_page(x, pages->block->offset + offset,
+                                         pages->block->host + offset,
+                                         x->buf + out_size, generation);
+        x->lens[i] = cpu_to_be32(len);
+        out_size += len;
+    }
+
+    p->iov[p->iovs_num].iov_base = x->lens;
+    p->iov[p->iovs_num].iov_len = pages->normal_num * sizeof(uint32_t);
+    p->iovs_num++;
+    p->iov[p->iovs_num].iov_base = x->buf;
+    p->iov[p->iovs_num].iov_len = out_size;
+    p->iovs_num++;
+    p->next_packet_size = pages->normal_num * sizeof(uint32_t) + out_size;
+
+    trace_multifd_xbzrle_send(p->id, pages->normal_num, out_size);
+
+out:
+    multifd_xbzrle_cache_zero_pages(pages, generation);
+    p->flags |= MULTIFD_FLAG_XBZRLE;
+    multifd_send_fill_packet(p);
+    return 0;
+}
+
+/* Multifd xbzrle decoding */
+
+static int multifd_xbzrle_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t page_count = multifd_ram_page_count();
+    struct xbzrle_data *x = g_new0(struct xbzrle_data, 1);
+
+    x->buf_len = page_count * (sizeof(uint32_t) + multifd_ram_page_size());
+    x->buf = g_try_malloc(x->buf_len);
+    if (!x->buf) {
+        g_free(x);
+        error_setg(errp, "multifd %u: out of memory for buf", p->id);
+        return -1;
+    }
+    p->compress_data = x;
+
+    return 0;
+}
+
+static void multifd_xbzrle_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct xbzrle_data *x = p->compress_data;
+
+    if (x) {
+        g_free(x->buf);
+        g_free(x);
+        p->compress_data = NULL;
+    }
+}
+
+static int multifd_xbzrle_recv(MultiFDRecvParams *p, Error **errp)
+{
+    struct xbzrle_data *x = p->compress_data;
+    uint32_t in_size = p->next_packet_size;
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t hdr_size = p->normal_num * sizeof(uint32_t);
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    uint32_t *lens;
+    uint8_t *data;
+    uint32_t data_size;
+    int ret;
+    int i;
+
+    if (flags != MULTIFD_FLAG_XBZRLE) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_XBZRLE);
+        return -1;
+    }
+
+    multifd_recv_zero_page_process(p);
+
+    if (!p->normal_num) {
+        assert(in_size == 0);
+        return 0;
+    }
+
+    if (in_size < hdr_size || in_size > x->buf_len) {
+        error_setg(errp, "multifd %u: packet size %u out of range "
+                   "(min %u max %u)", p->id, in_size, hdr_size, x->buf_len);
+        return -1;
+    }
+
+    ret = qio_channel_read_all(p->c, (void *)x->buf, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    lens = (uint32_t *)x->buf;
+    data = x->buf + hdr_size;
+    data_size = in_size - hdr_size;
+
+    for (i = 0; i < p->normal_num; i++) {
+        uint32_t len = be32_to_cpu(lens[i]);
+        uint8_t *host = p->host + p->normal[i];
+
+        if (len > page_size || len > data_size) {
+            error_setg(errp, "multifd %u: invalid encoded length %u "
+                       "for page %d", p->id, len, i);
+            return -1;
+        }
+
+        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+        if (len == page_size) {
+            memcpy(host, data, page_size);
+        } else if (len &&
+                   xbzrle_decode_buffer(data, len, host, page_size) < 0) {
+            error_setg(errp, "multifd %u: failed to decode xbzrle page "
+                       "at offset 0x" RAM_ADDR_FMT, p->id, p->normal[i]);
+            return -1;
+        }
+        data += len;
+        data_size -= len;
+    }
+
+    if (data_size) {
+        error_setg(errp, "multifd %u: %u trailing bytes in packet",
+                   p->id, data_size);
+        return -1;
+    }
+
+    return 0;
+}
+
+static const MultiFDMethods multifd_xbzrle_ops = {
+    .send_setup = multifd_xbzrle_send_setup,
+    .send_cleanup = multifd_xbzrle_send_cleanup,
+    .send_prepare = multifd_xbzrle_send_prepare,
+    .recv_setup = multifd_xbzrle_recv_setup,
+    .recv_cleanup = multifd_xbzrle_recv_cleanup,
+    .recv = multifd_xbzrle_recv
+};
+
+static void multifd_xbzrle_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_XBZRLE, &multifd_xbzrle_ops);
+}
+
+migration_init(multifd_xbzrle_register);
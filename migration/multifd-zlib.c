@@ -30,6 +30,8 @@ struct zlib_data {
     uint32_t zbuff_len;
     /* uncompressed buffer of size qemu_target_page_size() */
     uint8_t *buf;
+    /* compression level currently used by the stream */
+    int level;
 };
 
 /* Multifd zlib compression */
@@ -43,7 +45,8 @@ static int multifd_zlib_send_setup(MultiFDSendParams *p, Error **errp)
     zs->zalloc = Z_NULL;
     zs->zfree = Z_NULL;
     zs->opaque = Z_NULL;
-    if (deflateInit(zs, migrate_multifd_zlib_level()) != Z_OK) {
+    z->level = migrate_multifd_zlib_level();
+    if (deflateInit(zs, z->level) != Z_OK) {
         err_msg = "deflate init failed";
         goto err_free_z;
     }
@@ -99,6 +102,7 @@ static int multifd_zlib_send_prepare(MultiFDSendParams *p, Error **errp)
     z_stream *zs = &z->zs;
     uint32_t out_size = 0;
     uint32_t page_size = multifd_ram_page_size();
+    int level = multifd_send_compression_level();
     int ret;
     uint32_t i;
 
@@ -106,6 +110,24 @@ static int multifd_zlib_send_prepare(MultiFDSendParams *p, Error **errp)
         goto out;
     }
 
+    if (level != z->level) {
+        /*
+         * The previous packet ended with Z_SYNC_FLUSH, so the new level
+         * applies to this packet on; the stream stays the same for the
+         * destination.
+         */
+        zs->avail_out = z->zbuff_len;
+        zs->next_out = z->zbuff;
+        ret = deflateParams(zs, level, Z_DEFAULT_STRATEGY);
+        if (ret != Z_OK) {
+            error_setg(errp, "multifd %u: deflateParams returned %d",
+                       p->id, ret);
+            return -1;
+        }
+        out_size = z->zbuff_len - zs->avail_out;
+        z->level = level;
+    }
+
     for (i = 0; i < pages->normal_num; i++) {
         uint32_t available = z->zbuff_len - out_size;
         int flush = Z_NO_FLUSH;
@@ -33,6 +33,8 @@ struct zstd_data {
     uint8_t *zbuff;
     /* size of compressed buffer */
     uint32_t zbuff_len;
+    /* compression level of the current frame */
+    int level;
 };
 
 /* Multifd zstd compression */
@@ -49,7 +51,8 @@ static int multifd_zstd_send_setup(MultiFDSendParams *p, Error **errp)
         return -1;
     }
 
-    res = ZSTD_initCStream(z->zcs, migrate_multifd_zstd_level());
+    z->level = migrate_multifd_zstd_level();
+    res = ZSTD_initCStream(z->zcs, z->level);
     if (ZSTD_isError(res)) {
         ZSTD_freeCStream(z->zcs);
         g_free(z);
@@ -92,6 +95,14 @@ static int multifd_zstd_send_prepare(MultiFDSendParams *p, Error **errp)
 {
     MultiFDPages_t *pages = &p->data->u.ram;
     struct zstd_data *z = p->compress_data;
+    int level = multifd_send_compression_level();
+    /*
+     * zstd only changes the level at frame boundaries, so end the frame
+     * with this packet and start a new one with the next.  The level
+     * only changes if migrate_multifd_zstd_level_switch() says the
+     * destination copes with that.
+     */
+    bool end_frame = level != z->level;
     int ret;
     uint32_t i;
 
@@ -107,7 +118,7 @@ static int multifd_zstd_send_prepare(MultiFDSendParams *p, Error **errp)
         ZSTD_EndDirective flush = ZSTD_e_continue;
 
         if (i == pages->normal_num - 1) {
-            flush = ZSTD_e_flush;
+            flush = end_frame ? ZSTD_e_end : ZSTD_e_flush;
         }
         z->in.src = pages->block->host + pages->offset[i];
         z->in.size = multifd_ram_page_size();
@@ -136,6 +147,17 @@ static int multifd_zstd_send_prepare(MultiFDSendParams *p, Error **errp)
             return -1;
         }
     }
+    if (end_frame) {
+        size_t res = ZSTD_CCtx_setParameter(z->zcs, ZSTD_c_compressionLevel,
+                                            level);
+
+        if (ZSTD_isError(res)) {
+            error_setg(errp, "multifd %u: setting level %d failed with %s",
+                       p->id, level, ZSTD_getErrorName(res));
+            return -1;
+        }
+        z->level = level;
+    }
     p->iov[p->iovs_num].iov_base = z->zbuff;
     p->iov[p->iovs_num].iov_len = z->out.pos;
     p->iovs_num++;
@@ -257,6 +279,21 @@ static int multifd_zstd_recv(MultiFDRecvParams *p, Error **errp)
         }
         out_size += z->out.pos;
     }
+    /*
+     * If the source ended the frame with this packet (it does so when
+     * changing the compression level), consume the end of the frame.
+     */
+    while (z->in.pos < z->in.size) {
+        ZSTD_outBuffer out = { NULL, 0, 0 };
+        size_t pos = z->in.pos;
+
+        ret = ZSTD_decompressStream(z->zds, &out, &z->in);
+        if (ZSTD_isError(ret) || z->in.pos == pos) {
+            error_setg(errp, "multifd %u: %zu trailing bytes in packet",
+                       p->id, z->in.size - pos);
+            return -1;
+        }
+    }
     if (out_size != expected_size) {
         error_setg(errp, "multifd %u: packet size received %u size expected %u",
                    p->id, out_size, expected_size);
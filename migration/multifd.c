@@ -13,17 +13,20 @@
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
 #include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
 #include "exec/ramblock.h"
 #include "qemu/error-report.h"
 #include "qapi/error.h"
 #include "file.h"
+#include "migration/colo.h"
 #include "migration.h"
 #include "migration-stats.h"
 #include "socket.h"
 #include "tls.h"
 #include "qemu-file.h"
+#include "ram.h"
 #include "trace.h"
 #include "multifd.h"
 #include "threadinfo.h"
@@ -77,6 +80,22 @@ struct {
     int exiting;
     /* multifd ops */
     const MultiFDMethods *ops;
+    /*
+     * Number of channels multifd_send() hands work to, between 1 and
+     * migrate_multifd_channels().  Only accessed by the migration thread.
+     */
+    int active_channels;
+    /*
+     * channels_ready posts that multifd_send() consumed on behalf of
+     * inactive channels; they are given back when channels are
+     * activated again.  Only accessed by the migration thread.
+     */
+    int ready_stolen;
+    /*
+     * Compression level for the methods that can change it during
+     * migration, -1 otherwise.  Read by the channel threads.
+     */
+    int compression_level;
 } *multifd_send_state;
 
 struct {
@@ -300,8 +319,9 @@ static void multifd_send_kick_main(MultiFDSendParams *p)
  */
 bool multifd_send(MultiFDSendData **send_data)
 {
-    int i;
+    int i, busy = 0;
     static int next_channel;
+    int active = multifd_send_state->active_channels;
     MultiFDSendParams *p = NULL; /* make happy gcc */
     MultiFDSendData *tmp;
 
@@ -317,8 +337,8 @@ bool multifd_send(MultiFDSendData **send_data)
      * using more channels, so ensure it doesn't overflow if the
      * limit is lower now.
      */
-    next_channel %= migrate_multifd_channels();
-    for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
+    next_channel %= active;
+    for (i = next_channel;; i = (i + 1) % active) {
         if (multifd_send_should_exit()) {
             return false;
         }
@@ -328,9 +348,19 @@ bool multifd_send(MultiFDSendData **send_data)
          * sender thread can clear it.
          */
         if (qatomic_read(&p->pending_job) == false) {
-            next_channel = (i + 1) % migrate_multifd_channels();
+            next_channel = (i + 1) % active;
             break;
         }
+        /*
+         * All the active channels are busy, so the ready post we got
+         * came from a channel that is not active anymore.  Keep it aside
+         * and wait for an active channel to finish.
+         */
+        if (++busy == active) {
+            multifd_send_state->ready_stolen++;
+            qemu_sem_wait(&multifd_send_state->channels_ready);
+            busy = 0;
+        }
     }
 
     /*
@@ -359,6 +389,84 @@ bool multifd_send(MultiFDSendData **send_data)
     return true;
 }
 
+void multifd_send_get_stats(MultiFDSendStats *stats)
+{
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!multifd_send_state) {
+        return;
+    }
+
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        stats->bytes += stat64_get(&p->bytes_sent);
+        stats->prepare_ns += stat64_get(&p->prepare_ns);
+        stats->write_ns += stat64_get(&p->write_ns);
+    }
+}
+
+int multifd_send_active_channels(void)
+{
+    return multifd_send_state ? multifd_send_state->active_channels : 0;
+}
+
+/*
+ * Limit the channels used by multifd_send() to the first @channels ones.
+ * The other channels stay connected and keep taking part in the syncs.
+ * Must be called from the thread that calls multifd_send().
+ */
+void multifd_send_set_active_channels(int channels)
+{
+    assert(channels > 0 && channels <= migrate_multifd_channels());
+
+    if (channels > multifd_send_state->active_channels) {
+        while (multifd_send_state->ready_stolen) {
+            qemu_sem_post(&multifd_send_state->channels_ready);
+            multifd_send_state->ready_stolen--;
+        }
+    }
+    trace_multifd_send_set_active_channels(
+        multifd_send_state->active_channels, channels);
+    multifd_send_state->active_channels = channels;
+}
+
+/* Level of the compression methods that support changing it on the fly */
+static int multifd_send_initial_compression_level(void)
+{
+    switch (migrate_multifd_compression()) {
+    case MULTIFD_COMPRESSION_ZLIB:
+        return migrate_multifd_zlib_level();
+    case MULTIFD_COMPRESSION_ZSTD:
+        if (!migrate_multifd_zstd_level_switch()) {
+            /* The destination may not accept a frame end mid-stream */
+            return -1;
+        }
+        return migrate_multifd_zstd_level();
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Returns the level the compression method should use for the next
+ * packets, -1 if the method doesn't support changing its level.
+ */
+int multifd_send_compression_level(void)
+{
+    return qatomic_read(&multifd_send_state->compression_level);
+}
+
+void multifd_send_set_compression_level(int level)
+{
+    assert(multifd_send_state->compression_level >= 0 && level >= 0);
+
+    trace_multifd_send_set_compression_level(
+        multifd_send_state->compression_level, level);
+    qatomic_set(&multifd_send_state->compression_level, level);
+}
+
 /* Multifd send side hit an error; remember it and prepare to quit */
 static void multifd_send_set_error(Error *err)
 {
@@ -600,6 +708,9 @@ static void *multifd_send_thread(void *opaque)
          * qatomic_store_release() in multifd_send().
          */
         if (qatomic_load_acquire(&p->pending_job)) {
+            int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+            int64_t now;
+
             p->iovs_num = 0;
             assert(!multifd_payload_empty(p->data));
 
@@ -608,6 +719,10 @@ static void *multifd_send_thread(void *opaque)
                 break;
             }
 
+            now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+            stat64_add(&p->prepare_ns, now - start);
+            start = now;
+
             if (migrate_mapped_ram()) {
                 ret = file_write_ramblock_iov(p->c, p->iov, p->iovs_num,
                                               &p->data->u.ram, &local_err);
@@ -621,6 +736,23 @@ static void *multifd_send_thread(void *opaque)
                 break;
             }
 
+            /*
+             * The guest may write to the pages of a background snapshot
+             * as soon as they have been sent.
+             */
+            if (migrate_background_snapshot() &&
+                ram_write_tracking_release(p->data->u.ram.block,
+                                           p->data->u.ram.offset,
+                                           p->data->u.ram.num)) {
+                error_setg(&local_err, "multifd %u: failed to release write "
+                           "protection", p->id);
+                ret = -1;
+                break;
+            }
+
+            stat64_add(&p->write_ns,
+                       qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+            stat64_add(&p->bytes_sent, p->next_packet_size + p->packet_len);
             stat64_add(&mig_stats.multifd_bytes,
                        p->next_packet_size + p->packet_len);
 
@@ -826,6 +958,9 @@ bool multifd_send_setup(void)
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
     qatomic_set(&multifd_send_state->exiting, 0);
     multifd_send_state->ops = multifd_ops[migrate_multifd_compression()];
+    multifd_send_state->active_channels = thread_count;
+    multifd_send_state->compression_level =
+        multifd_send_initial_compression_level();
 
     for (i = 0; i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
@@ -1186,6 +1321,9 @@ static void *multifd_recv_thread(void *opaque)
             if (ret != 0) {
                 break;
             }
+            if (use_packets && migration_incoming_colo_enabled()) {
+                multifd_colo_process_recv(p);
+            }
         }
 
         if (use_packets) {
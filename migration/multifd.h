@@ -33,11 +33,28 @@ bool multifd_queue_page(RAMBlock *block, ram_addr_t offset);
 bool multifd_recv(void);
 MultiFDRecvData *multifd_get_recv_data(void);
 
+/* Cumulative statistics of the multifd send channels */
+typedef struct {
+    /* bytes written, including packet headers */
+    uint64_t bytes;
+    /* time spent preparing (e.g. compressing) packets, in ns */
+    uint64_t prepare_ns;
+    /* time spent writing packets to the channels, in ns */
+    uint64_t write_ns;
+} MultiFDSendStats;
+
+void multifd_send_get_stats(MultiFDSendStats *stats);
+int multifd_send_active_channels(void);
+void multifd_send_set_active_channels(int channels);
+int multifd_send_compression_level(void);
+void multifd_send_set_compression_level(int level);
+void multifd_xbzrle_cache_zero_page(ram_addr_t addr);
+
 /* Multifd Compression flags */
 #define MULTIFD_FLAG_SYNC (1 << 0)
 
-/* We reserve 5 bits for compression methods */
-#define MULTIFD_FLAG_COMPRESSION_MASK (0x1f << 1)
+/* We reserve 7 bits for compression methods */
+#define MULTIFD_FLAG_COMPRESSION_MASK (0x7f << 1)
 /* we need to be compatible. Before compression value was 0 */
 #define MULTIFD_FLAG_NOCOMP (0 << 1)
 #define MULTIFD_FLAG_ZLIB (1 << 1)
@@ -45,6 +62,8 @@ MultiFDRecvData *multifd_get_recv_data(void);
 #define MULTIFD_FLAG_QPL (4 << 1)
 #define MULTIFD_FLAG_UADK (8 << 1)
 #define MULTIFD_FLAG_QATZIP (16 << 1)
+#define MULTIFD_FLAG_XBZRLE (32 << 1)
+#define MULTIFD_FLAG_LZ4 (64 << 1)
 
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
@@ -163,6 +182,10 @@ typedef struct {
     uint32_t next_packet_size;
     /* packets sent through this channel */
     uint64_t packets_sent;
+    /* bytes sent and time spent, see MultiFDSendStats */
+    Stat64 bytes_sent;
+    Stat64 prepare_ns;
+    Stat64 write_ns;
     /* buffers to send */
     struct iovec *iov;
     /* number of iovs used */
@@ -313,6 +336,8 @@ void multifd_send_fill_packet(MultiFDSendParams *p);
 bool multifd_send_prepare_common(MultiFDSendParams *p);
 void multifd_send_zero_page_detect(MultiFDSendParams *p);
 void multifd_recv_zero_page_process(MultiFDRecvParams *p);
+void multifd_colo_prepare_recv(MultiFDRecvParams *p);
+void multifd_colo_process_recv(MultiFDRecvParams *p);
 
 static inline void multifd_send_prepare_header(MultiFDSendParams *p)
 {
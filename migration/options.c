@@ -22,6 +22,7 @@
 #include "qapi/qmp/qnull.h"
 #include "sysemu/runstate.h"
 #include "migration/colo.h"
+#include "migration/cpr.h"
 #include "migration/misc.h"
 #include "migration.h"
 #include "migration-stats.h"
@@ -79,6 +80,14 @@
 #define DEFAULT_MIGRATE_ANNOUNCE_ROUNDS    5
 #define DEFAULT_MIGRATE_ANNOUNCE_STEP    100
 
+/* Number of pages requested ahead of a strided postcopy fault, 0 disables */
+#define DEFAULT_MIGRATE_POSTCOPY_PREFETCH_WINDOW 0
+#define MAX_POSTCOPY_PREFETCH_WINDOW 256
+
+/* Threads copying pages that the guest writes during a background snapshot */
+#define DEFAULT_MIGRATE_BACKGROUND_SNAPSHOT_THREADS 2
+#define MAX_BACKGROUND_SNAPSHOT_THREADS 16
+
 #define DEFINE_PROP_MIG_CAP(name, x)             \
     DEFINE_PROP_BOOL(name, MigrationState, capabilities[x], false)
 
@@ -94,6 +103,8 @@ Property migration_properties[] = {
                      send_section_footer, true),
     DEFINE_PROP_BOOL("multifd-flush-after-each-section", MigrationState,
                       multifd_flush_after_each_section, false),
+    DEFINE_PROP_BOOL("x-multifd-zstd-level-switch", MigrationState,
+                     multifd_zstd_level_switch, true),
     DEFINE_PROP_UINT8("x-clear-bitmap-shift", MigrationState,
                       clear_bitmap_shift, CLEAR_BITMAP_SHIFT_DEFAULT),
     DEFINE_PROP_BOOL("x-preempt-pre-7-2", MigrationState,
@@ -172,6 +183,12 @@ Property migration_properties[] = {
     DEFINE_PROP_ZERO_PAGE_DETECTION("zero-page-detection", MigrationState,
                        parameters.zero_page_detection,
                        ZERO_PAGE_DETECTION_MULTIFD),
+    DEFINE_PROP_UINT32("postcopy-prefetch-window", MigrationState,
+                      parameters.postcopy_prefetch_window,
+                      DEFAULT_MIGRATE_POSTCOPY_PREFETCH_WINDOW),
+    DEFINE_PROP_UINT8("background-snapshot-threads", MigrationState,
+                      parameters.background_snapshot_threads,
+                      DEFAULT_MIGRATE_BACKGROUND_SNAPSHOT_THREADS),
 
     /* Migration capabilities */
     DEFINE_PROP_MIG_CAP("x-xbzrle", MIGRATION_CAPABILITY_XBZRLE),
@@ -183,6 +200,8 @@ Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-postcopy-preempt",
                         MIGRATION_CAPABILITY_POSTCOPY_PREEMPT),
     DEFINE_PROP_MIG_CAP("x-colo", MIGRATION_CAPABILITY_X_COLO),
+    DEFINE_PROP_MIG_CAP("x-ignore-shared",
+                        MIGRATION_CAPABILITY_X_IGNORE_SHARED),
     DEFINE_PROP_MIG_CAP("x-release-ram", MIGRATION_CAPABILITY_RELEASE_RAM),
     DEFINE_PROP_MIG_CAP("x-return-path", MIGRATION_CAPABILITY_RETURN_PATH),
     DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_MULTIFD),
@@ -196,6 +215,13 @@ Property migration_properties[] = {
                         MIGRATION_CAPABILITY_SWITCHOVER_ACK),
     DEFINE_PROP_MIG_CAP("x-dirty-limit", MIGRATION_CAPABILITY_DIRTY_LIMIT),
     DEFINE_PROP_MIG_CAP("mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
+    DEFINE_PROP_MIG_CAP("multifd-autotune",
+                        MIGRATION_CAPABILITY_MULTIFD_AUTOTUNE),
+    DEFINE_PROP_MIG_CAP("lazy-restore", MIGRATION_CAPABILITY_LAZY_RESTORE),
+    DEFINE_PROP_MIG_CAP("defer-hot-pages",
+                        MIGRATION_CAPABILITY_DEFER_HOT_PAGES),
+    DEFINE_PROP_MIG_CAP("incremental-checkpoint",
+                        MIGRATION_CAPABILITY_INCREMENTAL_CHECKPOINT),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -220,6 +246,13 @@ bool migrate_colo(void)
     return s->capabilities[MIGRATION_CAPABILITY_X_COLO];
 }
 
+bool migrate_defer_hot_pages(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_DEFER_HOT_PAGES];
+}
+
 bool migrate_dirty_bitmaps(void)
 {
     MigrationState *s = migrate_get_current();
@@ -255,6 +288,20 @@ bool migrate_ignore_shared(void)
     return s->capabilities[MIGRATION_CAPABILITY_X_IGNORE_SHARED];
 }
 
+bool migrate_lazy_restore(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_LAZY_RESTORE];
+}
+
+bool migrate_incremental_checkpoint(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_INCREMENTAL_CHECKPOINT];
+}
+
 bool migrate_late_block_activate(void)
 {
     MigrationState *s = migrate_get_current();
@@ -269,6 +316,13 @@ bool migrate_multifd(void)
     return s->capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+bool migrate_multifd_autotune(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_MULTIFD_AUTOTUNE];
+}
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s = migrate_get_current();
@@ -362,6 +416,13 @@ bool migrate_multifd_flush_after_each_section(void)
     return s->multifd_flush_after_each_section;
 }
 
+bool migrate_multifd_zstd_level_switch(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->multifd_zstd_level_switch;
+}
+
 bool migrate_postcopy(void)
 {
     return migrate_postcopy_ram() || migrate_dirty_bitmaps();
@@ -428,7 +489,6 @@ INITIALIZE_MIGRATE_CAPS_SET(check_caps_background_snapshot,
     MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME,
     MIGRATION_CAPABILITY_LATE_BLOCK_ACTIVATE,
     MIGRATION_CAPABILITY_RETURN_PATH,
-    MIGRATION_CAPABILITY_MULTIFD,
     MIGRATION_CAPABILITY_PAUSE_BEFORE_SWITCHOVER,
     MIGRATION_CAPABILITY_AUTO_CONVERGE,
     MIGRATION_CAPABILITY_RELEASE_RAM,
@@ -436,7 +496,9 @@ INITIALIZE_MIGRATE_CAPS_SET(check_caps_background_snapshot,
     MIGRATION_CAPABILITY_XBZRLE,
     MIGRATION_CAPABILITY_X_COLO,
     MIGRATION_CAPABILITY_VALIDATE_UUID,
-    MIGRATION_CAPABILITY_ZERO_COPY_SEND);
+    MIGRATION_CAPABILITY_ZERO_COPY_SEND,
+    MIGRATION_CAPABILITY_DEFER_HOT_PAGES,
+    MIGRATION_CAPABILITY_INCREMENTAL_CHECKPOINT);
 
 static bool migrate_incoming_started(void)
 {
@@ -588,6 +650,27 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
         }
     }
 
+    if (new_caps[MIGRATION_CAPABILITY_X_COLO]) {
+        /* Only the uncompressed multifd receive path fills the RAM cache */
+        if (new_caps[MIGRATION_CAPABILITY_MULTIFD] &&
+            migrate_multifd_compression()) {
+            error_setg(errp, "COLO is not compatible with multifd compression");
+            return false;
+        }
+
+        if (new_caps[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+            error_setg(errp, "COLO is not compatible with mapped-ram");
+            return false;
+        }
+    }
+
+    if (new_caps[MIGRATION_CAPABILITY_MULTIFD_AUTOTUNE] &&
+        !new_caps[MIGRATION_CAPABILITY_MULTIFD]) {
+        error_setg(errp, "Capability 'multifd-autotune' requires capability "
+                         "'multifd'");
+        return false;
+    }
+
     if (new_caps[MIGRATION_CAPABILITY_MAPPED_RAM]) {
         if (new_caps[MIGRATION_CAPABILITY_XBZRLE]) {
             error_setg(errp,
@@ -602,6 +685,29 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
         }
     }
 
+    if (new_caps[MIGRATION_CAPABILITY_LAZY_RESTORE]) {
+        if (!new_caps[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+            error_setg(errp, "Capability 'lazy-restore' requires capability "
+                             "'mapped-ram'");
+            return false;
+        }
+
+        /* Same as postcopy, only the destination needs userfaultfd */
+        if (!old_caps[MIGRATION_CAPABILITY_LAZY_RESTORE] &&
+            runstate_check(RUN_STATE_INMIGRATE) &&
+            !postcopy_ram_supported_by_host(mis, errp)) {
+            error_prepend(errp, "Lazy restore is not supported: ");
+            return false;
+        }
+    }
+
+    if (new_caps[MIGRATION_CAPABILITY_INCREMENTAL_CHECKPOINT] &&
+        !new_caps[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+        error_setg(errp, "Capability 'incremental-checkpoint' requires "
+                         "capability 'mapped-ram'");
+        return false;
+    }
+
     return true;
 }
 
@@ -666,10 +772,21 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     for (cap = params; cap; cap = cap->next) {
         s->capabilities[cap->value->capability] = cap->value->state;
     }
+
+    if (!migrate_incremental_checkpoint()) {
+        ram_checkpoint_discard();
+    }
 }
 
 /* parameters */
 
+uint8_t migrate_background_snapshot_threads(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.background_snapshot_threads;
+}
+
 const BitmapMigrationNodeAliasList *migrate_block_bitmap_mapping(void)
 {
     MigrationState *s = migrate_get_current();
@@ -769,7 +886,11 @@ uint64_t migrate_max_postcopy_bandwidth(void)
 MigMode migrate_mode(void)
 {
     MigrationState *s = migrate_get_current();
-    MigMode mode = s->parameters.mode;
+    MigMode mode = cpr_get_incoming_mode();
+
+    if (mode == MIG_MODE_NONE) {
+        mode = s->parameters.mode;
+    }
 
     assert(mode >= 0 && mode < MIG_MODE__MAX);
     return mode;
@@ -811,6 +932,13 @@ int migrate_multifd_zstd_level(void)
     return s->parameters.multifd_zstd_level;
 }
 
+uint32_t migrate_postcopy_prefetch_window(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.postcopy_prefetch_window;
+}
+
 uint8_t migrate_throttle_trigger_threshold(void)
 {
     MigrationState *s = migrate_get_current();
@@ -945,6 +1073,11 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->zero_page_detection = s->parameters.zero_page_detection;
     params->has_direct_io = true;
     params->direct_io = s->parameters.direct_io;
+    params->has_postcopy_prefetch_window = true;
+    params->postcopy_prefetch_window = s->parameters.postcopy_prefetch_window;
+    params->has_background_snapshot_threads = true;
+    params->background_snapshot_threads =
+        s->parameters.background_snapshot_threads;
 
     return params;
 }
@@ -979,6 +1112,8 @@ void migrate_params_init(MigrationParameters *params)
     params->has_mode = true;
     params->has_zero_page_detection = true;
     params->has_direct_io = true;
+    params->has_postcopy_prefetch_window = true;
+    params->has_background_snapshot_threads = true;
 }
 
 /*
@@ -1144,6 +1279,12 @@ bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (migrate_colo() && migrate_multifd() &&
+        params->has_multifd_compression && params->multifd_compression) {
+        error_setg(errp, "COLO is not compatible with multifd compression");
+        return false;
+    }
+
     if (params->has_x_vcpu_dirty_limit_period &&
         (params->x_vcpu_dirty_limit_period < 1 ||
          params->x_vcpu_dirty_limit_period > 1000)) {
@@ -1165,6 +1306,25 @@ bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_postcopy_prefetch_window &&
+        params->postcopy_prefetch_window > MAX_POSTCOPY_PREFETCH_WINDOW) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "postcopy_prefetch_window",
+                   "a value between 0 and "
+                   stringify(MAX_POSTCOPY_PREFETCH_WINDOW));
+        return false;
+    }
+
+    if (params->has_background_snapshot_threads &&
+        params->background_snapshot_threads >
+            MAX_BACKGROUND_SNAPSHOT_THREADS) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "background_snapshot_threads",
+                   "a value between 0 and "
+                   stringify(MAX_BACKGROUND_SNAPSHOT_THREADS));
+        return false;
+    }
+
     return true;
 }
 
@@ -1278,6 +1438,15 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_direct_io) {
         dest->direct_io = params->direct_io;
     }
+
+    if (params->has_postcopy_prefetch_window) {
+        dest->postcopy_prefetch_window = params->postcopy_prefetch_window;
+    }
+
+    if (params->has_background_snapshot_threads) {
+        dest->background_snapshot_threads =
+            params->background_snapshot_threads;
+    }
 }
 
 static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
@@ -1410,6 +1579,16 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_direct_io) {
         s->parameters.direct_io = params->direct_io;
     }
+
+    if (params->has_postcopy_prefetch_window) {
+        s->parameters.postcopy_prefetch_window =
+            params->postcopy_prefetch_window;
+    }
+
+    if (params->has_background_snapshot_threads) {
+        s->parameters.background_snapshot_threads =
+            params->background_snapshot_threads;
+    }
 }
 
 void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
@@ -774,6 +774,17 @@ static int postcopy_request_page(MigrationIncomingState *mis, RAMBlock *rb,
      * all relevant bits are set or not.
      */
     assert(QEMU_IS_ALIGNED(start, qemu_ram_pagesize(rb)));
+
+    /*
+     * With lazy restore, pages come from the migration file.  The load
+     * thread places pages concurrently, so leave discarded pages to
+     * ram_lazy_restore_request_pages() too, which serializes with it.
+     */
+    if (migrate_lazy_restore()) {
+        return ram_lazy_restore_request_pages(mis, rb, start,
+                                              qemu_ram_pagesize(rb));
+    }
+
     if (ramblock_page_is_discarded(rb, start)) {
         bool received = ramblock_recv_bitmap_test_byte_offset(rb, start);
 
@@ -958,6 +969,127 @@ static void postcopy_pause_fault_thread(MigrationIncomingState *mis)
     trace_postcopy_pause_fault_thread_continued();
 }
 
+/*
+ * Fault history of one faulting thread (normally a vCPU), used to spot
+ * sequential or fixed-stride access patterns in postcopy faults.
+ */
+typedef struct PostcopyFaultStream {
+    RAMBlock *rb;
+    ram_addr_t last_offset;
+    /* Distance in bytes between the last two faults, 0 if unknown */
+    int64_t stride;
+    /* Number of consecutive faults that matched the stride */
+    unsigned int hits;
+} PostcopyFaultStream;
+
+/* Strides larger than this (in host pages) are not considered a pattern */
+#define POSTCOPY_PREFETCH_MAX_STRIDE 64
+/* Bound the number of tracked threads; the history is reset beyond that */
+#define POSTCOPY_PREFETCH_MAX_STREAMS 1024
+
+static void postcopy_prefetch_send(MigrationIncomingState *mis, RAMBlock *rb,
+                                   ram_addr_t start, size_t len)
+{
+    trace_postcopy_prefetch_request(qemu_ram_get_idstr(rb), start, len);
+    if (migrate_lazy_restore()) {
+        /* A failure will be reported again by the next real fault */
+        ram_lazy_restore_request_pages(mis, rb, start, len);
+        return;
+    }
+    /*
+     * Prefetches are only hints and are not tracked in page_requested; if
+     * the return path is broken the next real fault will pause the thread.
+     */
+    migrate_send_rp_message_req_pages(mis, rb, start, len);
+}
+
+/*
+ * Update the fault history of thread @ptid with a fault on @offset of
+ * @rb, and if the last faults followed a constant stride, ask the source
+ * for up to postcopy-prefetch-window pages further along that stride.
+ * Contiguous pages are coalesced into a single request.
+ */
+static void postcopy_prefetch_pages(MigrationIncomingState *mis,
+                                    GHashTable *streams, uint32_t ptid,
+                                    RAMBlock *rb, ram_addr_t offset)
+{
+    uint32_t window = migrate_postcopy_prefetch_window();
+    size_t pagesize = qemu_ram_pagesize(rb);
+    PostcopyFaultStream *s;
+    ram_addr_t run_start = 0;
+    size_t run_len = 0;
+    int64_t stride;
+    uint32_t i;
+
+    if (!window) {
+        return;
+    }
+
+    s = g_hash_table_lookup(streams, GUINT_TO_POINTER(ptid));
+    if (!s) {
+        if (g_hash_table_size(streams) >= POSTCOPY_PREFETCH_MAX_STREAMS) {
+            g_hash_table_remove_all(streams);
+        }
+        s = g_new0(PostcopyFaultStream, 1);
+        g_hash_table_insert(streams, GUINT_TO_POINTER(ptid), s);
+    }
+
+    stride = 0;
+    if (s->rb == rb) {
+        stride = (int64_t)offset - (int64_t)s->last_offset;
+        if (ABS(stride) > POSTCOPY_PREFETCH_MAX_STRIDE * (int64_t)pagesize) {
+            stride = 0;
+        }
+    }
+    if (stride && stride == s->stride) {
+        s->hits++;
+    } else {
+        s->hits = 0;
+    }
+    s->rb = rb;
+    s->last_offset = offset;
+    s->stride = stride;
+
+    /* Need at least three faults at the same stride to call it a pattern */
+    if (!s->hits) {
+        return;
+    }
+
+    trace_postcopy_prefetch_pattern(ptid, qemu_ram_get_idstr(rb), offset,
+                                    stride, s->hits);
+
+    for (i = 1; i <= window; i++) {
+        int64_t next = (int64_t)offset + stride * i;
+
+        if (next < 0 || next >= rb->used_length) {
+            break;
+        }
+        if (ramblock_recv_bitmap_test_byte_offset(rb, next) ||
+            ramblock_page_is_discarded(rb, next)) {
+            continue;
+        }
+        if (run_len && run_len + pagesize <= UINT32_MAX) {
+            if (next == run_start + run_len) {
+                run_len += pagesize;
+                continue;
+            }
+            if (next + pagesize == run_start) {
+                run_start = next;
+                run_len += pagesize;
+                continue;
+            }
+        }
+        if (run_len) {
+            postcopy_prefetch_send(mis, rb, run_start, run_len);
+        }
+        run_start = next;
+        run_len = pagesize;
+    }
+    if (run_len) {
+        postcopy_prefetch_send(mis, rb, run_start, run_len);
+    }
+}
+
 /*
  * Handle faults detected by the USERFAULT markings
  */
@@ -968,9 +1100,12 @@ static void *postcopy_ram_fault_thread(void *opaque)
     int ret;
     size_t index;
     RAMBlock *rb = NULL;
+    GHashTable *streams;
 
     trace_postcopy_ram_fault_thread_entry();
     rcu_register_thread();
+    streams = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                    NULL, g_free);
     mis->last_rb = NULL; /* last RAMBlock we sent part of */
     qemu_sem_post(&mis->thread_sync_sem);
 
@@ -1009,7 +1144,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
             break;
         }
 
-        if (!mis->to_src_file) {
+        if (!mis->to_src_file && !migrate_lazy_restore()) {
             /*
              * Possibly someone tells us that the return path is
              * broken already using the event. We should hold until
@@ -1087,11 +1222,19 @@ retry:
              */
             ret = postcopy_request_page(mis, rb, rb_offset,
                                         msg.arg.pagefault.address);
+            if (ret && migrate_lazy_restore()) {
+                /* The file is the only copy of the page, give up */
+                exit(EXIT_FAILURE);
+            }
             if (ret) {
                 /* May be network failure, try to wait for recovery */
                 postcopy_pause_fault_thread(mis);
                 goto retry;
             }
+
+            postcopy_prefetch_pages(mis, streams,
+                                    msg.arg.pagefault.feat.ptid,
+                                    rb, rb_offset);
         }
 
         /* Now handle any requests from external processes on shared memory */
@@ -1152,6 +1295,7 @@ retry:
     }
     rcu_unregister_thread();
     trace_postcopy_ram_fault_thread_exit();
+    g_hash_table_destroy(streams);
     g_free(pfd);
     return NULL;
 }
@@ -28,6 +28,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/madvise.h"
@@ -56,6 +57,7 @@
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
+#include "file.h"
 #include "sysemu/runstate.h"
 #include "rdma.h"
 #include "options.h"
@@ -218,7 +220,21 @@ bool migrate_ram_is_ignored(RAMBlock *block)
 {
     return !qemu_ram_is_migratable(block) ||
            (migrate_ignore_shared() && qemu_ram_is_shared(block)
-                                    && qemu_ram_is_named_file(block));
+                                    && qemu_ram_is_named_file(block)) ||
+           /* The new QEMU maps the same memfd or file as we do */
+           (migrate_mode() == MIG_MODE_CPR_TRANSFER &&
+            qemu_ram_is_shared(block) && qemu_ram_get_fd(block) >= 0);
+}
+
+/*
+ * A VM cloned from a template VM maps the template's RAM file privately
+ * (share=off,readonly=on), so its RAM is already in place when it loads
+ * the device state that the template saved with x-ignore-shared.
+ */
+static bool ramblock_is_template_clone(RAMBlock *block)
+{
+    return migrate_ignore_shared() && qemu_ram_is_named_file(block) &&
+           !qemu_ram_is_shared(block) && (block->flags & RAM_READONLY_FD);
 }
 
 #undef RAMBLOCK_FOREACH
@@ -351,6 +367,19 @@ struct RAMSrcPageRequest {
     QSIMPLEQ_ENTRY(RAMSrcPageRequest) next_req;
 };
 
+/*
+ * Content of a host page copied by a write fault thread during a
+ * background snapshot, before the guest was allowed to modify it
+ */
+typedef struct RAMWriteFaultCopy {
+    RAMBlock *rb;
+    ram_addr_t offset;
+    size_t size;
+    uint8_t *data;
+
+    QSIMPLEQ_ENTRY(RAMWriteFaultCopy) next;
+} RAMWriteFaultCopy;
+
 /* State of RAM for migration */
 struct RAMState {
     /*
@@ -360,6 +389,23 @@ struct RAMState {
     PageSearchStatus pss[RAM_CHANNEL_MAX];
     /* UFFD file descriptor, used in 'write-tracking' migration */
     int uffdio_fd;
+    /* Threads handling UFFD write faults, see ram_wp_fault_thread() */
+    QemuThread *wp_threads;
+    int wp_threads_num;
+    bool wp_quit;
+    /*
+     * Protects:
+     * - RAMBlock wp_bmap
+     * - wp_copies, wp_copies_size, wp_copying
+     */
+    QemuMutex wp_mutex;
+    /* Signaled when a page copy is queued or consumed */
+    QemuCond wp_cond;
+    /* Copies of write-faulting pages, waiting to be saved */
+    QSIMPLEQ_HEAD(, RAMWriteFaultCopy) wp_copies;
+    uint64_t wp_copies_size;
+    /* Number of page copies in progress in the fault threads */
+    unsigned int wp_copying;
     /* total ram size in bytes */
     uint64_t ram_bytes_total;
     /* Last block that we have visited searching for dirty pages */
@@ -394,6 +440,10 @@ struct RAMState {
     uint64_t target_page_count;
     /* number of dirty bits in the bitmap */
     uint64_t migration_dirty_pages;
+    /* number of dirty bits in hot regions after the last bitmap sync */
+    uint64_t hot_dirty_pages;
+    /* Whether the dirty page scan skips hot regions */
+    bool skip_hot_pages;
     /*
      * Protects:
      * - dirty/clear bitmap
@@ -698,6 +748,17 @@ static int save_xbzrle_page(RAMState *rs, PageSearchStatus *pss,
     return 1;
 }
 
+/*
+ * A region dirtied in this many consecutive bitmap syncs is hot, see
+ * migrate_defer_hot_pages().
+ */
+#define DIRTY_HEAT_HOT 2
+
+static bool ramblock_page_is_hot(RAMBlock *rb, unsigned long page)
+{
+    return rb->dirty_heat[page >> DIRTY_HEAT_SHIFT] >= DIRTY_HEAT_HOT;
+}
+
 /**
  * pss_find_next_dirty: find the next dirty page of current ramblock
  *
@@ -731,6 +792,16 @@ static void pss_find_next_dirty(PageSearchStatus *pss)
     }
 
     pss->page = find_next_bit(bitmap, size, pss->page);
+
+    /* Jump over the hot regions, they are sent after everything else */
+    if (ram_state->skip_hot_pages && rb->dirty_heat &&
+        !pss->host_page_sending) {
+        while (pss->page < size && ramblock_page_is_hot(rb, pss->page)) {
+            pss->page = find_next_bit(bitmap, size,
+                                      ROUND_UP(pss->page + 1,
+                                               1UL << DIRTY_HEAT_SHIFT));
+        }
+    }
 }
 
 static void migration_clear_memory_region_dirty_bitmap(RAMBlock *rb,
@@ -922,6 +993,43 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
     rs->num_dirty_pages_period += new_dirty_pages;
 }
 
+/**
+ * ramblock_update_dirty_heat: account a bitmap sync in the dirty heat
+ *
+ * Returns the number of dirty pages of the hot regions of @rb
+ *
+ * Called with RCU critical section and bitmap_mutex held, right after
+ * the dirty bitmap of @rb was synced.
+ *
+ * @rb: RAMBlock to update
+ */
+static uint64_t ramblock_update_dirty_heat(RAMBlock *rb)
+{
+    unsigned long pages = rb->used_length >> TARGET_PAGE_BITS;
+    unsigned long regions = DIV_ROUND_UP(pages, 1UL << DIRTY_HEAT_SHIFT);
+    uint64_t hot_pages = 0;
+    unsigned long i;
+
+    for (i = 0; i < regions; i++) {
+        unsigned long start = i << DIRTY_HEAT_SHIFT;
+
+        if (!test_bit(i, rb->dirty_heat_bmap)) {
+            rb->dirty_heat[i] = 0;
+            continue;
+        }
+        if (rb->dirty_heat[i] < DIRTY_HEAT_HOT) {
+            rb->dirty_heat[i]++;
+        }
+        if (rb->dirty_heat[i] >= DIRTY_HEAT_HOT) {
+            hot_pages += bitmap_count_one_with_offset(rb->bmap, start,
+                             MIN(pages - start, 1UL << DIRTY_HEAT_SHIFT));
+        }
+    }
+    bitmap_zero(rb->dirty_heat_bmap, regions);
+
+    return hot_pages;
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -1057,15 +1165,22 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
 
     WITH_QEMU_LOCK_GUARD(&rs->bitmap_mutex) {
         WITH_RCU_READ_LOCK_GUARD() {
+            rs->hot_dirty_pages = 0;
             RAMBLOCK_FOREACH_NOT_IGNORED(block) {
                 ramblock_sync_dirty_bitmap(rs, block);
+                if (block->dirty_heat) {
+                    rs->hot_dirty_pages += ramblock_update_dirty_heat(block);
+                }
             }
             stat64_set(&mig_stats.dirty_bytes_last_sync, ram_bytes_remaining());
+            /* Everything has to be sent in the last round */
+            rs->skip_hot_pages = rs->hot_dirty_pages && !last_stage;
         }
     }
 
     memory_global_after_dirty_log_sync();
-    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
+    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period,
+                                    rs->hot_dirty_pages);
 
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
@@ -1165,6 +1280,12 @@ static int save_zero_page(RAMState *rs, PageSearchStatus *pss,
         XBZRLE_cache_unlock();
     }
 
+    /* Same for the cache of the multifd xbzrle method */
+    if (migrate_multifd() &&
+        migrate_multifd_compression() == MULTIFD_COMPRESSION_XBZRLE) {
+        multifd_xbzrle_cache_zero_page(pss->block->offset + offset);
+    }
+
     return len;
 }
 
@@ -1213,7 +1334,7 @@ static int save_normal_page(PageSearchStatus *pss, RAMBlock *block,
     if (migrate_mapped_ram()) {
         qemu_put_buffer_at(file, buf, TARGET_PAGE_SIZE,
                            block->pages_offset + offset);
-        set_bit(offset >> TARGET_PAGE_BITS, block->file_bmap);
+        set_bit_atomic(offset >> TARGET_PAGE_BITS, block->file_bmap);
     } else {
         ram_transferred_add(save_page_header(pss, pss->pss_channel, block,
                                              offset | RAM_SAVE_FLAG_PAGE));
@@ -1289,6 +1410,18 @@ static int ram_save_multifd_page(RAMBlock *block, ram_addr_t offset)
 #define PAGE_ALL_CLEAN 0
 #define PAGE_TRY_AGAIN 1
 #define PAGE_DIRTY_FOUND 2
+/*
+ * Whether the dirty pages of the hot regions can be left for the
+ * switchover, that is, whether they fit in the downtime limit.
+ * Otherwise they are sent at the end of each round.
+ */
+static bool ram_defer_hot_pages_to_switchover(RAMState *rs)
+{
+    MigrationState *s = migrate_get_current();
+
+    return rs->hot_dirty_pages * TARGET_PAGE_SIZE < s->threshold_size;
+}
+
 /**
  * find_dirty_block: find the next dirty page and update any state
  * associated with the search process.
@@ -1310,6 +1443,16 @@ static int find_dirty_block(RAMState *rs, PageSearchStatus *pss)
 
     if (pss->complete_round && pss->block == rs->last_seen_block &&
         pss->page >= rs->last_page) {
+        if (rs->skip_hot_pages && !ram_defer_hot_pages_to_switchover(rs)) {
+            /*
+             * All the cold pages were sent, go around once more for
+             * the hot ones.
+             */
+            trace_ram_send_hot_pages(rs->hot_dirty_pages);
+            rs->skip_hot_pages = false;
+            pss->complete_round = false;
+            return PAGE_TRY_AGAIN;
+        }
         /*
          * We've been once around the RAM and haven't found anything.
          * Give up.
@@ -1398,7 +1541,30 @@ static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
     return block;
 }
 
+/*
+ * ram_save_block_multifd: whether the pages of @block are sent through the
+ *   multifd channels
+ *
+ * A background snapshot can only release the write protection of a host
+ * page once all of it has been sent.  Host pages that span several target
+ * pages could be split over several multifd channels, so they are sent
+ * through the main channel instead.
+ */
+static bool ram_save_block_multifd(RAMBlock *block)
+{
+    if (!migrate_multifd()) {
+        return false;
+    }
+    return !migrate_background_snapshot() ||
+           qemu_ram_pagesize(block) == TARGET_PAGE_SIZE;
+}
+
 #if defined(__linux__)
+/* Upper bound of the memory used by the copies of write-faulting pages */
+#define RAM_WP_COPIES_MAX       (64 * MiB)
+/* Maximum number of write faults read at once by a fault thread */
+#define RAM_WP_FAULT_BATCH      32
+
 /**
  * poll_fault_page: try to get next UFFD write fault page and, if pending fault
  *   is found, return RAM block pointer and page offset
@@ -1416,7 +1582,8 @@ static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
     RAMBlock *block;
     int res;
 
-    if (!migrate_background_snapshot()) {
+    /* Write faults are handled by the dedicated threads if there are any */
+    if (!migrate_background_snapshot() || rs->wp_threads_num) {
         return NULL;
     }
 
@@ -1446,8 +1613,12 @@ static int ram_save_release_protection(RAMState *rs, PageSearchStatus *pss,
 {
     int res = 0;
 
-    /* Check if page is from UFFD-managed region. */
-    if (pss->block->flags & RAM_UF_WRITEPROTECT) {
+    /*
+     * Check if page is from UFFD-managed region.  Pages queued to multifd
+     * are released by the channel that sends them.
+     */
+    if ((pss->block->flags & RAM_UF_WRITEPROTECT) &&
+        !ram_save_block_multifd(pss->block)) {
         void *page_address = pss->block->host + (start_page << TARGET_PAGE_BITS);
         uint64_t run_length = (pss->page - start_page) << TARGET_PAGE_BITS;
 
@@ -1461,6 +1632,319 @@ static int ram_save_release_protection(RAMState *rs, PageSearchStatus *pss,
     return res;
 }
 
+/**
+ * ram_write_tracking_release: release UFFD write protection of pages
+ *   that a multifd channel has sent
+ *
+ * Returns 0 on success, negative value in case of an error
+ *
+ * @block: RAM block the pages belong to
+ * @offset: offsets of the pages inside the block
+ * @num: number of pages
+ */
+int ram_write_tracking_release(RAMBlock *block, ram_addr_t *offset,
+                               uint32_t num)
+{
+    RAMState *rs = ram_state;
+    uint32_t i, start = 0;
+
+    if (!(block->flags & RAM_UF_WRITEPROTECT)) {
+        return 0;
+    }
+
+    /* Release contiguous pages at once */
+    for (i = 1; i <= num; i++) {
+        uint64_t run_length;
+
+        if (i < num && offset[i] == offset[i - 1] + TARGET_PAGE_SIZE) {
+            continue;
+        }
+        run_length = offset[i - 1] - offset[start] + TARGET_PAGE_SIZE;
+        if (uffd_change_protection(rs->uffdio_fd, block->host + offset[start],
+                                   run_length, false, false)) {
+            return -1;
+        }
+        start = i;
+    }
+
+    return 0;
+}
+
+/*
+ * ram_wp_claim: claim the host page containing @page of @block for the
+ *   migration thread
+ *
+ * Returns false if a write fault thread already saved a copy of it, in
+ * which case the migration thread must skip it.
+ *
+ * @rs: current RAM state
+ * @block: RAM block that contains the page
+ * @page: index of the target page inside the block
+ */
+static bool ram_wp_claim(RAMState *rs, RAMBlock *block, unsigned long page)
+{
+    unsigned long hpage;
+
+    if (!rs->wp_threads_num || !(block->flags & RAM_UF_WRITEPROTECT)) {
+        return true;
+    }
+
+    hpage = ((ram_addr_t)page << TARGET_PAGE_BITS) / qemu_ram_pagesize(block);
+    QEMU_LOCK_GUARD(&rs->wp_mutex);
+    return !test_and_set_bit(hpage, block->wp_bmap);
+}
+
+/*
+ * ram_wp_save_copy: save the pages copied by a write fault thread
+ *
+ * Returns the number of pages written
+ *
+ * @rs: current RAM state
+ * @pss: page-search-status structure of the main channel
+ * @copy: the copy of the host page
+ */
+static int ram_wp_save_copy(RAMState *rs, PageSearchStatus *pss,
+                            RAMWriteFaultCopy *copy)
+{
+    RAMBlock *block = copy->rb;
+    size_t i;
+    int pages = 0;
+
+    for (i = 0; i < copy->size; i += TARGET_PAGE_SIZE) {
+        ram_addr_t offset = copy->offset + i;
+
+        if (offset >= block->used_length) {
+            break;
+        }
+        if (migration_bitmap_clear_dirty(rs, block,
+                                         offset >> TARGET_PAGE_BITS)) {
+            pages += save_normal_page(pss, block, offset, copy->data + i,
+                                      false);
+        }
+    }
+
+    trace_ram_wp_save_copy(block->idstr, copy->offset, pages);
+    return pages;
+}
+
+/*
+ * ram_wp_save_copies: save the pages copied by the write fault threads
+ *   so far
+ *
+ * Returns the number of pages written
+ *
+ * @rs: current RAM state
+ * @pss: page-search-status structure of the main channel
+ */
+static int ram_wp_save_copies(RAMState *rs, PageSearchStatus *pss)
+{
+    RAMWriteFaultCopy *copy;
+    int pages = 0;
+
+    if (!rs->wp_threads_num) {
+        return 0;
+    }
+
+    while (true) {
+        WITH_QEMU_LOCK_GUARD(&rs->wp_mutex) {
+            copy = QSIMPLEQ_FIRST(&rs->wp_copies);
+            if (copy) {
+                QSIMPLEQ_REMOVE_HEAD(&rs->wp_copies, next);
+            }
+        }
+        if (!copy) {
+            break;
+        }
+
+        pages += ram_wp_save_copy(rs, pss, copy);
+
+        WITH_QEMU_LOCK_GUARD(&rs->wp_mutex) {
+            rs->wp_copies_size -= copy->size;
+            qemu_cond_broadcast(&rs->wp_cond);
+        }
+        g_free(copy->data);
+        g_free(copy);
+    }
+
+    return pages;
+}
+
+/*
+ * ram_wp_flush_copies: save all the pages copied by the write fault
+ *   threads, including the copies that are still in progress
+ *
+ * Called at the end of a background snapshot, when every dirty page has
+ * been claimed either by the migration thread or by a fault thread.
+ *
+ * @rs: current RAM state
+ * @pss: page-search-status structure of the main channel
+ */
+static void ram_wp_flush_copies(RAMState *rs, PageSearchStatus *pss)
+{
+    bool done = false;
+
+    while (!done) {
+        ram_wp_save_copies(rs, pss);
+
+        WITH_QEMU_LOCK_GUARD(&rs->wp_mutex) {
+            while (rs->wp_copying && QSIMPLEQ_EMPTY(&rs->wp_copies)) {
+                qemu_cond_wait(&rs->wp_cond, &rs->wp_mutex);
+            }
+            done = QSIMPLEQ_EMPTY(&rs->wp_copies);
+        }
+    }
+}
+
+/*
+ * ram_wp_handle_fault: handle a write fault during a background snapshot
+ *
+ * If the migration thread has not claimed the host page yet, copy it aside
+ * for the migration thread to save later, and let the guest write to it
+ * right away.  Otherwise the migration thread is saving it, and it will
+ * release the page once done.
+ *
+ * @rs: current RAM state
+ * @addr: faulting address
+ */
+static void ram_wp_handle_fault(RAMState *rs, void *addr)
+{
+    RAMWriteFaultCopy *copy;
+    ram_addr_t offset;
+    RAMBlock *block;
+    unsigned long hpage;
+    size_t size;
+
+    block = qemu_ram_block_from_host(addr, false, &offset);
+    assert(block && (block->flags & RAM_UF_WRITEPROTECT) != 0);
+    size = qemu_ram_pagesize(block);
+    offset = QEMU_ALIGN_DOWN(offset, size);
+    hpage = offset / size;
+
+    WITH_QEMU_LOCK_GUARD(&rs->wp_mutex) {
+        /* Bound the memory used by the copies */
+        while (!test_bit(hpage, block->wp_bmap) && rs->wp_copies_size &&
+               rs->wp_copies_size + size > RAM_WP_COPIES_MAX &&
+               !qatomic_read(&rs->wp_quit)) {
+            qemu_cond_wait(&rs->wp_cond, &rs->wp_mutex);
+        }
+        if (test_and_set_bit(hpage, block->wp_bmap)) {
+            trace_ram_wp_fault_claimed(block->idstr, offset);
+            return;
+        }
+        rs->wp_copying++;
+        rs->wp_copies_size += size;
+    }
+
+    copy = g_new0(RAMWriteFaultCopy, 1);
+    copy->rb = block;
+    copy->offset = offset;
+    copy->size = size;
+    copy->data = g_malloc(size);
+    memcpy(copy->data, block->host + offset, size);
+
+    /* The content is safe, let the guest go */
+    uffd_change_protection(rs->uffdio_fd, block->host + offset, size,
+                           false, false);
+    trace_ram_wp_fault_copy(block->idstr, offset, size);
+
+    WITH_QEMU_LOCK_GUARD(&rs->wp_mutex) {
+        QSIMPLEQ_INSERT_TAIL(&rs->wp_copies, copy, next);
+        rs->wp_copying--;
+        qemu_cond_broadcast(&rs->wp_cond);
+    }
+}
+
+static void *ram_wp_fault_thread(void *opaque)
+{
+    struct uffd_msg msgs[RAM_WP_FAULT_BATCH];
+    RAMState *rs = opaque;
+
+    rcu_register_thread();
+
+    while (!qatomic_read(&rs->wp_quit)) {
+        int i, n;
+
+        /* Wake up regularly to notice the end of the snapshot */
+        if (!uffd_poll_events(rs->uffdio_fd, 100)) {
+            continue;
+        }
+        /* Other fault threads may have read the events already */
+        n = uffd_read_events(rs->uffdio_fd, msgs, RAM_WP_FAULT_BATCH);
+        WITH_RCU_READ_LOCK_GUARD() {
+            for (i = 0; i < n; i++) {
+                ram_wp_handle_fault(rs,
+                    (void *)(uintptr_t)msgs[i].arg.pagefault.address);
+            }
+        }
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void ram_wp_threads_start(RAMState *rs)
+{
+    RAMBlock *block;
+    int i;
+
+    rs->wp_threads_num = migrate_background_snapshot_threads();
+    if (!rs->wp_threads_num) {
+        return;
+    }
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (block->flags & RAM_UF_WRITEPROTECT) {
+            block->wp_bmap = bitmap_new(DIV_ROUND_UP(block->used_length,
+                                                     qemu_ram_pagesize(block)));
+        }
+    }
+
+    rs->wp_quit = false;
+    rs->wp_threads = g_new0(QemuThread, rs->wp_threads_num);
+    for (i = 0; i < rs->wp_threads_num; i++) {
+        g_autofree char *name = g_strdup_printf("mig/src/wp_%d", i);
+
+        qemu_thread_create(&rs->wp_threads[i], name, ram_wp_fault_thread,
+                           rs, QEMU_THREAD_JOINABLE);
+    }
+    trace_ram_wp_threads_start(rs->wp_threads_num);
+}
+
+static void ram_wp_threads_stop(RAMState *rs)
+{
+    RAMWriteFaultCopy *copy, *next;
+    RAMBlock *block;
+    int i;
+
+    if (!rs->wp_threads_num) {
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&rs->wp_mutex) {
+        qatomic_set(&rs->wp_quit, true);
+        qemu_cond_broadcast(&rs->wp_cond);
+    }
+    for (i = 0; i < rs->wp_threads_num; i++) {
+        qemu_thread_join(&rs->wp_threads[i]);
+    }
+    g_free(rs->wp_threads);
+    rs->wp_threads = NULL;
+    rs->wp_threads_num = 0;
+
+    /* Only left if the snapshot failed */
+    QSIMPLEQ_FOREACH_SAFE(copy, &rs->wp_copies, next, next) {
+        g_free(copy->data);
+        g_free(copy);
+    }
+    QSIMPLEQ_INIT(&rs->wp_copies);
+    rs->wp_copies_size = 0;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        g_free(block->wp_bmap);
+        block->wp_bmap = NULL;
+    }
+}
+
 /* ram_write_tracking_available: check if kernel supports required UFFD features
  *
  * Returns true if supports, false otherwise
@@ -1688,6 +2172,7 @@ int ram_write_tracking_start(void)
                 block->host, block->max_length);
     }
 
+    ram_wp_threads_start(rs);
     return 0;
 
 fail:
@@ -1716,8 +2201,15 @@ void ram_write_tracking_stop(void)
     RAMState *rs = ram_state;
     RAMBlock *block;
 
+    /* The snapshot failed before RAM was set up */
+    if (!rs) {
+        return;
+    }
+
     RCU_READ_LOCK_GUARD();
 
+    ram_wp_threads_stop(rs);
+
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         if ((block->flags & RAM_UF_WRITEPROTECT) == 0) {
             continue;
@@ -1758,6 +2250,26 @@ static int ram_save_release_protection(RAMState *rs, PageSearchStatus *pss,
     return 0;
 }
 
+int ram_write_tracking_release(RAMBlock *block, ram_addr_t *offset,
+                               uint32_t num)
+{
+    return 0;
+}
+
+static bool ram_wp_claim(RAMState *rs, RAMBlock *block, unsigned long page)
+{
+    return true;
+}
+
+static int ram_wp_save_copies(RAMState *rs, PageSearchStatus *pss)
+{
+    return 0;
+}
+
+static void ram_wp_flush_copies(RAMState *rs, PageSearchStatus *pss)
+{
+}
+
 bool ram_write_tracking_available(void)
 {
     return false;
@@ -2023,12 +2535,20 @@ static int ram_save_target_page_multifd(RAMState *rs, PageSearchStatus *pss)
     RAMBlock *block = pss->block;
     ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
 
+    if (!ram_save_block_multifd(block)) {
+        return ram_save_target_page_legacy(rs, pss);
+    }
+
     /*
      * While using multifd live migration, we still need to handle zero
      * page checking on the migration main thread.
      */
     if (migrate_zero_page_detection() == ZERO_PAGE_DETECTION_LEGACY) {
         if (save_zero_page(rs, pss, offset)) {
+            /* Not sent by a multifd channel, so release it here */
+            if (ram_write_tracking_release(block, &offset, 1)) {
+                return -1;
+            }
             return 1;
         }
     }
@@ -2178,6 +2698,13 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss)
     /* Update host page boundary information */
     pss_host_page_prepare(pss);
 
+    /* A write fault thread has already copied it, skip the host page */
+    if (!ram_wp_claim(rs, pss->block, pss->page)) {
+        pss->page = pss->host_page_end;
+        pss_host_page_finish(pss);
+        return 0;
+    }
+
     do {
         page_dirty = migration_bitmap_clear_dirty(rs, pss->block, pss->page);
 
@@ -2246,6 +2773,15 @@ static int ram_find_and_save_block(RAMState *rs)
         return pages;
     }
 
+    /*
+     * Save the pages copied by the write fault threads first, they use
+     * memory until then.
+     */
+    pages = ram_wp_save_copies(rs, pss);
+    if (pages) {
+        return pages;
+    }
+
     /*
      * Always keep last_seen_block/last_page valid during this procedure,
      * because find_dirty_block() relies on these values (e.g., we compare
@@ -2330,6 +2866,8 @@ static void ram_state_cleanup(RAMState **rsp)
         migration_page_queue_free(*rsp);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
+        qemu_mutex_destroy(&(*rsp)->wp_mutex);
+        qemu_cond_destroy(&(*rsp)->wp_cond);
         g_free(*rsp);
         *rsp = NULL;
     }
@@ -2351,7 +2889,113 @@ static void xbzrle_cleanup(void)
     XBZRLE_cache_unlock();
 }
 
-static void ram_bitmaps_destroy(void)
+/*
+ * Incremental checkpoints, see migrate_incremental_checkpoint().  After
+ * a successful migration to a file the dirty log keeps running and the
+ * file bitmaps of the RAMBlocks are kept, so that the next migration to
+ * the same file only writes the pages dirtied in between.
+ */
+static struct {
+    /* Target of the kept checkpoint, NULL if there is none */
+    char *filename;
+    uint64_t offset;
+    /* Target of the current migration, when it goes to a file */
+    char *next_filename;
+    uint64_t next_offset;
+    /* Whether the current migration is an incremental checkpoint */
+    bool incremental;
+} ram_checkpoint;
+
+/* Whether the kept checkpoint was written to @filename at @offset */
+static bool ram_checkpoint_matches(const char *filename, uint64_t offset)
+{
+    return migrate_incremental_checkpoint() && ram_checkpoint.filename &&
+           !strcmp(ram_checkpoint.filename, filename) &&
+           ram_checkpoint.offset == offset;
+}
+
+/**
+ * ram_checkpoint_prepare: record the file a migration is written to
+ *
+ * Returns true if the migration is an incremental checkpoint, in
+ * which case the file must not be truncated.
+ *
+ * @filename: path of the migration file
+ * @offset: offset of the migration stream in the file
+ */
+bool ram_checkpoint_prepare(const char *filename, uint64_t offset)
+{
+    g_free(ram_checkpoint.next_filename);
+    ram_checkpoint.next_filename = g_strdup(filename);
+    ram_checkpoint.next_offset = offset;
+
+    return ram_checkpoint_matches(filename, offset);
+}
+
+/*
+ * Drop the kept checkpoint, if any, so that the next checkpoint is a
+ * full one.  Called with the BQL, when no migration is running.
+ */
+void ram_checkpoint_discard(void)
+{
+    RAMBlock *block;
+
+    if (!ram_checkpoint.filename) {
+        return;
+    }
+
+    trace_ram_checkpoint_discard(ram_checkpoint.filename);
+    g_free(ram_checkpoint.filename);
+    ram_checkpoint.filename = NULL;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            g_free(block->file_bmap);
+            block->file_bmap = NULL;
+        }
+    }
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_MIGRATION);
+}
+
+/*
+ * Keep the state of a successful migration to a file as a checkpoint.
+ * Returns true if the dirty log and the file bitmaps must be kept.
+ */
+static bool ram_checkpoint_commit(void)
+{
+    g_autofree char *filename = g_steal_pointer(&ram_checkpoint.next_filename);
+
+    ram_checkpoint.incremental = false;
+
+    if (!filename || !migrate_incremental_checkpoint() ||
+        migrate_get_current()->state != MIGRATION_STATUS_COMPLETED) {
+        return false;
+    }
+
+    g_free(ram_checkpoint.filename);
+    ram_checkpoint.filename = g_steal_pointer(&filename);
+    ram_checkpoint.offset = ram_checkpoint.next_offset;
+    trace_ram_checkpoint_commit(ram_checkpoint.filename);
+
+    return true;
+}
+
+/*
+ * The pages of @block can't be written over the last checkpoint,
+ * e.g. because they moved in the file: write all of them.
+ */
+static void ramblock_checkpoint_reset(RAMState *rs, RAMBlock *block)
+{
+    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+
+    rs->migration_dirty_pages += pages - bitmap_count_one(block->bmap, pages);
+    bitmap_set(block->bmap, 0, pages);
+    bitmap_zero(block->file_bmap, pages);
+    rs->migration_dirty_pages -=
+        ramblock_dirty_bitmap_clear_discarded_pages(block);
+}
+
+static void ram_bitmaps_destroy(bool keep_file_bmap)
 {
     RAMBlock *block;
 
@@ -2360,17 +3004,29 @@ static void ram_bitmaps_destroy(void)
         block->clear_bmap = NULL;
         g_free(block->bmap);
         block->bmap = NULL;
-        g_free(block->file_bmap);
-        block->file_bmap = NULL;
+        if (!keep_file_bmap) {
+            g_free(block->file_bmap);
+            block->file_bmap = NULL;
+        }
+        g_free(block->dirty_heat_bmap);
+        block->dirty_heat_bmap = NULL;
+        g_free(block->dirty_heat);
+        block->dirty_heat = NULL;
     }
 }
 
 static void ram_save_cleanup(void *opaque)
 {
     RAMState **rsp = opaque;
+    bool keep_checkpoint = ram_checkpoint_commit();
+
+    if (!keep_checkpoint) {
+        g_free(ram_checkpoint.filename);
+        ram_checkpoint.filename = NULL;
+    }
 
     /* We don't use dirty log with background snapshots */
-    if (!migrate_background_snapshot()) {
+    if (!migrate_background_snapshot() && !keep_checkpoint) {
         /* caller have hold BQL or is in a bh, so there is
          * no writing race against the migration bitmap
          */
@@ -2384,7 +3040,7 @@ static void ram_save_cleanup(void *opaque)
         }
     }
 
-    ram_bitmaps_destroy();
+    ram_bitmaps_destroy(keep_checkpoint);
 
     xbzrle_cleanup();
     multifd_ram_save_cleanup();
@@ -2591,6 +3247,7 @@ void ram_postcopy_send_discard_bitmap(MigrationState *ms)
 
     /* This should be our last sync, the src is now paused */
     migration_bitmap_sync(rs, false);
+    rs->skip_hot_pages = false;
 
     /* Easiest way to make sure we don't resume in the middle of a host-page */
     rs->pss[RAM_CHANNEL_PRECOPY].last_sent_block = NULL;
@@ -2702,6 +3359,9 @@ static bool ram_state_init(RAMState **rsp, Error **errp)
     qemu_mutex_init(&(*rsp)->bitmap_mutex);
     qemu_mutex_init(&(*rsp)->src_page_req_mutex);
     QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
+    qemu_mutex_init(&(*rsp)->wp_mutex);
+    qemu_cond_init(&(*rsp)->wp_cond);
+    QSIMPLEQ_INIT(&(*rsp)->wp_copies);
     (*rsp)->ram_bytes_total = ram_bytes_total();
 
     /*
@@ -2715,7 +3375,7 @@ static bool ram_state_init(RAMState **rsp, Error **errp)
     return true;
 }
 
-static void ram_list_init_bitmaps(void)
+static void ram_list_init_bitmaps(RAMState *rs)
 {
     MigrationState *ms = migrate_get_current();
     RAMBlock *block;
@@ -2747,9 +3407,25 @@ static void ram_list_init_bitmaps(void)
              * guest memory.
              */
             block->bmap = bitmap_new(pages);
-            bitmap_set(block->bmap, 0, pages);
-            if (migrate_mapped_ram()) {
-                block->file_bmap = bitmap_new(pages);
+            if (ram_checkpoint.incremental && block->file_bmap) {
+                /*
+                 * The file has the last checkpoint, only the pages
+                 * dirtied since then need to be written.
+                 */
+                rs->migration_dirty_pages -=
+                    block->used_length >> TARGET_PAGE_BITS;
+            } else {
+                bitmap_set(block->bmap, 0, pages);
+                if (migrate_mapped_ram()) {
+                    block->file_bmap = bitmap_new(pages);
+                }
+            }
+            if (migrate_defer_hot_pages()) {
+                unsigned long regions =
+                    DIV_ROUND_UP(pages, 1UL << DIRTY_HEAT_SHIFT);
+
+                block->dirty_heat_bmap = bitmap_new(regions);
+                block->dirty_heat = g_new0(uint8_t, regions);
             }
             block->clear_bmap_shift = shift;
             block->clear_bmap = bitmap_new(clear_bmap_size(pages, shift));
@@ -2774,10 +3450,17 @@ static bool ram_init_bitmaps(RAMState *rs, Error **errp)
 {
     bool ret = true;
 
+    ram_checkpoint.incremental = ram_checkpoint.next_filename &&
+        ram_checkpoint_matches(ram_checkpoint.next_filename,
+                               ram_checkpoint.next_offset);
+    if (!ram_checkpoint.incremental) {
+        ram_checkpoint_discard();
+    }
+
     qemu_mutex_lock_ramlist();
 
     WITH_RCU_READ_LOCK_GUARD() {
-        ram_list_init_bitmaps();
+        ram_list_init_bitmaps(rs);
         /* We don't use dirty log with background snapshots */
         if (!migrate_background_snapshot()) {
             ret = memory_global_dirty_log_start(GLOBAL_DIRTY_MIGRATION, errp);
@@ -2791,7 +3474,7 @@ out_unlock:
     qemu_mutex_unlock_ramlist();
 
     if (!ret) {
-        ram_bitmaps_destroy();
+        ram_bitmaps_destroy(false);
         return false;
     }
 
@@ -2984,6 +3667,15 @@ static bool mapped_ram_read_header(QEMUFile *file, MappedRamHeader *header,
     return true;
 }
 
+static int ram_save_prepare(void *opaque, Error **errp)
+{
+    /* Set again by the file transport if the migration goes to a file */
+    g_free(ram_checkpoint.next_filename);
+    ram_checkpoint.next_filename = NULL;
+
+    return 0;
+}
+
 /*
  * Each of ram_save_setup, ram_save_iterate and ram_save_complete has
  * long-running RCU critical section.  When rcu-reclaims in the code
@@ -3037,7 +3729,15 @@ static int ram_save_setup(QEMUFile *f, void *opaque, Error **errp)
             }
 
             if (migrate_mapped_ram()) {
+                uint64_t pages_offset = block->pages_offset;
+
                 mapped_ram_setup_ramblock(f, block);
+                if (ram_checkpoint.incremental &&
+                    !migrate_ram_is_ignored(block) &&
+                    block->pages_offset != pages_offset) {
+                    trace_ram_checkpoint_reset(block->idstr);
+                    ramblock_checkpoint_reset(*rsp, block);
+                }
             }
         }
     }
@@ -3101,10 +3801,13 @@ static void ram_save_file_bmap(QEMUFile *f)
         /*
          * Free the bitmap here to catch any synchronization issues
          * with multifd channels. No channels should be sending pages
-         * after we've written the bitmap to file.
+         * after we've written the bitmap to file.  Incremental
+         * checkpoints keep it for the next one.
          */
-        g_free(block->file_bmap);
-        block->file_bmap = NULL;
+        if (!migrate_incremental_checkpoint()) {
+            g_free(block->file_bmap);
+            block->file_bmap = NULL;
+        }
     }
 }
 
@@ -3276,6 +3979,9 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
                 return pages;
             }
         }
+        if (migrate_background_snapshot()) {
+            ram_wp_flush_copies(rs, &rs->pss[RAM_CHANNEL_PRECOPY]);
+        }
         qemu_mutex_unlock(&rs->bitmap_mutex);
 
         ret = rdma_registration_stop(f, RAM_CONTROL_FINISH);
@@ -3302,6 +4008,16 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         }
     }
 
+    /*
+     * COLO keeps using the multifd channels after the migration: the
+     * secondary must have received all the pages of a checkpoint before
+     * it applies its RAM cache.
+     */
+    if (migrate_colo() && migrate_multifd() &&
+        !migrate_multifd_flush_after_each_section()) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_FLUSH);
+    }
+
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
     return qemu_fflush(f);
 }
@@ -3963,6 +4679,332 @@ err:
     return false;
 }
 
+/*
+ * Lazy restore from a mapped-ram file: the RAM blocks are registered with
+ * userfaultfd as for postcopy, and the postcopy fault thread loads the
+ * pages that the guest touches from the file instead of requesting them
+ * from the source (see postcopy_request_page()), while a background
+ * thread loads all the others.
+ */
+typedef struct {
+    /* Channel on the migration file, for reading pages at any offset */
+    QIOChannel *ioc;
+    QemuThread thread;
+    bool have_thread;
+    /* Serializes placing pages between the fault and the load thread */
+    QemuMutex lock;
+    /* Read buffers of the fault and the load thread */
+    uint8_t *fault_buf;
+    uint8_t *load_buf;
+    size_t buf_size;
+    /* Tells the load thread to stop */
+    bool quit;
+    /* Below fields are protected by the BQL */
+    bool loaded;
+    bool vm_started;
+} RAMLazyRestore;
+
+static RAMLazyRestore *lazy_restore;
+
+/*
+ * Load the host pages of @block in [@start, @start + @len) that were not
+ * placed yet, reading them from the file through @buf.  Discarded pages
+ * are never in the file; they are only populated (with zeroes) when
+ * @fault is set, i.e. when they are accessed.
+ *
+ * Returns 0 for success or -errno on error.
+ */
+static int ram_lazy_restore_load(MigrationIncomingState *mis, RAMBlock *block,
+                                 ram_addr_t start, size_t len, uint8_t *buf,
+                                 bool fault, Error **errp)
+{
+    size_t pagesize = qemu_ram_pagesize(block);
+    unsigned long first = start >> TARGET_PAGE_BITS;
+    unsigned long last = (start + len) >> TARGET_PAGE_BITS;
+    ram_addr_t offset;
+    ssize_t read;
+    int ret;
+
+    assert(len <= lazy_restore->buf_size);
+    assert(QEMU_IS_ALIGNED(start | len, pagesize));
+
+    /* Pages that are not in the file are zero, no need to read those */
+    if (find_next_bit(block->file_bmap, last, first) < last) {
+        read = qio_channel_pread(lazy_restore->ioc, (char *)buf, len,
+                                 block->pages_offset + start, errp);
+        if (read != len) {
+            if (read >= 0) {
+                error_setg(errp, "short read (%zd bytes)", read);
+            }
+            error_prepend(errp, "(%s) failed to read pages " RAM_ADDR_FMT
+                          " from file offset %" PRIx64 ": ", block->idstr,
+                          start, block->pages_offset + start);
+            return -EIO;
+        }
+    }
+
+    for (offset = start; offset < start + len; offset += pagesize) {
+        unsigned long page = offset >> TARGET_PAGE_BITS;
+        unsigned long end = (offset + pagesize) >> TARGET_PAGE_BITS;
+        void *host = host_from_ram_block_offset(block, offset);
+        uint8_t *from = buf + (offset - start);
+        unsigned long i;
+
+        QEMU_LOCK_GUARD(&lazy_restore->lock);
+
+        if (ramblock_recv_bitmap_test_byte_offset(block, offset)) {
+            continue;
+        }
+
+        if (ramblock_page_is_discarded(block, offset)) {
+            if (!fault) {
+                continue;
+            }
+            ret = postcopy_place_page_zero(mis, host, block);
+        } else if (find_next_bit(block->file_bmap, end, page) >= end) {
+            ret = postcopy_place_page_zero(mis, host, block);
+        } else {
+            /*
+             * Pages that became zero are only cleared in the bitmap, the
+             * file may still have their old content.
+             */
+            for (i = find_next_zero_bit(block->file_bmap, end, page);
+                 i < end;
+                 i = find_next_zero_bit(block->file_bmap, end, i + 1)) {
+                memset(from + ((i - page) << TARGET_PAGE_BITS), 0,
+                       TARGET_PAGE_SIZE);
+            }
+            ret = postcopy_place_page(mis, host, from, block);
+        }
+        if (ret) {
+            error_setg_errno(errp, -ret, "(%s) failed to place page "
+                             RAM_ADDR_FMT, block->idstr, offset);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Called by the postcopy fault thread, instead of asking the source, to
+ * load pages that are waited for by the guest or by a device.
+ *
+ * Returns 0 for success or -errno on error.
+ */
+int ram_lazy_restore_request_pages(MigrationIncomingState *mis, RAMBlock *rb,
+                                   ram_addr_t start, size_t len)
+{
+    Error *local_err = NULL;
+    size_t size;
+    int ret = 0;
+
+    trace_ram_lazy_restore_request_pages(rb->idstr, start, len);
+
+    while (len && !ret) {
+        size = MIN(len, lazy_restore->buf_size);
+        ret = ram_lazy_restore_load(mis, rb, start, size,
+                                    lazy_restore->fault_buf, true,
+                                    &local_err);
+        start += size;
+        len -= size;
+    }
+    if (ret) {
+        error_report_err(local_err);
+    }
+
+    return ret;
+}
+
+static int ram_lazy_restore_block(MigrationIncomingState *mis,
+                                  RAMBlock *block, Error **errp)
+{
+    unsigned long host_pages = qemu_ram_pagesize(block) >> TARGET_PAGE_BITS;
+    unsigned long max_pages = lazy_restore->buf_size >> TARGET_PAGE_BITS;
+    unsigned long pages = block->postcopy_length >> TARGET_PAGE_BITS;
+    unsigned long start, end;
+    int ret;
+
+    /*
+     * Load runs of pages that were not placed yet; the fault thread may
+     * place some concurrently, they are skipped when the run is placed.
+     */
+    for (start = find_first_zero_bit(block->receivedmap, pages);
+         start < pages;
+         start = find_next_zero_bit(block->receivedmap, pages, end)) {
+        if (qatomic_read(&lazy_restore->quit)) {
+            return 0;
+        }
+
+        start = QEMU_ALIGN_DOWN(start, host_pages);
+        end = find_next_bit(block->receivedmap, pages, start);
+        end = MIN(QEMU_ALIGN_UP(end, host_pages), start + max_pages);
+
+        ret = ram_lazy_restore_load(mis, block, start << TARGET_PAGE_BITS,
+                                    (end - start) << TARGET_PAGE_BITS,
+                                    lazy_restore->load_buf, false, errp);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static void ram_lazy_restore_loaded_bh(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+
+    /* The incoming migration may have failed in the meantime */
+    if (!lazy_restore) {
+        return;
+    }
+
+    trace_ram_lazy_restore_loaded(lazy_restore->vm_started);
+    lazy_restore->loaded = true;
+    if (lazy_restore->vm_started) {
+        migration_incoming_complete(mis);
+    }
+}
+
+static void *ram_lazy_restore_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    Error *local_err = NULL;
+    RAMBlock *block;
+    int ret = 0;
+
+    rcu_register_thread();
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            ret = ram_lazy_restore_block(mis, block, &local_err);
+            if (ret) {
+                break;
+            }
+        }
+    }
+
+    if (ret) {
+        /*
+         * The guest may be running already, and the file is the only
+         * copy of the rest of its memory; like a postcopy failure that
+         * can't be recovered, there's nothing better to do than exit.
+         */
+        error_report_err(local_err);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!qatomic_read(&lazy_restore->quit)) {
+        migration_bh_schedule(ram_lazy_restore_loaded_bh, mis);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Start the lazy restore, once the RAM blocks have been parsed: from now
+ * on, RAM is only loaded when accessed or by the load thread.
+ */
+static int ram_lazy_restore_start(MigrationIncomingState *mis, Error **errp)
+{
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (!block->file_bmap) {
+            error_setg(errp, "RAM block %s is not in the migration file",
+                       block->idstr);
+            return -EINVAL;
+        }
+    }
+
+    trace_ram_lazy_restore_start();
+
+    lazy_restore = g_new0(RAMLazyRestore, 1);
+    qemu_mutex_init(&lazy_restore->lock);
+    lazy_restore->buf_size = ROUND_UP(MAPPED_RAM_LOAD_BUF_SIZE,
+                                      mis->largest_page_size);
+    lazy_restore->fault_buf = qemu_memalign(qemu_real_host_page_size(),
+                                            lazy_restore->buf_size);
+    lazy_restore->load_buf = qemu_memalign(qemu_real_host_page_size(),
+                                           lazy_restore->buf_size);
+
+    lazy_restore->ioc = file_open_incoming_channel(errp);
+    if (!lazy_restore->ioc) {
+        return -EINVAL;
+    }
+
+    if (postcopy_notify(POSTCOPY_NOTIFY_INBOUND_ADVISE, errp)) {
+        return -EINVAL;
+    }
+
+    /*
+     * Empty RAM so that every access faults until the page is loaded;
+     * then sensitise it exactly like postcopy does on LISTEN.
+     */
+    if (postcopy_ram_incoming_init(mis) ||
+        postcopy_ram_incoming_setup(mis)) {
+        error_setg(errp, "Failed to register RAM with userfaultfd");
+        return -EINVAL;
+    }
+
+    if (postcopy_notify(POSTCOPY_NOTIFY_INBOUND_LISTEN, errp)) {
+        return -EINVAL;
+    }
+
+    qemu_thread_create(&lazy_restore->thread, "mig/dst/lazy",
+                       ram_lazy_restore_thread, mis, QEMU_THREAD_JOINABLE);
+    lazy_restore->have_thread = true;
+
+    return 0;
+}
+
+/*
+ * Called once the guest state is loaded and the guest was started.
+ * Returns true if RAM is still being loaded, in which case the incoming
+ * migration completes at the end of that.
+ */
+bool ram_lazy_restore_wait_loaded(void)
+{
+    if (!lazy_restore || lazy_restore->loaded) {
+        return false;
+    }
+
+    lazy_restore->vm_started = true;
+    return true;
+}
+
+void ram_lazy_restore_cleanup(MigrationIncomingState *mis)
+{
+    RAMBlock *block;
+
+    if (!lazy_restore) {
+        return;
+    }
+
+    if (lazy_restore->have_thread) {
+        qatomic_set(&lazy_restore->quit, true);
+        qemu_thread_join(&lazy_restore->thread);
+    }
+
+    postcopy_ram_incoming_cleanup(mis);
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+    }
+
+    if (lazy_restore->ioc) {
+        object_unref(OBJECT(lazy_restore->ioc));
+    }
+    qemu_vfree(lazy_restore->fault_buf);
+    qemu_vfree(lazy_restore->load_buf);
+    qemu_mutex_destroy(&lazy_restore->lock);
+    g_free(lazy_restore);
+    lazy_restore = NULL;
+}
+
 static void parse_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
                                       ram_addr_t length, Error **errp)
 {
@@ -4000,7 +5042,11 @@ static void parse_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
         return;
     }
 
-    if (!read_ramblock_mapped_ram(f, block, num_pages, bitmap, errp)) {
+    if (migrate_lazy_restore()) {
+        /* Pages are loaded later, see ram_lazy_restore_start() */
+        g_free(block->file_bmap);
+        block->file_bmap = g_steal_pointer(&bitmap);
+    } else if (!read_ramblock_mapped_ram(f, block, num_pages, bitmap, errp)) {
         return;
     }
 
@@ -4061,7 +5107,8 @@ static int parse_ramblock(QEMUFile *f, RAMBlock *block, ram_addr_t length)
     }
     if (migrate_ignore_shared()) {
         hwaddr addr = qemu_get_be64(f);
-        if (migrate_ram_is_ignored(block) &&
+        if ((migrate_ram_is_ignored(block) ||
+             ramblock_is_template_clone(block)) &&
             block->mr->addr != addr) {
             error_report("Mismatched GPAs for block %s "
                          "%" PRId64 "!= %" PRId64, block->idstr,
@@ -4214,6 +5261,14 @@ static int ram_load_precopy(QEMUFile *f)
             if (migrate_mapped_ram()) {
                 multifd_recv_sync_main();
             }
+            if (!ret && migrate_lazy_restore()) {
+                Error *local_err = NULL;
+
+                ret = ram_lazy_restore_start(mis, &local_err);
+                if (ret) {
+                    error_report_err(local_err);
+                }
+            }
             break;
 
         case RAM_SAVE_FLAG_ZERO:
@@ -4469,6 +5524,7 @@ void postcopy_preempt_shutdown_file(MigrationState *s)
 }
 
 static SaveVMHandlers savevm_ram_handlers = {
+    .save_prepare = ram_save_prepare,
     .save_setup = ram_save_setup,
     .save_live_iterate = ram_save_iterate,
     .save_live_complete_postcopy = ram_save_complete,
@@ -4510,6 +5566,12 @@ static void ram_mig_ram_block_resized(RAMBlockNotifier *n, void *host,
         error_setg(&err, "RAM block '%s' resized during precopy.", rb->idstr);
         migration_cancel(err);
         error_free(err);
+    } else {
+        /*
+         * The kept file bitmaps and the layout of the checkpoint file
+         * are for the old size: the next checkpoint must be a full one.
+         */
+        ram_checkpoint_discard();
     }
 
     switch (ps) {
@@ -59,6 +59,11 @@ void ram_postcopy_send_discard_bitmap(MigrationState *ms);
 int ram_discard_range(const char *block_name, uint64_t start, size_t length);
 int ram_postcopy_incoming_init(MigrationIncomingState *mis);
 int ram_load_postcopy(QEMUFile *f, int channel);
+/* For lazy restore from a mapped-ram file */
+int ram_lazy_restore_request_pages(MigrationIncomingState *mis, RAMBlock *rb,
+                                   ram_addr_t start, size_t len);
+bool ram_lazy_restore_wait_loaded(void);
+void ram_lazy_restore_cleanup(MigrationIncomingState *mis);
 
 void ram_handle_zero(void *host, uint64_t size);
 
@@ -78,6 +83,8 @@ void postcopy_preempt_shutdown_file(MigrationState *s);
 void *postcopy_preempt_thread(void *opaque);
 void ramblock_set_file_bmap_atomic(RAMBlock *block, ram_addr_t offset,
                                    bool set);
+bool ram_checkpoint_prepare(const char *filename, uint64_t offset);
+void ram_checkpoint_discard(void);
 
 /* ram cache */
 int colo_init_ram_cache(void);
@@ -92,5 +99,7 @@ bool ram_write_tracking_compatible(void);
 void ram_write_tracking_prepare(void);
 int ram_write_tracking_start(void);
 void ram_write_tracking_stop(void);
+int ram_write_tracking_release(RAMBlock *block, ram_addr_t *offset,
+                               uint32_t num);
 
 #endif
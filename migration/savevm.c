@@ -216,6 +216,18 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+    /*
+     * Statistics used to predict the switchover downtime, see
+     * qemu_savevm_state_downtime_estimate().
+     */
+    /* bytes reported by the last state_pending_{estimate,exact} call */
+    uint64_t pending_bytes;
+    /* bytes written and time (us) spent iterating in this migration */
+    uint64_t iterate_bytes;
+    int64_t iterate_time;
+    /* bytes written and time (us) spent by the last switchover save */
+    uint64_t complete_bytes;
+    int64_t complete_time;
 } SaveStateEntry;
 
 typedef struct SaveState {
@@ -1323,6 +1335,10 @@ int qemu_savevm_state_setup(QEMUFile *f, Error **errp)
 
     trace_savevm_state_setup();
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        se->pending_bytes = 0;
+        se->iterate_bytes = 0;
+        se->iterate_time = 0;
+
         if (se->vmsd && se->vmsd->early_setup) {
             ret = vmstate_save(f, se, ms->vmdesc, errp);
             if (ret) {
@@ -1394,6 +1410,8 @@ int qemu_savevm_state_iterate(QEMUFile *f, bool postcopy)
 {
     SaveStateEntry *se;
     bool all_finished = true;
+    uint64_t start_bytes;
+    int64_t start_ts;
     int ret;
 
     trace_savevm_state_iterate();
@@ -1424,11 +1442,15 @@ int qemu_savevm_state_iterate(QEMUFile *f, bool postcopy)
         }
         trace_savevm_section_start(se->idstr, se->section_id);
 
+        start_bytes = qemu_file_transferred(f);
+        start_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         save_section_header(f, se, QEMU_VM_SECTION_PART);
 
         ret = se->ops->save_live_iterate(f, se->opaque);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         save_section_footer(f, se);
+        se->iterate_bytes += qemu_file_transferred(f) - start_bytes;
+        se->iterate_time += qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_ts;
 
         if (ret < 0) {
             error_report("failed to save SaveStateEntry with id(name): "
@@ -1493,6 +1515,7 @@ static
 int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 {
     int64_t start_ts_each, end_ts_each;
+    uint64_t start_bytes;
     SaveStateEntry *se;
     int ret;
 
@@ -1511,6 +1534,7 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
         }
 
         start_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        start_bytes = qemu_file_transferred(f);
         trace_savevm_section_start(se->idstr, se->section_id);
 
         save_section_header(f, se, QEMU_VM_SECTION_END);
@@ -1523,6 +1547,8 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
             return -1;
         }
         end_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        se->complete_bytes = qemu_file_transferred(f) - start_bytes;
+        se->complete_time = end_ts_each - start_ts_each;
         trace_vmstate_downtime_save("iterable", se->idstr, se->instance_id,
                                     end_ts_each - start_ts_each);
     }
@@ -1538,6 +1564,7 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
 {
     MigrationState *ms = migrate_get_current();
     int64_t start_ts_each, end_ts_each;
+    uint64_t start_bytes;
     JSONWriter *vmdesc = ms->vmdesc;
     int vmdesc_len;
     SaveStateEntry *se;
@@ -1551,6 +1578,7 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         }
 
         start_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        start_bytes = qemu_file_transferred(f);
 
         ret = vmstate_save(f, se, vmdesc, &local_err);
         if (ret) {
@@ -1561,6 +1589,8 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         }
 
         end_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        se->complete_bytes = qemu_file_transferred(f) - start_bytes;
+        se->complete_time = end_ts_each - start_ts_each;
         trace_vmstate_downtime_save("non-iterable", se->idstr, se->instance_id,
                                     end_ts_each - start_ts_each);
     }
@@ -1646,6 +1676,7 @@ void qemu_savevm_state_pending_estimate(uint64_t *must_precopy,
                                         uint64_t *can_postcopy)
 {
     SaveStateEntry *se;
+    uint64_t pending;
 
     *must_precopy = 0;
     *can_postcopy = 0;
@@ -1659,7 +1690,9 @@ void qemu_savevm_state_pending_estimate(uint64_t *must_precopy,
                 continue;
             }
         }
+        pending = *must_precopy + *can_postcopy;
         se->ops->state_pending_estimate(se->opaque, must_precopy, can_postcopy);
+        se->pending_bytes = *must_precopy + *can_postcopy - pending;
     }
 }
 
@@ -1667,6 +1700,7 @@ void qemu_savevm_state_pending_exact(uint64_t *must_precopy,
                                      uint64_t *can_postcopy)
 {
     SaveStateEntry *se;
+    uint64_t pending;
 
     *must_precopy = 0;
     *can_postcopy = 0;
@@ -1680,8 +1714,97 @@ void qemu_savevm_state_pending_exact(uint64_t *must_precopy,
                 continue;
             }
         }
+        pending = *must_precopy + *can_postcopy;
         se->ops->state_pending_exact(se->opaque, must_precopy, can_postcopy);
+        se->pending_bytes = *must_precopy + *can_postcopy - pending;
+    }
+}
+
+/*
+ * Whether @se has state that is only saved at switchover, when the VM is
+ * stopped, without being iterated first.
+ */
+static bool qemu_savevm_se_non_iterable(SaveStateEntry *se)
+{
+    if (se->vmsd) {
+        return !se->vmsd->early_setup;
+    }
+    return se->ops && se->ops->save_state;
+}
+
+static bool qemu_savevm_se_iterable(SaveStateEntry *se)
+{
+    if (!se->ops || !se->ops->save_live_complete_precopy) {
+        return false;
+    }
+    return !se->ops->is_active || se->ops->is_active(se->opaque);
+}
+
+/*
+ * Predict how long the switchover takes for each state section, given
+ * the expected @bandwidth in bytes per ms:
+ *
+ * - iterable sections (RAM, VFIO, ...) send what they report as pending;
+ *   when iterating showed that a section produces data slower than the
+ *   link can carry it (e.g. device state read from a VFIO device), its
+ *   own rate is used instead;
+ * - non-iterable sections are only saved at switchover, and are assumed
+ *   to be as large and as slow to save as the last time they were saved;
+ *   before the first save they are not accounted.
+ *
+ * Returns the time in ms on top of sending the pending data of the
+ * iterable sections at @bandwidth, which is already accounted by the
+ * caller.  If @breakdown is not NULL, it is filled with the sections that
+ * are iterable or expected to take at least a millisecond.
+ */
+uint64_t
+qemu_savevm_state_downtime_estimate(double bandwidth,
+                                    DowntimeBreakdownEntryList **breakdown)
+{
+    DowntimeBreakdownEntryList **tail = breakdown;
+    SaveStateEntry *se;
+    double extra = 0;
+
+    if (bandwidth <= 0) {
+        return 0;
     }
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        bool iterable = qemu_savevm_se_iterable(se);
+        uint64_t bytes;
+        double link_ms, time_ms;
+
+        if (iterable) {
+            bytes = se->pending_bytes;
+            link_ms = bytes / bandwidth;
+            time_ms = link_ms;
+            if (!se->is_ram && se->iterate_bytes && se->iterate_time) {
+                double own_ms = (double)bytes * se->iterate_time /
+                                se->iterate_bytes / 1000;
+
+                time_ms = MAX(time_ms, own_ms);
+            }
+            extra += time_ms - link_ms;
+        } else if (qemu_savevm_se_non_iterable(se)) {
+            bytes = se->complete_bytes;
+            time_ms = MAX(bytes / bandwidth, se->complete_time / 1000.0);
+            extra += time_ms;
+        } else {
+            continue;
+        }
+
+        if (tail && (iterable || time_ms >= 1)) {
+            DowntimeBreakdownEntry *e = g_new0(DowntimeBreakdownEntry, 1);
+
+            e->name = g_strdup(se->idstr);
+            e->instance_id = se->instance_id;
+            e->size = bytes;
+            e->time = time_ms;
+            QAPI_LIST_APPEND(tail, e);
+        }
+    }
+
+    return extra;
 }
 
 void qemu_savevm_state_cleanup(void)
@@ -2225,7 +2348,8 @@ static gboolean postcopy_sync_page_req(gpointer key, gpointer value,
         return FALSE;
     }
 
-    ret = migrate_send_rp_message_req_pages(mis, rb, rb_offset);
+    ret = migrate_send_rp_message_req_pages(mis, rb, rb_offset,
+                                            qemu_ram_pagesize(rb));
     if (ret) {
         /* Please refer to above comment. */
         error_report("%s: send rp message failed for addr %p",
@@ -29,6 +29,17 @@
 #include "qemu/memalign.h"
 
 
+/*
+ * Memory area registered with the kernel, which the frames of the queues
+ * are taken from.  With shared-umem=on, all queues of a netdev share one,
+ * each using its own range of frames.
+ */
+typedef struct AFXDPUmem {
+    struct xsk_umem      *umem;
+    char                 *buffer;
+    unsigned int         refcount;
+} AFXDPUmem;
+
 typedef struct AFXDPState {
     NetClientState       nc;
 
@@ -47,25 +58,43 @@ typedef struct AFXDPState {
     uint64_t             *pool;
     uint32_t             n_pool;
     char                 *buffer;
-    struct xsk_umem      *umem;
+    AFXDPUmem            *umem;
 
     uint32_t             n_queues;
     uint32_t             xdp_flags;
     bool                 inhibit;
+    bool                 busy_poll;
 } AFXDPState;
 
 #define AF_XDP_BATCH_SIZE 64
 
+/* Frames of a queue, enough for all 4 rings (rx, tx, cq, fq) to be full */
+#define AF_XDP_QUEUE_FRAMES ((XSK_RING_PROD__DEFAULT_NUM_DESCS \
+                              + XSK_RING_CONS__DEFAULT_NUM_DESCS) * 2)
+
 static void af_xdp_send(void *opaque);
 static void af_xdp_writable(void *opaque);
+static bool af_xdp_rx_poll(void *opaque);
+
+/* The event loop in which the af-xdp backend is processed. */
+static AioContext *af_xdp_get_aio_context(AFXDPState *s)
+{
+    return s->nc.aio_context ? s->nc.aio_context : iohandler_get_aio_context();
+}
 
-/* Set the event-loop handlers for the af-xdp backend. */
+/*
+ * Set the event-loop handlers for the af-xdp backend.  The Rx ring can be
+ * polled without a system call, so that an IOThread with polling enabled
+ * does not have to sleep in ppoll() while the peer is sending.
+ */
 static void af_xdp_update_fd_handler(AFXDPState *s)
 {
-    qemu_set_fd_handler(xsk_socket__fd(s->xsk),
-                        s->read_poll ? af_xdp_send : NULL,
-                        s->write_poll ? af_xdp_writable : NULL,
-                        s);
+    aio_set_fd_handler(af_xdp_get_aio_context(s), xsk_socket__fd(s->xsk),
+                       s->read_poll ? af_xdp_send : NULL,
+                       s->write_poll ? af_xdp_writable : NULL,
+                       s->read_poll ? af_xdp_rx_poll : NULL,
+                       s->read_poll ? af_xdp_send : NULL,
+                       s);
 }
 
 /* Update the read handler. */
@@ -97,6 +126,23 @@ static void af_xdp_poll(NetClientState *nc, bool enable)
     }
 }
 
+/* Move the event-loop handlers to @ctx, or to the main loop if NULL. */
+static void af_xdp_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    aio_set_fd_handler(af_xdp_get_aio_context(s), xsk_socket__fd(s->xsk),
+                       NULL, NULL, NULL, NULL, NULL);
+    s->nc.aio_context = ctx;
+    af_xdp_update_fd_handler(s);
+}
+
+/* Make the kernel process the Tx ring. */
+static void af_xdp_kick_tx(AFXDPState *s)
+{
+    sendto(xsk_socket__fd(s->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+}
+
 static void af_xdp_complete_tx(AFXDPState *s)
 {
     uint32_t idx = 0;
@@ -124,6 +170,15 @@ static void af_xdp_writable(void *opaque)
 {
     AFXDPState *s = opaque;
 
+    /*
+     * With busy polling, the kernel may only complete transmissions when
+     * the socket is used.  The socket is always writable, so kick it
+     * rather than spin on it.
+     */
+    if (s->busy_poll && s->outstanding_tx) {
+        af_xdp_kick_tx(s);
+    }
+
     /* Try to recover buffers that are already sent. */
     af_xdp_complete_tx(s);
 
@@ -139,10 +194,11 @@ static void af_xdp_writable(void *opaque)
     qemu_flush_queued_packets(&s->nc);
 }
 
-static ssize_t af_xdp_receive(NetClientState *nc,
-                              const uint8_t *buf, size_t size)
+static ssize_t af_xdp_receive_iov(NetClientState *nc,
+                                  const struct iovec *iov, int iovcnt)
 {
     AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    size_t size = iov_size(iov, iovcnt);
     struct xdp_desc *desc;
     uint32_t idx;
     void *data;
@@ -168,13 +224,17 @@ static ssize_t af_xdp_receive(NetClientState *nc,
     desc->addr = s->pool[--s->n_pool];
     desc->len = size;
 
+    /* Copy straight from the peer's buffers to the umem frame. */
     data = xsk_umem__get_data(s->buffer, desc->addr);
-    memcpy(data, buf, size);
+    iov_to_buf(iov, iovcnt, 0, data, size);
 
     xsk_ring_prod__submit(&s->tx, 1);
     s->outstanding_tx++;
 
-    if (xsk_ring_prod__needs_wakeup(&s->tx)) {
+    if (s->busy_poll) {
+        /* With busy polling, transmission is driven by the socket calls. */
+        af_xdp_kick_tx(s);
+    } else if (xsk_ring_prod__needs_wakeup(&s->tx)) {
         af_xdp_write_poll(s, true);
     }
 
@@ -216,6 +276,27 @@ static void af_xdp_fq_refill(AFXDPState *s, uint32_t n)
     }
 }
 
+/*
+ * The io_poll() callback: check the Rx ring for packets.  With busy polling,
+ * the kernel only processes the device queue when the socket is used, so
+ * give it a kick whenever the ring is empty.
+ */
+static bool af_xdp_rx_poll(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    if (xsk_cons_nb_avail(&s->rx, 1)) {
+        return true;
+    }
+
+    if (s->busy_poll) {
+        recvfrom(xsk_socket__fd(s->xsk), NULL, 0, MSG_DONTWAIT, NULL, NULL);
+        return xsk_cons_nb_avail(&s->rx, 1);
+    }
+
+    return false;
+}
+
 static void af_xdp_send(void *opaque)
 {
     uint32_t i, n_rx, idx = 0;
@@ -257,6 +338,18 @@ static void af_xdp_send(void *opaque)
     af_xdp_fq_refill(s, AF_XDP_BATCH_SIZE);
 }
 
+/* Free the umem once no socket uses it anymore. */
+static void af_xdp_umem_unref(AFXDPUmem *umem)
+{
+    if (!umem || --umem->refcount) {
+        return;
+    }
+
+    xsk_umem__delete(umem->umem);
+    qemu_vfree(umem->buffer);
+    g_free(umem);
+}
+
 /* Flush and close. */
 static void af_xdp_cleanup(NetClientState *nc)
 {
@@ -270,9 +363,8 @@ static void af_xdp_cleanup(NetClientState *nc)
     s->xsk = NULL;
     g_free(s->pool);
     s->pool = NULL;
-    xsk_umem__delete(s->umem);
+    af_xdp_umem_unref(s->umem);
     s->umem = NULL;
-    qemu_vfree(s->buffer);
     s->buffer = NULL;
 
     /* Remove the program if it's the last open queue. */
@@ -284,7 +376,14 @@ static void af_xdp_cleanup(NetClientState *nc)
     }
 }
 
-static int af_xdp_umem_create(AFXDPState *s, int sock_fd, Error **errp)
+/*
+ * Create the umem of queue @s, or use @shared, the umem of the first queue,
+ * and fill the pool with the frames of the queue.  With @n_shared queues
+ * using the umem, queue i owns frames [i * AF_XDP_QUEUE_FRAMES,
+ * (i + 1) * AF_XDP_QUEUE_FRAMES).
+ */
+static int af_xdp_umem_create(AFXDPState *s, int sock_fd, AFXDPUmem *shared,
+                              uint32_t n_shared, Error **errp)
 {
     struct xsk_umem_config config = {
         .fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
@@ -292,47 +391,73 @@ static int af_xdp_umem_create(AFXDPState *s, int sock_fd, Error **errp)
         .frame_size = XSK_UMEM__DEFAULT_FRAME_SIZE,
         .frame_headroom = 0,
     };
-    uint64_t n_descs;
+    uint64_t first = 0;
     uint64_t size;
     int64_t i;
     int ret;
 
-    /* Number of descriptors if all 4 queues (rx, tx, cq, fq) are full. */
-    n_descs = (XSK_RING_PROD__DEFAULT_NUM_DESCS
-               + XSK_RING_CONS__DEFAULT_NUM_DESCS) * 2;
-    size = n_descs * XSK_UMEM__DEFAULT_FRAME_SIZE;
+    if (shared) {
+        s->umem = shared;
+        s->umem->refcount++;
+        first = (uint64_t)s->nc.queue_index * AF_XDP_QUEUE_FRAMES;
+        goto fill_pool;
+    }
+
+    size = (uint64_t)AF_XDP_QUEUE_FRAMES * MAX(n_shared, 1)
+           * XSK_UMEM__DEFAULT_FRAME_SIZE;
 
-    s->buffer = qemu_memalign(qemu_real_host_page_size(), size);
-    memset(s->buffer, 0, size);
+    s->umem = g_new0(AFXDPUmem, 1);
+    s->umem->refcount = 1;
+    s->umem->buffer = qemu_memalign(qemu_real_host_page_size(), size);
+    memset(s->umem->buffer, 0, size);
 
     if (sock_fd < 0) {
-        ret = xsk_umem__create(&s->umem, s->buffer, size,
+        ret = xsk_umem__create(&s->umem->umem, s->umem->buffer, size,
                                &s->fq, &s->cq, &config);
     } else {
-        ret = xsk_umem__create_with_fd(&s->umem, sock_fd, s->buffer, size,
+        ret = xsk_umem__create_with_fd(&s->umem->umem, sock_fd,
+                                       s->umem->buffer, size,
                                        &s->fq, &s->cq, &config);
     }
 
     if (ret) {
-        qemu_vfree(s->buffer);
         error_setg_errno(errp, errno,
                          "failed to create umem for %s queue_index: %d",
                          s->ifname, s->nc.queue_index);
+        qemu_vfree(s->umem->buffer);
+        g_free(s->umem);
+        s->umem = NULL;
         return -1;
     }
 
-    s->pool = g_new(uint64_t, n_descs);
+fill_pool:
+    s->buffer = s->umem->buffer;
+    s->pool = g_new(uint64_t, AF_XDP_QUEUE_FRAMES);
     /* Fill the pool in the opposite order, because it's a LIFO queue. */
-    for (i = n_descs; i >= 0; i--) {
-        s->pool[i] = i * XSK_UMEM__DEFAULT_FRAME_SIZE;
+    for (i = AF_XDP_QUEUE_FRAMES - 1; i >= 0; i--) {
+        s->pool[i] = (first + i) * XSK_UMEM__DEFAULT_FRAME_SIZE;
     }
-    s->n_pool = n_descs;
-
-    af_xdp_fq_refill(s, XSK_RING_PROD__DEFAULT_NUM_DESCS);
+    s->n_pool = AF_XDP_QUEUE_FRAMES;
 
     return 0;
 }
 
+/*
+ * Create the socket of queue @s.  A socket that uses the umem of another
+ * one needs fill and completion rings of its own.
+ */
+static int af_xdp_xsk_create(AFXDPState *s, int queue_id,
+                             const struct xsk_socket_config *cfg)
+{
+    if (s->umem->refcount > 1) {
+        return xsk_socket__create_shared(&s->xsk, s->ifname, queue_id,
+                                         s->umem->umem, &s->rx, &s->tx,
+                                         &s->fq, &s->cq, cfg);
+    }
+    return xsk_socket__create(&s->xsk, s->ifname, queue_id,
+                              s->umem->umem, &s->rx, &s->tx, cfg);
+}
+
 static int af_xdp_socket_create(AFXDPState *s,
                                 const NetdevAFXDPOptions *opts, Error **errp)
 {
@@ -354,6 +479,10 @@ static int af_xdp_socket_create(AFXDPState *s,
         cfg.bind_flags |= XDP_COPY;
     }
 
+    if (opts->has_zero_copy && opts->zero_copy) {
+        cfg.bind_flags |= XDP_ZEROCOPY;
+    }
+
     queue_id = s->nc.queue_index;
     if (opts->has_start_queue && opts->start_queue > 0) {
         queue_id += opts->start_queue;
@@ -363,22 +492,19 @@ static int af_xdp_socket_create(AFXDPState *s,
         /* Specific mode requested. */
         cfg.xdp_flags |= (opts->mode == AFXDP_MODE_NATIVE)
                          ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
-        if (xsk_socket__create(&s->xsk, s->ifname, queue_id,
-                               s->umem, &s->rx, &s->tx, &cfg)) {
+        if (af_xdp_xsk_create(s, queue_id, &cfg)) {
             error = errno;
         }
     } else {
         /* No mode requested, try native first. */
         cfg.xdp_flags |= XDP_FLAGS_DRV_MODE;
 
-        if (xsk_socket__create(&s->xsk, s->ifname, queue_id,
-                               s->umem, &s->rx, &s->tx, &cfg)) {
+        if (af_xdp_xsk_create(s, queue_id, &cfg)) {
             /* Can't use native mode, try skb. */
             cfg.xdp_flags &= ~XDP_FLAGS_DRV_MODE;
             cfg.xdp_flags |= XDP_FLAGS_SKB_MODE;
 
-            if (xsk_socket__create(&s->xsk, s->ifname, queue_id,
-                                   s->umem, &s->rx, &s->tx, &cfg)) {
+            if (af_xdp_xsk_create(s, queue_id, &cfg)) {
                 error = errno;
             }
         }
@@ -393,16 +519,50 @@ static int af_xdp_socket_create(AFXDPState *s,
 
     s->xdp_flags = cfg.xdp_flags;
 
+    /* The fill ring of a socket that shares the umem only exists now. */
+    af_xdp_fq_refill(s, XSK_RING_PROD__DEFAULT_NUM_DESCS);
+
     return 0;
 }
 
+/*
+ * Let the kernel process the device queue from the socket calls instead of
+ * interrupts, for at most @usecs per call.
+ */
+static int af_xdp_busy_poll_setup(AFXDPState *s, uint32_t usecs, Error **errp)
+{
+#if defined(SO_PREFER_BUSY_POLL) && defined(SO_BUSY_POLL_BUDGET)
+    int fd = xsk_socket__fd(s->xsk);
+    int prefer = 1, timeout = usecs, budget = AF_XDP_BATCH_SIZE;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+                   &prefer, sizeof(prefer)) ||
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL,
+                   &timeout, sizeof(timeout)) ||
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET,
+                   &budget, sizeof(budget))) {
+        error_setg_errno(errp, errno,
+                         "failed to enable busy polling for %s queue_index: %d",
+                         s->ifname, s->nc.queue_index);
+        return -1;
+    }
+
+    s->busy_poll = true;
+    return 0;
+#else
+    error_setg(errp, "busy polling is not supported on this host");
+    return -1;
+#endif
+}
+
 /* NetClientInfo methods. */
 static NetClientInfo net_af_xdp_info = {
     .type = NET_CLIENT_DRIVER_AF_XDP,
     .size = sizeof(AFXDPState),
-    .receive = af_xdp_receive,
+    .receive_iov = af_xdp_receive_iov,
     .poll = af_xdp_poll,
     .cleanup = af_xdp_cleanup,
+    .set_aio_context = af_xdp_set_aio_context,
 };
 
 static int *parse_socket_fds(const char *sock_fds_str,
@@ -447,6 +607,8 @@ int net_init_af_xdp(const Netdev *netdev,
     unsigned int ifindex;
     uint32_t prog_id = 0;
     g_autofree int *sock_fds = NULL;
+    bool shared_umem = opts->has_shared_umem && opts->shared_umem;
+    AFXDPUmem *umem = NULL;
     int64_t i, queues;
     Error *err = NULL;
     AFXDPState *s;
@@ -465,11 +627,23 @@ int net_init_af_xdp(const Netdev *netdev,
         return -1;
     }
 
+    if (opts->has_force_copy && opts->force_copy &&
+        opts->has_zero_copy && opts->zero_copy) {
+        error_setg(errp, "'force-copy=on' and 'zero-copy=on' are exclusive");
+        return -1;
+    }
+
     if ((opts->has_inhibit && opts->inhibit) != !!opts->sock_fds) {
         error_setg(errp, "'inhibit=on' requires 'sock-fds' and vice versa");
         return -1;
     }
 
+    /* Sockets that share a umem are created by libxdp itself */
+    if (shared_umem && opts->sock_fds) {
+        error_setg(errp, "'shared-umem=on' and 'sock-fds' are exclusive");
+        return -1;
+    }
+
     if (opts->sock_fds) {
         sock_fds = parse_socket_fds(opts->sock_fds, queues, errp);
         if (!sock_fds) {
@@ -492,13 +666,22 @@ int net_init_af_xdp(const Netdev *netdev,
         s->ifindex = ifindex;
         s->n_queues = queues;
 
-        if (af_xdp_umem_create(s, sock_fds ? sock_fds[i] : -1, errp)
-            || af_xdp_socket_create(s, opts, errp)) {
+        if (af_xdp_umem_create(s, sock_fds ? sock_fds[i] : -1, umem,
+                               shared_umem ? queues : 1, errp)
+            || af_xdp_socket_create(s, opts, errp)
+            || (opts->has_poll_us && opts->poll_us
+                && af_xdp_busy_poll_setup(s, opts->poll_us, errp))) {
             /* Make sure the XDP program will be removed. */
             s->n_queues = i;
             error_propagate(errp, err);
             goto err;
         }
+
+        if (shared_umem) {
+            umem = s->umem;
+        }
+
+        af_xdp_read_poll(s, true); /* Initially only poll for reads. */
     }
 
     if (nc0) {
@@ -511,8 +694,6 @@ int net_init_af_xdp(const Netdev *netdev,
         }
     }
 
-    af_xdp_read_poll(s, true); /* Initially only poll for reads. */
-
     return 0;
 
 err:
@@ -27,6 +27,7 @@
 #include "net/net.h"
 #include "clients.h"
 #include "hub.h"
+#include "offload.h"
 #include "hw/qdev-properties.h"
 #include "net/slirp.h"
 #include "net/eth.h"
@@ -47,6 +48,7 @@
 #include "qemu/iov.h"
 #include "qemu/qemu-print.h"
 #include "qemu/main-loop.h"
+#include "block/aio-wait.h"
 #include "qemu/option.h"
 #include "qemu/keyval.h"
 #include "qapi/error.h"
@@ -400,6 +402,7 @@ static void qemu_free_net_client(NetClientState *nc)
     }
     g_free(nc->name);
     g_free(nc->model);
+    net_offload_free(nc->offload);
     if (nc->destructor) {
         nc->destructor(nc);
     }
@@ -505,6 +508,10 @@ bool qemu_has_ufo(NetClientState *nc)
 
 bool qemu_has_uso(NetClientState *nc)
 {
+    if (nc && nc->offload) {
+        return true;
+    }
+
     if (!nc || !nc->info->has_uso) {
         return false;
     }
@@ -514,6 +521,10 @@ bool qemu_has_uso(NetClientState *nc)
 
 bool qemu_has_vnet_hdr(NetClientState *nc)
 {
+    if (nc && nc->offload) {
+        return true;
+    }
+
     if (!nc || !nc->info->has_vnet_hdr) {
         return false;
     }
@@ -523,6 +534,12 @@ bool qemu_has_vnet_hdr(NetClientState *nc)
 
 bool qemu_has_vnet_hdr_len(NetClientState *nc, int len)
 {
+    if (nc && nc->offload) {
+        return len == sizeof(struct virtio_net_hdr_mrg_rxbuf) ||
+               len == sizeof(struct virtio_net_hdr) ||
+               len == sizeof(struct virtio_net_hdr_v1_hash);
+    }
+
     if (!nc || !nc->info->has_vnet_hdr_len) {
         return false;
     }
@@ -533,6 +550,12 @@ bool qemu_has_vnet_hdr_len(NetClientState *nc, int len)
 void qemu_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
                           int ecn, int ufo, int uso4, int uso6)
 {
+    if (nc && nc->offload) {
+        net_offload_set_offload(nc->offload, csum, tso4, tso6, ecn, ufo,
+                                uso4, uso6);
+        return;
+    }
+
     if (!nc || !nc->info->set_offload) {
         return;
     }
@@ -547,7 +570,7 @@ int qemu_get_vnet_hdr_len(NetClientState *nc)
 
 void qemu_set_vnet_hdr_len(NetClientState *nc, int len)
 {
-    if (!nc || !nc->info->set_vnet_hdr_len) {
+    if (!nc || (!nc->offload && !nc->info->set_vnet_hdr_len)) {
         return;
     }
 
@@ -556,7 +579,9 @@ void qemu_set_vnet_hdr_len(NetClientState *nc, int len)
            len == sizeof(struct virtio_net_hdr_v1_hash));
 
     nc->vnet_hdr_len = len;
-    nc->info->set_vnet_hdr_len(nc, len);
+    if (nc->info->set_vnet_hdr_len) {
+        nc->info->set_vnet_hdr_len(nc, len);
+    }
 }
 
 int qemu_set_vnet_le(NetClientState *nc, bool is_le)
@@ -585,6 +610,26 @@ int qemu_set_vnet_be(NetClientState *nc, bool is_be)
 #endif
 }
 
+/*
+ * Move the processing of @nc to @ctx, or back to the main loop if @ctx is
+ * NULL.  The caller must make sure that nothing runs in the previous
+ * context on behalf of @nc while this is done.
+ */
+void qemu_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    if (!nc || nc->aio_context == ctx) {
+        return;
+    }
+
+    if (nc->info->set_aio_context) {
+        nc->info->set_aio_context(nc, ctx);
+    }
+    if (nc->offload) {
+        net_offload_set_aio_context(nc->offload, ctx);
+    }
+    nc->aio_context = ctx;
+}
+
 int qemu_can_receive_packet(NetClientState *nc)
 {
     if (nc->receive_disabled) {
@@ -732,6 +777,15 @@ ssize_t qemu_send_packet_async(NetClientState *sender,
                                const uint8_t *buf, int size,
                                NetPacketSent *sent_cb)
 {
+    if (sender->offload && sender->vnet_hdr_len) {
+        struct iovec iov = {
+            .iov_base = (void *)buf,
+            .iov_len = size,
+        };
+
+        return net_offload_send_iov(sender->offload, &iov, 1, sent_cb);
+    }
+
     return qemu_send_packet_async_with_flags(sender, QEMU_NET_PACKET_FLAG_NONE,
                                              buf, size, sent_cb);
 }
@@ -760,10 +814,42 @@ ssize_t qemu_receive_packet_iov(NetClientState *nc, const struct iovec *iov,
     return qemu_net_queue_receive_iov(nc->incoming_queue, iov, iovcnt);
 }
 
+typedef struct NetSendRawData {
+    NetClientState *nc;
+    const uint8_t *buf;
+    int size;
+    ssize_t ret;
+} NetSendRawData;
+
+static void qemu_send_packet_raw_bh(void *opaque)
+{
+    NetSendRawData *data = opaque;
+
+    data->ret = qemu_send_packet_async_with_flags(data->nc,
+                                                  QEMU_NET_PACKET_FLAG_RAW,
+                                                  data->buf, data->size,
+                                                  NULL);
+}
+
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size)
 {
-    return qemu_send_packet_async_with_flags(nc, QEMU_NET_PACKET_FLAG_RAW,
-                                             buf, size, NULL);
+    NetSendRawData data = {
+        .nc = nc,
+        .buf = buf,
+        .size = size,
+    };
+
+    /*
+     * Raw packets such as self-announcements are sent from the main loop;
+     * if @nc is processed in an IOThread, send them from there.
+     */
+    if (nc->aio_context &&
+        nc->aio_context != qemu_get_current_aio_context()) {
+        aio_wait_bh_oneshot(nc->aio_context, qemu_send_packet_raw_bh, &data);
+    } else {
+        qemu_send_packet_raw_bh(&data);
+    }
+    return data.ret;
 }
 
 static ssize_t nc_sendv_compat(NetClientState *nc, const struct iovec *iov,
@@ -793,6 +879,16 @@ static ssize_t nc_sendv_compat(NetClientState *nc, const struct iovec *iov,
     return ret;
 }
 
+/* Delivers a packet once its virtio-net header was handled in software */
+static ssize_t qemu_offload_deliver(NetClientState *nc,
+                                    const struct iovec *iov, int iovcnt)
+{
+    if (nc->info->receive_iov) {
+        return nc->info->receive_iov(nc, iov, iovcnt);
+    }
+    return nc_sendv_compat(nc, iov, iovcnt, QEMU_NET_PACKET_FLAG_NONE);
+}
+
 static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
                                        unsigned flags,
                                        const struct iovec *iov,
@@ -830,7 +926,10 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
         iov = iov_copy;
     }
 
-    if (nc->info->receive_iov) {
+    if (nc->offload && nc->vnet_hdr_len) {
+        ret = net_offload_receive_iov(nc->offload, iov, iovcnt,
+                                      qemu_offload_deliver);
+    } else if (nc->info->receive_iov) {
         ret = nc->info->receive_iov(nc, iov, iovcnt);
     } else {
         ret = nc_sendv_compat(nc, iov, iovcnt, flags);
@@ -847,9 +946,64 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
-ssize_t qemu_sendv_packet_async(NetClientState *sender,
-                                const struct iovec *iov, int iovcnt,
-                                NetPacketSent *sent_cb)
+/*
+ * Let @sender read its next packet straight into the buffers of its peer,
+ * instead of reading it into a buffer of its own and passing it to
+ * qemu_send_packet_async(), which copies it.  This is only possible when
+ * nothing needs to see the packet on the way: no filters, no packets
+ * queued before it and no padding.
+ *
+ * Returns the number of elements of @iov that were filled, or 0 if the
+ * packet has to be sent the usual way.  Otherwise, the caller must call
+ * qemu_receive_direct_end() once it has written the packet, including the
+ * vnet header if any, to @iov.
+ */
+int qemu_receive_direct_begin(NetClientState *sender, struct iovec *iov,
+                              int iovcnt)
+{
+    NetClientState *peer = sender->peer;
+
+    if (!peer || !peer->info->receive_direct_begin || sender->offload ||
+        sender->link_down || peer->link_down ||
+        !QTAILQ_EMPTY(&sender->filters) || !QTAILQ_EMPTY(&peer->filters) ||
+        net_peer_needs_padding(sender) ||
+        !qemu_net_queue_is_empty(peer->incoming_queue) ||
+        !qemu_can_send_packet(sender)) {
+        return 0;
+    }
+
+    return peer->info->receive_direct_begin(peer, iov, iovcnt);
+}
+
+/*
+ * Complete a qemu_receive_direct_begin() with the @size of the packet, or
+ * a negative value to give the buffers back, e.g. if no packet could be
+ * read.  A packet that does not fit in the buffers must be sent the usual
+ * way instead: the peer would drop it.
+ */
+void qemu_receive_direct_end(NetClientState *sender, ssize_t size)
+{
+    NetClientState *peer = sender->peer;
+    MemReentrancyGuard *owned_reentrancy_guard = NULL;
+
+    if (peer->info->type == NET_CLIENT_DRIVER_NIC &&
+        !qemu_get_nic(peer)->reentrancy_guard->engaged_in_io) {
+        owned_reentrancy_guard = qemu_get_nic(peer)->reentrancy_guard;
+        owned_reentrancy_guard->engaged_in_io = true;
+    }
+
+    peer->info->receive_direct_end(peer, size);
+
+    if (owned_reentrancy_guard) {
+        owned_reentrancy_guard->engaged_in_io = false;
+    }
+}
+
+static ssize_t qemu_sendv_packet_async_with_flags(NetClientState *sender,
+                                                  unsigned flags,
+                                                  const struct iovec *iov,
+                                                  int iovcnt,
+                                                  NetPacketSent *sent_cb)
 {
     NetQueue *queue;
     size_t size = iov_size(iov, iovcnt);
@@ -865,24 +1019,46 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
 
     /* Let filters handle the packet first */
     ret = filter_receive_iov(sender, NET_FILTER_DIRECTION_TX, sender,
-                             QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, sent_cb);
+                             flags, iov, iovcnt, sent_cb);
     if (ret) {
         return ret;
     }
 
     ret = filter_receive_iov(sender->peer, NET_FILTER_DIRECTION_RX, sender,
-                             QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, sent_cb);
+                             flags, iov, iovcnt, sent_cb);
     if (ret) {
         return ret;
     }
 
     queue = sender->peer->incoming_queue;
 
-    return qemu_net_queue_send_iov(queue, sender,
-                                   QEMU_NET_PACKET_FLAG_NONE,
+    return qemu_net_queue_send_iov(queue, sender, flags,
                                    iov, iovcnt, sent_cb);
 }
 
+/* Sends a packet whose virtio-net header was added in software */
+static ssize_t qemu_offload_send(NetClientState *sender,
+                                 const struct iovec *iov, int iovcnt,
+                                 NetPacketSent *sent_cb)
+{
+    return qemu_sendv_packet_async_with_flags(sender,
+                                              QEMU_NET_PACKET_FLAG_NONE,
+                                              iov, iovcnt, sent_cb);
+}
+
+ssize_t qemu_sendv_packet_async(NetClientState *sender,
+                                const struct iovec *iov, int iovcnt,
+                                NetPacketSent *sent_cb)
+{
+    if (sender->offload && sender->vnet_hdr_len) {
+        return net_offload_send_iov(sender->offload, iov, iovcnt, sent_cb);
+    }
+
+    return qemu_sendv_packet_async_with_flags(sender,
+                                              QEMU_NET_PACKET_FLAG_NONE,
+                                              iov, iovcnt, sent_cb);
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
@@ -1280,6 +1456,35 @@ static int (* const net_client_init_fun[NET_CLIENT_DRIVER__MAX])(
 };
 
 
+/* Whether the offload option of @netdev asks for software offloads */
+static bool netdev_sw_offload(const Netdev *netdev)
+{
+    switch (netdev->type) {
+    case NET_CLIENT_DRIVER_SOCKET:
+        return netdev->u.socket.has_offload && netdev->u.socket.offload;
+    case NET_CLIENT_DRIVER_STREAM:
+        return netdev->u.stream.has_offload && netdev->u.stream.offload;
+    case NET_CLIENT_DRIVER_DGRAM:
+        return netdev->u.dgram.has_offload && netdev->u.dgram.offload;
+#ifdef CONFIG_L2TPV3
+    case NET_CLIENT_DRIVER_L2TPV3:
+        return netdev->u.l2tpv3.has_offload && netdev->u.l2tpv3.offload;
+#endif
+#ifdef CONFIG_AF_XDP
+    case NET_CLIENT_DRIVER_AF_XDP:
+        return netdev->u.af_xdp.has_offload && netdev->u.af_xdp.offload;
+#endif
+    default:
+        return false;
+    }
+}
+
+static void qemu_enable_sw_offload(NetClientState *nc)
+{
+    assert(!nc->offload && !nc->info->has_vnet_hdr);
+    nc->offload = net_offload_new(nc, qemu_offload_send);
+}
+
 static int net_client_init1(const Netdev *netdev, bool is_netdev, Error **errp)
 {
     NetClientState *peer = NULL;
@@ -1334,6 +1539,18 @@ static int net_client_init1(const Netdev *netdev, bool is_netdev, Error **errp)
         nc = qemu_find_netdev(netdev->id);
         assert(nc);
         nc->is_netdev = true;
+
+        if (netdev_sw_offload(netdev)) {
+            NetClientState *ncs[MAX_QUEUE_NUM];
+            int queues, i;
+
+            queues = qemu_find_net_clients_except(netdev->id, ncs,
+                                                  NET_CLIENT_DRIVER_NIC,
+                                                  MAX_QUEUE_NUM);
+            for (i = 0; i < queues; i++) {
+                qemu_enable_sw_offload(ncs[i]);
+            }
+        }
     }
 
     return 0;
@@ -0,0 +1,669 @@
+/*
+ * Software offloads for net clients without virtio-net header support
+ *
+ * Backends such as socket, stream, dgram, l2tpv3 or af-xdp can only carry
+ * Ethernet frames that fit the MTU.  With offload=on, the net layer
+ * pretends that they support virtio-net headers, so that guests can keep
+ * checksum offload, TSO and USO enabled, and does the work at the
+ * boundary of the backend instead:
+ *
+ * - packets that the backend receives from its peer have their checksum
+ *   completed, and GSO packets are split with the same NetTxPkt helpers
+ *   that e1000e, igb and vmxnet3 use when their peer has no offloads;
+ *
+ * - TCP segments that the backend sends to its peer are coalesced into
+ *   GSO packets, much like virtio-net does for RSC, when the peer accepts
+ *   them.  Each burst of segments is flushed from a bottom half, i.e.
+ *   once the backend is done with its current event.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "block/aio.h"
+#include "net/checksum.h"
+#include "net/eth.h"
+#include "hw/net/net_tx_pkt.h"
+#include "standard-headers/linux/virtio_net.h"
+#include "offload.h"
+#include "trace.h"
+
+/* Same as VIRTQUEUE_MAX_SIZE, the most a virtio-net device can send */
+#define NET_OFFLOAD_MAX_FRAGS 1024
+
+#define NET_OFFLOAD_GRO_FLOWS 8
+
+/* Coalesced frames leave room for the longest virtio-net header */
+#define NET_OFFLOAD_FRAME_OFFSET sizeof(struct virtio_net_hdr_v1_hash)
+
+/* Enough to tell a packet from another by its headers */
+#define NET_OFFLOAD_RESUME_LEN 128
+
+typedef struct NetOffloadFlow {
+    uint8_t *buf;               /* virtio-net header and coalesced frame */
+    size_t size;                /* size of the frame, 0 if unused */
+    uint16_t proto;
+    size_t tcp_off;
+    size_t tcp_hdrlen;
+    uint32_t next_seq;
+    size_t mss;                 /* payload of the first segment */
+    size_t last;                /* payload of the last segment */
+    unsigned int segments;
+    uint16_t ip_id;             /* IPv4 ID of the first segment */
+    bool ip_id_fixed;           /* all segments have the same IPv4 ID */
+} NetOffloadFlow;
+
+/* A TCP segment that is a candidate for coalescing */
+typedef struct NetOffloadUnit {
+    uint16_t proto;
+    const uint8_t *ip;
+    const struct tcp_header *tcp;
+    size_t tcp_off;
+    size_t tcp_hdrlen;
+    size_t size;                /* size of the frame without padding */
+    size_t payload;
+    uint8_t flags;
+} NetOffloadUnit;
+
+typedef struct NetOffloadSegments {
+    NetClientState *nc;
+    NetOffloadDeliver *deliver;
+    unsigned int index;
+    unsigned int skip;
+    bool blocked;
+} NetOffloadSegments;
+
+struct NetOffloadState {
+    NetClientState *nc;
+    NetOffloadSend *send;
+
+    /* Packets from the peer: checksum and segmentation */
+    struct NetTxPkt *seg_pkt;
+    struct iovec seg_iov[NET_OFFLOAD_MAX_FRAGS];
+    uint8_t *seg_buf;
+    struct {
+        unsigned int done;      /* segments accepted by the client */
+        size_t size;
+        uint8_t head[NET_OFFLOAD_RESUME_LEN];
+    } seg_resume;
+
+    /* Packets to the peer: receive coalescing */
+    bool gro4;
+    bool gro6;
+    uint8_t *gro_buf;
+    NetOffloadFlow flows[NET_OFFLOAD_GRO_FLOWS];
+    unsigned int gro_held;
+    QEMUBH *flush_bh;
+};
+
+static void net_offload_free_frag(void *opaque, void *base, size_t len)
+{
+    /* Fragments belong to the caller of net_offload_receive_iov() */
+}
+
+/* A checksum without segmentation is done on a copy of the packet */
+static ssize_t net_offload_checksum(NetOffloadState *s, int iovcnt,
+                                    const struct virtio_net_hdr *hdr,
+                                    NetOffloadDeliver *deliver)
+{
+    struct iovec iov = { .iov_base = s->seg_buf };
+    size_t csum_off = hdr->csum_start + hdr->csum_offset;
+    uint16_t csum;
+
+    iov.iov_len = iov_to_buf(s->seg_iov, iovcnt, 0, s->seg_buf, NET_BUFSIZE);
+    if (hdr->csum_start > iov.iov_len ||
+        csum_off + sizeof(csum) > iov.iov_len) {
+        trace_net_offload_drop(s->nc, iov.iov_len);
+        return iov.iov_len;
+    }
+
+    /* The checksum field already holds the sum of the pseudo-header */
+    csum = net_checksum_finish_nozero(
+        net_checksum_add(iov.iov_len - hdr->csum_start,
+                         s->seg_buf + hdr->csum_start));
+    stw_be_p(s->seg_buf + csum_off, csum);
+
+    return deliver(s->nc, &iov, 1);
+}
+
+static void net_offload_deliver_segment(void *opaque,
+                                        const struct iovec *iov, int iovcnt,
+                                        const struct iovec *virt_iov,
+                                        int virt_iovcnt)
+{
+    NetOffloadSegments *segs = opaque;
+
+    if (segs->blocked) {
+        return;
+    }
+
+    if (segs->index >= segs->skip && !segs->deliver(segs->nc, iov, iovcnt)) {
+        segs->blocked = true;
+        return;
+    }
+    segs->index++;
+}
+
+static bool net_offload_resume_matches(NetOffloadState *s,
+                                       const struct iovec *iov, int iovcnt,
+                                       size_t size)
+{
+    uint8_t head[NET_OFFLOAD_RESUME_LEN];
+    size_t len = iov_to_buf(iov, iovcnt, 0, head, sizeof(head));
+
+    return s->seg_resume.size == size && !memcmp(head, s->seg_resume.head, len);
+}
+
+/*
+ * Pass a packet with virtio-net header, as sent by the peer, to the net
+ * client through @deliver.
+ *
+ * If the client cannot take a segment, 0 is returned and the net queue
+ * will pass the same packet again once the client is ready; the segments
+ * that were accepted before are not sent a second time.  This is needed
+ * for clients, like stream, that keep a partially sent segment around.
+ */
+ssize_t net_offload_receive_iov(NetOffloadState *s, const struct iovec *iov,
+                                int iovcnt, NetOffloadDeliver *deliver)
+{
+    NetClientState *nc = s->nc;
+    size_t hdr_len = nc->vnet_hdr_len;
+    size_t size = iov_size(iov, iovcnt);
+    NetOffloadSegments segs = {
+        .nc = nc,
+        .deliver = deliver,
+    };
+    struct virtio_net_hdr hdr;
+    uint8_t gso_type;
+    bool ok;
+    int cnt, i;
+
+    if (!hdr_len) {
+        return deliver(nc, iov, iovcnt);
+    }
+
+    if (size < hdr_len) {
+        return size;
+    }
+
+    if (s->seg_resume.done &&
+        !net_offload_resume_matches(s, iov, iovcnt, size)) {
+        /* The packet was purged before all its segments could be sent */
+        s->seg_resume.done = 0;
+    }
+
+    iov_to_buf(iov, iovcnt, 0, &hdr, sizeof(hdr));
+    cnt = iov_copy(s->seg_iov, NET_OFFLOAD_MAX_FRAGS, iov, iovcnt,
+                   hdr_len, size - hdr_len);
+    if (iov_size(s->seg_iov, cnt) != size - hdr_len) {
+        trace_net_offload_drop(nc, size);
+        return size;
+    }
+
+    gso_type = hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+    if (gso_type == VIRTIO_NET_HDR_GSO_NONE) {
+        if (hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+            return net_offload_checksum(s, cnt, &hdr, deliver);
+        }
+        return deliver(nc, s->seg_iov, cnt);
+    }
+
+    net_tx_pkt_reset(s->seg_pkt, net_offload_free_frag, NULL);
+    for (i = 0; i < cnt; i++) {
+        net_tx_pkt_add_raw_fragment(s->seg_pkt, s->seg_iov[i].iov_base,
+                                    s->seg_iov[i].iov_len);
+    }
+
+    ok = hdr.gso_size && net_tx_pkt_parse(s->seg_pkt);
+    if (ok) {
+        switch (gso_type) {
+        case VIRTIO_NET_HDR_GSO_TCPV4:
+        case VIRTIO_NET_HDR_GSO_TCPV6:
+            ok = net_tx_pkt_build_vheader(s->seg_pkt, true, true,
+                                          hdr.gso_size) &&
+                 (net_tx_pkt_get_vhdr(s->seg_pkt)->gso_type &
+                  ~VIRTIO_NET_HDR_GSO_ECN) == gso_type;
+            break;
+        case VIRTIO_NET_HDR_GSO_UDP_L4:
+            ok = net_tx_pkt_build_vheader_uso(s->seg_pkt, hdr.gso_size);
+            break;
+        default:
+            ok = false;
+            break;
+        }
+    }
+
+    segs.skip = s->seg_resume.done;
+    if (!ok || !net_tx_pkt_send_custom(s->seg_pkt, false,
+                                       net_offload_deliver_segment, &segs)) {
+        trace_net_offload_drop(nc, size);
+        s->seg_resume.done = 0;
+        return size;
+    }
+
+    if (segs.blocked) {
+        trace_net_offload_blocked(nc, segs.index);
+        s->seg_resume.done = segs.index;
+        s->seg_resume.size = size;
+        iov_to_buf(iov, iovcnt, 0, s->seg_resume.head,
+                   sizeof(s->seg_resume.head));
+        return 0;
+    }
+
+    s->seg_resume.done = 0;
+    return size;
+}
+
+static ssize_t net_offload_send_plain(NetOffloadState *s,
+                                      const uint8_t *buf, size_t size,
+                                      NetPacketSent *sent_cb)
+{
+    struct virtio_net_hdr_v1_hash hdr = { };
+    struct iovec iov[] = {
+        {
+            .iov_base = &hdr,
+            .iov_len = s->nc->vnet_hdr_len,
+        }, {
+            .iov_base = (void *)buf,
+            .iov_len = size,
+        },
+    };
+
+    return s->send(s->nc, iov, ARRAY_SIZE(iov), sent_cb);
+}
+
+static void net_offload_flush(NetOffloadState *s, NetOffloadFlow *flow)
+{
+    size_t hdr_len = s->nc->vnet_hdr_len;
+    uint8_t *frame = flow->buf + NET_OFFLOAD_FRAME_OFFSET;
+    struct virtio_net_hdr *hdr = (void *)(frame - hdr_len);
+    struct iovec iov = {
+        .iov_base = hdr,
+        .iov_len = hdr_len + flow->size,
+    };
+
+    /* Segments were only coalesced if their checksum was right */
+    memset(hdr, 0, hdr_len);
+    hdr->flags = VIRTIO_NET_HDR_F_DATA_VALID;
+    if (flow->segments > 1) {
+        hdr->gso_size = flow->mss;
+        hdr->hdr_len = flow->tcp_off + flow->tcp_hdrlen;
+        if (flow->proto == ETH_P_IP) {
+            hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+            eth_fix_ip4_checksum(frame + ETH_HLEN, sizeof(struct ip_header));
+        } else {
+            hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+        }
+    }
+
+    trace_net_offload_gro_flush(s->nc, flow->segments, flow->size);
+    flow->size = 0;
+    s->gro_held--;
+
+    s->send(s->nc, &iov, 1, NULL);
+}
+
+static void net_offload_flush_all(NetOffloadState *s)
+{
+    int i;
+
+    for (i = 0; i < NET_OFFLOAD_GRO_FLOWS && s->gro_held; i++) {
+        if (s->flows[i].size) {
+            net_offload_flush(s, &s->flows[i]);
+        }
+    }
+}
+
+static void net_offload_flush_bh(void *opaque)
+{
+    net_offload_flush_all(opaque);
+}
+
+/* Fill @unit if @buf is a TCP segment that coalescing may apply to */
+static bool net_offload_gro_parse(NetOffloadState *s,
+                                  const uint8_t *buf, size_t size,
+                                  NetOffloadUnit *unit)
+{
+    const uint8_t *l3 = buf + ETH_HLEN;
+    size_t ip_hdrlen, l3_len;
+
+    if (size < ETH_HLEN + sizeof(struct ip_header) +
+               sizeof(struct tcp_header)) {
+        return false;
+    }
+
+    unit->proto = lduw_be_p(&PKT_GET_ETH_HDR(buf)->h_proto);
+    switch (unit->proto) {
+    case ETH_P_IP: {
+        const struct ip_header *ip = (const struct ip_header *)l3;
+
+        /* Options and fragments are left alone, like in virtio-net RSC */
+        if (!qatomic_read(&s->gro4) ||
+            ip->ip_ver_len != ((IP_HEADER_VERSION_4 << 4) |
+                               (sizeof(struct ip_header) >> 2)) ||
+            ip->ip_p != IP_PROTO_TCP ||
+            (lduw_be_p(&ip->ip_off) & (IP_MF | IP_OFFMASK)) ||
+            IPTOS_ECN(ip->ip_tos) == IPTOS_ECN_CE) {
+            return false;
+        }
+        ip_hdrlen = sizeof(struct ip_header);
+        l3_len = lduw_be_p(&ip->ip_len);
+        break;
+    }
+    case ETH_P_IPV6: {
+        const struct ip6_header *ip6 = (const struct ip6_header *)l3;
+
+        /* Extension headers are left alone, like in virtio-net RSC */
+        if (!qatomic_read(&s->gro6) ||
+            size < ETH_HLEN + sizeof(struct ip6_header) +
+                   sizeof(struct tcp_header) ||
+            (l3[0] >> 4) != IP_HEADER_VERSION_6 ||
+            ip6->ip6_nxt != IP_PROTO_TCP ||
+            IP6_ECN(ip6->ip6_ecn_acc) == IP6_ECN_CE) {
+            return false;
+        }
+        ip_hdrlen = sizeof(struct ip6_header);
+        l3_len = ip_hdrlen + lduw_be_p(&ip6->ip6_plen);
+        break;
+    }
+    default:
+        return false;
+    }
+
+    if (l3_len > size - ETH_HLEN ||
+        l3_len < ip_hdrlen + sizeof(struct tcp_header)) {
+        return false;
+    }
+
+    unit->ip = l3;
+    unit->tcp_off = ETH_HLEN + ip_hdrlen;
+    unit->tcp = (const struct tcp_header *)(buf + unit->tcp_off);
+    unit->tcp_hdrlen = TCP_HEADER_DATA_OFFSET(unit->tcp);
+    if (unit->tcp_hdrlen < sizeof(struct tcp_header) ||
+        unit->tcp_hdrlen > l3_len - ip_hdrlen) {
+        return false;
+    }
+
+    unit->size = ETH_HLEN + l3_len;
+    unit->payload = l3_len - ip_hdrlen - unit->tcp_hdrlen;
+    unit->flags = lduw_be_p(&unit->tcp->th_offset_flags) & 0xff;
+    return true;
+}
+
+static bool net_offload_gro_csum_ok(const NetOffloadUnit *unit)
+{
+    size_t len = unit->size - unit->tcp_off;
+    uint32_t sum, cso;
+
+    if (unit->proto == ETH_P_IP) {
+        sum = eth_calc_ip4_pseudo_hdr_csum((struct ip_header *)unit->ip,
+                                           len, &cso);
+    } else {
+        sum = eth_calc_ip6_pseudo_hdr_csum((struct ip6_header *)unit->ip,
+                                           len, IP_PROTO_TCP, &cso);
+    }
+    sum += net_checksum_add(len, (uint8_t *)unit->tcp);
+
+    return net_checksum_finish(sum) == 0;
+}
+
+static NetOffloadFlow *net_offload_gro_lookup(NetOffloadState *s,
+                                              const uint8_t *buf,
+                                              const NetOffloadUnit *unit)
+{
+    size_t addr_off, addr_len;
+    int i;
+
+    if (unit->proto == ETH_P_IP) {
+        addr_off = ETH_HLEN + offsetof(struct ip_header, ip_src);
+        addr_len = 2 * sizeof(uint32_t);
+    } else {
+        addr_off = ETH_HLEN + offsetof(struct ip6_header, ip6_src);
+        addr_len = 2 * sizeof(struct in6_address);
+    }
+
+    for (i = 0; i < NET_OFFLOAD_GRO_FLOWS; i++) {
+        NetOffloadFlow *flow = &s->flows[i];
+        const uint8_t *frame = flow->buf + NET_OFFLOAD_FRAME_OFFSET;
+
+        /* Same MAC and IP addresses, same TCP ports */
+        if (flow->size && flow->proto == unit->proto &&
+            !memcmp(frame, buf, ETH_HLEN) &&
+            !memcmp(frame + addr_off, buf + addr_off, addr_len) &&
+            !memcmp(frame + flow->tcp_off, unit->tcp,
+                    2 * sizeof(uint16_t))) {
+            return flow;
+        }
+    }
+    return NULL;
+}
+
+static bool net_offload_gro_merge(NetOffloadFlow *flow,
+                                  const NetOffloadUnit *unit)
+{
+    uint8_t *frame = flow->buf + NET_OFFLOAD_FRAME_OFFSET;
+    uint8_t *ip = frame + ETH_HLEN;
+    struct tcp_header *tcp = (struct tcp_header *)(frame + flow->tcp_off);
+    size_t l3_len = flow->size - ETH_HLEN;
+
+    /*
+     * As in Linux GRO, only in-order segments with the same headers are
+     * coalesced, and all of them but the last must have the same size.
+     */
+    if (ldl_be_p(&unit->tcp->th_seq) != flow->next_seq ||
+        ldl_be_p(&unit->tcp->th_ack) != ldl_be_p(&tcp->th_ack) ||
+        unit->tcp_hdrlen != flow->tcp_hdrlen ||
+        memcmp(unit->tcp + 1, tcp + 1,
+               flow->tcp_hdrlen - sizeof(struct tcp_header)) ||
+        flow->last != flow->mss || unit->payload > flow->mss ||
+        l3_len + unit->payload > ETH_MAX_IP_DGRAM_LEN) {
+        return false;
+    }
+
+    if (flow->proto == ETH_P_IP) {
+        const struct ip_header *o_ip = (const struct ip_header *)ip;
+        const struct ip_header *n_ip = (const struct ip_header *)unit->ip;
+        uint16_t ip_off = lduw_be_p(&n_ip->ip_off);
+        uint16_t id_delta = lduw_be_p(&n_ip->ip_id) - flow->ip_id;
+        bool fixed_id = !id_delta && (ip_off & IP_DF);
+
+        /*
+         * The ID must go up by one with each segment, or, if DF is set,
+         * stay the same for the whole flow.
+         */
+        if (o_ip->ip_tos != n_ip->ip_tos || o_ip->ip_ttl != n_ip->ip_ttl ||
+            ((ip_off ^ lduw_be_p(&o_ip->ip_off)) & IP_DF) ||
+            (!fixed_id && id_delta != flow->segments) ||
+            (flow->segments > 1 && fixed_id != flow->ip_id_fixed)) {
+            return false;
+        }
+        flow->ip_id_fixed = fixed_id;
+        stw_be_p(ip + offsetof(struct ip_header, ip_len),
+                 l3_len + unit->payload);
+    } else {
+        const struct ip6_header *o_ip6 = (const struct ip6_header *)ip;
+        const struct ip6_header *n_ip6 = (const struct ip6_header *)unit->ip;
+
+        if (memcmp(ip, unit->ip, sizeof(uint32_t)) ||
+            o_ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim !=
+            n_ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim) {
+            return false;
+        }
+        stw_be_p(ip + offsetof(struct ip6_header, ip6_plen),
+                 l3_len - sizeof(struct ip6_header) + unit->payload);
+    }
+
+    memcpy(frame + flow->size,
+           (const uint8_t *)unit->tcp + unit->tcp_hdrlen, unit->payload);
+    flow->size += unit->payload;
+    flow->next_seq += unit->payload;
+    flow->last = unit->payload;
+    flow->segments++;
+
+    /* The coalesced segment carries the latest window and PSH flag */
+    tcp->th_win = unit->tcp->th_win;
+    if (unit->flags & TH_PUSH) {
+        stw_be_p(&tcp->th_offset_flags,
+                 lduw_be_p(&tcp->th_offset_flags) | TH_PUSH);
+    }
+    return true;
+}
+
+static void net_offload_gro_hold(NetOffloadState *s, NetOffloadFlow *flow,
+                                 const uint8_t *buf,
+                                 const NetOffloadUnit *unit)
+{
+    if (!flow->buf) {
+        flow->buf = g_malloc(NET_BUFSIZE);
+    }
+
+    memcpy(flow->buf + NET_OFFLOAD_FRAME_OFFSET, buf, unit->size);
+    flow->size = unit->size;
+    flow->proto = unit->proto;
+    flow->tcp_off = unit->tcp_off;
+    flow->tcp_hdrlen = unit->tcp_hdrlen;
+    flow->next_seq = ldl_be_p(&unit->tcp->th_seq) + unit->payload;
+    flow->mss = unit->payload;
+    flow->last = unit->payload;
+    flow->segments = 1;
+    flow->ip_id = unit->proto == ETH_P_IP ?
+        lduw_be_p(&((const struct ip_header *)unit->ip)->ip_id) : 0;
+    flow->ip_id_fixed = false;
+
+    s->gro_held++;
+    qemu_bh_schedule(s->flush_bh);
+}
+
+static ssize_t net_offload_gro(NetOffloadState *s,
+                               const uint8_t *buf, size_t size,
+                               NetPacketSent *sent_cb)
+{
+    NetOffloadUnit unit;
+    NetOffloadFlow *flow;
+    int i;
+
+    if (!net_offload_gro_parse(s, buf, size, &unit)) {
+        return net_offload_send_plain(s, buf, size, sent_cb);
+    }
+
+    flow = net_offload_gro_lookup(s, buf, &unit);
+
+    if (!unit.payload ||
+        (unit.flags & (TH_SYN | TH_FIN | TH_RST | TH_URG | TH_ECE | TH_CWR)) ||
+        !net_offload_gro_csum_ok(&unit)) {
+        /* Keep the segments of the flow in order */
+        if (flow) {
+            net_offload_flush(s, flow);
+        }
+        return net_offload_send_plain(s, buf, size, sent_cb);
+    }
+
+    if (flow) {
+        if (net_offload_gro_merge(flow, &unit)) {
+            if (unit.flags & TH_PUSH) {
+                net_offload_flush(s, flow);
+            }
+            return size;
+        }
+        net_offload_flush(s, flow);
+    } else if (unit.flags & TH_PUSH) {
+        return net_offload_send_plain(s, buf, size, sent_cb);
+    } else {
+        for (i = 0; i < NET_OFFLOAD_GRO_FLOWS; i++) {
+            if (!s->flows[i].size) {
+                break;
+            }
+        }
+        if (i == NET_OFFLOAD_GRO_FLOWS) {
+            net_offload_flush_all(s);
+            i = 0;
+        }
+        flow = &s->flows[i];
+    }
+
+    net_offload_gro_hold(s, flow, buf, &unit);
+    return size;
+}
+
+/*
+ * Send a packet from the net client to its peer, with the virtio-net
+ * header that the peer expects.
+ */
+ssize_t net_offload_send_iov(NetOffloadState *s, const struct iovec *iov,
+                             int iovcnt, NetPacketSent *sent_cb)
+{
+    const uint8_t *buf;
+    size_t size;
+
+    if (iovcnt == 1) {
+        buf = iov->iov_base;
+        size = iov->iov_len;
+    } else {
+        size = iov_size(iov, iovcnt);
+        if (size > NET_BUFSIZE) {
+            return size;
+        }
+        iov_to_buf(iov, iovcnt, 0, s->gro_buf, size);
+        buf = s->gro_buf;
+    }
+
+    if (!qatomic_read(&s->gro4) && !qatomic_read(&s->gro6)) {
+        net_offload_flush_all(s);
+        return net_offload_send_plain(s, buf, size, sent_cb);
+    }
+
+    return net_offload_gro(s, buf, size, sent_cb);
+}
+
+/* Called with the offloads that the peer accepts in packets it receives */
+void net_offload_set_offload(NetOffloadState *s, int csum, int tso4, int tso6,
+                             int ecn, int ufo, int uso4, int uso6)
+{
+    qatomic_set(&s->gro4, csum && tso4);
+    qatomic_set(&s->gro6, csum && tso6);
+}
+
+void net_offload_set_aio_context(NetOffloadState *s, AioContext *ctx)
+{
+    qemu_bh_delete(s->flush_bh);
+    s->flush_bh = aio_bh_new(ctx ?: qemu_get_aio_context(),
+                             net_offload_flush_bh, s);
+    if (s->gro_held) {
+        qemu_bh_schedule(s->flush_bh);
+    }
+}
+
+NetOffloadState *net_offload_new(NetClientState *nc, NetOffloadSend *send)
+{
+    NetOffloadState *s = g_new0(NetOffloadState, 1);
+
+    s->nc = nc;
+    s->send = send;
+    net_tx_pkt_init(&s->seg_pkt, NET_OFFLOAD_MAX_FRAGS);
+    s->seg_buf = g_malloc(NET_BUFSIZE);
+    s->gro_buf = g_malloc(NET_BUFSIZE);
+    s->flush_bh = aio_bh_new(nc->aio_context ?: qemu_get_aio_context(),
+                             net_offload_flush_bh, s);
+    return s;
+}
+
+void net_offload_free(NetOffloadState *s)
+{
+    int i;
+
+    if (!s) {
+        return;
+    }
+
+    qemu_bh_delete(s->flush_bh);
+    for (i = 0; i < NET_OFFLOAD_GRO_FLOWS; i++) {
+        g_free(s->flows[i].buf);
+    }
+    net_tx_pkt_uninit(s->seg_pkt);
+    g_free(s->seg_buf);
+    g_free(s->gro_buf);
+    g_free(s);
+}
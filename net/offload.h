@@ -0,0 +1,32 @@
+/*
+ * Software offloads for net clients without virtio-net header support
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef NET_OFFLOAD_H
+#define NET_OFFLOAD_H
+
+#include "net/net.h"
+
+/* Passes a packet without virtio-net header to the net client itself */
+typedef ssize_t (NetOffloadDeliver)(NetClientState *nc,
+                                    const struct iovec *iov, int iovcnt);
+
+/* Sends a packet with virtio-net header from the net client to its peer */
+typedef ssize_t (NetOffloadSend)(NetClientState *nc,
+                                 const struct iovec *iov, int iovcnt,
+                                 NetPacketSent *sent_cb);
+
+NetOffloadState *net_offload_new(NetClientState *nc, NetOffloadSend *send);
+void net_offload_free(NetOffloadState *s);
+void net_offload_set_offload(NetOffloadState *s, int csum, int tso4, int tso6,
+                             int ecn, int ufo, int uso4, int uso6);
+void net_offload_set_aio_context(NetOffloadState *s, AioContext *ctx);
+ssize_t net_offload_receive_iov(NetOffloadState *s, const struct iovec *iov,
+                                int iovcnt, NetOffloadDeliver *deliver);
+ssize_t net_offload_send_iov(NetOffloadState *s, const struct iovec *iov,
+                             int iovcnt, NetPacketSent *sent_cb);
+
+#endif /* NET_OFFLOAD_H */
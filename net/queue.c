@@ -270,6 +270,11 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
     }
 }
 
+bool qemu_net_queue_is_empty(NetQueue *queue)
+{
+    return QTAILQ_EMPTY(&queue->packets);
+}
+
 bool qemu_net_queue_flush(NetQueue *queue)
 {
     if (queue->delivering)
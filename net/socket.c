@@ -48,12 +48,17 @@ typedef struct NetSocketState {
 static void net_socket_accept(void *opaque);
 static void net_socket_writable(void *opaque);
 
+static AioContext *net_socket_get_aio_context(NetSocketState *s)
+{
+    return s->nc.aio_context ? s->nc.aio_context : iohandler_get_aio_context();
+}
+
 static void net_socket_update_fd_handler(NetSocketState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll ? s->send_fn : NULL,
-                        s->write_poll ? net_socket_writable : NULL,
-                        s);
+    aio_set_fd_handler(net_socket_get_aio_context(s), s->fd,
+                       s->read_poll ? s->send_fn : NULL,
+                       s->write_poll ? net_socket_writable : NULL,
+                       NULL, NULL, s);
 }
 
 static void net_socket_read_poll(NetSocketState *s, bool enable)
@@ -319,11 +324,27 @@ static void net_socket_cleanup(NetClientState *nc)
     }
 }
 
+/*
+ * Only datagram sockets can be processed in an IOThread: stream sockets
+ * also handle connections and disconnections, which must run in the main
+ * loop.
+ */
+static void net_socket_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+
+    aio_set_fd_handler(net_socket_get_aio_context(s), s->fd, NULL, NULL, NULL,
+                       NULL, NULL);
+    s->nc.aio_context = ctx;
+    net_socket_update_fd_handler(s);
+}
+
 static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_DRIVER_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
     .cleanup = net_socket_cleanup,
+    .set_aio_context = net_socket_set_aio_context,
 };
 
 static NetSocketState *net_socket_fd_init_dgram(NetClientState *peer,
@@ -0,0 +1,456 @@
+/*
+ * TAP io_uring support
+ *
+ * Packets are received with a single multishot read, which fills buffers
+ * from a ring of provided buffers for as long as packets keep coming.
+ * Completions are reaped in batches from the AioContext of the tap queue.
+ *
+ * Packets are transmitted by copying them into one of a fixed number of
+ * write slots.  Writes are submitted with defer_call(), so that all packets
+ * sent by a peer during one flush of its queue cost a single system call.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <poll.h>
+#include <liburing.h>
+#include "block/aio.h"
+#include "net/net.h"
+#include "qapi/error.h"
+#include "qemu/defer-call.h"
+#include "qemu/iov.h"
+#include "tap_int.h"
+#include "trace.h"
+
+/*
+ * io_uring ring size, large enough for all write slots, each with a poll
+ * in front of it, plus the read
+ */
+#define TAP_URING_ENTRIES 512
+
+/* Receive buffers, each one holds a packet including the vnet header */
+#define TAP_URING_RX_BUFS 64
+#define TAP_URING_RX_BUF_SIZE NET_BUFSIZE
+#define TAP_URING_RX_BGID 0
+
+#define TAP_URING_TX_SLOTS 128
+
+/* user_data of requests that are not writes, which use their slot index */
+#define TAP_URING_RX_DATA UINT64_MAX
+#define TAP_URING_CANCEL_DATA (UINT64_MAX - 1)
+#define TAP_URING_POLL_DATA (UINT64_MAX - 2)
+
+typedef struct TapUringRxPacket {
+    uint16_t bid;
+    int size;
+} TapUringRxPacket;
+
+typedef struct TapUringTxSlot {
+    uint8_t *buf;
+    size_t buf_size;
+    size_t len;
+} TapUringTxSlot;
+
+struct TapUring {
+    int fd;
+    AioContext *ctx;
+    struct io_uring ring;
+
+    TapUringReceiveFunc *receive;
+    TapUringWritableFunc *writable;
+    void *opaque;
+
+    struct io_uring_buf_ring *rx_ring;
+    uint8_t *rx_bufs;
+    bool rx_enabled;
+    bool rx_armed;
+    bool rx_failed;
+    bool rx_wait;               /* poll before reading again */
+    bool rx_processing;
+
+    /* Packets that were read but not passed to ->receive() yet */
+    TapUringRxPacket rx_pending[TAP_URING_RX_BUFS];
+    unsigned int rx_pending_head;
+    unsigned int rx_pending_count;
+
+    TapUringTxSlot tx_slots[TAP_URING_TX_SLOTS];
+    unsigned int tx_free[TAP_URING_TX_SLOTS];
+    unsigned int tx_free_count;
+    bool tx_blocked;
+};
+
+static void tap_uring_submit(TapUring *u)
+{
+    int ret;
+
+    do {
+        ret = io_uring_submit(&u->ring);
+    } while (ret == -EINTR);
+
+    /* Requests that were not submitted are retried on the next submit */
+    trace_tap_uring_submit(u, ret);
+}
+
+static void tap_uring_deferred_fn(void *opaque)
+{
+    tap_uring_submit(opaque);
+}
+
+static struct io_uring_sqe *tap_uring_get_sqe(TapUring *u)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+
+    /* The ring has room for all write slots and for the read */
+    assert(sqe);
+    return sqe;
+}
+
+static void tap_uring_arm_rx(TapUring *u)
+{
+    struct io_uring_sqe *sqe;
+
+    if (u->rx_armed || !u->rx_enabled || u->rx_failed) {
+        return;
+    }
+
+    /*
+     * The poll completes like a read that stopped, so that the read is
+     * armed again once there is something to read.
+     */
+    sqe = tap_uring_get_sqe(u);
+    if (u->rx_wait) {
+        io_uring_prep_poll_add(sqe, u->fd, POLLIN);
+        u->rx_wait = false;
+    } else {
+        io_uring_prep_read_multishot(sqe, u->fd, 0, 0, TAP_URING_RX_BGID);
+    }
+    io_uring_sqe_set_data64(sqe, TAP_URING_RX_DATA);
+    u->rx_armed = true;
+    tap_uring_submit(u);
+}
+
+static void tap_uring_cancel_rx(TapUring *u)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!u->rx_armed) {
+        return;
+    }
+
+    sqe = tap_uring_get_sqe(u);
+    io_uring_prep_cancel64(sqe, TAP_URING_RX_DATA, 0);
+    io_uring_sqe_set_data64(sqe, TAP_URING_CANCEL_DATA);
+    tap_uring_submit(u);
+}
+
+/* Pass received packets to the peer and give their buffers back */
+static void tap_uring_process_rx(TapUring *u)
+{
+    unsigned int mask = io_uring_buf_ring_mask(TAP_URING_RX_BUFS);
+    unsigned int recycled = 0;
+
+    if (u->rx_processing) {
+        return;
+    }
+    u->rx_processing = true;
+
+    while (u->rx_enabled && u->rx_pending_count) {
+        TapUringRxPacket pkt = u->rx_pending[u->rx_pending_head];
+        uint8_t *buf = u->rx_bufs + pkt.bid * TAP_URING_RX_BUF_SIZE;
+
+        u->rx_pending_head = (u->rx_pending_head + 1) % TAP_URING_RX_BUFS;
+        u->rx_pending_count--;
+
+        u->receive(u->opaque, buf, pkt.size);
+        io_uring_buf_ring_add(u->rx_ring, buf, TAP_URING_RX_BUF_SIZE,
+                              pkt.bid, mask, recycled++);
+    }
+    if (recycled) {
+        io_uring_buf_ring_advance(u->rx_ring, recycled);
+    }
+
+    u->rx_processing = false;
+
+    /* The read stops when it runs out of buffers */
+    tap_uring_arm_rx(u);
+}
+
+static void tap_uring_rx_complete(TapUring *u, struct io_uring_cqe *cqe)
+{
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned int tail;
+
+        assert(u->rx_pending_count < TAP_URING_RX_BUFS);
+        tail = (u->rx_pending_head + u->rx_pending_count) % TAP_URING_RX_BUFS;
+        u->rx_pending[tail] = (TapUringRxPacket) {
+            .bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT,
+            .size = MAX(cqe->res, 0),
+        };
+        u->rx_pending_count++;
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        trace_tap_uring_rx_stopped(u, cqe->res);
+        u->rx_armed = false;
+
+        switch (cqe->res) {
+        case -EAGAIN:
+            /*
+             * The file is in non-blocking mode, which another process that
+             * shares it can set, e.g. the new QEMU of a cpr-transfer.
+             */
+            u->rx_wait = true;
+            break;
+        case -ENOBUFS:
+        case -ECANCELED:
+        case -EINTR:
+            break;
+        default:
+            /*
+             * Avoid spinning on a persistent error, e.g. a detached queue;
+             * reading is resumed when the queue is enabled again.
+             */
+            if (cqe->res < 0) {
+                u->rx_failed = true;
+            }
+            break;
+        }
+    }
+}
+
+static void tap_uring_prep_write(TapUring *u, unsigned int i)
+{
+    struct io_uring_sqe *sqe = tap_uring_get_sqe(u);
+
+    io_uring_prep_write(sqe, u->fd, u->tx_slots[i].buf, u->tx_slots[i].len, 0);
+    io_uring_sqe_set_data64(sqe, i);
+}
+
+static void tap_uring_tx_complete(TapUring *u, struct io_uring_cqe *cqe,
+                                  bool retry)
+{
+    unsigned int slot = cqe->user_data;
+    struct io_uring_sqe *sqe;
+
+    assert(slot < TAP_URING_TX_SLOTS);
+
+    /* Like reads, writes fail with -EAGAIN on a non-blocking file */
+    if (cqe->res == -EAGAIN && retry) {
+        sqe = tap_uring_get_sqe(u);
+        io_uring_prep_poll_add(sqe, u->fd, POLLOUT);
+        io_uring_sqe_set_data64(sqe, TAP_URING_POLL_DATA);
+        io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+        tap_uring_prep_write(u, slot);
+        defer_call(tap_uring_deferred_fn, u);
+        return;
+    }
+
+    if (cqe->res < 0) {
+        trace_tap_uring_tx_error(u, cqe->res);
+    }
+    u->tx_free[u->tx_free_count++] = slot;
+}
+
+static void tap_uring_process_completions(TapUring *u)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+    unsigned int count = 0;
+
+    io_uring_for_each_cqe(&u->ring, head, cqe) {
+        switch (cqe->user_data) {
+        case TAP_URING_RX_DATA:
+            tap_uring_rx_complete(u, cqe);
+            break;
+        case TAP_URING_CANCEL_DATA:
+        case TAP_URING_POLL_DATA:
+            break;
+        default:
+            tap_uring_tx_complete(u, cqe, true);
+            break;
+        }
+        count++;
+    }
+    io_uring_cq_advance(&u->ring, count);
+    trace_tap_uring_process_completions(u, count);
+
+    tap_uring_process_rx(u);
+
+    if (u->tx_blocked && u->tx_free_count) {
+        u->tx_blocked = false;
+        u->writable(u->opaque);
+    }
+}
+
+static void tap_uring_completion_cb(void *opaque)
+{
+    tap_uring_process_completions(opaque);
+}
+
+static bool tap_uring_poll_cb(void *opaque)
+{
+    TapUring *u = opaque;
+
+    return io_uring_cq_ready(&u->ring);
+}
+
+static void tap_uring_poll_ready(void *opaque)
+{
+    tap_uring_process_completions(opaque);
+}
+
+/*
+ * Returns the size of the packet, or 0 if all write slots are in use, in
+ * which case ->writable() is called once one is available again.
+ */
+ssize_t tap_uring_writev(TapUring *u, const struct iovec *iov, int iovcnt)
+{
+    size_t size = iov_size(iov, iovcnt);
+    TapUringTxSlot *slot;
+    unsigned int i;
+
+    if (!u->tx_free_count) {
+        u->tx_blocked = true;
+        return 0;
+    }
+
+    i = u->tx_free[--u->tx_free_count];
+    slot = &u->tx_slots[i];
+    if (slot->buf_size < size) {
+        g_free(slot->buf);
+        slot->buf = g_malloc(size);
+        slot->buf_size = size;
+    }
+    iov_to_buf(iov, iovcnt, 0, slot->buf, size);
+    slot->len = size;
+
+    tap_uring_prep_write(u, i);
+    defer_call(tap_uring_deferred_fn, u);
+
+    return size;
+}
+
+void tap_uring_set_rx_enabled(TapUring *u, bool enable)
+{
+    if (u->rx_enabled == enable) {
+        return;
+    }
+
+    u->rx_enabled = enable;
+    if (enable) {
+        u->rx_failed = false;
+        tap_uring_process_rx(u);
+    } else {
+        tap_uring_cancel_rx(u);
+    }
+}
+
+void tap_uring_set_aio_context(TapUring *u, AioContext *ctx)
+{
+    if (u->ctx) {
+        aio_set_fd_handler(u->ctx, u->ring.ring_fd, NULL, NULL, NULL, NULL,
+                           NULL);
+    }
+    u->ctx = ctx;
+    if (ctx) {
+        aio_set_fd_handler(ctx, u->ring.ring_fd, tap_uring_completion_cb,
+                           NULL, tap_uring_poll_cb, tap_uring_poll_ready, u);
+    }
+}
+
+TapUring *tap_uring_new(int fd, TapUringReceiveFunc *receive,
+                        TapUringWritableFunc *writable, void *opaque,
+                        Error **errp)
+{
+    TapUring *u = g_new0(TapUring, 1);
+    struct io_uring_probe *probe;
+    bool has_read_multishot;
+    unsigned int i;
+    int ret;
+
+    ret = io_uring_queue_init(TAP_URING_ENTRIES, &u->ring, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "failed to init linux io_uring ring");
+        g_free(u);
+        return NULL;
+    }
+
+    probe = io_uring_get_probe_ring(&u->ring);
+    has_read_multishot = probe &&
+        io_uring_opcode_supported(probe, IORING_OP_READ_MULTISHOT);
+    io_uring_free_probe(probe);
+    if (!has_read_multishot) {
+        error_setg(errp, "io_uring of the host kernel does not support "
+                   "multishot reads");
+        goto fail;
+    }
+
+    u->rx_ring = io_uring_setup_buf_ring(&u->ring, TAP_URING_RX_BUFS,
+                                         TAP_URING_RX_BGID, 0, &ret);
+    if (!u->rx_ring) {
+        error_setg_errno(errp, -ret, "failed to register io_uring buffers");
+        goto fail;
+    }
+    u->rx_bufs = g_malloc((size_t)TAP_URING_RX_BUFS * TAP_URING_RX_BUF_SIZE);
+    for (i = 0; i < TAP_URING_RX_BUFS; i++) {
+        io_uring_buf_ring_add(u->rx_ring,
+                              u->rx_bufs + i * TAP_URING_RX_BUF_SIZE,
+                              TAP_URING_RX_BUF_SIZE, i,
+                              io_uring_buf_ring_mask(TAP_URING_RX_BUFS), i);
+    }
+    io_uring_buf_ring_advance(u->rx_ring, TAP_URING_RX_BUFS);
+
+    for (i = 0; i < TAP_URING_TX_SLOTS; i++) {
+        u->tx_free[i] = TAP_URING_TX_SLOTS - 1 - i;
+    }
+    u->tx_free_count = TAP_URING_TX_SLOTS;
+
+    u->fd = fd;
+    u->receive = receive;
+    u->writable = writable;
+    u->opaque = opaque;
+    return u;
+
+fail:
+    io_uring_queue_exit(&u->ring);
+    g_free(u);
+    return NULL;
+}
+
+void tap_uring_free(TapUring *u)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int i;
+
+    tap_uring_set_aio_context(u, NULL);
+
+    /* The kernel may still access the buffers until requests complete */
+    u->rx_enabled = false;
+    tap_uring_cancel_rx(u);
+    tap_uring_submit(u);
+    while (u->rx_armed || u->tx_free_count < TAP_URING_TX_SLOTS) {
+        if (io_uring_wait_cqe(&u->ring, &cqe) < 0) {
+            break;
+        }
+        if (cqe->user_data == TAP_URING_RX_DATA) {
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                u->rx_armed = false;
+            }
+        } else if (cqe->user_data != TAP_URING_CANCEL_DATA &&
+                   cqe->user_data != TAP_URING_POLL_DATA) {
+            tap_uring_tx_complete(u, cqe, false);
+        }
+        io_uring_cqe_seen(&u->ring, cqe);
+    }
+
+    io_uring_free_buf_ring(&u->ring, u->rx_ring, TAP_URING_RX_BUFS,
+                           TAP_URING_RX_BGID);
+    io_uring_queue_exit(&u->ring);
+
+    g_free(u->rx_bufs);
+    for (i = 0; i < TAP_URING_TX_SLOTS; i++) {
+        g_free(u->tx_slots[i].buf);
+    }
+    g_free(u);
+}
@@ -35,11 +35,14 @@
 #include "net/eth.h"
 #include "net/net.h"
 #include "clients.h"
+#include "migration/cpr.h"
+#include "migration/misc.h"
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
 #include "qapi/error.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 #include "qemu/main-loop.h"
 #include "qemu/sockets.h"
 
@@ -60,22 +63,38 @@ typedef struct TAPState {
     bool has_uso;
     bool enabled;
     VHostNetState *vhost_net;
+    TapUring *uring;
     unsigned host_vnet_hdr_len;
     Notifier exit;
+    NotifierWithReturn cpr_notifier;
+    /* The new QEMU of a completed cpr-transfer owns the interface */
+    bool cpr_transferred;
 } TAPState;
 
+/* Enough for the descriptors of a guest buffer for big packets */
+#define TAP_DIRECT_MAX_IOV 64
+
 static void launch_script(const char *setup_script, const char *ifname,
                           int fd, Error **errp);
 
 static void tap_send(void *opaque);
 static void tap_writable(void *opaque);
 
+static AioContext *tap_get_aio_context(TAPState *s)
+{
+    return s->nc.aio_context ? s->nc.aio_context : iohandler_get_aio_context();
+}
+
 static void tap_update_fd_handler(TAPState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll && s->enabled ? tap_send : NULL,
-                        s->write_poll && s->enabled ? tap_writable : NULL,
-                        s);
+    if (s->uring) {
+        tap_uring_set_rx_enabled(s->uring, s->read_poll && s->enabled);
+        return;
+    }
+    aio_set_fd_handler(tap_get_aio_context(s), s->fd,
+                       s->read_poll && s->enabled ? tap_send : NULL,
+                       s->write_poll && s->enabled ? tap_writable : NULL,
+                       NULL, NULL, s);
 }
 
 static void tap_read_poll(TAPState *s, bool enable)
@@ -103,6 +122,10 @@ static ssize_t tap_write_packet(TAPState *s, const struct iovec *iov, int iovcnt
 {
     ssize_t len;
 
+    if (s->uring) {
+        return tap_uring_writev(s->uring, iov, iovcnt);
+    }
+
     len = RETRY_ON_EINTR(writev(s->fd, iov, iovcnt));
 
     if (len == -1 && errno == EAGAIN) {
@@ -156,40 +179,98 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, true);
 }
 
-static void tap_send(void *opaque)
+/* Pass a packet read from the tap device to the peer */
+static ssize_t tap_send_packet(TAPState *s, uint8_t *buf, int size)
 {
-    TAPState *s = opaque;
-    int size;
-    int packets = 0;
+    uint8_t min_pkt[ETH_ZLEN];
+    size_t min_pktsz = sizeof(min_pkt);
 
-    while (true) {
-        uint8_t *buf = s->buf;
-        uint8_t min_pkt[ETH_ZLEN];
-        size_t min_pktsz = sizeof(min_pkt);
+    if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+        buf  += s->host_vnet_hdr_len;
+        size -= s->host_vnet_hdr_len;
+    }
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
-        if (size <= 0) {
-            break;
+    if (net_peer_needs_padding(&s->nc)) {
+        if (eth_pad_short_frame(min_pkt, &min_pktsz, buf, size)) {
+            buf = min_pkt;
+            size = min_pktsz;
         }
+    }
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
-        }
+    return qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
+}
+
+/*
+ * Read the next packet straight into the buffers of the peer, if it can
+ * take it that way.  Returns false if the packet is still to be read,
+ * otherwise @size is what tap_send_packet() would return, or the error
+ * of the read.
+ */
+static bool tap_send_direct(TAPState *s, ssize_t *size)
+{
+#ifndef __sun__
+    struct iovec iov[TAP_DIRECT_MAX_IOV + 1];
+    size_t len;
+    int iovcnt;
+
+    /* The peer gets the packet exactly as it is read */
+    if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+        return false;
+    }
+
+    iovcnt = qemu_receive_direct_begin(&s->nc, iov, TAP_DIRECT_MAX_IOV);
+    if (!iovcnt) {
+        return false;
+    }
+
+    /* What does not fit in the buffers of the peer is read into s->buf */
+    len = MIN(iov_size(iov, iovcnt), sizeof(s->buf));
+    iov[iovcnt].iov_base = s->buf + len;
+    iov[iovcnt].iov_len = sizeof(s->buf) - len;
 
-        if (net_peer_needs_padding(&s->nc)) {
-            if (eth_pad_short_frame(min_pkt, &min_pktsz, buf, size)) {
-                buf = min_pkt;
-                size = min_pktsz;
+    *size = RETRY_ON_EINTR(readv(s->fd, iov, iovcnt + 1));
+    if (*size <= (ssize_t)len) {
+        qemu_receive_direct_end(&s->nc, *size);
+        return true;
+    }
+
+    /* Too large for the peer's buffers, send the packet the usual way */
+    iov_to_buf(iov, iovcnt, 0, s->buf, len);
+    qemu_receive_direct_end(&s->nc, -1);
+    *size = tap_send_packet(s, s->buf, *size);
+    if (*size == 0) {
+        tap_read_poll(s, false);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+static void tap_send(void *opaque)
+{
+    TAPState *s = opaque;
+    ssize_t size;
+    int packets = 0;
+
+    while (true) {
+        if (tap_send_direct(s, &size)) {
+            if (size <= 0) {
+                break;
+            }
+        } else {
+            size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
+            if (size <= 0) {
+                break;
             }
-        }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
-            tap_read_poll(s, false);
-            break;
-        } else if (size < 0) {
-            break;
+            size = tap_send_packet(s, s->buf, size);
+            if (size == 0) {
+                tap_read_poll(s, false);
+                break;
+            } else if (size < 0) {
+                break;
+            }
         }
 
         /*
@@ -205,6 +286,22 @@ static void tap_send(void *opaque)
     }
 }
 
+#ifdef CONFIG_TAP_IO_URING
+static void tap_uring_receive(void *opaque, uint8_t *buf, int size)
+{
+    TAPState *s = opaque;
+
+    if (size <= 0) {
+        return;
+    }
+
+    /* Like tap_send(), stop until the peer is able to receive again */
+    if (tap_send_packet(s, buf, size) == 0) {
+        tap_read_poll(s, false);
+    }
+}
+#endif
+
 static bool tap_has_ufo(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -273,12 +370,44 @@ static void tap_set_offload(NetClientState *nc, int csum, int tso4,
     tap_fd_set_offload(s->fd, csum, tso4, tso6, ecn, ufo, uso4, uso6);
 }
 
+/*
+ * Whether another QEMU uses the interface: the new QEMU after a completed
+ * cpr-transfer, or the old one while the incoming cpr-transfer is still
+ * running (it resumes if the transfer fails).
+ */
+static bool tap_cpr_shared(TAPState *s)
+{
+    return s->cpr_transferred ||
+           (cpr_is_incoming() && cpr_find_fd(s->nc.name, 0) >= 0);
+}
+
+static int tap_cpr_notify(NotifierWithReturn *notifier, MigrationEvent *e,
+                          Error **errp)
+{
+    TAPState *s = container_of(notifier, TAPState, cpr_notifier);
+
+    if (e->type == MIG_EVENT_PRECOPY_DONE &&
+        cpr_find_fd(s->nc.name, 0) >= 0) {
+        s->cpr_transferred = true;
+    }
+
+    /*
+     * The new QEMU switched the shared file to non-blocking mode. io_uring
+     * copes with that by polling, but go back to blocking I/O now that
+     * this QEMU is the only user again.
+     */
+    if (e->type == MIG_EVENT_PRECOPY_FAILED && s->uring) {
+        g_unix_set_fd_nonblocking(s->fd, false, NULL);
+    }
+    return 0;
+}
+
 static void tap_exit_notify(Notifier *notifier, void *data)
 {
     TAPState *s = container_of(notifier, TAPState, exit);
     Error *err = NULL;
 
-    if (s->down_script[0]) {
+    if (s->down_script[0] && !tap_cpr_shared(s)) {
         launch_script(s->down_script, s->down_script_arg, s->fd, &err);
         if (err) {
             error_report_err(err);
@@ -300,9 +429,22 @@ static void tap_cleanup(NetClientState *nc)
 
     tap_exit_notify(&s->exit, NULL);
     qemu_remove_exit_notifier(&s->exit);
+    migration_remove_notifier(&s->cpr_notifier);
 
     tap_read_poll(s, false);
     tap_write_poll(s, false);
+    if (s->uring) {
+        tap_uring_free(s->uring);
+        s->uring = NULL;
+        /*
+         * The file description may be shared, give it back in non-blocking
+         * mode unless the new QEMU of a cpr-transfer is using it.
+         */
+        if (!s->cpr_transferred) {
+            g_unix_set_fd_nonblocking(s->fd, true, NULL);
+        }
+    }
+    cpr_delete_fd_all(nc->name);
     close(s->fd);
     s->fd = -1;
 }
@@ -314,6 +456,22 @@ static void tap_poll(NetClientState *nc, bool enable)
     tap_write_poll(s, enable);
 }
 
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    if (s->uring) {
+        s->nc.aio_context = ctx;
+        tap_uring_set_aio_context(s->uring, tap_get_aio_context(s));
+        return;
+    }
+
+    aio_set_fd_handler(tap_get_aio_context(s), s->fd, NULL, NULL, NULL, NULL,
+                       NULL);
+    s->nc.aio_context = ctx;
+    tap_update_fd_handler(s);
+}
+
 static bool tap_set_steering_ebpf(NetClientState *nc, int prog_fd)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -347,6 +505,7 @@ static NetClientInfo net_tap_info = {
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
     .set_steering_ebpf = tap_set_steering_ebpf,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -381,6 +540,8 @@ static TAPState *net_tap_fd_init(NetClientState *peer,
 
     s->exit.notify = tap_exit_notify;
     qemu_add_exit_notifier(&s->exit);
+    migration_add_notifier_mode(&s->cpr_notifier, tap_cpr_notify,
+                                MIG_MODE_CPR_TRANSFER);
 
     return s;
 }
@@ -724,6 +885,39 @@ static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
         goto failed;
     }
 
+#ifdef CONFIG_TAP_IO_URING
+    if (tap->has_io_uring && tap->io_uring) {
+        if (s->vhost_net) {
+            error_setg(errp, "io-uring=on is incompatible with vhost");
+            goto failed;
+        }
+
+        /*
+         * io_uring waits for the device to become ready by itself, but
+         * fails reads and writes with -EAGAIN on a non-blocking file.
+         * tap_cleanup() switches the file back to non-blocking mode.
+         */
+        if (!g_unix_set_fd_nonblocking(fd, false, NULL)) {
+            error_setg_errno(errp, errno, "%s: Can't use file descriptor %d",
+                             name, fd);
+            goto failed;
+        }
+
+        s->uring = tap_uring_new(fd, tap_uring_receive, tap_writable, s,
+                                 errp);
+        if (!s->uring) {
+            g_unix_set_fd_nonblocking(fd, true, NULL);
+            goto failed;
+        }
+
+        /* From now on, packets are only read and written through the ring */
+        aio_set_fd_handler(tap_get_aio_context(s), s->fd, NULL, NULL, NULL,
+                           NULL, NULL);
+        tap_uring_set_aio_context(s->uring, tap_get_aio_context(s));
+        tap_update_fd_handler(s);
+    }
+#endif
+
     return;
 
 failed:
@@ -951,15 +1145,58 @@ free_fail:
         }
 
         for (i = 0; i < queues; i++) {
-            fd = net_tap_init(tap, &vnet_hdr, i >= 1 ? "no" : script,
-                              ifname, sizeof ifname, queues > 1, errp);
-            if (fd == -1) {
-                return -1;
+            /*
+             * After a cpr-transfer, keep using the tap queues of the old
+             * QEMU; the interface is already set up.
+             */
+            bool reused;
+
+            fd = cpr_find_fd(name, i);
+            reused = fd >= 0;
+            if (reused) {
+#ifdef CONFIG_TAP_IO_URING
+                /*
+                 * The old QEMU keeps reading the queue until the transfer
+                 * completes, and resumes if it fails; it cannot cope with
+                 * the file turning blocking under its feet.
+                 */
+                if (tap->has_io_uring && tap->io_uring) {
+                    error_setg(errp, "io-uring=on is not supported for a "
+                               "tap device handed over by cpr-transfer");
+                    return -1;
+                }
+#endif
+                /*
+                 * O_NONBLOCK belongs to the file description, which is
+                 * shared with the old QEMU and in whatever mode it uses.
+                 */
+                if (!g_unix_set_fd_nonblocking(fd, true, NULL)) {
+                    error_setg_errno(errp, errno,
+                                     "%s: Can't use file descriptor %d",
+                                     name, fd);
+                    return -1;
+                }
+                vnet_hdr = tap_probe_vnet_hdr(fd, errp);
+                if (vnet_hdr < 0) {
+                    return -1;
+                }
+            } else {
+                fd = net_tap_init(tap, &vnet_hdr, i >= 1 ? "no" : script,
+                                  ifname, sizeof ifname, queues > 1, errp);
+                if (fd == -1) {
+                    return -1;
+                }
+                cpr_save_fd(name, i, fd);
             }
 
-            if (queues > 1 && i == 0 && !tap->ifname) {
+            /*
+             * tap_open() only reports the name the kernel picked when it
+             * creates a single queue; a reused queue doesn't go through it.
+             */
+            if ((queues > 1 || reused) && i == 0 && !tap->ifname) {
                 if (tap_fd_get_ifname(fd, ifname)) {
                     error_setg(errp, "Fail to get ifname");
+                    cpr_delete_fd_all(name);
                     close(fd);
                     return -1;
                 }
@@ -971,6 +1208,7 @@ free_fail:
                              vhostfdname, vnet_hdr, fd, &err);
             if (err) {
                 error_propagate(errp, err);
+                cpr_delete_fd_all(name);
                 close(fd);
                 return -1;
             }
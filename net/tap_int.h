@@ -47,4 +47,42 @@ int tap_fd_disable(int fd);
 int tap_fd_get_ifname(int fd, char *ifname);
 int tap_fd_set_steering_ebpf(int fd, int prog_fd);
 
+typedef struct TapUring TapUring;
+
+/* Called for each received packet, in order */
+typedef void TapUringReceiveFunc(void *opaque, uint8_t *buf, int size);
+/* Called when a write slot frees up after tap_uring_writev() returned 0 */
+typedef void TapUringWritableFunc(void *opaque);
+
+#ifdef CONFIG_TAP_IO_URING
+TapUring *tap_uring_new(int fd, TapUringReceiveFunc *receive,
+                        TapUringWritableFunc *writable, void *opaque,
+                        Error **errp);
+void tap_uring_free(TapUring *u);
+void tap_uring_set_aio_context(TapUring *u, AioContext *ctx);
+void tap_uring_set_rx_enabled(TapUring *u, bool enable);
+ssize_t tap_uring_writev(TapUring *u, const struct iovec *iov, int iovcnt);
+#else
+static inline void tap_uring_free(TapUring *u)
+{
+    g_assert_not_reached();
+}
+
+static inline void tap_uring_set_aio_context(TapUring *u, AioContext *ctx)
+{
+    g_assert_not_reached();
+}
+
+static inline void tap_uring_set_rx_enabled(TapUring *u, bool enable)
+{
+    g_assert_not_reached();
+}
+
+static inline ssize_t tap_uring_writev(TapUring *u, const struct iovec *iov,
+                                       int iovcnt)
+{
+    g_assert_not_reached();
+}
+#endif
+
 #endif /* NET_TAP_INT_H */
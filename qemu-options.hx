@@ -188,6 +188,7 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
     "                tb-size=n (TCG translation block cache size)\n"
     "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
+    "                dirty-ring-reapers=n (KVM dirty ring reaper threads, default 1)\n"
     "                eager-split-size=n (KVM Eager Page Split chunk size, default 0, disabled. ARM only)\n"
     "                notify-vmexit=run|internal-error|disable,notify-window=n (enable notify VM exit and set notify window, x86 only)\n"
     "                thread=single|multi (enable multi-threaded TCG)\n"
@@ -248,6 +249,16 @@ SRST
         is disabled (dirty-ring-size=0).  When enabled, KVM will instead
         record dirty pages in a bitmap.
 
+    ``dirty-ring-reapers=n``
+        When the KVM dirty ring is enabled, it controls the number of
+        threads that collect the dirty pages from the rings.  Each thread
+        owns the rings of a subset of the vCPUs, so guests with many
+        vCPUs can use more threads to keep the rings from getting full
+        during migration.  The number of reaped pages, the number of
+        exits due to full rings and the reaping rate in pages per second
+        are reported by ``query-stats`` for the VM.  By default, a
+        single thread is used (dirty-ring-reapers=1).
+
     ``eager-split-size=n``
         KVM implements dirty page logging at the PAGE_SIZE granularity and
         enabling dirty-logging on a huge-page requires breaking it into
@@ -2831,7 +2842,11 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "-netdev tap,id=str[,fd=h][,fds=x:y:...:z][,ifname=name][,script=file][,downscript=dfile]\n"
     "         [,br=bridge][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off]\n"
     "         [,vhostfd=h][,vhostfds=x:y:...:z][,vhostforce=on|off][,queues=n]\n"
-    "         [,poll-us=n]\n"
+    "         [,poll-us=n]"
+#ifdef CONFIG_TAP_IO_URING
+    "[,io-uring=on|off]"
+#endif
+    "\n"
     "                configure a host TAP network backend with ID 'str'\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
@@ -2854,6 +2869,9 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                use 'queues=n' to specify the number of queues to be created for multiqueue TAP\n"
     "                use 'poll-us=n' to specify the maximum number of microseconds that could be\n"
     "                spent on busy polling for vhost net\n"
+#ifdef CONFIG_TAP_IO_URING
+    "                use 'io-uring=on' to read and write packets with io_uring\n"
+#endif
     "-netdev bridge,id=str[,br=bridge][,helper=helper]\n"
     "                configure a host TAP network backend with ID 'str' that is\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
@@ -2863,7 +2881,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "-netdev l2tpv3,id=str,src=srcaddr,dst=dstaddr[,srcport=srcport][,dstport=dstport]\n"
     "         [,rxsession=rxsession],txsession=txsession[,ipv6=on|off][,udp=on|off]\n"
     "         [,cookie64=on|off][,counter][,pincounter][,txcookie=txcookie]\n"
-    "         [,rxcookie=rxcookie][,offset=offset]\n"
+    "         [,rxcookie=rxcookie][,offset=offset][,offload=on|off]\n"
     "                configure a network backend with ID 'str' connected to\n"
     "                an Ethernet over L2TPv3 pseudowire.\n"
     "                Linux kernel 3.3+ as well as most routers can talk\n"
@@ -2885,30 +2903,34 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                use 'counter=off' to force a 'cut-down' L2TPv3 with no counter\n"
     "                use 'pincounter=on' to work around broken counter handling in peer\n"
     "                use 'offset=X' to add an extra offset between header and data\n"
+    "                use 'offload=on' to emulate checksum and segmentation offloads\n"
 #endif
-    "-netdev socket,id=str[,fd=h][,listen=[host]:port][,connect=host:port]\n"
+    "-netdev socket,id=str[,fd=h][,listen=[host]:port][,connect=host:port][,offload=on|off]\n"
     "                configure a network backend to connect to another network\n"
     "                using a socket connection\n"
-    "-netdev socket,id=str[,fd=h][,mcast=maddr:port[,localaddr=addr]]\n"
+    "-netdev socket,id=str[,fd=h][,mcast=maddr:port[,localaddr=addr]][,offload=on|off]\n"
     "                configure a network backend to connect to a multicast maddr and port\n"
     "                use 'localaddr=addr' to specify the host address to send packets from\n"
-    "-netdev socket,id=str[,fd=h][,udp=host:port][,localaddr=host:port]\n"
+    "-netdev socket,id=str[,fd=h][,udp=host:port][,localaddr=host:port][,offload=on|off]\n"
     "                configure a network backend to connect to another network\n"
     "                using an UDP tunnel\n"
-    "-netdev stream,id=str[,server=on|off],addr.type=inet,addr.host=host,addr.port=port[,to=maxport][,numeric=on|off][,keep-alive=on|off][,mptcp=on|off][,addr.ipv4=on|off][,addr.ipv6=on|off][,reconnect=seconds]\n"
-    "-netdev stream,id=str[,server=on|off],addr.type=unix,addr.path=path[,abstract=on|off][,tight=on|off][,reconnect=seconds]\n"
-    "-netdev stream,id=str[,server=on|off],addr.type=fd,addr.str=file-descriptor[,reconnect=seconds]\n"
+    "                use 'offload=on' to emulate checksum and segmentation offloads\n"
+    "-netdev stream,id=str[,server=on|off],addr.type=inet,addr.host=host,addr.port=port[,to=maxport][,numeric=on|off][,keep-alive=on|off][,mptcp=on|off][,addr.ipv4=on|off][,addr.ipv6=on|off][,reconnect=seconds][,offload=on|off]\n"
+    "-netdev stream,id=str[,server=on|off],addr.type=unix,addr.path=path[,abstract=on|off][,tight=on|off][,reconnect=seconds][,offload=on|off]\n"
+    "-netdev stream,id=str[,server=on|off],addr.type=fd,addr.str=file-descriptor[,reconnect=seconds][,offload=on|off]\n"
     "                configure a network backend to connect to another network\n"
     "                using a socket connection in stream mode.\n"
-    "-netdev dgram,id=str,remote.type=inet,remote.host=maddr,remote.port=port[,local.type=inet,local.host=addr]\n"
-    "-netdev dgram,id=str,remote.type=inet,remote.host=maddr,remote.port=port[,local.type=fd,local.str=file-descriptor]\n"
+    "                use 'offload=on' to emulate checksum and segmentation offloads\n"
+    "-netdev dgram,id=str,remote.type=inet,remote.host=maddr,remote.port=port[,local.type=inet,local.host=addr][,offload=on|off]\n"
+    "-netdev dgram,id=str,remote.type=inet,remote.host=maddr,remote.port=port[,local.type=fd,local.str=file-descriptor][,offload=on|off]\n"
     "                configure a network backend to connect to a multicast maddr and port\n"
     "                use ``local.host=addr`` to specify the host address to send packets from\n"
-    "-netdev dgram,id=str,local.type=inet,local.host=addr,local.port=port[,remote.type=inet,remote.host=addr,remote.port=port]\n"
-    "-netdev dgram,id=str,local.type=unix,local.path=path[,remote.type=unix,remote.path=path]\n"
-    "-netdev dgram,id=str,local.type=fd,local.str=file-descriptor\n"
+    "-netdev dgram,id=str,local.type=inet,local.host=addr,local.port=port[,remote.type=inet,remote.host=addr,remote.port=port][,offload=on|off]\n"
+    "-netdev dgram,id=str,local.type=unix,local.path=path[,remote.type=unix,remote.path=path][,offload=on|off]\n"
+    "-netdev dgram,id=str,local.type=fd,local.str=file-descriptor[,offload=on|off]\n"
     "                configure a network backend to connect to another network\n"
     "                using an UDP tunnel\n"
+    "                use 'offload=on' to emulate checksum and segmentation offloads\n"
 #ifdef CONFIG_VDE
     "-netdev vde,id=str[,sock=socketpath][,port=n][,group=groupname][,mode=octalmode]\n"
     "                configure a network backend to connect to port 'n' of a vde switch\n"
@@ -2924,16 +2946,22 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
 #endif
 #ifdef CONFIG_AF_XDP
     "-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
-    "         [,queues=n][,start-queue=m][,inhibit=on|off][,sock-fds=x:y:...:z]\n"
+    "         [,zero-copy=on|off][,queues=n][,start-queue=m][,inhibit=on|off]\n"
+    "         [,sock-fds=x:y:...:z][,poll-us=n][,shared-umem=on|off]\n"
+    "         [,offload=on|off]\n"
     "                attach to the existing network interface 'name' with AF_XDP socket\n"
     "                use 'mode=MODE' to specify an XDP program attach mode\n"
     "                use 'force-copy=on|off' to force XDP copy mode even if device supports zero-copy (default: off)\n"
+    "                use 'zero-copy=on|off' to fail if device does not support zero-copy (default: off)\n"
     "                use 'inhibit=on|off' to inhibit loading of a default XDP program (default: off)\n"
     "                with inhibit=on,\n"
     "                  use 'sock-fds' to provide file descriptors for already open AF_XDP sockets\n"
     "                  added to a socket map in XDP program.  One socket per queue.\n"
     "                use 'queues=n' to specify how many queues of a multiqueue interface should be used\n"
     "                use 'start-queue=m' to specify the first queue that should be used\n"
+    "                use 'poll-us=n' to let the kernel busy poll the device queues for n microseconds\n"
+    "                use 'shared-umem=on' to register one packet memory area for all queues\n"
+    "                use 'offload=on' to emulate checksum and segmentation offloads\n"
 #endif
 #ifdef CONFIG_POSIX
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
@@ -3238,6 +3266,15 @@ SRST
     ``fd``\ =h can be used to specify the handle of an already opened
     host TAP interface.
 
+    ``io-uring=on`` makes QEMU read and write packets with io_uring
+    instead of one system call per packet.  Many receive buffers are
+    kept posted to the kernel and packets sent by the guest in a burst
+    are submitted together.  It requires Linux 6.7 or newer and cannot
+    be combined with vhost.  The file descriptor of the TAP interface is
+    in blocking mode while the netdev exists, which also affects other
+    processes that share it; for this reason it cannot be used by the
+    new QEMU of a cpr-transfer.
+
     Examples:
 
     .. parsed-literal::
@@ -3626,7 +3663,7 @@ SRST
         # launch QEMU instance
         |qemu_system| linux.img -nic vde,sock=/tmp/myswitch
 
-``-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off][,queues=n][,start-queue=m][,inhibit=on|off][,sock-fds=x:y:...:z]``
+``-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off][,zero-copy=on|off][,queues=n][,start-queue=m][,inhibit=on|off][,sock-fds=x:y:...:z][,poll-us=n][,shared-umem=on|off][,offload=on|off]``
     Configure AF_XDP backend to connect to a network interface 'name'
     using AF_XDP socket.  A specific program attach mode for a default
     XDP program can be forced with 'mode', defaults to best-effort,
@@ -3675,6 +3712,35 @@ SRST
         |qemu_system| linux.img -device virtio-net-pci,netdev=n1 \\
             -netdev af-xdp,id=n1,ifname=eth0,queues=3,inhibit=on,sock-fds=15:16:17
 
+    The kernel uses zero-copy mode, where the device reads and writes
+    packets directly in the memory shared with QEMU, if the driver supports
+    it, and falls back to copy mode otherwise.  'zero-copy=on' makes the
+    creation of the sockets fail instead of falling back.
+
+    Each queue registers its own packet memory area (UMEM) with the kernel,
+    unless 'shared-umem=on' is given: the queues then use one area, each
+    with its own range of frames, which the kernel only has to pin and map
+    for DMA once.  It cannot be used with 'sock-fds'.
+
+    With 'poll-us=n', the device queues are processed by busy polling from
+    the socket calls of QEMU, for up to n microseconds, rather than from
+    interrupts.  This requires CAP_NET_ADMIN and works best when each queue
+    is processed by its own IOThread with polling enabled (see the
+    ``iothread-vq-mapping`` property of virtio-net), and when the interrupts
+    of the device are deferred, e.g. with
+    ``echo 2 > /sys/class/net/eth0/napi_defer_hard_irqs`` and
+    ``echo 200000 > /sys/class/net/eth0/gro_flush_timeout``.
+
+    .. parsed-literal::
+
+        |qemu_system| linux.img \\
+            -object iothread,id=iot0,poll-max-ns=50000 \\
+            -object iothread,id=iot1,poll-max-ns=50000 \\
+            -netdev af-xdp,id=n1,ifname=eth0,queues=2,zero-copy=on,poll-us=20 \\
+            -device '{"driver":"virtio-net-pci","netdev":"n1","mq":true,"vectors":6,
+                      "iothread-vq-mapping":[{"iothread":"iot0"},
+                                             {"iothread":"iot1"}]}'
+
 ``-netdev vhost-user,chardev=id[,vhostforce=on|off][,queues=n]``
     Establish a vhost-user netdev, backed by a chardev id. The chardev
     should be a unix domain socket backed one. The vhost-user uses a
@@ -4992,6 +5058,22 @@ SRST
     to issuing the migrate\_incoming to allow the migration to begin.
 ERST
 
+DEF("cpr-uri", HAS_ARG, QEMU_OPTION_cpr_uri, \
+    "-cpr-uri unix:socketpath\n" \
+    "                receive the file descriptors of the old QEMU for a\n" \
+    "                cpr-transfer migration on the given unix socket\n",
+    QEMU_ARCH_ALL)
+SRST
+``-cpr-uri unix:socketpath``
+    Prepare for a cpr-transfer migration from an old QEMU on the same
+    host.  QEMU listens on the given unix socket and waits for the old
+    QEMU to send its file descriptors (such as shared memfd guest RAM
+    and tap devices) before creating any backend, so that the guest
+    keeps using them.  Must be used together with ``-incoming``; the
+    old QEMU gives the same socket as the ``cpr`` channel of its
+    ``migrate`` command.
+ERST
+
 DEF("only-migratable", 0, QEMU_OPTION_only_migratable, \
     "-only-migratable     allow only migratable devices\n", QEMU_ARCH_ALL)
 SRST
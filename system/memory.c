@@ -22,6 +22,7 @@
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/qemu-print.h"
+#include "qemu/timer.h"
 #include "qom/object.h"
 #include "trace.h"
 
@@ -50,6 +51,24 @@ static QTAILQ_HEAD(, AddressSpace) address_spaces
 
 static GHashTable *flat_views;
 
+/*
+ * Parts of the FlatViews in flat_views that changed since they were
+ * rendered, as a GArray of AddrRange in the FlatView's address space,
+ * keyed like flat_views.  Only these parts are rendered again on the
+ * next commit, unless flat_views_all_dirty is set.
+ */
+static GHashTable *flat_views_dirty;
+static bool flat_views_all_dirty;
+
+/* Profiling counters for memory_region_transaction_commit() */
+static struct {
+    uint64_t commits;
+    uint64_t commit_ns;
+    uint64_t rendered;
+    uint64_t updated;
+    uint64_t reused;
+} flat_views_stats;
+
 typedef struct AddrRange AddrRange;
 
 /*
@@ -749,10 +768,22 @@ static MemoryRegion *memory_region_get_flatview_root(MemoryRegion *mr)
     return NULL;
 }
 
+static void flatview_build_dispatch(FlatView *view)
+{
+    int i;
+
+    view->dispatch = address_space_dispatch_new(view);
+    for (i = 0; i < view->nr; i++) {
+        MemoryRegionSection mrs =
+            section_from_flat_range(&view->ranges[i], view);
+        flatview_add_to_dispatch(view, &mrs);
+    }
+    address_space_dispatch_compact(view->dispatch);
+}
+
 /* Render a memory topology into a list of disjoint absolute ranges. */
 static FlatView *generate_memory_topology(MemoryRegion *mr)
 {
-    int i;
     FlatView *view;
 
     view = flatview_new(mr);
@@ -763,19 +794,209 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
                              false, false, false);
     }
     flatview_simplify(view);
+    flatview_build_dispatch(view);
+    g_hash_table_replace(flat_views, mr, view);
+    flat_views_stats.rendered++;
 
-    view->dispatch = address_space_dispatch_new(view);
-    for (i = 0; i < view->nr; i++) {
-        MemoryRegionSection mrs =
-            section_from_flat_range(&view->ranges[i], view);
-        flatview_add_to_dispatch(view, &mrs);
+    return view;
+}
+
+static gint addrrange_compare_start(gconstpointer a, gconstpointer b)
+{
+    const AddrRange *r1 = a, *r2 = b;
+
+    if (int128_lt(r1->start, r2->start)) {
+        return -1;
     }
-    address_space_dispatch_compact(view->dispatch);
-    g_hash_table_replace(flat_views, mr, view);
+    return int128_eq(r1->start, r2->start) ? 0 : 1;
+}
+
+/* Sort the ranges in @ranges and merge those that overlap or touch */
+static void addrrange_array_merge(GArray *ranges)
+{
+    AddrRange *r;
+    unsigned nr = 0;
+    unsigned i;
+
+    g_array_sort(ranges, addrrange_compare_start);
+    r = &g_array_index(ranges, AddrRange, 0);
+    for (i = 0; i < ranges->len; i++) {
+        if (nr && int128_ge(addrrange_end(r[nr - 1]), r[i].start)) {
+            Int128 end = int128_max(addrrange_end(r[nr - 1]),
+                                    addrrange_end(r[i]));
+
+            r[nr - 1].size = int128_sub(end, r[nr - 1].start);
+        } else {
+            r[nr++] = r[i];
+        }
+    }
+    g_array_set_size(ranges, nr);
+}
+
+/*
+ * Derive a new FlatView for the root of @old, where only the ranges in
+ * @dirty changed: the ranges of @old outside @dirty are copied, and the
+ * holes are filled by rendering the root again, clipped to each dirty
+ * range.  The dispatch tree is built from scratch, as FlatViews are
+ * immutable once published.
+ */
+static FlatView *flatview_update(FlatView *old, GArray *dirty)
+{
+    FlatView *view = flatview_new(old->root);
+    g_autoptr(GArray) unmergeable = g_array_new(false, false,
+                                                sizeof(AddrRange));
+    AddrRange *d;
+    unsigned nr_dirty;
+    unsigned i, j;
+
+    addrrange_array_merge(dirty);
+
+    /*
+     * Pieces of an unmergeable range are never merged back together, so
+     * render the whole range again if it overlaps or touches a dirty one.
+     */
+    d = &g_array_index(dirty, AddrRange, 0);
+    j = 0;
+    for (i = 0; i < old->nr; i++) {
+        FlatRange *fr = &old->ranges[i];
+
+        if (!fr->unmergeable) {
+            continue;
+        }
+        while (j < dirty->len &&
+               int128_lt(addrrange_end(d[j]), fr->addr.start)) {
+            j++;
+        }
+        if (j < dirty->len &&
+            int128_le(d[j].start, addrrange_end(fr->addr))) {
+            g_array_append_val(unmergeable, fr->addr);
+        }
+    }
+    if (unmergeable->len) {
+        g_array_append_vals(dirty, unmergeable->data, unmergeable->len);
+        addrrange_array_merge(dirty);
+    }
+    d = &g_array_index(dirty, AddrRange, 0);
+    nr_dirty = dirty->len;
+
+    /* Copy whatever did not change */
+    j = 0;
+    for (i = 0; i < old->nr; i++) {
+        FlatRange *fr = &old->ranges[i];
+        Int128 start = fr->addr.start;
+        Int128 end = addrrange_end(fr->addr);
+
+        while (int128_lt(start, end)) {
+            Int128 piece_end = end;
+            FlatRange piece;
+
+            while (j < nr_dirty && int128_le(addrrange_end(d[j]), start)) {
+                j++;
+            }
+            if (j < nr_dirty) {
+                if (int128_le(d[j].start, start)) {
+                    start = int128_min(addrrange_end(d[j]), end);
+                    continue;
+                }
+                piece_end = int128_min(end, d[j].start);
+            }
+
+            piece = *fr;
+            piece.offset_in_region +=
+                int128_get64(int128_sub(start, fr->addr.start));
+            piece.addr = addrrange_make(start, int128_sub(piece_end, start));
+            flatview_insert(view, view->nr, &piece);
+            start = piece_end;
+        }
+    }
+
+    /* Fill the holes */
+    for (i = 0; i < nr_dirty; i++) {
+        render_memory_region(view, old->root, int128_zero(), d[i],
+                             false, false, false);
+    }
+    flatview_simplify(view);
+    flatview_build_dispatch(view);
+    flat_views_stats.updated++;
 
     return view;
 }
 
+#ifdef CONFIG_DEBUG_FLATVIEW
+/*
+ * Check that a FlatView that was updated or reused is the same as a full
+ * render of its root.
+ */
+static void flatview_check(gpointer key, gpointer value, gpointer opaque)
+{
+    MemoryRegion *mr = key;
+    FlatView *view = value;
+    FlatView *full;
+    unsigned i;
+
+    if (!mr) {
+        return;
+    }
+
+    full = flatview_new(mr);
+    render_memory_region(full, mr, int128_zero(),
+                         addrrange_make(int128_zero(), int128_2_64()),
+                         false, false, false);
+    flatview_simplify(full);
+
+    assert(view->nr == full->nr);
+    for (i = 0; i < view->nr; i++) {
+        assert(flatrange_equal(&view->ranges[i], &full->ranges[i]));
+        assert(view->ranges[i].dirty_log_mask ==
+               full->ranges[i].dirty_log_mask);
+    }
+    flatview_unref(full);
+}
+#endif
+
+/*
+ * Record that @range, relative to @mr, may render differently.  This
+ * propagates the range to every FlatView root that can see @mr, through
+ * containers and aliases.
+ */
+static void memory_region_mark_dirty(MemoryRegion *mr, AddrRange range)
+{
+    AddrRange extent = addrrange_make(int128_zero(), mr->size);
+    MemoryRegion *alias;
+
+    if (!flat_views || !addrrange_intersects(range, extent)) {
+        return;
+    }
+    range = addrrange_intersection(range, extent);
+
+    if (g_hash_table_contains(flat_views, mr)) {
+        GArray *dirty = g_hash_table_lookup(flat_views_dirty, mr);
+        AddrRange r = addrrange_shift(range, int128_make64(mr->addr));
+
+        if (!dirty) {
+            dirty = g_array_new(false, false, sizeof(AddrRange));
+            g_hash_table_insert(flat_views_dirty, mr, dirty);
+        }
+        g_array_append_val(dirty, r);
+    }
+
+    if (mr->container) {
+        memory_region_mark_dirty(mr->container,
+                                 addrrange_shift(range,
+                                                 int128_make64(mr->addr)));
+    }
+    QLIST_FOREACH(alias, &mr->aliases, aliases_link) {
+        memory_region_mark_dirty(alias,
+            addrrange_shift(range,
+                            int128_neg(int128_make64(alias->alias_offset))));
+    }
+}
+
+static void memory_region_mark_dirty_all(MemoryRegion *mr)
+{
+    memory_region_mark_dirty(mr, addrrange_make(int128_zero(), mr->size));
+}
+
 static void address_space_add_del_ioeventfds(AddressSpace *as,
                                              MemoryRegionIoeventfd *fds_new,
                                              unsigned fds_new_nb,
@@ -1020,6 +1241,9 @@ static void flatviews_init(void)
 
     flat_views = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
                                        (GDestroyNotify) flatview_unref);
+    flat_views_dirty = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                             NULL,
+                                             (GDestroyNotify) g_array_unref);
     if (!empty_view) {
         empty_view = generate_memory_topology(NULL);
         /* We keep it alive forever in the global variable.  */
@@ -1032,24 +1256,60 @@ static void flatviews_init(void)
 
 static void flatviews_reset(void)
 {
+    GHashTable *old_views = flat_views;
+    GHashTable *old_dirty = flat_views_dirty;
+    uint64_t rendered = flat_views_stats.rendered;
+    uint64_t updated = flat_views_stats.updated;
+    uint64_t reused = flat_views_stats.reused;
     AddressSpace *as;
 
-    if (flat_views) {
-        g_hash_table_unref(flat_views);
-        flat_views = NULL;
-    }
+    flat_views = NULL;
+    flat_views_dirty = NULL;
     flatviews_init();
 
-    /* Render unique FVs */
+    /*
+     * Render unique FVs.  Those that already existed only need the parts
+     * that changed to be rendered again, or nothing at all.
+     */
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
+        FlatView *old_view;
+        GArray *dirty;
 
         if (g_hash_table_lookup(flat_views, physmr)) {
             continue;
         }
 
-        generate_memory_topology(physmr);
+        old_view = old_views ? g_hash_table_lookup(old_views, physmr) : NULL;
+        if (!old_view || flat_views_all_dirty) {
+            generate_memory_topology(physmr);
+            continue;
+        }
+
+        dirty = g_hash_table_lookup(old_dirty, physmr);
+        if (dirty) {
+            g_hash_table_replace(flat_views, physmr,
+                                 flatview_update(old_view, dirty));
+        } else {
+            flatview_ref(old_view);
+            g_hash_table_replace(flat_views, physmr, old_view);
+            flat_views_stats.reused++;
+        }
+    }
+    flat_views_all_dirty = false;
+
+#ifdef CONFIG_DEBUG_FLATVIEW
+    g_hash_table_foreach(flat_views, flatview_check, NULL);
+#endif
+
+    if (old_views) {
+        g_hash_table_unref(old_views);
+        g_hash_table_unref(old_dirty);
     }
+
+    trace_flatviews_reset(flat_views_stats.rendered - rendered,
+                          flat_views_stats.updated - updated,
+                          flat_views_stats.reused - reused);
 }
 
 static void address_space_set_flatview(AddressSpace *as)
@@ -1061,6 +1321,14 @@ static void address_space_set_flatview(AddressSpace *as)
     assert(new_view);
 
     if (old_view == new_view) {
+        /*
+         * FlatViews that did not change are reused across commits, but
+         * listeners still expect to hear about every region in between
+         * begin and commit.
+         */
+        if (!QTAILQ_EMPTY(&as->listeners)) {
+            address_space_update_topology_pass(as, new_view, new_view, true);
+        }
         return;
     }
 
@@ -1124,6 +1392,9 @@ void memory_region_transaction_commit(void)
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
+            int64_t start = get_clock();
+            int64_t ns;
+
             flatviews_reset();
 
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
@@ -1135,6 +1406,11 @@ void memory_region_transaction_commit(void)
             memory_region_update_pending = false;
             ioeventfd_update_pending = false;
             MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+
+            ns = get_clock() - start;
+            flat_views_stats.commits++;
+            flat_views_stats.commit_ns += ns;
+            trace_memory_region_transaction_commit(ns);
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
@@ -1512,9 +1788,22 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
      * directly, instead of going through eventfd.  This probably should
      * test "tcg_enabled() || qtest_enabled()", or should just go away.
      */
-    if (!kvm_enabled() &&
-        memory_region_dispatch_write_eventfds(mr, addr, data, size, attrs)) {
-        return MEMTX_OK;
+    if (!kvm_enabled() && mr->ioeventfd_nb) {
+        bool handled;
+
+        /* mr->ioeventfds is only stable under the BQL */
+        if (mr->lockless_io && !bql_locked()) {
+            bql_lock();
+            handled = memory_region_dispatch_write_eventfds(mr, addr, data,
+                                                            size, attrs);
+            bql_unlock();
+        } else {
+            handled = memory_region_dispatch_write_eventfds(mr, addr, data,
+                                                            size, attrs);
+        }
+        if (handled) {
+            return MEMTX_OK;
+        }
     }
 
     if (mr->ops->write) {
@@ -1705,6 +1994,7 @@ void memory_region_init_alias(MemoryRegion *mr,
     memory_region_init(mr, owner, name, size);
     mr->alias = orig;
     mr->alias_offset = offset;
+    QLIST_INSERT_HEAD(&orig->aliases, mr, aliases_link);
 }
 
 bool memory_region_init_rom_nomigrate(MemoryRegion *mr,
@@ -1787,6 +2077,15 @@ static void memory_region_finalize(Object *obj)
     }
     memory_region_transaction_commit();
 
+    if (mr->alias) {
+        QLIST_SAFE_REMOVE(mr, aliases_link);
+    }
+    while (!QLIST_EMPTY(&mr->aliases)) {
+        MemoryRegion *alias = QLIST_FIRST(&mr->aliases);
+
+        QLIST_SAFE_REMOVE(alias, aliases_link);
+    }
+
     mr->destructor(mr);
     memory_region_clear_coalescing(mr);
     g_free((char *)mr->name);
@@ -2235,7 +2534,10 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_pending = true;
+        memory_region_mark_dirty_all(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2352,6 +2654,15 @@ DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty(MemoryRegion *mr,
     return snapshot;
 }
 
+void memory_region_count_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
+                                         hwaddr size, unsigned client,
+                                         unsigned shift, uint32_t *counts)
+{
+    assert(mr->ram_block);
+    cpu_physical_memory_count_and_clear_dirty(
+        memory_region_get_ram_addr(mr) + addr, size, client, shift, counts);
+}
+
 bool memory_region_snapshot_get_dirty(MemoryRegion *mr, DirtyBitmapSnapshot *snap,
                                       hwaddr addr, hwaddr size)
 {
@@ -2365,7 +2676,10 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_pending = true;
+            memory_region_mark_dirty_all(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2375,7 +2689,10 @@ void memory_region_set_nonvolatile(MemoryRegion *mr, bool nonvolatile)
     if (mr->nonvolatile != nonvolatile) {
         memory_region_transaction_begin();
         mr->nonvolatile = nonvolatile;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_pending = true;
+            memory_region_mark_dirty_all(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2385,7 +2702,10 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_pending = true;
+            memory_region_mark_dirty_all(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2535,6 +2855,12 @@ void memory_region_clear_flush_coalesced(MemoryRegion *mr)
     }
 }
 
+void memory_region_enable_lockless_io(MemoryRegion *mr)
+{
+    mr->lockless_io = true;
+    mr->disable_reentrancy_guard = true;
+}
+
 void memory_region_add_eventfd(MemoryRegion *mr,
                                hwaddr addr,
                                unsigned size,
@@ -2621,7 +2947,10 @@ static void memory_region_update_container_subregions(MemoryRegion *subregion)
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        memory_region_update_pending = true;
+        memory_region_mark_dirty_all(subregion);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2664,6 +2993,9 @@ void memory_region_del_subregion(MemoryRegion *mr,
 
     memory_region_transaction_begin();
     assert(subregion->container == mr);
+    if (mr->enabled && subregion->enabled) {
+        memory_region_mark_dirty_all(subregion);
+    }
     subregion->container = NULL;
     for (alias = subregion->alias; alias; alias = alias->alias) {
         alias->mapped_via_alias--;
@@ -2683,6 +3015,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     memory_region_transaction_begin();
     mr->enabled = enabled;
     memory_region_update_pending = true;
+    memory_region_mark_dirty_all(mr);
     memory_region_transaction_commit();
 }
 
@@ -2697,8 +3030,10 @@ void memory_region_set_size(MemoryRegion *mr, uint64_t size)
         return;
     }
     memory_region_transaction_begin();
+    memory_region_mark_dirty_all(mr);
     mr->size = s;
     memory_region_update_pending = true;
+    memory_region_mark_dirty_all(mr);
     memory_region_transaction_commit();
 }
 
@@ -2719,6 +3054,7 @@ static void memory_region_readd_subregion(MemoryRegion *mr)
 void memory_region_set_address(MemoryRegion *mr, hwaddr addr)
 {
     if (addr != mr->addr) {
+        memory_region_mark_dirty_all(mr);
         mr->addr = addr;
         memory_region_readd_subregion(mr);
     }
@@ -2734,7 +3070,10 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_pending = true;
+        memory_region_mark_dirty_all(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2746,7 +3085,10 @@ void memory_region_set_unmergeable(MemoryRegion *mr, bool unmergeable)
 
     memory_region_transaction_begin();
     mr->unmergeable = unmergeable;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_pending = true;
+        memory_region_mark_dirty_all(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2946,6 +3288,7 @@ bool memory_global_dirty_log_start(unsigned int flags, Error **errp)
 
         memory_region_transaction_begin();
         memory_region_update_pending = true;
+        flat_views_all_dirty = true;
         memory_region_transaction_commit();
     }
     return true;
@@ -2962,6 +3305,7 @@ static void memory_global_dirty_log_do_stop(unsigned int flags)
     if (!global_dirty_tracking) {
         memory_region_transaction_begin();
         memory_region_update_pending = true;
+        flat_views_all_dirty = true;
         memory_region_transaction_commit();
         MEMORY_LISTENER_CALL_GLOBAL(log_global_stop, Reverse);
     }
@@ -3504,6 +3848,14 @@ static void mtree_info_flatview(bool dispatch_tree, bool owner)
     /* Print */
     g_hash_table_foreach(views, mtree_print_flatview, &fvi);
 
+    qemu_printf("FlatView updates: %" PRIu64 " commits in %" PRIu64 " us, "
+                "%" PRIu64 " rendered, %" PRIu64 " updated, "
+                "%" PRIu64 " reused\n",
+                flat_views_stats.commits,
+                flat_views_stats.commit_ns / SCALE_US,
+                flat_views_stats.rendered, flat_views_stats.updated,
+                flat_views_stats.reused);
+
     /* Free */
     g_hash_table_foreach_remove(views, mtree_info_flatview_free, 0);
     g_hash_table_unref(views);
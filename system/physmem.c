@@ -919,6 +919,62 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
     return dirty;
 }
 
+void cpu_physical_memory_count_and_clear_dirty(ram_addr_t start,
+                                              ram_addr_t length,
+                                              unsigned client,
+                                              unsigned shift,
+                                              uint32_t *counts)
+{
+    DirtyMemoryBlocks *blocks;
+    unsigned long first, page, end;
+
+    if (length == 0) {
+        return;
+    }
+
+    first = start >> TARGET_PAGE_BITS;
+    end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+    page = first;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        blocks = qatomic_rcu_read(&ram_list.dirty_memory[client]);
+
+        while (page < end) {
+            unsigned long idx = page / DIRTY_MEMORY_BLOCK_SIZE;
+            unsigned long offset = page % DIRTY_MEMORY_BLOCK_SIZE;
+            unsigned long bit = offset % BITS_PER_LONG;
+            unsigned long num = MIN(end - page, BITS_PER_LONG - bit);
+            unsigned long *word = &blocks->blocks[idx][BIT_WORD(offset)];
+            unsigned long mask = BITMAP_FIRST_WORD_MASK(bit);
+            unsigned long base = page - bit - first;
+            unsigned long bits;
+
+            if (bit + num < BITS_PER_LONG) {
+                mask &= BITMAP_LAST_WORD_MASK(bit + num);
+            }
+            if (mask == ~0UL) {
+                bits = *word ? qatomic_xchg(word, 0) : 0;
+            } else {
+                bits = qatomic_fetch_and(word, ~mask) & mask;
+            }
+
+            if (bits && ((page - first) >> shift) ==
+                        ((page - first + num - 1) >> shift)) {
+                /* The whole chunk is in a single region */
+                counts[(page - first) >> shift] += ctpopl(bits);
+            } else {
+                while (bits) {
+                    counts[(base + ctzl(bits)) >> shift]++;
+                    bits &= bits - 1;
+                }
+            }
+            page += num;
+        }
+    }
+
+    cpu_physical_memory_dirty_bits_cleared(start, length);
+}
+
 DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
     (MemoryRegion *mr, hwaddr offset, hwaddr length, unsigned client)
 {
@@ -2714,7 +2770,11 @@ bool prepare_mmio_access(MemoryRegion *mr)
 {
     bool release_lock = false;
 
-    if (!bql_locked()) {
+    /*
+     * Flushing coalesced MMIO dispatches writes to other regions, which
+     * needs the BQL even if @mr itself can do without it.
+     */
+    if (!bql_locked() && (!mr->lockless_io || mr->flush_coalesced_mmio)) {
         bql_lock();
         release_lock = true;
     }
@@ -77,6 +77,7 @@
 #include "hw/block/block.h"
 #include "hw/i386/x86.h"
 #include "hw/i386/pc.h"
+#include "migration/cpr.h"
 #include "migration/misc.h"
 #include "migration/snapshot.h"
 #include "sysemu/tpm.h"
@@ -159,6 +160,7 @@ typedef struct DeviceOption {
 static const char *cpu_option;
 static const char *mem_path;
 static const char *incoming;
+static const char *cpr_uri;
 static const char *loadvm;
 static const char *accelerators;
 static bool have_custom_ram_size;
@@ -2446,6 +2448,10 @@ static void qemu_validate_options(const QDict *machine_opts)
                      "mutually exclusive");
         exit(EXIT_FAILURE);
     }
+    if (cpr_uri && !incoming) {
+        error_report("'cpr-uri' requires the 'incoming' option");
+        exit(EXIT_FAILURE);
+    }
     if (incoming && preconfig_requested && strcmp(incoming, "defer") != 0) {
         error_report("'preconfig' supports '-incoming defer' only");
         exit(EXIT_FAILURE);
@@ -3465,6 +3471,9 @@ void qemu_init(int argc, char **argv)
                 }
                 incoming = optarg;
                 break;
+            case QEMU_OPTION_cpr_uri:
+                cpr_uri = optarg;
+                break;
             case QEMU_OPTION_only_migratable:
                 only_migratable = 1;
                 break;
@@ -3685,6 +3694,14 @@ void qemu_init(int argc, char **argv)
 
     configure_rtc(qemu_find_opts_singleton("rtc"));
 
+    /*
+     * The file descriptors of the old QEMU must be known before any
+     * backend that may reuse them is created.
+     */
+    if (cpr_uri) {
+        cpr_state_load(cpr_uri, &error_fatal);
+    }
+
     /* Transfer QemuOpts options into machine options */
     parse_memory_options();
 
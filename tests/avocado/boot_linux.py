@@ -9,6 +9,7 @@
 # later.  See the COPYING file in the top-level directory.
 
 import os
+import re
 
 from avocado_qemu.linuxtest import LinuxTest
 from avocado_qemu import BUILD_DIR
@@ -58,6 +59,50 @@ def test_pc_q35_kvm(self):
         self.vm.add_args("-accel", "kvm")
         self.launch_and_wait(set_up_ssh_connection=False)
 
+    # Enable memory decoding, then move BAR2 (64-bit) 64 GiB up and back
+    BAR_MOVE = ('import struct\n'
+                'f = open("/sys/bus/pci/devices/0000:00:10.0/config", "r+b", 0)\n'
+                'f.seek(4)\n'
+                'cmd, = struct.unpack("<H", f.read(2))\n'
+                'f.seek(4)\n'
+                'f.write(struct.pack("<H", cmd | 2))\n'
+                'f.seek(0x1c)\n'
+                'hi, = struct.unpack("<I", f.read(4))\n'
+                'for v in (hi + 0x10, hi):\n'
+                '    f.seek(0x1c)\n'
+                '    f.write(struct.pack("<I", v))\n')
+
+    def count_slot_updates(self, trace_file):
+        with open(trace_file, encoding='utf-8') as f:
+            return len(re.findall(r'kvm_region_commit .* updated [1-9]',
+                                  f.read()))
+
+    def test_pc_q35_kvm_memslot_move(self):
+        """
+        Moving a RAM BAR must update its KVM memory slot in place,
+        without errors if the kernel refuses the move
+
+        :avocado: tags=machine:q35
+        :avocado: tags=accel:kvm
+        :avocado: tags=device:ivshmem-plain
+        """
+        self.require_accelerator("kvm")
+        trace_file = os.path.join(self.workdir, 'trace.log')
+        self.vm.add_args("-accel", "kvm")
+        self.vm.add_args("-object",
+                         "memory-backend-memfd,id=shm,size=4M,share=on")
+        self.vm.add_args("-device",
+                         "ivshmem-plain,memdev=shm,bus=pcie.0,addr=0x10")
+        self.vm.add_args("-trace",
+                         f"enable=kvm_region_commit,file={trace_file}")
+        self.launch_and_wait()
+
+        updates = self.count_slot_updates(trace_file)
+        self.ssh_command("python3 -c '%s'" % self.BAR_MOVE)
+        self.vm.shutdown()
+        self.assertGreater(self.count_slot_updates(trace_file), updates)
+        self.assertNotIn("KVM_SET_USER_MEMORY_REGION", self.vm.get_log())
+
 
 # For Aarch64 we only boot KVM tests in CI as booting the current
 # Fedora OS in TCG tests is very heavyweight. There are lighter weight
@@ -0,0 +1,289 @@
+/*
+ * Cost of popping and pushing virtqueue elements one by one or in batches
+ *
+ * A split virtqueue of a virtio device behind a virtio-mmio transport
+ * lives in guest RAM.  The driver side makes buffers available in
+ * bursts by writing the rings directly; the device side takes them and
+ * gives them back with virtqueue_pop() and virtqueue_push(), or with
+ * virtqueue_pop_batch() and virtqueue_push_batch() when -b is given.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+#include "exec/address-spaces.h"
+#include "hw/sysbus.h"
+#include "hw/virtio/virtio.h"
+#include "hw/virtio/virtio-mmio.h"
+#include "standard-headers/linux/virtio_ids.h"
+#include "standard-headers/linux/virtio_ring.h"
+#include "sysemu/sysemu.h"
+
+#define MAX_BATCH 256
+#define RING_ALIGN 4096
+
+#define TYPE_VIRTQUEUE_BENCH "virtqueue-bench-device"
+
+static unsigned int queue_size = 256;
+static unsigned int burst = 64;
+static unsigned int batch;
+static unsigned int duration = 1;
+static unsigned int buf_size = 4096;
+static bool event_idx;
+
+static MemoryRegion bench_ram;
+static struct vring vring;
+static VirtIODevice *vdev;
+static VirtQueue *vq;
+static uint16_t driver_avail_idx;
+static uint16_t driver_used_idx;
+
+static const char commands_string[] =
+    " -q = virtqueue size\n"
+    " -n = number of buffers made available at once by the driver\n"
+    " -b = pop and push up to this many elements at once (default: 1)\n"
+    " -e = negotiate VIRTIO_RING_F_EVENT_IDX\n"
+    " -d = duration in seconds";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static void bench_handle_output(VirtIODevice *vdev, VirtQueue *vq)
+{
+    /* The benchmark loop polls the queue, kicks are never sent */
+}
+
+static uint64_t bench_get_features(VirtIODevice *vdev, uint64_t features,
+                                   Error **errp)
+{
+    if (event_idx) {
+        virtio_add_feature(&features, VIRTIO_RING_F_EVENT_IDX);
+    }
+    return features;
+}
+
+static void bench_realize(DeviceState *dev, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+
+    virtio_init(vdev, VIRTIO_ID_RNG, 0);
+    vq = virtio_add_queue(vdev, queue_size, bench_handle_output);
+}
+
+static void bench_class_init(ObjectClass *klass, void *data)
+{
+    VirtioDeviceClass *vdc = VIRTIO_DEVICE_CLASS(klass);
+
+    vdc->realize = bench_realize;
+    vdc->get_features = bench_get_features;
+}
+
+static const TypeInfo bench_info = {
+    .name = TYPE_VIRTQUEUE_BENCH,
+    .parent = TYPE_VIRTIO_DEVICE,
+    .instance_size = sizeof(VirtIODevice),
+    .class_init = bench_class_init,
+};
+
+static void driver_kick(void)
+{
+    unsigned int i;
+
+    /* Reclaim used buffers */
+    driver_used_idx = le16_to_cpu(qatomic_load_acquire(&vring.used->idx));
+
+    for (i = 0; i < burst; i++) {
+        uint16_t head;
+
+        if ((uint16_t)(driver_avail_idx - driver_used_idx) == queue_size) {
+            break;
+        }
+        head = driver_avail_idx % queue_size;
+        vring.avail->ring[head] = cpu_to_le16(head);
+        driver_avail_idx++;
+    }
+    qatomic_store_release(&vring.avail->idx, cpu_to_le16(driver_avail_idx));
+}
+
+static void device_process(VirtQueueElement *elem)
+{
+    /* Touch the buffer like a device reading a request header */
+    qatomic_read((uint32_t *)elem->out_sg[0].iov_base);
+}
+
+static uint64_t run_test(void)
+{
+    VirtQueueElement *elems[MAX_BATCH];
+    unsigned int lens[MAX_BATCH] = { 0 };
+    VirtQueueElement *elem;
+    uint64_t processed = 0;
+    int64_t end;
+    unsigned int i, num;
+
+    end = get_clock() + (int64_t)duration * NANOSECONDS_PER_SECOND;
+    while (get_clock() < end) {
+        unsigned int j;
+
+        /* Poll the clock only every so often */
+        for (j = 0; j < 1024; j++) {
+            driver_kick();
+            if (batch) {
+                while ((num = virtqueue_pop_batch(vq, sizeof(VirtQueueElement),
+                                                  (void **)elems, batch))) {
+                    for (i = 0; i < num; i++) {
+                        device_process(elems[i]);
+                    }
+                    virtqueue_push_batch(vq, elems, lens, num);
+                    for (i = 0; i < num; i++) {
+                        g_free(elems[i]);
+                    }
+                    processed += num;
+                }
+            } else {
+                while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+                    device_process(elem);
+                    virtqueue_push(vq, elem, 0);
+                    g_free(elem);
+                    processed++;
+                }
+            }
+        }
+    }
+    g_assert(!vdev->broken);
+    return processed;
+}
+
+static void setup(void)
+{
+    DeviceState *proxy, *dev;
+    uint64_t features = 1ULL << VIRTIO_F_VERSION_1;
+    hwaddr desc, avail, used, bufs;
+    uint8_t *ptr;
+    unsigned int i;
+
+    /* A zero descriptor table address means that the queue is disabled */
+    desc = RING_ALIGN;
+    bufs = desc + ROUND_UP(vring_size(queue_size, RING_ALIGN), RING_ALIGN);
+    memory_region_init_ram(&bench_ram, NULL, "virtqueue-bench.ram",
+                           bufs + (uint64_t)queue_size * buf_size,
+                           &error_fatal);
+    memory_region_add_subregion(get_system_memory(), 0, &bench_ram);
+    ptr = memory_region_get_ram_ptr(&bench_ram);
+
+    vring_init(&vring, queue_size, ptr + desc, RING_ALIGN);
+    for (i = 0; i < queue_size; i++) {
+        vring.desc[i].addr = cpu_to_le64(bufs + (uint64_t)i * buf_size);
+        vring.desc[i].len = cpu_to_le32(buf_size);
+    }
+    avail = (uint8_t *)vring.avail - ptr;
+    used = (uint8_t *)vring.used - ptr;
+
+    type_register_static(&bench_info);
+    proxy = qdev_new(TYPE_VIRTIO_MMIO);
+    qdev_prop_set_bit(proxy, "force-legacy", false);
+    sysbus_realize_and_unref(SYS_BUS_DEVICE(proxy), &error_fatal);
+    dev = qdev_new(TYPE_VIRTQUEUE_BENCH);
+    qdev_realize_and_unref(dev, BUS(&VIRTIO_MMIO(proxy)->bus), &error_fatal);
+    vdev = VIRTIO_DEVICE(dev);
+
+    /* Do what the driver does through the transport registers */
+    if (event_idx) {
+        features |= 1ULL << VIRTIO_RING_F_EVENT_IDX;
+    }
+    g_assert(virtio_set_features(vdev, features) == 0);
+    virtio_queue_set_rings(vdev, 0, desc, avail, used);
+}
+
+static void pr_params(void)
+{
+    printf("Parameters:\n");
+    printf(" queue size:        %u\n", queue_size);
+    printf(" driver burst:      %u\n", burst);
+    printf(" batch size:        %u\n", batch ? batch : 1);
+    printf(" event idx:         %s\n", event_idx ? "on" : "off");
+    printf(" duration:          %u\n", duration);
+}
+
+static void pr_stats(uint64_t processed)
+{
+    double tx = processed / duration / 1e6;
+
+    printf("Results:\n");
+    printf("Duration:            %u s\n", duration);
+    printf(" Throughput:         %.2f Melements/s\n", tx);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hb:d:en:q:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'e':
+            event_idx = true;
+            break;
+        case 'n':
+            burst = atoi(optarg);
+            break;
+        case 'q':
+            queue_size = atoi(optarg);
+            break;
+        }
+    }
+
+    if (!queue_size || queue_size > VIRTQUEUE_MAX_SIZE ||
+        !is_power_of_2(queue_size)) {
+        fprintf(stderr, "Invalid virtqueue size %u\n", queue_size);
+        exit(1);
+    }
+    if (batch > MAX_BATCH) {
+        fprintf(stderr, "Batch size must be at most %u\n", MAX_BATCH);
+        exit(1);
+    }
+    if (!burst || !duration) {
+        usage_complete(argv);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    char *qemu_argv[] = {
+        argv[0], (char *)"-machine", (char *)"none", (char *)"-accel",
+        (char *)"qtest", (char *)"-nodefaults", (char *)"-display",
+        (char *)"none", NULL
+    };
+    uint64_t processed;
+
+    parse_args(argc, argv);
+
+    /* Returns with the BQL held, as the device code expects */
+    qemu_init(ARRAY_SIZE(qemu_argv) - 1, qemu_argv);
+
+    pr_params();
+    setup();
+    processed = run_test();
+    pr_stats(processed);
+    return 0;
+}
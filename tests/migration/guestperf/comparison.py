@@ -136,6 +136,23 @@ def __init__(self, name, scenarios):
                  multifd=True, multifd_channels=64),
     ]),
 
+    # Looking at effect of the multifd compression method
+    # with a fixed number of channels
+    Comparison("compr-multifd-method", scenarios = [
+        Scenario("compr-multifd-method-none",
+                 multifd=True, multifd_channels=8,
+                 multifd_compression="none"),
+        Scenario("compr-multifd-method-zlib",
+                 multifd=True, multifd_channels=8,
+                 multifd_compression="zlib"),
+        Scenario("compr-multifd-method-zstd",
+                 multifd=True, multifd_channels=8,
+                 multifd_compression="zstd"),
+        Scenario("compr-multifd-method-lz4",
+                 multifd=True, multifd_channels=8,
+                 multifd_compression="lz4"),
+    ]),
+
     # Looking at effect of dirty-limit with
     # varying x_vcpu_dirty_limit_period
     Comparison("compr-dirty-limit-period", scenarios = [
@@ -204,6 +204,10 @@ def _migrate(self, hardware, scenario, src, dst, connect_uri):
                            ])
             resp = dst.cmd("migrate-set-parameters",
                            multifd_channels=scenario._multifd_channels)
+            resp = src.cmd("migrate-set-parameters",
+                           multifd_compression=scenario._multifd_compression)
+            resp = dst.cmd("migrate-set-parameters",
+                           multifd_compression=scenario._multifd_compression)
 
         if scenario._dirty_limit:
             if not hardware._dirty_ring_size:
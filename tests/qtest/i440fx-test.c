@@ -15,9 +15,14 @@
 #include "qemu/osdep.h"
 
 #include "libqtest-single.h"
+#include "qemu/bswap.h"
+#include "libqos/malloc-pc.h"
 #include "libqos/pci.h"
 #include "libqos/pci-pc.h"
+#include "libqos/virtio-pci.h"
 #include "hw/pci/pci_regs.h"
+#include "standard-headers/linux/virtio_blk.h"
+#include "standard-headers/linux/virtio_config.h"
 
 #define BROKEN 1
 
@@ -278,6 +283,257 @@ static void test_i440fx_pam(gconstpointer opaque)
     qtest_end();
 }
 
+/* Return the ranges of the FlatView of the "memory" address space */
+static char *flatview_memory(void)
+{
+    g_autofree char *out = qtest_hmp(global_qtest, "info mtree -f");
+    g_auto(GStrv) views = g_strsplit(out, "FlatView #", -1);
+    int i;
+
+    for (i = 0; views[i]; i++) {
+        char *ranges = strstr(views[i], " Root memory region: system\n");
+        char *end;
+
+        if (!ranges || !strstr(views[i], " AS \"memory\", root: system\n")) {
+            continue;
+        }
+        end = strstr(ranges, "\n\n");
+        g_assert(end);
+        return g_strndup(ranges, end - ranges);
+    }
+
+    g_assert_not_reached();
+}
+
+static char *bar_range(uint64_t addr, uint64_t size)
+{
+    return g_strdup_printf("%016" PRIx64 "-%016" PRIx64
+                           " (prio 1, i/o): pci-testdev-mmio\n",
+                           addr, addr + size - 1);
+}
+
+/*
+ * FlatViews are only rendered again where the memory topology changed.
+ * Move a BAR, turn memory decoding off and on, and toggle the PAM
+ * aliases, then check that the flat view of the system memory is the
+ * same as the one rendered from scratch before the changes.
+ */
+static void test_i440fx_flatview(gconstpointer opaque)
+{
+    QPCIBus *bus;
+    QPCIDevice *host, *dev;
+    QPCIBar bar;
+    uint64_t size;
+    uint8_t pam[7];
+    uint16_t cmd;
+    g_autofree char *orig = NULL;
+    g_autofree char *orig_bar = NULL;
+    g_autofree char *moved_bar = NULL;
+    char *view;
+    int i;
+
+    if (!qtest_has_device("pci-testdev")) {
+        g_test_skip("pci-testdev is not available");
+        return;
+    }
+
+    qtest_start("-machine pc -device pci-testdev,addr=04.0");
+    bus = qpci_new_pc(global_qtest, NULL);
+    host = qpci_device_find(bus, QPCI_DEVFN(0, 0));
+    dev = qpci_device_find(bus, QPCI_DEVFN(4, 0));
+    g_assert(host != NULL);
+    g_assert(dev != NULL);
+
+    qpci_device_enable(dev);
+    bar = qpci_iomap(dev, 0, &size);
+    orig_bar = bar_range(bar.addr, size);
+    moved_bar = bar_range(bar.addr + 16 * size, size);
+
+    orig = flatview_memory();
+    g_assert(strstr(orig, orig_bar));
+
+    /* Move the BAR within its container, and back */
+    qpci_config_writel(dev, PCI_BASE_ADDRESS_0, bar.addr + 16 * size);
+    view = flatview_memory();
+    g_assert(strstr(view, moved_bar));
+    g_assert(!strstr(view, orig_bar));
+    g_free(view);
+    qpci_config_writel(dev, PCI_BASE_ADDRESS_0, bar.addr);
+
+    /* Remove the BAR from its container, and add it back */
+    cmd = qpci_config_readw(dev, PCI_COMMAND);
+    qpci_config_writew(dev, PCI_COMMAND, cmd & ~PCI_COMMAND_MEMORY);
+    view = flatview_memory();
+    g_assert(!strstr(view, "pci-testdev-mmio"));
+    g_free(view);
+    qpci_config_writew(dev, PCI_COMMAND, cmd);
+
+    /* Switch the PAM aliases to RAM, and back */
+    for (i = 0; i < ARRAY_SIZE(pam); i++) {
+        pam[i] = qpci_config_readb(host, 0x59 + i);
+    }
+    for (i = 1; i < 2 * ARRAY_SIZE(pam); i++) {
+        pam_set(host, i, PAM_RE | PAM_WE);
+    }
+    view = flatview_memory();
+    g_assert_cmpstr(view, !=, orig);
+    g_free(view);
+    for (i = 0; i < ARRAY_SIZE(pam); i++) {
+        qpci_config_writeb(host, 0x59 + i, pam[i]);
+    }
+
+    view = flatview_memory();
+    g_assert_cmpstr(view, ==, orig);
+    g_free(view);
+
+    g_free(dev);
+    g_free(host);
+    qpci_free_pc(bus);
+    qtest_end();
+}
+
+#define VIRTIO_PAM_INDEX        10      /* 0xE0000..0xE3FFF */
+#define VIRTIO_PAM_ADDR         0xE0000
+#define VIRTIO_PAM_REQS         64
+#define VIRTIO_PAM_REQ_SIZE     32      /* header and status */
+#define VIRTIO_PAM_TIMEOUT_US   (30 * 1000 * 1000)
+
+/* Post a one-sector read into @data_addr, with header and status at @req */
+static uint32_t virtio_pam_read(QVirtioDevice *vdev, QVirtQueue *vq,
+                                uint64_t req, uint64_t data_addr)
+{
+    struct virtio_blk_outhdr hdr = {
+        .type = cpu_to_le32(VIRTIO_BLK_T_IN),
+    };
+    uint8_t status = 0xff;
+    uint32_t head;
+
+    memwrite(req, &hdr, sizeof(hdr));
+    memwrite(req + sizeof(hdr), &status, sizeof(status));
+
+    head = qvirtqueue_add(global_qtest, vq, req, sizeof(hdr), false, true);
+    qvirtqueue_add(global_qtest, vq, data_addr, 512, true, true);
+    qvirtqueue_add(global_qtest, vq, req + sizeof(hdr), sizeof(status),
+                   true, false);
+    qvirtqueue_kick(global_qtest, vdev, vq, head);
+    return head;
+}
+
+static uint32_t virtio_pam_wait(QVirtQueue *vq)
+{
+    gint64 start_time = g_get_monotonic_time();
+    uint32_t desc_idx;
+
+    while (!qvirtqueue_get_buf(global_qtest, vq, &desc_idx, NULL)) {
+        g_assert(g_get_monotonic_time() - start_time <=
+                 VIRTIO_PAM_TIMEOUT_US);
+        clock_step(100);
+    }
+    return desc_idx;
+}
+
+static void virtio_pam_check(QVirtQueue *vq, uint32_t head, uint64_t req)
+{
+    g_assert_cmpint(virtio_pam_wait(vq), ==, head);
+    g_assert_cmpint(readb(req + sizeof(struct virtio_blk_outhdr)), ==,
+                    VIRTIO_BLK_S_OK);
+}
+
+/*
+ * virtio devices cache the host address of the guest RAM that their
+ * descriptors point to.  Check that PAM changes, which make the area of
+ * a buffer read-only and then writable again, invalidate that cache, also
+ * while an IOThread keeps mapping buffers in that area.
+ */
+static void test_i440fx_virtio_pam(gconstpointer opaque)
+{
+    QGuestAllocator alloc;
+    QPCIBus *bus;
+    QPCIDevice *host;
+    QVirtioPCIDevice *dev;
+    QVirtioDevice *vdev;
+    QVirtQueue *vq;
+    uint64_t reqs, start;
+    uint32_t head;
+    int i;
+
+    if (!qtest_has_device("virtio-blk-pci")) {
+        g_test_skip("virtio-blk-pci is not available");
+        return;
+    }
+
+    /* Read-only buffers are bounced, let all the requests be in flight */
+    qtest_start("-machine pc -object iothread,id=io0 "
+                "-drive if=none,id=drv0,driver=null-co,read-zeroes=on "
+                "-device virtio-blk-pci,drive=drv0,iothread=io0,addr=04.0,"
+                "x-max-bounce-buffer-size=65536");
+    bus = qpci_new_pc(global_qtest, NULL);
+    pc_alloc_init(&alloc, global_qtest, 0);
+    host = qpci_device_find(bus, QPCI_DEVFN(0, 0));
+    g_assert(host != NULL);
+    dev = virtio_pci_new(bus, &(QPCIAddress) { .devfn = QPCI_DEVFN(4, 0) });
+    g_assert_nonnull(dev);
+    vdev = &dev->vdev;
+
+    qvirtio_pci_device_enable(dev);
+    qvirtio_start_device(vdev);
+    qvirtio_set_features(vdev, qvirtio_get_features(vdev) &
+                               (1ull << VIRTIO_F_VERSION_1));
+    vq = qvirtqueue_setup(vdev, &alloc, 0);
+    qvirtio_set_driver_ok(vdev);
+
+    /* Three descriptors for each request */
+    g_assert_cmpint(vq->size, >=, (VIRTIO_PAM_REQS + 3) * 3);
+    start = guest_alloc(&alloc, (VIRTIO_PAM_REQS + 3) * VIRTIO_PAM_REQ_SIZE);
+    reqs = start;
+
+    /* Let the device cache the translation of a buffer in RAM */
+    pam_set(host, VIRTIO_PAM_INDEX, PAM_RE | PAM_WE);
+    write_area(VIRTIO_PAM_ADDR, VIRTIO_PAM_ADDR + 511, 0x42);
+    head = virtio_pam_read(vdev, vq, reqs, VIRTIO_PAM_ADDR);
+    virtio_pam_check(vq, head, reqs);
+    g_assert(verify_area(VIRTIO_PAM_ADDR, VIRTIO_PAM_ADDR + 511, 0));
+    reqs += VIRTIO_PAM_REQ_SIZE;
+
+    /* The device must not write the area once it is read-only */
+    write_area(VIRTIO_PAM_ADDR, VIRTIO_PAM_ADDR + 511, 0x42);
+    pam_set(host, VIRTIO_PAM_INDEX, PAM_RE);
+    head = virtio_pam_read(vdev, vq, reqs, VIRTIO_PAM_ADDR);
+    virtio_pam_check(vq, head, reqs);
+    g_assert(verify_area(VIRTIO_PAM_ADDR, VIRTIO_PAM_ADDR + 511, 0x42));
+    reqs += VIRTIO_PAM_REQ_SIZE;
+
+    /* ... and must write it again once it is writable */
+    pam_set(host, VIRTIO_PAM_INDEX, PAM_RE | PAM_WE);
+    head = virtio_pam_read(vdev, vq, reqs, VIRTIO_PAM_ADDR);
+    virtio_pam_check(vq, head, reqs);
+    g_assert(verify_area(VIRTIO_PAM_ADDR, VIRTIO_PAM_ADDR + 511, 0));
+    reqs += VIRTIO_PAM_REQ_SIZE;
+
+    /* Flip the area while the IOThread maps the buffers of the requests */
+    for (i = 0; i < VIRTIO_PAM_REQS; i++) {
+        virtio_pam_read(vdev, vq, reqs + i * VIRTIO_PAM_REQ_SIZE,
+                        VIRTIO_PAM_ADDR + (i % 8) * 512);
+        pam_set(host, VIRTIO_PAM_INDEX, i & 1 ? PAM_RE | PAM_WE : PAM_RE);
+    }
+    for (i = 0; i < VIRTIO_PAM_REQS; i++) {
+        virtio_pam_wait(vq);
+    }
+    for (i = 0; i < VIRTIO_PAM_REQS; i++) {
+        g_assert_cmpint(readb(reqs + i * VIRTIO_PAM_REQ_SIZE +
+                              sizeof(struct virtio_blk_outhdr)), ==,
+                        VIRTIO_BLK_S_OK);
+    }
+
+    guest_free(&alloc, start);
+    qvirtqueue_cleanup(vdev->bus, vq, &alloc);
+    qos_object_destroy((QOSGraphObject *)dev);
+    g_free(host);
+    alloc_destroy(&alloc);
+    qpci_free_pc(bus);
+    qtest_end();
+}
+
 #define BLOB_SIZE ((size_t)65536)
 #define ISA_BIOS_MAXSZ ((size_t)(128 * 1024))
 
@@ -386,6 +642,8 @@ int main(int argc, char **argv)
 
     qtest_add_data_func("i440fx/defaults", &data, test_i440fx_defaults);
     qtest_add_data_func("i440fx/pam", &data, test_i440fx_pam);
+    qtest_add_data_func("i440fx/flatview", &data, test_i440fx_flatview);
+    qtest_add_data_func("i440fx/virtio-pam", &data, test_i440fx_virtio_pam);
     add_firmware_test("i440fx/firmware/bios", request_bios);
     add_firmware_test("i440fx/firmware/pflash", request_pflash);
 
@@ -45,7 +45,8 @@ static void virtio_net_setup(QVirtioNet *interface)
     features = qvirtio_get_features(vdev);
     features &= ~(QVIRTIO_F_BAD_FEATURE |
                   (1ull << VIRTIO_RING_F_INDIRECT_DESC) |
-                  (1ull << VIRTIO_RING_F_EVENT_IDX));
+                  (1ull << VIRTIO_RING_F_EVENT_IDX) |
+                  (1ull << VIRTIO_F_RING_PACKED));
     qvirtio_set_features(vdev, features);
 
     if (features & (1ull << VIRTIO_NET_F_MQ)) {
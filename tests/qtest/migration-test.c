@@ -14,13 +14,16 @@
 
 #include "libqtest.h"
 #include "qapi/qmp/qdict.h"
+#include "qemu/cutils.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
 #include "qemu/sockets.h"
+#include "qemu/units.h"
 #include "chardev/char.h"
 #include "crypto/tlscredspsk.h"
 #include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qnum.h"
 #include "ppc-util.h"
 
 #include "migration-helpers.h"
@@ -69,6 +72,7 @@ static QTestMigrationState dst_state;
 #define FILE_TEST_FILENAME "migfile"
 #define FILE_TEST_OFFSET 0x1000
 #define FILE_TEST_MARKER 'X'
+#define TEMPLATE_TEST_FILENAME "template-ram"
 #define QEMU_ENV_SRC "QTEST_QEMU_BINARY_SRC"
 #define QEMU_ENV_DST "QTEST_QEMU_BINARY_DST"
 
@@ -84,6 +88,9 @@ typedef enum PostcopyRecoveryFailStage {
 } PostcopyRecoveryFailStage;
 
 #if defined(__linux__)
+#include <net/if.h>
+#include <netpacket/packet.h>
+#include <sys/ioctl.h>
 #include <sys/syscall.h>
 #include <sys/vfs.h>
 #endif
@@ -123,6 +130,19 @@ static bool ufd_version_check(void)
     return true;
 }
 
+static bool ufd_wp_check(void)
+{
+    uint64_t features;
+
+    if (uffd_query_features(&features) ||
+        !(features & UFFD_FEATURE_PAGEFAULT_FLAG_WP)) {
+        g_test_message("Skipping test: userfaultfd write-protect not available");
+        return false;
+    }
+
+    return true;
+}
+
 #else
 static bool ufd_version_check(void)
 {
@@ -130,6 +150,11 @@ static bool ufd_version_check(void)
     return false;
 }
 
+static bool ufd_wp_check(void)
+{
+    return false;
+}
+
 #endif
 
 static char *tmpfs;
@@ -601,6 +626,11 @@ typedef struct {
      */
     bool hide_stderr;
     bool use_shmem;
+    /*
+     * The source's RAM lives in TEMPLATE_TEST_FILENAME, which the target
+     * maps privately, like a VM cloned from a template VM.
+     */
+    bool use_template;
     /* only launch the target process */
     bool only_target;
     /* Use dirty ring if true; dirty logging otherwise */
@@ -721,6 +751,7 @@ static int test_migrate_start(QTestState **from, QTestState **to,
     g_autofree gchar *cmd_target = NULL;
     const gchar *ignore_stderr;
     g_autofree char *shmem_opts = NULL;
+    g_autofree char *shmem_target_opts = NULL;
     g_autofree char *shmem_path = NULL;
     const char *kvm_opts = NULL;
     const char *arch = qtest_get_arch();
@@ -794,12 +825,24 @@ static int test_migrate_start(QTestState **from, QTestState **to,
         ignore_stderr = "";
     }
 
-    if (args->use_shmem) {
-        shmem_path = g_strdup_printf("/dev/shm/qemu-%d", getpid());
+    if (args->use_shmem || args->use_template) {
+        if (args->use_template) {
+            /* Kept until test_migrate_end(), so that the test can read it */
+            shmem_path = g_strdup_printf("%s/%s", tmpfs,
+                                         TEMPLATE_TEST_FILENAME);
+        } else {
+            shmem_path = g_strdup_printf("/dev/shm/qemu-%d", getpid());
+        }
         shmem_opts = g_strdup_printf(
             "-object memory-backend-file,id=mem0,size=%s"
             ",mem-path=%s,share=on -numa node,memdev=mem0",
             memory_size, shmem_path);
+        if (args->use_template) {
+            shmem_target_opts = g_strdup_printf(
+                "-object memory-backend-file,id=mem0,size=%s"
+                ",mem-path=%s,readonly=on,rom=off -numa node,memdev=mem0",
+                memory_size, shmem_path);
+        }
     }
 
     if (args->use_dirty_ring) {
@@ -850,6 +893,7 @@ static int test_migrate_start(QTestState **from, QTestState **to,
                                  memory_size, tmpfs, uri,
                                  arch_opts ? arch_opts : "",
                                  arch_target ? arch_target : "",
+                                 shmem_target_opts ? shmem_target_opts :
                                  shmem_opts ? shmem_opts : "",
                                  args->opts_target ? args->opts_target : "",
                                  ignore_stderr);
@@ -908,6 +952,7 @@ static void test_migrate_end(QTestState *from, QTestState *to, bool test_dest)
     cleanup("src_serial");
     cleanup("dest_serial");
     cleanup(FILE_TEST_FILENAME);
+    cleanup(TEMPLATE_TEST_FILENAME);
 }
 
 #ifdef CONFIG_GNUTLS
@@ -1349,6 +1394,23 @@ static void test_postcopy_suspend(void)
     test_postcopy_common(&args);
 }
 
+static void *
+test_migrate_postcopy_prefetch_start(QTestState *from, QTestState *to)
+{
+    migrate_set_parameter_int(to, "postcopy-prefetch-window", 16);
+
+    return NULL;
+}
+
+static void test_postcopy_prefetch(void)
+{
+    MigrateCommon args = {
+        .start_hook = test_migrate_postcopy_prefetch_start,
+    };
+
+    test_postcopy_common(&args);
+}
+
 static void test_postcopy_preempt(void)
 {
     MigrateCommon args = {
@@ -2180,6 +2242,306 @@ static void *test_mode_reboot_start(QTestState *from, QTestState *to)
     return NULL;
 }
 
+static void *test_mode_transfer_start(QTestState *from, QTestState *to)
+{
+    migrate_set_parameter_str(from, "mode", "cpr-transfer");
+
+    return NULL;
+}
+
+/* cpr-transfer must refuse to start without a channel to pass fds on */
+static void test_mode_transfer_no_cpr_channel(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .listen_uri = uri,
+        .connect_uri = uri,
+        .start_hook = test_mode_transfer_start,
+        .result = MIG_TEST_QMP_ERROR,
+    };
+
+    test_precopy_common(&args);
+}
+
+#if defined(__linux__)
+/* The new QEMU only reaches the qtest handshake after getting the fds */
+static gpointer test_mode_transfer_start_target(gpointer opaque)
+{
+    return qtest_init_with_env(QEMU_ENV_DST, opaque);
+}
+
+/*
+ * A new QEMU that fails to start never reaches the qtest handshake, so run
+ * it directly; returns its stderr.
+ */
+static gpointer test_mode_transfer_start_failing_target(gpointer opaque)
+{
+    const char *qemu = getenv(QEMU_ENV_DST) ?: getenv("QTEST_QEMU_BINARY");
+    g_autofree char *cmd = g_strdup_printf("%s -display none %s",
+                                           qemu, (char *)opaque);
+    g_auto(GStrv) argv = NULL;
+    char *err = NULL;
+    int status;
+
+    g_assert(g_shell_parse_argv(cmd, NULL, &argv, NULL));
+    g_assert(g_spawn_sync(NULL, argv, NULL, G_SPAWN_STDOUT_TO_DEV_NULL,
+                          NULL, NULL, NULL, &err, &status, NULL));
+    g_assert(!WIFEXITED(status) || WEXITSTATUS(status) != 0);
+    return err;
+}
+
+/* Whether tap devices can use io-uring=on, both in QEMU and the kernel */
+static bool test_mode_transfer_has_tap_io_uring(void)
+{
+    g_autofree char *ifname = g_strdup_printf("qcprp%d", getpid());
+    QTestState *qts = qtest_init("-machine none");
+    QDict *resp;
+    bool ret;
+
+    resp = qtest_qmp(qts, "{ 'execute': 'netdev_add', 'arguments': {"
+                     "  'type': 'tap', 'id': 'probe', 'ifname': %s,"
+                     "  'script': 'no', 'downscript': 'no',"
+                     "  'io-uring': true } }", ifname);
+    ret = !qdict_haskey(resp, "error");
+    qobject_unref(resp);
+    qtest_quit(qts);
+    return ret;
+}
+
+/* Bring @ifname up and send a few frames to whoever reads the tap queue */
+static void test_mode_transfer_send_frames(const char *ifname)
+{
+    static const uint8_t broadcast[] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_ifindex = if_nametoindex(ifname),
+        .sll_halen = sizeof(broadcast),
+    };
+    struct ifreq ifr = { 0 };
+    uint8_t frame[64] = { 0 };
+    int fd, i;
+
+    g_assert_cmpint(sll.sll_ifindex, !=, 0);
+    fd = socket(AF_PACKET, SOCK_RAW, 0);
+    g_assert_cmpint(fd, >=, 0);
+
+    pstrcpy(ifr.ifr_name, sizeof(ifr.ifr_name), ifname);
+    g_assert_cmpint(ioctl(fd, SIOCGIFFLAGS, &ifr), ==, 0);
+    ifr.ifr_flags |= IFF_UP;
+    g_assert_cmpint(ioctl(fd, SIOCSIFFLAGS, &ifr), ==, 0);
+
+    /* Broadcast frames with a local experimental ethertype */
+    memcpy(frame, broadcast, sizeof(broadcast));
+    memcpy(sll.sll_addr, broadcast, sizeof(broadcast));
+    frame[12] = 0x88;
+    frame[13] = 0xb5;
+    for (i = 0; i < 16; i++) {
+        g_assert_cmpint(sendto(fd, frame, sizeof(frame), 0,
+                               (struct sockaddr *)&sll, sizeof(sll)),
+                        ==, sizeof(frame));
+    }
+    close(fd);
+}
+
+typedef struct {
+    /* The old and new QEMU use io-uring=on for their tap device */
+    bool src_tap_io_uring;
+    bool dst_tap_io_uring;
+} TransferArgs;
+
+/*
+ * Hand guest RAM (a shared memfd) and, when we are allowed to create one,
+ * a tap device over to a new QEMU.  The old QEMU must not run the tap
+ * downscript when it exits, since the new QEMU keeps using the interface.
+ *
+ * A new QEMU that wants io-uring=on for the tap device must refuse it,
+ * leaving the old QEMU running and in charge of the interface.
+ */
+static void test_mode_transfer_common(TransferArgs *args)
+{
+    g_autofree char *uri = g_strdup_printf("%s/migsocket", tmpfs);
+    g_autofree char *cpr_uri = g_strdup_printf("%s/cprsocket", tmpfs);
+    g_autofree char *downscript = g_strdup_printf("%s/downscript", tmpfs);
+    g_autofree char *downscript_log = g_strdup_printf("%s/downscript.log",
+                                                      tmpfs);
+    g_autofree char *ifname = g_strdup_printf("qcpr%d", getpid());
+    g_autofree char *machine = NULL;
+    g_autofree char *common_opts = NULL;
+    g_autofree char *net_opts = NULL;
+    g_autofree char *cmd_source = NULL;
+    g_autofree char *cmd_target = NULL;
+    bool io_uring = args->src_tap_io_uring || args->dst_tap_io_uring;
+    const char *machine_alias;
+    bool use_tap;
+    QTestState *from, *to;
+    GThread *thread;
+    int i;
+
+    machine_alias = g_str_equal(qtest_get_arch(), "i386") ? "pc" : "q35";
+    if (!qtest_has_machine(machine_alias)) {
+        g_test_skip("machine not supported");
+        return;
+    }
+    machine = resolve_machine_version(machine_alias, QEMU_ENV_SRC,
+                                      QEMU_ENV_DST);
+
+    use_tap = geteuid() == 0 && access("/dev/net/tun", R_OK | W_OK) == 0;
+    if (io_uring && !use_tap) {
+        g_test_skip("tap interfaces need CAP_NET_ADMIN");
+        return;
+    }
+    if (io_uring && !test_mode_transfer_has_tap_io_uring()) {
+        g_test_skip("tap io-uring=on not supported");
+        return;
+    }
+    if (use_tap) {
+        g_autofree char *script = g_strdup_printf("#!/bin/sh\n"
+                                                  "echo \"$1\" >> %s\n",
+                                                  downscript_log);
+
+        g_assert(g_file_set_contents(downscript, script, -1, NULL));
+        g_assert_cmpint(chmod(downscript, 0700), ==, 0);
+        net_opts = g_strdup_printf("-netdev tap,id=net0,ifname=%s,"
+                                   "script=no,downscript=%s",
+                                   ifname, downscript);
+    } else {
+        g_test_message("Not testing tap handover, needs CAP_NET_ADMIN");
+    }
+
+    start_address = X86_TEST_MEM_START;
+    end_address = X86_TEST_MEM_END;
+    src_state = (QTestMigrationState) { };
+    dst_state = (QTestMigrationState) { };
+    bootfile_create(tmpfs, false);
+
+    common_opts = g_strdup_printf("-accel kvm -accel tcg -machine %s "
+                                  "-m 150M -object memory-backend-memfd,"
+                                  "id=mem0,size=150M,share=on "
+                                  "-numa node,memdev=mem0 "
+                                  "-drive if=none,id=d0,file=%s,format=raw "
+                                  "-device ide-hd,drive=d0,secs=1,cyls=1,"
+                                  "heads=1 %s",
+                                  machine, bootpath,
+                                  net_opts ? net_opts : "");
+    cmd_source = g_strdup_printf("%s%s -name source,debug-threads=on "
+                                 "-serial file:%s/src_serial",
+                                 common_opts,
+                                 args->src_tap_io_uring ? ",io-uring=on" : "",
+                                 tmpfs);
+    cmd_target = g_strdup_printf("%s%s -name target,debug-threads=on "
+                                 "-serial file:%s/dest_serial "
+                                 "-incoming unix:%s -cpr-uri unix:%s",
+                                 common_opts,
+                                 args->dst_tap_io_uring ? ",io-uring=on" : "",
+                                 tmpfs, uri, cpr_uri);
+
+    from = qtest_init_with_env(QEMU_ENV_SRC, cmd_source);
+    qtest_qmp_set_event_callback(from, migrate_watch_for_events, &src_state);
+    migrate_set_capability(from, "events", true);
+    migrate_set_parameter_str(from, "mode", "cpr-transfer");
+    wait_for_serial("src_serial");
+
+    thread = g_thread_new("cpr-target",
+                          args->dst_tap_io_uring ?
+                          test_mode_transfer_start_failing_target :
+                          test_mode_transfer_start_target,
+                          cmd_target);
+
+    /* Wait for the new QEMU to listen for the fds */
+    for (i = 0; i < 1000 && !g_file_test(cpr_uri, G_FILE_TEST_EXISTS); i++) {
+        usleep(1000 * 10);
+    }
+    g_assert(g_file_test(cpr_uri, G_FILE_TEST_EXISTS));
+
+    qtest_qmp_assert_success(from,
+                             "{ 'execute': 'migrate', 'arguments': {"
+                             "  'channels': ["
+                             "    { 'channel-type': 'main',"
+                             "      'addr': { 'transport': 'socket',"
+                             "                'type': 'unix',"
+                             "                'path': %s } },"
+                             "    { 'channel-type': 'cpr',"
+                             "      'addr': { 'transport': 'socket',"
+                             "                'type': 'unix',"
+                             "                'path': %s } } ] } }",
+                             uri, cpr_uri);
+
+    if (args->dst_tap_io_uring) {
+        g_autofree char *err = g_thread_join(thread);
+
+        g_assert(strstr(err, "io-uring=on is not supported"));
+
+        /* The old QEMU keeps running and still owns the tap */
+        wait_for_migration_fail(from, false);
+        qtest_quit(from);
+        g_assert(g_file_test(downscript_log, G_FILE_TEST_EXISTS));
+        goto out;
+    }
+
+    to = g_thread_join(thread);
+    qtest_qmp_set_event_callback(to, migrate_watch_for_events, &dst_state);
+
+    wait_for_migration_complete(from);
+    wait_for_resume(to, &dst_state);
+
+    /* The new QEMU owns the tap now */
+    qtest_quit(from);
+    g_assert(!g_file_test(downscript_log, G_FILE_TEST_EXISTS));
+
+    /*
+     * Whatever mode the old QEMU left the shared file in, the new QEMU
+     * must not block its main loop reading from it.
+     */
+    if (use_tap) {
+        test_mode_transfer_send_frames(ifname);
+        qtest_qmp_assert_success(to, "{ 'execute' : 'query-status'}");
+    }
+
+    /* The guest keeps running on the same memory */
+    wait_for_serial("dest_serial");
+    qtest_qmp_assert_success(to, "{ 'execute' : 'stop'}");
+    check_guests_ram(to);
+
+    qtest_quit(to);
+    if (use_tap) {
+        g_assert(g_file_test(downscript_log, G_FILE_TEST_EXISTS));
+    }
+
+out:
+    cleanup("migsocket");
+    cleanup("cprsocket");
+    cleanup("downscript");
+    cleanup("downscript.log");
+    cleanup("src_serial");
+    cleanup("dest_serial");
+}
+
+static void test_mode_transfer(void)
+{
+    TransferArgs args = { };
+
+    test_mode_transfer_common(&args);
+}
+
+static void test_mode_transfer_tap_io_uring_src(void)
+{
+    TransferArgs args = {
+        .src_tap_io_uring = true,
+    };
+
+    test_mode_transfer_common(&args);
+}
+
+static void test_mode_transfer_tap_io_uring_dst(void)
+{
+    TransferArgs args = {
+        .dst_tap_io_uring = true,
+    };
+
+    test_mode_transfer_common(&args);
+}
+#endif
+
 static void *migrate_mapped_ram_start(QTestState *from, QTestState *to)
 {
     migrate_set_capability(from, "mapped-ram", true);
@@ -2188,6 +2550,62 @@ static void *migrate_mapped_ram_start(QTestState *from, QTestState *to)
     return NULL;
 }
 
+#ifndef _WIN32
+static void *test_template_clone_start(QTestState *from, QTestState *to)
+{
+    migrate_set_capability(from, "x-ignore-shared", true);
+    migrate_set_capability(to, "x-ignore-shared", true);
+
+    return NULL;
+}
+
+static void test_template_clone_end(QTestState *from, QTestState *to,
+                                    void *opaque)
+{
+    g_autofree char *path = g_strdup_printf("%s/%s", tmpfs,
+                                            TEMPLATE_TEST_FILENAME);
+    /* The test memory starts 1 MiB into guest RAM on every target */
+    off_t offset = 1024 * 1024;
+    uint8_t tmpl, byte;
+    int fd;
+
+    /* The clone found the template's RAM in the file */
+    g_assert_cmpint(read_ram_property_int(from, "transferred"), <,
+                    1024 * 1024);
+
+    qtest_qmp_assert_success(to, "{ 'execute' : 'stop'}");
+    wait_for_stop(to, &dst_state);
+
+    fd = open(path, O_RDONLY);
+    g_assert(fd >= 0);
+    g_assert_cmpint(pread(fd, &tmpl, 1, offset), ==, 1);
+    g_assert_cmpint(qtest_readb(from, start_address), ==, tmpl);
+
+    /* A write of the clone stays in its private copy of the page */
+    qtest_writeb(to, start_address, tmpl ^ 0xff);
+    g_assert_cmpint(qtest_readb(to, start_address), ==, tmpl ^ 0xff);
+    g_assert_cmpint(pread(fd, &byte, 1, offset), ==, 1);
+    g_assert_cmpint(byte, ==, tmpl);
+    g_assert_cmpint(qtest_readb(from, start_address), ==, tmpl);
+    close(fd);
+}
+
+static void test_template_clone(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .start.use_template = true,
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start_hook = test_template_clone_start,
+        .finish_hook = test_template_clone_end,
+    };
+
+    test_file_common(&args, true);
+}
+#endif
+
 static void test_mode_reboot(void)
 {
     g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
@@ -2228,6 +2646,68 @@ static void test_precopy_file_mapped_ram(void)
     test_file_common(&args, true);
 }
 
+static void *migrate_mapped_ram_lazy_restore_start(QTestState *from,
+                                                   QTestState *to)
+{
+    migrate_mapped_ram_start(from, to);
+    migrate_set_capability(to, "lazy-restore", true);
+
+    return NULL;
+}
+
+/*
+ * The destination guest starts while its RAM is still being loaded;
+ * the test pattern checks that every page it touches was loaded.
+ */
+static void test_precopy_file_mapped_ram_lazy_restore(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start_hook = migrate_mapped_ram_lazy_restore_start,
+    };
+
+    test_file_common(&args, false);
+}
+
+static void *migrate_mapped_ram_incremental_start(QTestState *from,
+                                                 QTestState *to)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+
+    migrate_mapped_ram_start(from, to);
+    migrate_set_capability(from, "incremental-checkpoint", true);
+
+    /* Take a full checkpoint and let the guest dirty memory again */
+    wait_for_serial("src_serial");
+    migrate_ensure_converge(from);
+    migrate_qmp(from, to, uri, NULL, "{}");
+    wait_for_migration_complete(from);
+    qtest_qmp_assert_success(from, "{ 'execute' : 'cont'}");
+
+    return NULL;
+}
+
+/*
+ * The migration writes over the checkpoint taken by the start hook;
+ * the destination must see the up to date memory.
+ */
+static void test_precopy_file_mapped_ram_incremental(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start_hook = migrate_mapped_ram_incremental_start,
+    };
+
+    test_file_common(&args, false);
+}
+
 static void *migrate_multifd_mapped_ram_start(QTestState *from, QTestState *to)
 {
     migrate_mapped_ram_start(from, to);
@@ -2267,54 +2747,125 @@ static void test_multifd_file_mapped_ram(void)
     test_file_common(&args, true);
 }
 
-static void *multifd_mapped_ram_dio_start(QTestState *from, QTestState *to)
+static void *migrate_background_snapshot_mapped_ram_start(QTestState *from,
+                                                          QTestState *to)
 {
-    migrate_multifd_mapped_ram_start(from, to);
-
-    migrate_set_parameter_bool(from, "direct-io", true);
-    migrate_set_parameter_bool(to, "direct-io", true);
+    migrate_mapped_ram_start(from, to);
+    migrate_set_capability(from, "background-snapshot", true);
 
     return NULL;
 }
 
-static void test_multifd_file_mapped_ram_dio(void)
+/*
+ * The guest keeps running and dirtying memory while it is saved, with
+ * its write faults handled by the fault threads.
+ */
+static void test_background_snapshot_file_mapped_ram(void)
 {
     g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
                                            FILE_TEST_FILENAME);
     MigrateCommon args = {
         .connect_uri = uri,
         .listen_uri = "defer",
-        .start_hook = multifd_mapped_ram_dio_start,
+        .start_hook = migrate_background_snapshot_mapped_ram_start,
     };
 
-    if (!probe_o_direct_support(tmpfs)) {
-        g_test_skip("Filesystem does not support O_DIRECT");
-        return;
-    }
-
-    test_file_common(&args, true);
+    test_file_common(&args, false);
 }
 
-#ifndef _WIN32
-static void multifd_mapped_ram_fdset_end(QTestState *from, QTestState *to,
-                                         void *opaque)
+static void *migrate_background_snapshot_multifd_mapped_ram_start(
+    QTestState *from, QTestState *to)
 {
-    QDict *resp;
-    QList *fdsets;
+    migrate_multifd_mapped_ram_start(from, to);
+    migrate_set_capability(from, "background-snapshot", true);
 
-    /*
-     * Remove the fdsets after migration, otherwise a second migration
-     * would fail due fdset reuse.
-     */
-    qtest_qmp_assert_success(from, "{'execute': 'remove-fd', "
-                             "'arguments': { 'fdset-id': 1}}");
+    return NULL;
+}
 
-    /*
-     * Make sure no fdsets are left after migration, otherwise a
-     * second migration would fail due fdset reuse.
-     */
-    resp = qtest_qmp(from, "{'execute': 'query-fdsets', "
-                     "'arguments': {}}");
+static void test_background_snapshot_multifd_file_mapped_ram(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start_hook = migrate_background_snapshot_multifd_mapped_ram_start,
+    };
+
+    test_file_common(&args, false);
+}
+
+static void *migrate_background_snapshot_multifd_nothreads_start(
+    QTestState *from, QTestState *to)
+{
+    migrate_background_snapshot_multifd_mapped_ram_start(from, to);
+    migrate_set_parameter_int(from, "background-snapshot-threads", 0);
+
+    return NULL;
+}
+
+/* Without fault threads, the migration thread handles the faults */
+static void test_background_snapshot_multifd_file_mapped_ram_nothreads(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start_hook = migrate_background_snapshot_multifd_nothreads_start,
+    };
+
+    test_file_common(&args, false);
+}
+
+static void *multifd_mapped_ram_dio_start(QTestState *from, QTestState *to)
+{
+    migrate_multifd_mapped_ram_start(from, to);
+
+    migrate_set_parameter_bool(from, "direct-io", true);
+    migrate_set_parameter_bool(to, "direct-io", true);
+
+    return NULL;
+}
+
+static void test_multifd_file_mapped_ram_dio(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start_hook = multifd_mapped_ram_dio_start,
+    };
+
+    if (!probe_o_direct_support(tmpfs)) {
+        g_test_skip("Filesystem does not support O_DIRECT");
+        return;
+    }
+
+    test_file_common(&args, true);
+}
+
+#ifndef _WIN32
+static void multifd_mapped_ram_fdset_end(QTestState *from, QTestState *to,
+                                         void *opaque)
+{
+    QDict *resp;
+    QList *fdsets;
+
+    /*
+     * Remove the fdsets after migration, otherwise a second migration
+     * would fail due fdset reuse.
+     */
+    qtest_qmp_assert_success(from, "{'execute': 'remove-fd', "
+                             "'arguments': { 'fdset-id': 1}}");
+
+    /*
+     * Make sure no fdsets are left after migration, otherwise a
+     * second migration would fail due fdset reuse.
+     */
+    resp = qtest_qmp(from, "{'execute': 'query-fdsets', "
+                     "'arguments': {}}");
     g_assert(qdict_haskey(resp, "return"));
     fdsets = qdict_get_qlist(resp, "return");
     g_assert(fdsets && qlist_empty(fdsets));
@@ -2390,6 +2941,30 @@ static void test_precopy_tcp_plain(void)
     test_precopy_common(&args);
 }
 
+static void *test_migrate_defer_hot_pages_start(QTestState *from,
+                                                QTestState *to)
+{
+    migrate_set_capability(from, "defer-hot-pages", true);
+
+    return NULL;
+}
+
+static void test_precopy_tcp_defer_hot_pages(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "tcp:127.0.0.1:0",
+        .start_hook = test_migrate_defer_hot_pages_start,
+        /*
+         * The guest keeps rewriting its whole test buffer, so after a
+         * few syncs all of it is hot.
+         */
+        .live = true,
+        .iterations = 3,
+    };
+
+    test_precopy_common(&args);
+}
+
 static void *test_migrate_switchover_ack_start(QTestState *from, QTestState *to)
 {
 
@@ -2849,6 +3424,60 @@ static void test_migrate_auto_converge(void)
     test_migrate_end(from, to, true);
 }
 
+/*
+ * While the migration is active, query-migrate reports which part of
+ * the expected downtime is predicted for each state section; RAM is
+ * always iterated, so it must be there.
+ */
+static void test_migrate_downtime_breakdown(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart args = {};
+    QTestState *from, *to;
+    QDict *rsp_return, *entry;
+    QListEntry *item;
+    QList *breakdown;
+    bool found_ram = false;
+
+    if (test_migrate_start(&from, &to, uri, &args)) {
+        return;
+    }
+
+    migrate_ensure_non_converge(from);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, to, uri, NULL, "{}");
+
+    /* The prediction is updated with the bandwidth, after a few passes */
+    wait_for_migration_pass(from);
+
+    rsp_return = migrate_query_not_failed(from);
+    g_assert(qdict_haskey(rsp_return, "expected-downtime"));
+    breakdown = qdict_get_qlist(rsp_return, "expected-downtime-breakdown");
+    g_assert(breakdown && !qlist_empty(breakdown));
+    QLIST_FOREACH_ENTRY(breakdown, item) {
+        entry = qobject_to(QDict, qlist_entry_obj(item));
+        g_assert(qdict_haskey(entry, "size"));
+        g_assert(qdict_haskey(entry, "time"));
+        if (g_str_equal(qdict_get_str(entry, "name"), "ram")) {
+            found_ram = true;
+        }
+    }
+    g_assert(found_ram);
+    qobject_unref(rsp_return);
+
+    migrate_ensure_converge(from);
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+}
+
 static void *
 test_migrate_precopy_tcp_multifd_start_common(QTestState *from,
                                               QTestState *to,
@@ -2920,6 +3549,44 @@ test_migrate_precopy_tcp_multifd_zstd_start(QTestState *from,
 }
 #endif /* CONFIG_ZSTD */
 
+#ifdef CONFIG_LZ4
+static void *
+test_migrate_precopy_tcp_multifd_lz4_start(QTestState *from,
+                                           QTestState *to)
+{
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "lz4");
+}
+#endif /* CONFIG_LZ4 */
+
+static void *
+test_migrate_precopy_tcp_multifd_xbzrle_start(QTestState *from,
+                                              QTestState *to)
+{
+    migrate_set_parameter_int(from, "xbzrle-cache-size", 33554432);
+
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "xbzrle");
+}
+
+static void *
+test_migrate_precopy_tcp_multifd_autotune_zlib_start(QTestState *from,
+                                                     QTestState *to)
+{
+    migrate_set_capability(from, "multifd-autotune", true);
+
+    return test_migrate_precopy_tcp_multifd_zlib_start(from, to);
+}
+
+#ifdef CONFIG_ZSTD
+static void *
+test_migrate_precopy_tcp_multifd_autotune_zstd_start(QTestState *from,
+                                                     QTestState *to)
+{
+    migrate_set_capability(from, "multifd-autotune", true);
+
+    return test_migrate_precopy_tcp_multifd_zstd_start(from, to);
+}
+#endif /* CONFIG_ZSTD */
+
 #ifdef CONFIG_QATZIP
 static void *
 test_migrate_precopy_tcp_multifd_qatzip_start(QTestState *from,
@@ -3029,6 +3696,232 @@ static void test_multifd_tcp_zstd(void)
 }
 #endif
 
+#ifdef CONFIG_LZ4
+static void test_multifd_tcp_lz4(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_lz4_start,
+    };
+    test_precopy_common(&args);
+}
+#endif
+
+static void test_multifd_tcp_xbzrle(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_xbzrle_start,
+        /*
+         * Deltas are only produced for pages sent more than once, keep
+         * the guest running so that it redirties its memory.
+         */
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
+#define XBZRLE_TEST_PATTERN 0x5a
+
+/*
+ * With zero-page-detection=legacy, zero pages bypass the multifd channels.
+ * Send a page raw, then as a zero page, then with its first contents
+ * again: the last version must not be encoded as unchanged against the
+ * copy cached before the page was zeroed.
+ */
+static void test_multifd_tcp_xbzrle_zero_page(void)
+{
+    MigrateStart args = {};
+    QTestState *from, *to;
+    /* The guest workload stops before end_address */
+    uint64_t addr;
+    uint8_t buf[TEST_MEM_PAGE_SIZE];
+    size_t i;
+
+    if (test_migrate_start(&from, &to, "defer", &args)) {
+        return;
+    }
+
+    addr = end_address;
+    test_migrate_precopy_tcp_multifd_xbzrle_start(from, to);
+    migrate_set_parameter_str(from, "zero-page-detection", "legacy");
+
+    wait_for_serial("src_serial");
+    qtest_memset(from, addr, XBZRLE_TEST_PATTERN, TEST_MEM_PAGE_SIZE);
+
+    migrate_ensure_non_converge(from);
+    migrate_qmp(from, to, NULL, NULL, "{}");
+
+    /*
+     * A page dirtied during a pass is sent during the next one; wait for
+     * two passes after each change so that each version goes out.
+     */
+    wait_for_migration_pass(from);
+    wait_for_migration_pass(from);
+    qtest_memset(from, addr, 0, TEST_MEM_PAGE_SIZE);
+    wait_for_migration_pass(from);
+    wait_for_migration_pass(from);
+    qtest_memset(from, addr, XBZRLE_TEST_PATTERN, TEST_MEM_PAGE_SIZE);
+    wait_for_migration_pass(from);
+    wait_for_migration_pass(from);
+
+    migrate_ensure_converge(from);
+    wait_for_migration_complete(from);
+    wait_for_stop(from, &src_state);
+    wait_for_resume(to, &dst_state);
+    wait_for_serial("dest_serial");
+
+    qtest_memread(to, addr, buf, sizeof(buf));
+    for (i = 0; i < sizeof(buf); i++) {
+        g_assert_cmphex(buf[i], ==, XBZRLE_TEST_PATTERN);
+    }
+
+    test_migrate_end(from, to, true);
+}
+
+/*
+ * Keep the guest running so that the controller gets to evaluate a few
+ * intervals and change the channels or the compression level while
+ * pages are in flight, then check what query-migrate reports about it.
+ */
+static void test_multifd_tcp_autotune_common(TestMigrateStartHook start_hook)
+{
+    MigrateStart args = {};
+    QTestState *from, *to;
+    QDict *rsp_return, *autotune = NULL;
+    const char *decision;
+    int64_t channels;
+    int i;
+
+    if (test_migrate_start(&from, &to, "defer", &args)) {
+        return;
+    }
+
+    start_hook(from, to);
+    channels = migrate_get_parameter_int(from, "multifd-channels");
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_ensure_non_converge(from);
+    migrate_qmp(from, to, NULL, NULL, "{}");
+    wait_for_migration_pass(from);
+
+    /*
+     * The first evaluation only takes the reference point; the
+     * throughput is filled in once a full interval has elapsed.
+     */
+    for (i = 0; i < 300; i++) {
+        rsp_return = migrate_query_not_failed(from);
+        if (qdict_haskey(rsp_return, "multifd-autotune")) {
+            autotune = qdict_get_qdict(rsp_return, "multifd-autotune");
+            if (qdict_get_int(autotune, "channel-throughput")) {
+                break;
+            }
+        }
+        qobject_unref(rsp_return);
+        autotune = NULL;
+        g_usleep(100 * 1000);
+    }
+    g_assert(autotune);
+
+    g_assert_cmpint(qdict_get_int(autotune, "active-channels"), >=, 1);
+    g_assert_cmpint(qdict_get_int(autotune, "active-channels"), <=, channels);
+    g_assert(qdict_haskey(autotune, "compression-level"));
+    g_assert_cmpint(qdict_get_int(autotune, "compression-level"), >=, 1);
+    g_assert_cmpint(qdict_get_int(autotune, "channel-busy"), >=, 0);
+    g_assert_cmpint(qdict_get_int(autotune, "channel-busy"), <=, 100);
+    g_assert_cmpint(qdict_get_int(autotune, "compression-time"), >=, 0);
+    g_assert_cmpint(qdict_get_int(autotune, "compression-time"), <=, 100);
+    decision = qdict_get_str(autotune, "last-decision");
+    g_assert(g_str_equal(decision, "none") ||
+             g_str_equal(decision, "add-channel") ||
+             g_str_equal(decision, "remove-channel") ||
+             g_str_equal(decision, "raise-level") ||
+             g_str_equal(decision, "lower-level"));
+    if (!g_str_equal(decision, "none")) {
+        g_assert_cmpint(qdict_get_int(autotune, "adjustments"), >=, 1);
+    }
+    qobject_unref(rsp_return);
+
+    migrate_ensure_converge(from);
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+}
+
+static void test_multifd_tcp_autotune_zlib(void)
+{
+    test_multifd_tcp_autotune_common(
+        test_migrate_precopy_tcp_multifd_autotune_zlib_start);
+}
+
+#ifdef CONFIG_ZSTD
+static void test_multifd_tcp_autotune_zstd(void)
+{
+    test_multifd_tcp_autotune_common(
+        test_migrate_precopy_tcp_multifd_autotune_zstd_start);
+}
+#endif
+
+#ifdef CONFIG_REPLICATION
+/*
+ * COLO checkpoints with their RAM sent over the multifd channels.  There
+ * is no colo-compare object, so only the checkpoint timer triggers them.
+ * After a few checkpoints the secondary takes over; its RAM must then be
+ * what the primary had at the last checkpoint.
+ */
+static void test_multifd_tcp_colo(void)
+{
+    MigrateStart args = {};
+    QTestState *from, *to;
+    QDict *rsp;
+    int i;
+
+    if (test_migrate_start(&from, &to, "defer", &args)) {
+        return;
+    }
+
+    migrate_set_capability(from, "x-colo", true);
+    migrate_set_capability(to, "x-colo", true);
+    migrate_set_parameter_int(from, "x-checkpoint-delay", 200);
+    test_migrate_precopy_tcp_multifd_start_common(from, to, "none");
+
+    /* The secondary only loads uncompressed multifd pages into its cache */
+    rsp = qtest_qmp(from, "{ 'execute': 'migrate-set-parameters',"
+                          "'arguments': { 'multifd-compression': 'zlib' } }");
+    g_assert_true(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    migrate_ensure_converge(from);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, to, NULL, NULL, "{}");
+    wait_for_migration_status(from, "colo", NULL);
+
+    /* The primary stops and restarts the guest for each checkpoint */
+    for (i = 0; i < 3; i++) {
+        src_state.stop_seen = false;
+        src_state.resume_seen = false;
+        wait_for_stop(from, &src_state);
+        wait_for_resume(from, &src_state);
+    }
+
+    qtest_qmp_assert_success(to, "{ 'execute': 'x-colo-lost-heartbeat' }");
+    qtest_qmp_assert_success(from, "{ 'execute': 'x-colo-lost-heartbeat' }");
+
+    wait_for_serial("dest_serial");
+
+    test_migrate_end(from, to, true);
+}
+#endif
+
 #ifdef CONFIG_QATZIP
 static void test_multifd_tcp_qatzip(void)
 {
@@ -3544,6 +4437,138 @@ static void test_vcpu_dirty_limit(void)
     dirtylimit_stop_vm(vm);
 }
 
+static void test_dirty_heatmap(void)
+{
+    QTestState *vm;
+    QDict *rsp_return;
+    QList *blocks, *vcpus;
+    const QListEntry *entry;
+    uint64_t dirty_pages = 0;
+
+    vm = dirtylimit_start_vm();
+    wait_for_serial("vm_serial");
+
+    qtest_qmp_assert_success(vm,
+                             "{ 'execute': 'calc-dirty-rate',"
+                             "'arguments': { "
+                             "'calc-time': 1,"
+                             "'mode': 'dirty-ring',"
+                             "'heatmap-intervals': 2 }}");
+
+    /* Migration must wait for the heatmap */
+    rsp_return = qtest_qmp(vm, "{ 'execute': 'migrate',"
+                           "'arguments': { 'uri': 'exec:cat > /dev/null' }}");
+    g_assert(qdict_haskey(rsp_return, "error"));
+    qobject_unref(rsp_return);
+
+    wait_for_calc_dirtyrate_complete(vm, 2);
+
+    rsp_return = qtest_qmp_assert_success_ref(vm,
+                                     "{ 'execute': 'query-dirty-heatmap' }");
+    g_assert_cmpstr(qdict_get_str(rsp_return, "status"), ==, "measured");
+    g_assert_cmpint(qdict_get_int(rsp_return, "intervals"), ==, 2);
+    g_assert_cmpint(qdict_get_int(rsp_return, "region-size"), ==, 2 * MiB);
+
+    /* The boot sector keeps dirtying memory */
+    blocks = qdict_get_qlist(rsp_return, "blocks");
+    g_assert(blocks && !qlist_empty(blocks));
+    QLIST_FOREACH_ENTRY(blocks, entry) {
+        QDict *block = qobject_to(QDict, qlist_entry_obj(entry));
+        QList *runs = qdict_get_qlist(block, "runs");
+        uint64_t regions = 0;
+        const QListEntry *run;
+
+        /* Pairs of a number of regions and their dirty page count */
+        for (run = qlist_first(runs); run; run = qlist_next(run)) {
+            QNum *len = qobject_to(QNum, qlist_entry_obj(run));
+
+            run = qlist_next(run);
+            g_assert(run);
+            regions += qnum_get_uint(len);
+            dirty_pages += qnum_get_uint(len) *
+                qnum_get_uint(qobject_to(QNum, qlist_entry_obj(run)));
+        }
+        g_assert_cmpint(regions, ==, qdict_get_int(block, "regions"));
+    }
+    g_assert_cmpint(dirty_pages, >, 0);
+
+    vcpus = qdict_get_qlist(rsp_return, "vcpus");
+    g_assert(vcpus && !qlist_empty(vcpus));
+    qobject_unref(rsp_return);
+
+    dirtylimit_stop_vm(vm);
+}
+
+static int64_t get_kvm_stat(QTestState *vm, const char *name)
+{
+    QDict *rsp_return;
+    QList *providers;
+    QDict *provider;
+    QList *stats;
+    QDict *stat;
+    int64_t value;
+
+    rsp_return = qtest_qmp(vm, "{ 'execute': 'query-stats',"
+                           "'arguments': { 'target': 'vm',"
+                           "'providers': [ { 'provider': 'kvm',"
+                           "'names': [ %s ] } ] } }", name);
+    g_assert(rsp_return);
+
+    providers = qdict_get_qlist(rsp_return, "return");
+    g_assert(providers && !qlist_empty(providers));
+    provider = qobject_to(QDict, qlist_peek(providers));
+    g_assert(provider);
+    stats = qdict_get_qlist(provider, "stats");
+    g_assert(stats && !qlist_empty(stats));
+    stat = qobject_to(QDict, qlist_peek(stats));
+    g_assert(stat);
+    g_assert_cmpstr(qdict_get_str(stat, "name"), ==, name);
+    value = qdict_get_int(stat, "value");
+    qobject_unref(rsp_return);
+
+    return value;
+}
+
+static void test_dirty_ring_reapers(void)
+{
+    QTestState *vm;
+    g_autofree gchar *cmd = NULL;
+    int64_t rate = 0;
+    int i;
+
+    /*
+     * vCPU 0 runs the boot sector, and belongs to the first of the two
+     * reapers; the reap rate must account for the pages of both.
+     */
+    bootfile_create(tmpfs, false);
+    cmd = g_strdup_printf("-accel kvm,dirty-ring-size=4096,"
+                          "dirty-ring-reapers=2 "
+                          "-name dirty-ring-reapers-test,debug-threads=on "
+                          "-m 150M -smp 2 "
+                          "-serial file:%s/vm_serial "
+                          "-drive file=%s,format=raw ",
+                          tmpfs, bootpath);
+    vm = qtest_init(cmd);
+    wait_for_serial("vm_serial");
+
+    /* Let the reapers collect the dirty rings while measuring */
+    qtest_qmp_assert_success(vm,
+                             "{ 'execute': 'calc-dirty-rate',"
+                             "'arguments': { "
+                             "'calc-time': 5,"
+                             "'mode': 'dirty-ring' }}");
+
+    for (i = 0; i < 40 && rate == 0; i++) {
+        usleep(1000 * 100);
+        rate = get_kvm_stat(vm, "dirty_ring_reap_rate");
+    }
+    g_assert_cmpint(rate, >, 0);
+    g_assert_cmpint(get_kvm_stat(vm, "dirty_ring_reaped_pages"), >, 0);
+
+    wait_for_calc_dirtyrate_complete(vm, 5);
+    dirtylimit_stop_vm(vm);
+}
+
 static void migrate_dirty_limit_wait_showup(QTestState *from,
                                             const int64_t period,
                                             const int64_t value)
@@ -3787,6 +4812,8 @@ int main(int argc, char **argv)
         migration_test_add("/migration/postcopy/plain", test_postcopy);
         migration_test_add("/migration/postcopy/recovery/plain",
                            test_postcopy_recovery);
+        migration_test_add("/migration/postcopy/prefetch/plain",
+                           test_postcopy_prefetch);
         migration_test_add("/migration/postcopy/preempt/plain",
                            test_postcopy_preempt);
         migration_test_add("/migration/postcopy/preempt/recovery/plain",
@@ -3825,11 +4852,33 @@ int main(int argc, char **argv)
     if (getenv("QEMU_TEST_FLAKY_TESTS")) {
         migration_test_add("/migration/mode/reboot", test_mode_reboot);
     }
+#ifndef _WIN32
+    migration_test_add("/migration/precopy/file/template-clone",
+                       test_template_clone);
+#endif
+    migration_test_add("/migration/mode/transfer/no-cpr-channel",
+                       test_mode_transfer_no_cpr_channel);
+#if defined(__linux__)
+    if (g_str_equal(arch, "i386") || g_str_equal(arch, "x86_64")) {
+        migration_test_add("/migration/mode/transfer",
+                           test_mode_transfer);
+        migration_test_add("/migration/mode/transfer/tap-io-uring-src",
+                           test_mode_transfer_tap_io_uring_src);
+        migration_test_add("/migration/mode/transfer/tap-io-uring-dst",
+                           test_mode_transfer_tap_io_uring_dst);
+    }
+#endif
 
     migration_test_add("/migration/precopy/file/mapped-ram",
                        test_precopy_file_mapped_ram);
     migration_test_add("/migration/precopy/file/mapped-ram/live",
                        test_precopy_file_mapped_ram_live);
+    if (has_uffd) {
+        migration_test_add("/migration/precopy/file/mapped-ram/lazy-restore",
+                           test_precopy_file_mapped_ram_lazy_restore);
+    }
+    migration_test_add("/migration/precopy/file/mapped-ram/incremental",
+                       test_precopy_file_mapped_ram_incremental);
 
     migration_test_add("/migration/multifd/file/mapped-ram",
                        test_multifd_file_mapped_ram);
@@ -3839,6 +4888,17 @@ int main(int argc, char **argv)
     migration_test_add("/migration/multifd/file/mapped-ram/dio",
                        test_multifd_file_mapped_ram_dio);
 
+    if (has_uffd && ufd_wp_check()) {
+        migration_test_add("/migration/background-snapshot/file/mapped-ram",
+                           test_background_snapshot_file_mapped_ram);
+        migration_test_add(
+            "/migration/background-snapshot/multifd/file/mapped-ram",
+            test_background_snapshot_multifd_file_mapped_ram);
+        migration_test_add(
+            "/migration/background-snapshot/multifd/file/mapped-ram/nothreads",
+            test_background_snapshot_multifd_file_mapped_ram_nothreads);
+    }
+
 #ifndef _WIN32
     migration_test_add("/migration/multifd/file/mapped-ram/fdset",
                        test_multifd_file_mapped_ram_fdset);
@@ -3877,6 +4937,8 @@ int main(int argc, char **argv)
 
     migration_test_add("/migration/precopy/tcp/plain/switchover-ack",
                        test_precopy_tcp_switchover_ack);
+    migration_test_add("/migration/precopy/tcp/plain/defer-hot-pages",
+                       test_precopy_tcp_defer_hot_pages);
 
 #ifdef CONFIG_GNUTLS
     migration_test_add("/migration/precopy/tcp/tls/psk/match",
@@ -3922,6 +4984,9 @@ int main(int argc, char **argv)
     /*
      * See explanation why this test is slow on function definition
      */
+    migration_test_add("/migration/downtime_breakdown",
+                       test_migrate_downtime_breakdown);
+
     if (g_test_slow()) {
         migration_test_add("/migration/auto_converge",
                            test_migrate_auto_converge);
@@ -3947,6 +5012,24 @@ int main(int argc, char **argv)
     migration_test_add("/migration/multifd/tcp/plain/zstd",
                        test_multifd_tcp_zstd);
 #endif
+#ifdef CONFIG_LZ4
+    migration_test_add("/migration/multifd/tcp/plain/lz4",
+                       test_multifd_tcp_lz4);
+#endif
+    migration_test_add("/migration/multifd/tcp/plain/xbzrle",
+                       test_multifd_tcp_xbzrle);
+    migration_test_add("/migration/multifd/tcp/plain/xbzrle/zero-page",
+                       test_multifd_tcp_xbzrle_zero_page);
+    migration_test_add("/migration/multifd/tcp/plain/autotune/zlib",
+                       test_multifd_tcp_autotune_zlib);
+#ifdef CONFIG_ZSTD
+    migration_test_add("/migration/multifd/tcp/plain/autotune/zstd",
+                       test_multifd_tcp_autotune_zstd);
+#endif
+#ifdef CONFIG_REPLICATION
+    migration_test_add("/migration/multifd/tcp/plain/colo",
+                       test_multifd_tcp_colo);
+#endif
 #ifdef CONFIG_QATZIP
     migration_test_add("/migration/multifd/tcp/plain/qatzip",
                 test_multifd_tcp_qatzip);
@@ -3984,6 +5067,10 @@ int main(int argc, char **argv)
         if (qtest_has_machine("pc") && g_test_slow()) {
             migration_test_add("/migration/vcpu_dirty_limit",
                                test_vcpu_dirty_limit);
+            migration_test_add("/migration/dirty_heatmap",
+                               test_dirty_heatmap);
+            migration_test_add("/migration/dirty_ring_reapers",
+                               test_dirty_ring_reapers);
         }
     }
 
@@ -10,11 +10,16 @@
 #include "qemu/osdep.h"
 #include "qemu/module.h"
 #include "qemu/units.h"
+#include "qemu/cutils.h"
 #include "libqtest.h"
 #include "libqos/qgraph.h"
 #include "libqos/pci.h"
 #include "block/nvme.h"
 
+#define NVME_TEST_IOQS 4
+#define NVME_TEST_QSIZE 8
+#define NVME_TEST_TIMEOUT_US (5 * G_USEC_PER_SEC)
+
 typedef struct QNvme QNvme;
 
 struct QNvme {
@@ -142,6 +147,233 @@ static void nvmetest_pmr_reg_test(void *obj, void *data, QGuestAllocator *alloc)
     qpci_iounmap(pdev, pmr_bar);
 }
 
+typedef struct NvmeTestQueue {
+    uint64_t sq;
+    uint64_t cq;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint16_t phase;
+} NvmeTestQueue;
+
+typedef struct NvmeTestCtrl {
+    QPCIDevice *pdev;
+    QPCIBar bar;
+    QGuestAllocator *alloc;
+    NvmeTestQueue q[NVME_TEST_IOQS + 1];
+} NvmeTestCtrl;
+
+static void nvmetest_sq_doorbell(NvmeTestCtrl *c, uint16_t qid, uint32_t val)
+{
+    qpci_io_writel(c->pdev, c->bar, 0x1000 + (2 * qid) * 4, val);
+}
+
+static void nvmetest_cq_doorbell(NvmeTestCtrl *c, uint16_t qid, uint32_t val)
+{
+    qpci_io_writel(c->pdev, c->bar, 0x1000 + (2 * qid + 1) * 4, val);
+}
+
+/* Queue a command, without ringing the doorbell */
+static void nvmetest_post(NvmeTestCtrl *c, uint16_t qid, NvmeCmd *cmd)
+{
+    NvmeTestQueue *q = &c->q[qid];
+
+    qtest_memwrite(c->pdev->bus->qts, q->sq + q->sq_tail * sizeof(*cmd),
+                   cmd, sizeof(*cmd));
+    q->sq_tail = (q->sq_tail + 1) % NVME_TEST_QSIZE;
+}
+
+static void nvmetest_ring(NvmeTestCtrl *c, uint16_t qid)
+{
+    nvmetest_sq_doorbell(c, qid, c->q[qid].sq_tail);
+}
+
+static void nvmetest_wait_cqe(NvmeTestCtrl *c, uint16_t qid, NvmeCqe *cqe)
+{
+    NvmeTestQueue *q = &c->q[qid];
+    gint64 end = g_get_monotonic_time() + NVME_TEST_TIMEOUT_US;
+
+    for (;;) {
+        qtest_memread(c->pdev->bus->qts, q->cq + q->cq_head * sizeof(*cqe),
+                      cqe, sizeof(*cqe));
+        if ((le16_to_cpu(cqe->status) & 1) == q->phase) {
+            break;
+        }
+        g_assert(g_get_monotonic_time() < end);
+        g_usleep(100);
+    }
+
+    q->cq_head = (q->cq_head + 1) % NVME_TEST_QSIZE;
+    if (!q->cq_head) {
+        q->phase ^= 1;
+    }
+    nvmetest_cq_doorbell(c, qid, q->cq_head);
+}
+
+static uint16_t nvmetest_admin(NvmeTestCtrl *c, uint8_t opcode,
+                               uint64_t prp1, uint32_t cdw10, uint32_t cdw11)
+{
+    NvmeCmd cmd = {
+        .opcode = opcode,
+        .dptr.prp1 = cpu_to_le64(prp1),
+        .cdw10 = cpu_to_le32(cdw10),
+        .cdw11 = cpu_to_le32(cdw11),
+    };
+    NvmeCqe cqe;
+
+    nvmetest_post(c, 0, &cmd);
+    nvmetest_ring(c, 0);
+    nvmetest_wait_cqe(c, 0, &cqe);
+
+    return le16_to_cpu(cqe.status) >> 1;
+}
+
+static void nvmetest_enable(NvmeTestCtrl *c)
+{
+    NvmeTestQueue *aq = &c->q[0];
+    gint64 end = g_get_monotonic_time() + NVME_TEST_TIMEOUT_US;
+    uint32_t cc = 0;
+
+    aq->sq = guest_alloc(c->alloc, NVME_TEST_QSIZE * sizeof(NvmeCmd));
+    aq->cq = guest_alloc(c->alloc, NVME_TEST_QSIZE * sizeof(NvmeCqe));
+    aq->phase = 1;
+    qtest_memset(c->pdev->bus->qts, aq->cq, 0,
+                 NVME_TEST_QSIZE * sizeof(NvmeCqe));
+
+    qpci_io_writel(c->pdev, c->bar, NVME_REG_AQA,
+                   (NVME_TEST_QSIZE - 1) << 16 | (NVME_TEST_QSIZE - 1));
+    qpci_io_writeq(c->pdev, c->bar, NVME_REG_ASQ, aq->sq);
+    qpci_io_writeq(c->pdev, c->bar, NVME_REG_ACQ, aq->cq);
+
+    NVME_SET_CC_EN(cc, 1);
+    NVME_SET_CC_IOSQES(cc, 6);
+    NVME_SET_CC_IOCQES(cc, 4);
+    qpci_io_writel(c->pdev, c->bar, NVME_REG_CC, cc);
+
+    while (!(qpci_io_readl(c->pdev, c->bar, NVME_REG_CSTS) &
+             NVME_CSTS_READY)) {
+        g_assert(g_get_monotonic_time() < end);
+        g_usleep(100);
+    }
+}
+
+static void nvmetest_create_sq(NvmeTestCtrl *c, uint16_t qid)
+{
+    NvmeTestQueue *q = &c->q[qid];
+
+    q->sq_tail = 0;
+    g_assert_cmpint(nvmetest_admin(c, NVME_ADM_CMD_CREATE_SQ, q->sq,
+                                   (NVME_TEST_QSIZE - 1) << 16 | qid,
+                                   qid << 16 | 1), ==, NVME_SUCCESS);
+}
+
+static void nvmetest_create_ioq(NvmeTestCtrl *c, uint16_t qid)
+{
+    NvmeTestQueue *q = &c->q[qid];
+
+    q->sq = guest_alloc(c->alloc, NVME_TEST_QSIZE * sizeof(NvmeCmd));
+    q->cq = guest_alloc(c->alloc, NVME_TEST_QSIZE * sizeof(NvmeCqe));
+    q->phase = 1;
+    qtest_memset(c->pdev->bus->qts, q->cq, 0,
+                 NVME_TEST_QSIZE * sizeof(NvmeCqe));
+
+    /* Physically contiguous, no interrupts */
+    g_assert_cmpint(nvmetest_admin(c, NVME_ADM_CMD_CREATE_CQ, q->cq,
+                                   (NVME_TEST_QSIZE - 1) << 16 | qid, 1),
+                    ==, NVME_SUCCESS);
+    nvmetest_create_sq(c, qid);
+}
+
+static void nvmetest_post_read(NvmeTestCtrl *c, uint16_t qid, uint16_t cid,
+                               uint64_t buf)
+{
+    NvmeCmd cmd = {
+        .opcode = NVME_CMD_READ,
+        .cid = cpu_to_le16(cid),
+        .nsid = cpu_to_le32(1),
+        .dptr.prp1 = cpu_to_le64(buf),
+    };
+
+    qtest_memset(c->pdev->bus->qts, buf, 0xff, 512);
+    nvmetest_post(c, qid, &cmd);
+}
+
+static void nvmetest_check_read(NvmeTestCtrl *c, uint16_t qid, uint16_t cid,
+                                uint64_t buf)
+{
+    uint8_t data[512];
+    NvmeCqe cqe;
+
+    nvmetest_wait_cqe(c, qid, &cqe);
+    g_assert_cmpint(le16_to_cpu(cqe.status) >> 1, ==, NVME_SUCCESS);
+    g_assert_cmpint(le16_to_cpu(cqe.sq_id), ==, qid);
+    g_assert_cmpint(le16_to_cpu(cqe.cid), ==, cid);
+
+    qtest_memread(c->pdev->bus->qts, buf, data, sizeof(data));
+    g_assert(buffer_is_zero(data, sizeof(data)));
+}
+
+/*
+ * I/O submission queue tail doorbells are dispatched without the BQL.
+ * Ring the doorbells of several queues back to back, as vCPUs each
+ * driving their own queue would, and mix in doorbells that must fall
+ * back to the locked path: a deleted queue, a queue that was never
+ * created, and a tail past the end of the queue.
+ */
+static void nvmetest_io_doorbell_test(void *obj, void *data,
+                                      QGuestAllocator *alloc)
+{
+    QNvme *nvme = obj;
+    NvmeTestCtrl c = {
+        .pdev = &nvme->dev,
+        .alloc = alloc,
+    };
+    uint64_t buf[NVME_TEST_IOQS + 1];
+    uint16_t qid, round;
+
+    qpci_device_enable(c.pdev);
+    c.bar = qpci_iomap(c.pdev, 0, NULL);
+    nvmetest_enable(&c);
+
+    for (qid = 1; qid <= NVME_TEST_IOQS; qid++) {
+        nvmetest_create_ioq(&c, qid);
+        buf[qid] = guest_alloc(alloc, 512);
+    }
+
+    for (round = 0; round < 4 * NVME_TEST_QSIZE; round++) {
+        for (qid = 1; qid <= NVME_TEST_IOQS; qid++) {
+            nvmetest_post_read(&c, qid, round, buf[qid]);
+        }
+        for (qid = 1; qid <= NVME_TEST_IOQS; qid++) {
+            nvmetest_ring(&c, qid);
+        }
+        for (qid = 1; qid <= NVME_TEST_IOQS; qid++) {
+            nvmetest_check_read(&c, qid, round, buf[qid]);
+        }
+    }
+
+    /* Delete a queue, and ring its doorbell */
+    g_assert_cmpint(nvmetest_admin(&c, NVME_ADM_CMD_DELETE_SQ, 0, 1, 0),
+                    ==, NVME_SUCCESS);
+    nvmetest_sq_doorbell(&c, 1, 1);
+    nvmetest_sq_doorbell(&c, NVME_TEST_IOQS + 1, 1);
+    nvmetest_sq_doorbell(&c, 2, NVME_TEST_QSIZE);
+
+    /* The controller still processes commands on the other queues */
+    nvmetest_create_sq(&c, 1);
+    for (qid = 1; qid <= NVME_TEST_IOQS; qid++) {
+        nvmetest_post_read(&c, qid, round, buf[qid]);
+        nvmetest_ring(&c, qid);
+    }
+    for (qid = 1; qid <= NVME_TEST_IOQS; qid++) {
+        nvmetest_check_read(&c, qid, round, buf[qid]);
+    }
+
+    g_assert_false(qpci_io_readl(c.pdev, c.bar, NVME_REG_CSTS) &
+                   NVME_CSTS_FAILED);
+
+    qpci_iounmap(c.pdev, c.bar);
+}
+
 static void nvme_register_nodes(void)
 {
     QOSGraphEdgeOptions opts = {
@@ -168,6 +400,7 @@ static void nvme_register_nodes(void)
     });
 
     qos_add_test("reg-read", "nvme", nvmetest_reg_read_test, NULL);
+    qos_add_test("io-doorbell", "nvme", nvmetest_io_doorbell_test, NULL);
 }
 
 libqos_init(nvme_register_nodes);
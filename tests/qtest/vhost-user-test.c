@@ -1040,6 +1040,56 @@ static void test_multiqueue(void *obj, void *arg, QGuestAllocator *alloc)
     wait_for_rings_started(s, s->queues * 2);
 }
 
+static void *vhost_user_test_setup_iothread(GString *cmd_line, void *arg)
+{
+    TestServer *s = vhost_user_test_setup(cmd_line, arg);
+
+    g_string_append(cmd_line, " -object iothread,id=io0");
+    return s;
+}
+
+/* Queues that vhost processes cannot be mapped to an IOThread */
+static void test_iothread_vq_mapping(void *obj, void *arg,
+                                     QGuestAllocator *alloc)
+{
+    QVirtioPCIDevice *dev = obj;
+    QTestState *qts = dev->pdev->bus->qts;
+    TestServer *s = arg;
+    TestServer *s2;
+    QDict *resp;
+
+    if (dev->pdev->bus->not_hotpluggable) {
+        g_test_skip("pci bus does not support hotplug");
+        return;
+    }
+
+    /* The netdev of the qos device is in use, connect another one */
+    s2 = test_server_new("iothread", s->vu_ops);
+    test_server_listen(s2);
+    qtest_qmp_assert_success(qts,
+        "{ 'execute': 'chardev-add',"
+        "  'arguments': { 'id': 'chr1', 'backend': {"
+        "      'type': 'socket', 'data': {"
+        "          'addr': { 'type': 'unix', 'data': { 'path': %s } },"
+        "          'server': false } } } }", s2->socket_path);
+    qtest_qmp_assert_success(qts,
+        "{ 'execute': 'netdev_add',"
+        "  'arguments': { 'type': 'vhost-user', 'id': 'hs1',"
+        "                 'chardev': 'chr1' } }");
+
+    resp = qtest_qmp(qts, "{ 'execute': 'device_add',"
+                          "  'arguments': { 'driver': 'virtio-net-pci',"
+                          "                 'id': 'net1', 'netdev': 'hs1',"
+                          "                 'iothread-vq-mapping':"
+                          "                     [ { 'iothread': 'io0' } ] } }");
+    g_assert(qdict_haskey(resp, "error"));
+    g_assert_cmpstr(qdict_get_str(qdict_get_qdict(resp, "error"), "desc"), ==,
+                    "iothread-vq-mapping is incompatible with vhost");
+    qobject_unref(resp);
+
+    test_server_free(s2);
+}
+
 
 static uint64_t vu_net_get_features(TestServer *s)
 {
@@ -1135,6 +1185,12 @@ static void register_vhost_user_test(void)
     qos_add_test("vhost-user/multiqueue",
                  "virtio-net",
                  test_multiqueue, &opts);
+
+    opts.before = vhost_user_test_setup_iothread;
+    opts.edge.extra_device_opts = NULL;
+    qos_add_test("vhost-user/iothread-vq-mapping",
+                 "virtio-net-pci",
+                 test_iothread_vq_mapping, &opts);
 }
 libqos_init(register_vhost_user_test);
 
@@ -9,13 +9,29 @@
 
 #include "qemu/osdep.h"
 #include "libqtest-single.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
 #include "qemu/iov.h"
 #include "qemu/module.h"
+#include "qapi/qmp/qbool.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qstring.h"
 #include "hw/virtio/virtio-net.h"
 #include "libqos/qgraph.h"
 #include "libqos/virtio-net.h"
 
+#ifdef CONFIG_LINUX
+#include <net/if.h>
+#include <netpacket/packet.h>
+#include <sys/ioctl.h>
+
+#ifndef ETH_P_ALL
+#define ETH_P_ALL 0x0003
+#endif
+#endif
+
 #ifndef ETH_P_RARP
 #define ETH_P_RARP 0x8035
 #endif
@@ -261,6 +277,999 @@ static void announce_self(void *obj, void *data, QGuestAllocator *t_alloc)
     };
 }
 
+/*
+ * Post many packets and kick once, so that virtio-net pops them in
+ * batches.  The socket's send buffer only holds a few packets: the backend
+ * queues one in the middle of each batch, and the packets popped after it
+ * are unpopped.  Every packet must still reach the peer exactly once and in
+ * order, and the TX queue must end up with nothing in flight.
+ */
+#define TX_BATCH_PACKETS        64
+#define TX_BATCH_PAYLOAD        1024
+#define TX_BATCH_ROUNDS         3
+
+static void tx_batch_fill(uint8_t *buf, uint32_t seq)
+{
+    memset(buf, seq, TX_BATCH_PAYLOAD);
+    stl_be_p(buf, seq);
+}
+
+static void tx_batch_write(QTestState *qts, uint64_t addr, uint32_t seq)
+{
+    uint8_t buf[TX_BATCH_PAYLOAD];
+
+    tx_batch_fill(buf, seq);
+    qtest_memwrite(qts, addr, buf, sizeof(buf));
+}
+
+static void tx_batch_recv(int socket, uint32_t first)
+{
+    uint8_t buf[TX_BATCH_PAYLOAD], expected[TX_BATCH_PAYLOAD];
+    uint32_t len;
+    uint32_t seq;
+    int ret;
+
+    for (seq = first; seq < first + TX_BATCH_PACKETS; seq++) {
+        ret = recv(socket, &len, sizeof(len), MSG_WAITALL);
+        g_assert_cmpint(ret, ==, sizeof(len));
+        g_assert_cmpint(ntohl(len), ==, TX_BATCH_PAYLOAD);
+
+        ret = recv(socket, buf, sizeof(buf), MSG_WAITALL);
+        g_assert_cmpint(ret, ==, sizeof(buf));
+        g_assert_cmpint(ldl_be_p(buf), ==, seq);
+
+        tx_batch_fill(expected, seq);
+        g_assert(memcmp(buf, expected, sizeof(buf)) == 0);
+    }
+}
+
+static void tx_batch_check_idle(QTestState *qts)
+{
+    QDict *rsp, *status;
+    QListEntry *entry;
+    const char *path = NULL;
+
+    rsp = qtest_qmp(qts, "{ 'execute': 'x-query-virtio' }");
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(rsp, "return"), entry) {
+        QDict *info = qobject_to(QDict, qlist_entry_obj(entry));
+
+        if (g_str_equal(qdict_get_str(info, "name"), "virtio-net")) {
+            path = qdict_get_str(info, "path");
+        }
+    }
+    g_assert_nonnull(path);
+
+    status = qtest_qmp_assert_success_ref(qts,
+                 "{ 'execute': 'x-query-virtio-queue-status',"
+                 "  'arguments': { 'path': %s, 'queue': 1 } }", path);
+    g_assert_cmpint(qdict_get_int(status, "inuse"), ==, 0);
+    g_assert_cmpint(qdict_get_int(status, "last-avail-idx"), ==,
+                    qdict_get_int(status, "used-idx"));
+
+    qobject_unref(status);
+    qobject_unref(rsp);
+}
+
+static void tx_batch_split(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *vq = net_if->queues[1];
+    QTestState *qts = global_qtest;
+    uint32_t heads[TX_BATCH_PACKETS];
+    uint64_t hdr_addr, data_addr;
+    int *sv = data;
+    int i;
+
+    hdr_addr = guest_alloc(t_alloc, VNET_HDR_SIZE);
+    qtest_memset(qts, hdr_addr, 0, VNET_HDR_SIZE);
+    data_addr = guest_alloc(t_alloc, TX_BATCH_PACKETS * TX_BATCH_PAYLOAD);
+
+    /* Let the device see all the packets at once when the VM resumes */
+    qtest_qmp_assert_success(qts, "{ 'execute': 'stop' }");
+    for (i = 0; i < TX_BATCH_PACKETS; i++) {
+        tx_batch_write(qts, data_addr + i * TX_BATCH_PAYLOAD, i);
+        heads[i] = qvirtqueue_add(qts, vq, hdr_addr, VNET_HDR_SIZE,
+                                  false, true);
+        qvirtqueue_add(qts, vq, data_addr + i * TX_BATCH_PAYLOAD,
+                       TX_BATCH_PAYLOAD, false, false);
+        qvirtqueue_kick(qts, dev, vq, heads[i]);
+    }
+    qtest_qmp_assert_success(qts, "{ 'execute': 'cont' }");
+
+    tx_batch_recv(sv[0], 0);
+
+    /* Batches are completed with one interrupt, so poll the used ring */
+    for (i = 0; i < TX_BATCH_PACKETS; i++) {
+        gint64 start_time = g_get_monotonic_time();
+        uint32_t desc_idx;
+
+        while (!qvirtqueue_get_buf(qts, vq, &desc_idx, NULL)) {
+            g_assert(g_get_monotonic_time() - start_time <=
+                     QVIRTIO_NET_TIMEOUT_US);
+            qtest_clock_step(qts, 100);
+        }
+        g_assert_cmpint(desc_idx, ==, heads[i]);
+    }
+
+    tx_batch_check_idle(qts);
+
+    guest_free(t_alloc, data_addr);
+    guest_free(t_alloc, hdr_addr);
+}
+
+/* A minimal driver for a packed TX ring, with two descriptors per packet */
+typedef struct TxPackedRing {
+    QVirtQueue *vq;
+    uint16_t avail_idx;
+    bool avail_wrap;
+    uint16_t used_idx;
+    bool used_wrap;
+} TxPackedRing;
+
+static void tx_packed_write_desc(QTestState *qts, QVirtQueue *vq,
+                                 uint16_t idx, bool wrap, uint64_t addr,
+                                 uint32_t len, uint16_t id, uint16_t flags)
+{
+    struct vring_packed_desc desc = {
+        .addr = cpu_to_le64(addr),
+        .len = cpu_to_le32(len),
+        .id = cpu_to_le16(id),
+    };
+
+    if (wrap) {
+        flags |= 1 << VRING_PACKED_DESC_F_AVAIL;
+    } else {
+        flags |= 1 << VRING_PACKED_DESC_F_USED;
+    }
+    desc.flags = cpu_to_le16(flags);
+    qtest_memwrite(qts, vq->desc + idx * sizeof(desc), &desc, sizeof(desc));
+}
+
+static void tx_packed_advance(TxPackedRing *r)
+{
+    if (++r->avail_idx == r->vq->size) {
+        r->avail_idx = 0;
+        r->avail_wrap = !r->avail_wrap;
+    }
+}
+
+static void tx_packed_post(QTestState *qts, TxPackedRing *r,
+                           uint64_t hdr_addr, uint64_t data_addr, uint16_t id)
+{
+    uint16_t head = r->avail_idx;
+    bool head_wrap = r->avail_wrap;
+
+    tx_packed_advance(r);
+    tx_packed_write_desc(qts, r->vq, r->avail_idx, r->avail_wrap,
+                         data_addr, TX_BATCH_PAYLOAD, id, 0);
+    tx_packed_advance(r);
+
+    /* The head goes last, as it makes the whole chain available */
+    tx_packed_write_desc(qts, r->vq, head, head_wrap, hdr_addr,
+                         VNET_HDR_SIZE, id, VRING_DESC_F_NEXT);
+}
+
+static void tx_packed_wait_used(QTestState *qts, TxPackedRing *r, uint16_t id)
+{
+    gint64 start_time = g_get_monotonic_time();
+    struct vring_packed_desc desc;
+    bool avail, used;
+
+    for (;;) {
+        qtest_memread(qts, r->vq->desc + r->used_idx * sizeof(desc),
+                      &desc, sizeof(desc));
+        avail = le16_to_cpu(desc.flags) & (1 << VRING_PACKED_DESC_F_AVAIL);
+        used = le16_to_cpu(desc.flags) & (1 << VRING_PACKED_DESC_F_USED);
+        if (avail == r->used_wrap && used == r->used_wrap) {
+            break;
+        }
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_NET_TIMEOUT_US);
+        qtest_clock_step(qts, 100);
+    }
+    g_assert_cmpint(le16_to_cpu(desc.id), ==, id);
+
+    r->used_idx += 2;
+    if (r->used_idx >= r->vq->size) {
+        r->used_idx -= r->vq->size;
+        r->used_wrap = !r->used_wrap;
+    }
+}
+
+static void tx_batch_packed(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QTestState *qts = global_qtest;
+    TxPackedRing r = { .avail_wrap = true, .used_wrap = true };
+    uint64_t features = qvirtio_get_features(dev);
+    uint64_t hdr_addr, data_addr;
+    int *sv = data;
+    int round, i;
+
+    if (!(features & (1ull << VIRTIO_F_RING_PACKED))) {
+        g_test_skip("packed virtqueues need a VIRTIO 1.0 transport");
+        return;
+    }
+
+    /* libqos only drives split rings, so set the TX queue up again */
+    qvirtio_reset(dev);
+    qvirtio_set_acknowledge(dev);
+    qvirtio_set_driver(dev);
+    qvirtio_set_features(dev, features & ((1ull << VIRTIO_F_VERSION_1) |
+                                          (1ull << VIRTIO_F_RING_PACKED)));
+    r.vq = qvirtqueue_setup(dev, t_alloc, 1);
+
+    /*
+     * The descriptor table of the split layout is also the packed
+     * descriptor ring, and the available and used rings have room for the
+     * event suppression structures.  Only the descriptors need clearing.
+     */
+    qtest_memset(qts, r.vq->desc, 0,
+                 r.vq->size * sizeof(struct vring_packed_desc));
+    qvirtio_set_driver_ok(dev);
+
+    hdr_addr = guest_alloc(t_alloc, VNET_HDR_SIZE);
+    qtest_memset(qts, hdr_addr, 0, VNET_HDR_SIZE);
+    data_addr = guest_alloc(t_alloc, TX_BATCH_PACKETS * TX_BATCH_PAYLOAD);
+
+    /* Go around the ring more than once, to flip the wrap counters */
+    g_assert_cmpint(TX_BATCH_PACKETS * 2, <=, r.vq->size);
+    g_assert_cmpint(TX_BATCH_ROUNDS * TX_BATCH_PACKETS * 2, >, r.vq->size);
+
+    for (round = 0; round < TX_BATCH_ROUNDS; round++) {
+        uint32_t first = round * TX_BATCH_PACKETS;
+
+        qtest_qmp_assert_success(qts, "{ 'execute': 'stop' }");
+        for (i = 0; i < TX_BATCH_PACKETS; i++) {
+            tx_batch_write(qts, data_addr + i * TX_BATCH_PAYLOAD, first + i);
+            tx_packed_post(qts, &r, hdr_addr,
+                           data_addr + i * TX_BATCH_PAYLOAD, i);
+        }
+        dev->bus->virtqueue_kick(dev, r.vq);
+        qtest_qmp_assert_success(qts, "{ 'execute': 'cont' }");
+
+        tx_batch_recv(sv[0], first);
+        for (i = 0; i < TX_BATCH_PACKETS; i++) {
+            tx_packed_wait_used(qts, &r, i);
+        }
+    }
+
+    tx_batch_check_idle(qts);
+
+    guest_free(t_alloc, data_addr);
+    guest_free(t_alloc, hdr_addr);
+    qvirtqueue_cleanup(dev->bus, r.vq, t_alloc);
+}
+
+/*
+ * Drive a NIC that was hot-plugged in @slot, with one queue pair and the
+ * control virtqueue if @ctrl is not NULL.  VIRTIO_F_VERSION_1 and those of
+ * @features that the device offers are negotiated.
+ */
+static QVirtioPCIDevice *hotplug_nic_start(QPCIBus *bus, int slot,
+                                           QGuestAllocator *alloc,
+                                           uint64_t features,
+                                           QVirtQueue **rx, QVirtQueue **tx,
+                                           QVirtQueue **ctrl)
+{
+    QVirtioPCIDevice *dev;
+    QVirtioDevice *vdev;
+
+    dev = virtio_pci_new(bus, &(QPCIAddress) { .devfn = QPCI_DEVFN(slot, 0) });
+    g_assert_nonnull(dev);
+    vdev = &dev->vdev;
+
+    qvirtio_pci_device_enable(dev);
+    qvirtio_start_device(vdev);
+    qvirtio_set_features(vdev, qvirtio_get_features(vdev) &
+                               (features | (1ull << VIRTIO_F_VERSION_1)));
+    *rx = qvirtqueue_setup(vdev, alloc, 0);
+    *tx = qvirtqueue_setup(vdev, alloc, 1);
+    if (ctrl) {
+        *ctrl = qvirtqueue_setup(vdev, alloc, 2);
+    }
+    qvirtio_set_driver_ok(vdev);
+    return dev;
+}
+
+static void hotplug_nic_stop(QVirtioPCIDevice *dev, QGuestAllocator *alloc,
+                             QVirtQueue *rx, QVirtQueue *tx, QVirtQueue *ctrl)
+{
+    qvirtqueue_cleanup(dev->vdev.bus, rx, alloc);
+    qvirtqueue_cleanup(dev->vdev.bus, tx, alloc);
+    if (ctrl) {
+        qvirtqueue_cleanup(dev->vdev.bus, ctrl, alloc);
+    }
+    qos_object_destroy((QOSGraphObject *)dev);
+}
+
+/* Return the length of the next used element, which must be @head */
+static uint32_t hotplug_nic_wait_used(QTestState *qts, QVirtQueue *vq,
+                                      uint32_t head)
+{
+    gint64 start_time = g_get_monotonic_time();
+    uint32_t desc_idx, len;
+
+    while (!qvirtqueue_get_buf(qts, vq, &desc_idx, &len)) {
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_NET_TIMEOUT_US);
+        qtest_clock_step(qts, 100);
+    }
+    g_assert_cmpint(desc_idx, ==, head);
+    return len;
+}
+
+/*
+ * Each NIC of the IOThread tests is hot-plugged with its own datagram
+ * socket netdev hsN and IOThread io(N-1); hs3 cannot be processed in an
+ * IOThread.
+ */
+#define IOTHREAD_NICS           2
+#define IOTHREAD_PACKET_SIZE    60
+
+static void iothread_check_invalid(QTestState *qts, const char *netdev,
+                                   const char *key, QObject *value,
+                                   const char *desc)
+{
+    QDict *args, *resp, *err;
+
+    args = qdict_from_jsonf_nofail("{ 'driver': 'virtio-net-pci',"
+                                   "  'id': 'net1', 'netdev': %s,"
+                                   "  'iothread-vq-mapping':"
+                                   "      [ { 'iothread': 'io0' } ] }",
+                                   netdev);
+    if (key) {
+        qdict_put_obj(args, key, value);
+    }
+
+    resp = qtest_qmp(qts, "{ 'execute': 'device_add', 'arguments': %p }",
+                     args);
+    g_assert(qdict_haskey(resp, "error"));
+    err = qdict_get_qdict(resp, "error");
+    g_assert_cmpstr(qdict_get_str(err, "desc"), ==, desc);
+    qobject_unref(resp);
+}
+
+static void iothread_invalid(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *dev = obj;
+    QTestState *qts = dev->pdev->bus->qts;
+
+    if (dev->pdev->bus->not_hotpluggable) {
+        g_test_skip("pci bus does not support hotplug");
+        return;
+    }
+
+    iothread_check_invalid(qts, "hs1", "ioeventfd",
+                           QOBJECT(qbool_from_bool(false)),
+                           "ioeventfd is required for iothread-vq-mapping");
+    iothread_check_invalid(qts, "hs1", "tx", QOBJECT(qstring_from_str("timer")),
+                           "iothread-vq-mapping is incompatible with tx=timer");
+    iothread_check_invalid(qts, "hs1", "guest_rsc_ext",
+                           QOBJECT(qbool_from_bool(true)),
+                           "iothread-vq-mapping is incompatible with "
+                           "guest_rsc_ext");
+    iothread_check_invalid(qts, "hs3", NULL, NULL,
+                           "netdev 'hs3' cannot be processed in an IOThread");
+}
+
+static void iothread_fill(uint8_t *buf, int nic)
+{
+    memset(buf, 0x40 + nic, IOTHREAD_PACKET_SIZE);
+}
+
+/*
+ * Pass traffic in both directions through two NICs whose queues are
+ * processed by two different IOThreads, then check that filters cannot
+ * be added to their netdevs any more.
+ */
+static void iothread_datapath(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *dev1 = obj;
+    QTestState *qts = dev1->pdev->bus->qts;
+    QVirtioPCIDevice *devs[IOTHREAD_NICS];
+    QVirtQueue *rx[IOTHREAD_NICS], *tx[IOTHREAD_NICS];
+    uint32_t heads[IOTHREAD_NICS];
+    uint64_t bufs[IOTHREAD_NICS];
+    uint8_t buf[IOTHREAD_PACKET_SIZE + 1], expected[IOTHREAD_PACKET_SIZE];
+    int *sv = data;
+    QDict *resp;
+    int i, ret;
+
+    if (dev1->pdev->bus->not_hotpluggable) {
+        g_test_skip("pci bus does not support hotplug");
+        return;
+    }
+
+    for (i = 0; i < IOTHREAD_NICS; i++) {
+        g_autofree char *id = g_strdup_printf("net%d", i + 1);
+        g_autofree char *netdev = g_strdup_printf("hs%d", i + 1);
+        g_autofree char *iothread = g_strdup_printf("io%d", i);
+        g_autofree char *addr = g_strdup_printf("%x.0", PCI_SLOT_HP + i);
+
+        qtest_qmp_device_add(qts, "virtio-net-pci", id,
+                             "{ 'addr': %s, 'netdev': %s,"
+                             "  'iothread-vq-mapping':"
+                             "      [ { 'iothread': %s } ] }",
+                             addr, netdev, iothread);
+        devs[i] = hotplug_nic_start(dev1->pdev->bus, PCI_SLOT_HP + i, t_alloc,
+                                    0, &rx[i], &tx[i], NULL);
+        bufs[i] = guest_alloc(t_alloc, VNET_HDR_SIZE + 64);
+    }
+
+    /* Receive one packet on each NIC */
+    for (i = 0; i < IOTHREAD_NICS; i++) {
+        heads[i] = qvirtqueue_add(qts, rx[i], bufs[i], VNET_HDR_SIZE + 64,
+                                  true, false);
+        qvirtqueue_kick(qts, &devs[i]->vdev, rx[i], heads[i]);
+
+        iothread_fill(buf, i);
+        ret = send(sv[i * 2], buf, IOTHREAD_PACKET_SIZE, 0);
+        g_assert_cmpint(ret, ==, IOTHREAD_PACKET_SIZE);
+    }
+    for (i = 0; i < IOTHREAD_NICS; i++) {
+        g_assert_cmpint(hotplug_nic_wait_used(qts, rx[i], heads[i]), ==,
+                        VNET_HDR_SIZE + IOTHREAD_PACKET_SIZE);
+        qtest_memread(qts, bufs[i] + VNET_HDR_SIZE, buf,
+                      IOTHREAD_PACKET_SIZE);
+        iothread_fill(expected, i);
+        g_assert(memcmp(buf, expected, IOTHREAD_PACKET_SIZE) == 0);
+    }
+
+    /* ... and send one packet from each NIC */
+    for (i = 0; i < IOTHREAD_NICS; i++) {
+        iothread_fill(buf, IOTHREAD_NICS + i);
+        qtest_memset(qts, bufs[i], 0, VNET_HDR_SIZE);
+        qtest_memwrite(qts, bufs[i] + VNET_HDR_SIZE, buf,
+                       IOTHREAD_PACKET_SIZE);
+        heads[i] = qvirtqueue_add(qts, tx[i], bufs[i],
+                                  VNET_HDR_SIZE + IOTHREAD_PACKET_SIZE,
+                                  false, false);
+        qvirtqueue_kick(qts, &devs[i]->vdev, tx[i], heads[i]);
+    }
+    for (i = 0; i < IOTHREAD_NICS; i++) {
+        ret = recv(sv[i * 2], buf, sizeof(buf), 0);
+        g_assert_cmpint(ret, ==, IOTHREAD_PACKET_SIZE);
+        iothread_fill(expected, IOTHREAD_NICS + i);
+        g_assert(memcmp(buf, expected, IOTHREAD_PACKET_SIZE) == 0);
+        hotplug_nic_wait_used(qts, tx[i], heads[i]);
+    }
+
+    resp = qtest_qmp(qts, "{ 'execute': 'object-add',"
+                          "  'arguments': { 'qom-type': 'filter-buffer',"
+                          "                 'id': 'f0', 'netdev': 'hs1',"
+                          "                 'interval': 1000 } }");
+    g_assert(qdict_haskey(resp, "error"));
+    g_assert_cmpstr(qdict_get_str(qdict_get_qdict(resp, "error"), "desc"), ==,
+                    "Netdev processed in an IOThread is not supported");
+    qobject_unref(resp);
+
+    for (i = 0; i < IOTHREAD_NICS; i++) {
+        guest_free(t_alloc, bufs[i]);
+        hotplug_nic_stop(devs[i], t_alloc, rx[i], tx[i], NULL);
+    }
+}
+
+#ifdef CONFIG_LINUX
+/*
+ * Tests of the tap backend need a real tap interface.  They inject frames
+ * into the interface, and capture the frames sent by the guest, with a
+ * packet socket bound to it.
+ */
+#define TAP_PACKETS             16
+#define TAP_FRAME_SIZE          60
+#define TAP_BUF_SIZE            (VNET_HDR_SIZE + 64)
+#define TAP_ETHERTYPE           0x88b5  /* local experimental */
+
+static const uint8_t tap_bcast[] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+static void tap_fill(uint8_t *frame, size_t size, const uint8_t *dst,
+                     uint8_t seq)
+{
+    static const uint8_t src[] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
+
+    memcpy(frame, dst, 6);
+    memcpy(frame + 6, src, sizeof(src));
+    stw_be_p(frame + 12, TAP_ETHERTYPE);
+    memset(frame + 14, seq, size - 14);
+}
+
+/* Create tap interface @ifname for netdev hs1, false if it cannot be used */
+static bool tap_netdev_add(QTestState *qts, const char *ifname, bool io_uring)
+{
+    QDict *args, *resp;
+
+    if (geteuid() != 0 || access("/dev/net/tun", R_OK | W_OK) != 0) {
+        g_test_skip("tap interfaces need CAP_NET_ADMIN");
+        return false;
+    }
+
+    args = qdict_from_jsonf_nofail("{ 'type': 'tap', 'id': 'hs1',"
+                                   "  'ifname': %s, 'script': 'no',"
+                                   "  'downscript': 'no' }", ifname);
+    if (io_uring) {
+        qdict_put_bool(args, "io-uring", true);
+    }
+
+    /* io-uring=on may not be built in, or not supported by the kernel */
+    resp = qtest_qmp(qts, "{ 'execute': 'netdev_add', 'arguments': %p }",
+                     args);
+    if (qdict_haskey(resp, "error")) {
+        g_test_skip(qdict_get_str(qdict_get_qdict(resp, "error"), "desc"));
+        qobject_unref(resp);
+        return false;
+    }
+    qobject_unref(resp);
+    return true;
+}
+
+static int tap_open_packet_socket(const char *ifname)
+{
+    g_autofree char *sysctl =
+        g_strdup_printf("/proc/sys/net/ipv6/conf/%s/disable_ipv6", ifname);
+    struct timeval timeout = { .tv_sec = QVIRTIO_NET_TIMEOUT_US / 1000000 };
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(ETH_P_ALL),
+    };
+    struct ifreq ifr = { 0 };
+    int fd, ret;
+
+    /* Keep the host from sending its own packets to the guest */
+    g_file_set_contents(sysctl, "1", -1, NULL);
+
+    fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    g_assert_cmpint(fd, >=, 0);
+    ret = setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    g_assert_cmpint(ret, ==, 0);
+
+    pstrcpy(ifr.ifr_name, sizeof(ifr.ifr_name), ifname);
+    ret = ioctl(fd, SIOCGIFFLAGS, &ifr);
+    g_assert_cmpint(ret, ==, 0);
+    ifr.ifr_flags |= IFF_UP;
+    ret = ioctl(fd, SIOCSIFFLAGS, &ifr);
+    g_assert_cmpint(ret, ==, 0);
+
+    sll.sll_ifindex = if_nametoindex(ifname);
+    g_assert_cmpint(sll.sll_ifindex, !=, 0);
+    ret = bind(fd, (struct sockaddr *)&sll, sizeof(sll));
+    g_assert_cmpint(ret, ==, 0);
+    return fd;
+}
+
+static void tap_send_frame(int fd, size_t size, const uint8_t *dst,
+                           uint8_t seq)
+{
+    g_autofree uint8_t *frame = g_malloc(size);
+    ssize_t ret;
+
+    tap_fill(frame, size, dst, seq);
+    ret = send(fd, frame, size, 0);
+    g_assert_cmpint(ret, ==, size);
+}
+
+/* Receive the next frame that the guest sent, skipping any other traffic */
+static void tap_recv_frame(int fd, uint8_t *frame)
+{
+    struct sockaddr_ll sll;
+    socklen_t sll_len;
+    ssize_t ret;
+
+    for (;;) {
+        sll_len = sizeof(sll);
+        ret = recvfrom(fd, frame, TAP_FRAME_SIZE, MSG_TRUNC,
+                       (struct sockaddr *)&sll, &sll_len);
+        g_assert_cmpint(ret, >=, 0);
+        if (sll.sll_pkttype != PACKET_OUTGOING &&
+            ret == TAP_FRAME_SIZE &&
+            lduw_be_p(frame + 12) == TAP_ETHERTYPE) {
+            return;
+        }
+    }
+}
+
+static void tap_uring(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *dev1 = obj;
+    QTestState *qts = dev1->pdev->bus->qts;
+    g_autofree char *ifname = g_strdup_printf("qtap%d", getpid());
+    QVirtioPCIDevice *dev;
+    QVirtQueue *rx, *tx;
+    uint32_t heads[TAP_PACKETS];
+    uint8_t frame[TAP_FRAME_SIZE], expected[TAP_FRAME_SIZE];
+    uint64_t bufs, buf;
+    int fd, i;
+
+    if (dev1->pdev->bus->not_hotpluggable) {
+        g_test_skip("pci bus does not support hotplug");
+        return;
+    }
+    if (!tap_netdev_add(qts, ifname, true)) {
+        return;
+    }
+
+    qtest_qmp_device_add(qts, "virtio-net-pci", "net1",
+                         "{ 'addr': %s, 'netdev': 'hs1' }",
+                         stringify(PCI_SLOT_HP) ".0");
+    dev = hotplug_nic_start(dev1->pdev->bus, PCI_SLOT_HP, t_alloc, 0,
+                            &rx, &tx, NULL);
+    fd = tap_open_packet_socket(ifname);
+    bufs = guest_alloc(t_alloc, TAP_PACKETS * TAP_BUF_SIZE);
+
+    /* Receive a burst of frames */
+    for (i = 0; i < TAP_PACKETS; i++) {
+        heads[i] = qvirtqueue_add(qts, rx, bufs + i * TAP_BUF_SIZE,
+                                  TAP_BUF_SIZE, true, false);
+        qvirtqueue_kick(qts, &dev->vdev, rx, heads[i]);
+    }
+    for (i = 0; i < TAP_PACKETS; i++) {
+        tap_send_frame(fd, TAP_FRAME_SIZE, tap_bcast, i);
+    }
+    for (i = 0; i < TAP_PACKETS; i++) {
+        buf = bufs + i * TAP_BUF_SIZE;
+        g_assert_cmpint(hotplug_nic_wait_used(qts, rx, heads[i]), ==,
+                        VNET_HDR_SIZE + TAP_FRAME_SIZE);
+        qtest_memread(qts, buf + VNET_HDR_SIZE, frame, sizeof(frame));
+        tap_fill(expected, sizeof(expected), tap_bcast, i);
+        g_assert(memcmp(frame, expected, sizeof(frame)) == 0);
+    }
+
+    /* Send a burst, which the device sees at once when the VM resumes */
+    qtest_qmp_assert_success(qts, "{ 'execute': 'stop' }");
+    for (i = 0; i < TAP_PACKETS; i++) {
+        buf = bufs + i * TAP_BUF_SIZE;
+        tap_fill(frame, sizeof(frame), tap_bcast, TAP_PACKETS + i);
+        qtest_memset(qts, buf, 0, VNET_HDR_SIZE);
+        qtest_memwrite(qts, buf + VNET_HDR_SIZE, frame, sizeof(frame));
+        heads[i] = qvirtqueue_add(qts, tx, buf, VNET_HDR_SIZE + TAP_FRAME_SIZE,
+                                  false, false);
+        qvirtqueue_kick(qts, &dev->vdev, tx, heads[i]);
+    }
+    qtest_qmp_assert_success(qts, "{ 'execute': 'cont' }");
+    for (i = 0; i < TAP_PACKETS; i++) {
+        tap_recv_frame(fd, frame);
+        tap_fill(expected, sizeof(expected), tap_bcast, TAP_PACKETS + i);
+        g_assert(memcmp(frame, expected, sizeof(frame)) == 0);
+    }
+    for (i = 0; i < TAP_PACKETS; i++) {
+        hotplug_nic_wait_used(qts, tx, heads[i]);
+    }
+
+    close(fd);
+    guest_free(t_alloc, bufs);
+    hotplug_nic_stop(dev, t_alloc, rx, tx, NULL);
+}
+
+/*
+ * Frames that tap reads straight into guest buffers: one that the receive
+ * filter drops, one that fits in a buffer, and one that does not and must
+ * be spread over mergeable buffers.
+ */
+#define TAP_DIRECT_BUFS         8
+#define TAP_DIRECT_BUF_SIZE     256
+#define TAP_DIRECT_LARGE_SIZE   1000
+
+static const uint8_t tap_direct_mac[] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x57 };
+
+static void tap_direct_ctrl_promisc(QTestState *qts, QVirtioDevice *vdev,
+                                    QVirtQueue *ctrl, QGuestAllocator *alloc,
+                                    uint8_t on)
+{
+    struct virtio_net_ctrl_hdr hdr = {
+        .class = VIRTIO_NET_CTRL_RX,
+        .cmd = VIRTIO_NET_CTRL_RX_PROMISC,
+    };
+    uint64_t req = guest_alloc(alloc, sizeof(hdr) + 2);
+    uint32_t head;
+
+    qtest_memwrite(qts, req, &hdr, sizeof(hdr));
+    qtest_writeb(qts, req + sizeof(hdr), on);
+    qtest_writeb(qts, req + sizeof(hdr) + 1, 0xff);
+
+    head = qvirtqueue_add(qts, ctrl, req, sizeof(hdr), false, true);
+    qvirtqueue_add(qts, ctrl, req + sizeof(hdr), 1, false, true);
+    qvirtqueue_add(qts, ctrl, req + sizeof(hdr) + 1, 1, true, false);
+    qvirtqueue_kick(qts, vdev, ctrl, head);
+    hotplug_nic_wait_used(qts, ctrl, head);
+    g_assert_cmpint(qtest_readb(qts, req + sizeof(hdr) + 1), ==,
+                    VIRTIO_NET_OK);
+
+    guest_free(alloc, req);
+}
+
+static void tap_direct(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *dev1 = obj;
+    QTestState *qts = dev1->pdev->bus->qts;
+    g_autofree char *ifname = g_strdup_printf("qtap%d", getpid());
+    static const uint8_t other_mac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+    uint8_t large[TAP_DIRECT_LARGE_SIZE], expected[TAP_DIRECT_LARGE_SIZE];
+    uint32_t heads[TAP_DIRECT_BUFS];
+    QVirtioPCIDevice *dev;
+    QVirtQueue *rx, *tx, *ctrl;
+    uint64_t bufs;
+    size_t left, len;
+    int fd, i;
+
+    if (dev1->pdev->bus->not_hotpluggable) {
+        g_test_skip("pci bus does not support hotplug");
+        return;
+    }
+    if (!tap_netdev_add(qts, ifname, false)) {
+        return;
+    }
+
+    qtest_qmp_device_add(qts, "virtio-net-pci", "net1",
+                         "{ 'addr': %s, 'netdev': 'hs1',"
+                         "  'mac': '52:54:00:12:34:57' }",
+                         stringify(PCI_SLOT_HP) ".0");
+    dev = hotplug_nic_start(dev1->pdev->bus, PCI_SLOT_HP, t_alloc,
+                            (1ull << VIRTIO_NET_F_MRG_RXBUF) |
+                            (1ull << VIRTIO_NET_F_CTRL_VQ) |
+                            (1ull << VIRTIO_NET_F_CTRL_RX),
+                            &rx, &tx, &ctrl);
+    tap_direct_ctrl_promisc(qts, &dev->vdev, ctrl, t_alloc, 0);
+    fd = tap_open_packet_socket(ifname);
+
+    bufs = guest_alloc(t_alloc, TAP_DIRECT_BUFS * TAP_DIRECT_BUF_SIZE);
+    for (i = 0; i < TAP_DIRECT_BUFS; i++) {
+        heads[i] = qvirtqueue_add(qts, rx, bufs + i * TAP_DIRECT_BUF_SIZE,
+                                  TAP_DIRECT_BUF_SIZE, true, false);
+        qvirtqueue_kick(qts, &dev->vdev, rx, heads[i]);
+    }
+
+    tap_send_frame(fd, TAP_FRAME_SIZE, other_mac, 1);
+    tap_send_frame(fd, TAP_FRAME_SIZE, tap_direct_mac, 2);
+    tap_send_frame(fd, TAP_DIRECT_LARGE_SIZE, tap_direct_mac, 3);
+
+    /* The filtered frame gave its buffer back, the next one takes it */
+    g_assert_cmpint(hotplug_nic_wait_used(qts, rx, heads[0]), ==,
+                    VNET_HDR_SIZE + TAP_FRAME_SIZE);
+    g_assert_cmpint(qtest_readw(qts, bufs + offsetof(
+                        struct virtio_net_hdr_mrg_rxbuf, num_buffers)), ==, 1);
+    qtest_memread(qts, bufs + VNET_HDR_SIZE, large, TAP_FRAME_SIZE);
+    tap_fill(expected, TAP_FRAME_SIZE, tap_direct_mac, 2);
+    g_assert(memcmp(large, expected, TAP_FRAME_SIZE) == 0);
+
+    /* The large frame did not fit in one buffer */
+    left = VNET_HDR_SIZE + TAP_DIRECT_LARGE_SIZE;
+    for (i = 1; left; i++) {
+        g_assert_cmpint(i, <, TAP_DIRECT_BUFS);
+        len = MIN(left, TAP_DIRECT_BUF_SIZE);
+        g_assert_cmpint(hotplug_nic_wait_used(qts, rx, heads[i]), ==, len);
+        left -= len;
+    }
+    g_assert_cmpint(qtest_readw(qts, bufs + TAP_DIRECT_BUF_SIZE + offsetof(
+                        struct virtio_net_hdr_mrg_rxbuf, num_buffers)), ==,
+                    i - 1);
+    for (left = TAP_DIRECT_LARGE_SIZE, i = 1; left; left -= len, i++) {
+        size_t off = i == 1 ? VNET_HDR_SIZE : 0;
+
+        len = MIN(left, TAP_DIRECT_BUF_SIZE - off);
+        qtest_memread(qts, bufs + i * TAP_DIRECT_BUF_SIZE + off,
+                      large + TAP_DIRECT_LARGE_SIZE - left, len);
+    }
+    tap_fill(expected, TAP_DIRECT_LARGE_SIZE, tap_direct_mac, 3);
+    g_assert(memcmp(large, expected, TAP_DIRECT_LARGE_SIZE) == 0);
+
+    close(fd);
+    guest_free(t_alloc, bufs);
+    hotplug_nic_stop(dev, t_alloc, rx, tx, ctrl);
+}
+
+/*
+ * The af-xdp backend is attached to one end of a veth pair, and frames
+ * are injected and captured on the other end.  Its two queues share a
+ * umem, busy poll the device and are processed by two IOThreads.
+ */
+#define AF_XDP_QUEUES           2
+
+static bool af_xdp_run(const char *const *argv)
+{
+    int status;
+
+    return g_spawn_sync(NULL, (char **)argv, NULL,
+                        G_SPAWN_SEARCH_PATH | G_SPAWN_STDOUT_TO_DEV_NULL |
+                        G_SPAWN_STDERR_TO_DEV_NULL,
+                        NULL, NULL, NULL, NULL, &status, NULL) &&
+           WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* Create veth pair @ifname/@peer and netdev xdp0 on @ifname */
+static bool af_xdp_netdev_add(QTestState *qts, const char *ifname,
+                              const char *peer)
+{
+    g_autofree char *queues = g_strdup_printf("%d", AF_XDP_QUEUES);
+    const char *add[] = {
+        "ip", "link", "add", ifname,
+        "numtxqueues", queues, "numrxqueues", queues,
+        "type", "veth", "peer", "name", peer,
+        "numtxqueues", queues, "numrxqueues", queues, NULL
+    };
+    const char *up[] = { "ip", "link", "set", "dev", ifname, "up", NULL };
+    const char *del[] = { "ip", "link", "del", ifname, NULL };
+    QDict *resp;
+
+    if (geteuid() != 0) {
+        g_test_skip("veth interfaces need CAP_NET_ADMIN");
+        return false;
+    }
+    if (!af_xdp_run(add)) {
+        g_test_skip("cannot create veth interfaces");
+        return false;
+    }
+    g_assert(af_xdp_run(up));
+
+    /* af-xdp may not be built in, or busy polling not supported */
+    resp = qtest_qmp(qts, "{ 'execute': 'netdev_add', 'arguments': {"
+                     "  'type': 'af-xdp', 'id': 'xdp0', 'ifname': %s,"
+                     "  'queues': %d, 'poll-us': 50,"
+                     "  'shared-umem': true } }",
+                     ifname, AF_XDP_QUEUES);
+    if (qdict_haskey(resp, "error")) {
+        g_test_skip(qdict_get_str(qdict_get_qdict(resp, "error"), "desc"));
+        qobject_unref(resp);
+        af_xdp_run(del);
+        return false;
+    }
+    qobject_unref(resp);
+    return true;
+}
+
+static void af_xdp_ctrl_mq(QTestState *qts, QVirtioDevice *vdev,
+                           QVirtQueue *ctrl, QGuestAllocator *alloc,
+                           uint16_t pairs)
+{
+    struct virtio_net_ctrl_hdr hdr = {
+        .class = VIRTIO_NET_CTRL_MQ,
+        .cmd = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+    };
+    uint64_t req = guest_alloc(alloc, sizeof(hdr) + 3);
+    uint16_t le_pairs = cpu_to_le16(pairs);
+    uint32_t head;
+
+    qtest_memwrite(qts, req, &hdr, sizeof(hdr));
+    qtest_memwrite(qts, req + sizeof(hdr), &le_pairs, sizeof(le_pairs));
+    qtest_writeb(qts, req + sizeof(hdr) + 2, 0xff);
+
+    head = qvirtqueue_add(qts, ctrl, req, sizeof(hdr), false, true);
+    qvirtqueue_add(qts, ctrl, req + sizeof(hdr), 2, false, true);
+    qvirtqueue_add(qts, ctrl, req + sizeof(hdr) + 2, 1, true, false);
+    qvirtqueue_kick(qts, vdev, ctrl, head);
+    hotplug_nic_wait_used(qts, ctrl, head);
+    g_assert_cmpint(qtest_readb(qts, req + sizeof(hdr) + 2), ==,
+                    VIRTIO_NET_OK);
+
+    guest_free(alloc, req);
+}
+
+static void af_xdp_veth(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *dev1 = obj;
+    QTestState *qts = dev1->pdev->bus->qts;
+    g_autofree char *ifname = g_strdup_printf("qxdp%d", getpid());
+    g_autofree char *peer = g_strdup_printf("qxdpp%d", getpid());
+    const char *del[] = { "ip", "link", "del", ifname, NULL };
+    QVirtQueue *rx[AF_XDP_QUEUES], *tx[AF_XDP_QUEUES], *ctrl;
+    uint32_t heads[AF_XDP_QUEUES][TAP_PACKETS];
+    uint8_t frame[TAP_FRAME_SIZE], expected[TAP_FRAME_SIZE];
+    bool seen[TAP_PACKETS + AF_XDP_QUEUES] = { false };
+    gint64 start_time = g_get_monotonic_time();
+    QVirtioPCIDevice *dev;
+    QVirtioDevice *vdev;
+    uint32_t desc_idx, len;
+    uint64_t bufs, buf;
+    int fd, q, i, received;
+
+    if (dev1->pdev->bus->not_hotpluggable) {
+        g_test_skip("pci bus does not support hotplug");
+        return;
+    }
+    if (!af_xdp_netdev_add(qts, ifname, peer)) {
+        return;
+    }
+
+    qtest_qmp_device_add(qts, "virtio-net-pci", "net1",
+                         "{ 'addr': %s, 'netdev': 'xdp0', 'mq': true,"
+                         "  'iothread-vq-mapping':"
+                         "      [ { 'iothread': 'io0' },"
+                         "        { 'iothread': 'io1' } ] }",
+                         stringify(PCI_SLOT_HP) ".0");
+    dev = virtio_pci_new(dev1->pdev->bus,
+                         &(QPCIAddress) { .devfn = QPCI_DEVFN(PCI_SLOT_HP,
+                                                              0) });
+    g_assert_nonnull(dev);
+    vdev = &dev->vdev;
+    qvirtio_pci_device_enable(dev);
+    qvirtio_start_device(vdev);
+    qvirtio_set_features(vdev, qvirtio_get_features(vdev) &
+                               ((1ull << VIRTIO_F_VERSION_1) |
+                                (1ull << VIRTIO_NET_F_CTRL_VQ) |
+                                (1ull << VIRTIO_NET_F_MQ)));
+    for (q = 0; q < AF_XDP_QUEUES; q++) {
+        rx[q] = qvirtqueue_setup(vdev, t_alloc, q * 2);
+        tx[q] = qvirtqueue_setup(vdev, t_alloc, q * 2 + 1);
+    }
+    ctrl = qvirtqueue_setup(vdev, t_alloc, AF_XDP_QUEUES * 2);
+    qvirtio_set_driver_ok(vdev);
+    af_xdp_ctrl_mq(qts, vdev, ctrl, t_alloc, AF_XDP_QUEUES);
+
+    fd = tap_open_packet_socket(peer);
+    bufs = guest_alloc(t_alloc, AF_XDP_QUEUES * TAP_PACKETS * TAP_BUF_SIZE);
+
+    /* Frames may arrive on any queue of the veth, post buffers on all */
+    for (q = 0; q < AF_XDP_QUEUES; q++) {
+        for (i = 0; i < TAP_PACKETS; i++) {
+            buf = bufs + (q * TAP_PACKETS + i) * TAP_BUF_SIZE;
+            heads[q][i] = qvirtqueue_add(qts, rx[q], buf, TAP_BUF_SIZE,
+                                         true, false);
+            qvirtqueue_kick(qts, vdev, rx[q], heads[q][i]);
+        }
+    }
+    for (i = 0; i < TAP_PACKETS; i++) {
+        tap_send_frame(fd, TAP_FRAME_SIZE, tap_bcast, i);
+    }
+    for (received = 0; received < TAP_PACKETS; ) {
+        for (q = 0; q < AF_XDP_QUEUES; q++) {
+            if (!qvirtqueue_get_buf(qts, rx[q], &desc_idx, &len)) {
+                continue;
+            }
+            for (i = 0; heads[q][i] != desc_idx; i++) {
+                g_assert_cmpint(i, <, TAP_PACKETS - 1);
+            }
+            g_assert_cmpint(len, ==, VNET_HDR_SIZE + TAP_FRAME_SIZE);
+            buf = bufs + (q * TAP_PACKETS + i) * TAP_BUF_SIZE;
+            qtest_memread(qts, buf + VNET_HDR_SIZE, frame, sizeof(frame));
+            g_assert_cmpint(frame[14], <, TAP_PACKETS);
+            g_assert(!seen[frame[14]]);
+            seen[frame[14]] = true;
+            tap_fill(expected, sizeof(expected), tap_bcast, frame[14]);
+            g_assert(memcmp(frame, expected, sizeof(frame)) == 0);
+            received++;
+        }
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_NET_TIMEOUT_US);
+        qtest_clock_step(qts, 100);
+    }
+
+    /* Send a frame from each queue, each one goes through its own socket */
+    for (q = 0; q < AF_XDP_QUEUES; q++) {
+        buf = bufs + q * TAP_PACKETS * TAP_BUF_SIZE;
+        tap_fill(frame, sizeof(frame), tap_bcast, TAP_PACKETS + q);
+        qtest_memset(qts, buf, 0, VNET_HDR_SIZE);
+        qtest_memwrite(qts, buf + VNET_HDR_SIZE, frame, sizeof(frame));
+        heads[q][0] = qvirtqueue_add(qts, tx[q], buf,
+                                     VNET_HDR_SIZE + TAP_FRAME_SIZE,
+                                     false, false);
+        qvirtqueue_kick(qts, vdev, tx[q], heads[q][0]);
+    }
+    for (q = 0; q < AF_XDP_QUEUES; q++) {
+        tap_recv_frame(fd, frame);
+        g_assert_cmpint(frame[14], >=, TAP_PACKETS);
+        g_assert_cmpint(frame[14], <, TAP_PACKETS + AF_XDP_QUEUES);
+        g_assert(!seen[frame[14]]);
+        seen[frame[14]] = true;
+        tap_fill(expected, sizeof(expected), tap_bcast, frame[14]);
+        g_assert(memcmp(frame, expected, sizeof(frame)) == 0);
+    }
+    for (q = 0; q < AF_XDP_QUEUES; q++) {
+        hotplug_nic_wait_used(qts, tx[q], heads[q][0]);
+    }
+
+    close(fd);
+    guest_free(t_alloc, bufs);
+    for (q = 0; q < AF_XDP_QUEUES; q++) {
+        qvirtqueue_cleanup(vdev->bus, rx[q], t_alloc);
+        qvirtqueue_cleanup(vdev->bus, tx[q], t_alloc);
+    }
+    qvirtqueue_cleanup(vdev->bus, ctrl, t_alloc);
+    qos_object_destroy((QOSGraphObject *)dev);
+    af_xdp_run(del);
+}
+#endif /* CONFIG_LINUX */
+
 static void virtio_net_test_cleanup(void *sockets)
 {
     int *sv = sockets;
@@ -285,6 +1294,51 @@ static void *virtio_net_test_setup(GString *cmd_line, void *arg)
     return sv;
 }
 
+static void *virtio_net_test_setup_sndbuf(GString *cmd_line, void *arg)
+{
+    int *sv = virtio_net_test_setup(cmd_line, arg);
+    int sndbuf = 4096;
+    int ret;
+
+    /* Only a few packets fit before QEMU has to queue them */
+    ret = setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    g_assert_cmpint(ret, ==, 0);
+    return sv;
+}
+
+static void virtio_net_test_cleanup_iothread(void *sockets)
+{
+    int *sv = sockets;
+    int i;
+
+    for (i = 0; i < IOTHREAD_NICS * 2; i++) {
+        close(sv[i]);
+    }
+    g_free(sv);
+}
+
+static void *virtio_net_test_setup_iothread(GString *cmd_line, void *arg)
+{
+    int *sv = g_new(int, IOTHREAD_NICS * 2);
+    int i, ret;
+
+    virtio_net_test_setup(cmd_line, arg);
+
+    for (i = 0; i < IOTHREAD_NICS; i++) {
+        ret = socketpair(PF_UNIX, SOCK_DGRAM, 0, &sv[i * 2]);
+        g_assert_cmpint(ret, !=, -1);
+
+        g_string_append_printf(cmd_line,
+                               " -object iothread,id=io%d"
+                               " -netdev socket,fd=%d,id=hs%d ",
+                               i, sv[i * 2 + 1], i + 1);
+    }
+    g_string_append(cmd_line, " -netdev hubport,hubid=0,id=hs3 ");
+
+    g_test_queue_destroy(virtio_net_test_cleanup_iothread, sv);
+    return sv;
+}
+
 #endif /* _WIN32 */
 
 static void large_tx(void *obj, void *data, QGuestAllocator *t_alloc)
@@ -328,6 +1382,27 @@ static void register_virtio_net_test(void)
     qos_add_test("basic", "virtio-net", send_recv_test, &opts);
     qos_add_test("rx_stop_cont", "virtio-net", stop_cont_test, &opts);
     qos_add_test("announce-self", "virtio-net", announce_self, &opts);
+
+    opts.before = virtio_net_test_setup_sndbuf;
+    qos_add_test("tx_batch/split", "virtio-net", tx_batch_split, &opts);
+    opts.edge.extra_device_opts = "packed=on";
+    qos_add_test("tx_batch/packed", "virtio-net", tx_batch_packed, &opts);
+    opts.edge.extra_device_opts = NULL;
+
+    opts.before = virtio_net_test_setup_iothread;
+    qos_add_test("iothread/invalid", "virtio-net-pci", iothread_invalid,
+                 &opts);
+    qos_add_test("iothread/datapath", "virtio-net-pci", iothread_datapath,
+                 &opts);
+
+#ifdef CONFIG_LINUX
+    opts.before = virtio_net_test_setup;
+    qos_add_test("tap/io-uring", "virtio-net-pci", tap_uring, &opts);
+    qos_add_test("tap/direct", "virtio-net-pci", tap_direct, &opts);
+
+    opts.before = virtio_net_test_setup_iothread;
+    qos_add_test("af-xdp/veth", "virtio-net-pci", af_xdp_veth, &opts);
+#endif
 #endif
 
     /* These tests do not need a loopback backend.  */
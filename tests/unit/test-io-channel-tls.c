@@ -34,8 +34,14 @@
 #include "authz/list.h"
 #include "qom/object_interfaces.h"
 
+#ifdef HAVE_LINUX_TLS_H
+#include <sys/utsname.h>
+#endif
+
 #define WORKDIR "tests/test-io-channel-tls-work/"
 #define KEYFILE WORKDIR "key-ctx.pem"
+#define CLIENT_CERT_DIR "tests/test-io-channel-tls-client/"
+#define SERVER_CERT_DIR "tests/test-io-channel-tls-server/"
 
 struct QIOChannelTLSTestData {
     const char *servercacrt;
@@ -64,7 +70,8 @@ static void test_tls_handshake_done(QIOTask *task,
 
 
 static QCryptoTLSCreds *test_tls_creds_create(QCryptoTLSCredsEndpoint endpoint,
-                                              const char *certdir)
+                                              const char *certdir,
+                                              bool kernelOffload)
 {
     Object *parent = object_get_objects_root();
     Object *creds = object_new_with_props(
@@ -85,6 +92,7 @@ static QCryptoTLSCreds *test_tls_creds_create(QCryptoTLSCredsEndpoint endpoint,
          * validate the sanity check code.
          */
         "sanity-check", "no",
+        "kernel-offload", kernelOffload ? "on" : "off",
         NULL
         );
 
@@ -92,6 +100,50 @@ static QCryptoTLSCreds *test_tls_creds_create(QCryptoTLSCredsEndpoint endpoint,
 }
 
 
+static void test_tls_link_certs(const struct QIOChannelTLSTestData *data)
+{
+    g_mkdir_with_parents(CLIENT_CERT_DIR, 0700);
+    g_mkdir_with_parents(SERVER_CERT_DIR, 0700);
+
+    unlink(SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_CA_CERT);
+    unlink(SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_SERVER_CERT);
+    unlink(SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_SERVER_KEY);
+
+    unlink(CLIENT_CERT_DIR QCRYPTO_TLS_CREDS_X509_CA_CERT);
+    unlink(CLIENT_CERT_DIR QCRYPTO_TLS_CREDS_X509_CLIENT_CERT);
+    unlink(CLIENT_CERT_DIR QCRYPTO_TLS_CREDS_X509_CLIENT_KEY);
+
+    g_assert(link(data->servercacrt,
+                  SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_CA_CERT) == 0);
+    g_assert(link(data->servercrt,
+                  SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_SERVER_CERT) == 0);
+    g_assert(link(KEYFILE,
+                  SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_SERVER_KEY) == 0);
+
+    g_assert(link(data->clientcacrt,
+                  CLIENT_CERT_DIR QCRYPTO_TLS_CREDS_X509_CA_CERT) == 0);
+    g_assert(link(data->clientcrt,
+                  CLIENT_CERT_DIR QCRYPTO_TLS_CREDS_X509_CLIENT_CERT) == 0);
+    g_assert(link(KEYFILE,
+                  CLIENT_CERT_DIR QCRYPTO_TLS_CREDS_X509_CLIENT_KEY) == 0);
+}
+
+
+static void test_tls_unlink_certs(void)
+{
+    unlink(SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_CA_CERT);
+    unlink(SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_SERVER_CERT);
+    unlink(SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_SERVER_KEY);
+
+    unlink(CLIENT_CERT_DIR QCRYPTO_TLS_CREDS_X509_CA_CERT);
+    unlink(CLIENT_CERT_DIR QCRYPTO_TLS_CREDS_X509_CLIENT_CERT);
+    unlink(CLIENT_CERT_DIR QCRYPTO_TLS_CREDS_X509_CLIENT_KEY);
+
+    rmdir(CLIENT_CERT_DIR);
+    rmdir(SERVER_CERT_DIR);
+}
+
+
 /*
  * This tests validation checking of peer certificates
  *
@@ -123,41 +175,16 @@ static void test_io_channel_tls(const void *opaque)
     /* We'll use this for our fake client-server connection */
     g_assert(qemu_socketpair(AF_UNIX, SOCK_STREAM, 0, channel) == 0);
 
-#define CLIENT_CERT_DIR "tests/test-io-channel-tls-client/"
-#define SERVER_CERT_DIR "tests/test-io-channel-tls-server/"
-    g_mkdir_with_parents(CLIENT_CERT_DIR, 0700);
-    g_mkdir_with_parents(SERVER_CERT_DIR, 0700);
-
-    unlink(SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_CA_CERT);
-    unlink(SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_SERVER_CERT);
-    unlink(SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_SERVER_KEY);
-
-    unlink(CLIENT_CERT_DIR QCRYPTO_TLS_CREDS_X509_CA_CERT);
-    unlink(CLIENT_CERT_DIR QCRYPTO_TLS_CREDS_X509_CLIENT_CERT);
-    unlink(CLIENT_CERT_DIR QCRYPTO_TLS_CREDS_X509_CLIENT_KEY);
-
-    g_assert(link(data->servercacrt,
-                  SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_CA_CERT) == 0);
-    g_assert(link(data->servercrt,
-                  SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_SERVER_CERT) == 0);
-    g_assert(link(KEYFILE,
-                  SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_SERVER_KEY) == 0);
-
-    g_assert(link(data->clientcacrt,
-                  CLIENT_CERT_DIR QCRYPTO_TLS_CREDS_X509_CA_CERT) == 0);
-    g_assert(link(data->clientcrt,
-                  CLIENT_CERT_DIR QCRYPTO_TLS_CREDS_X509_CLIENT_CERT) == 0);
-    g_assert(link(KEYFILE,
-                  CLIENT_CERT_DIR QCRYPTO_TLS_CREDS_X509_CLIENT_KEY) == 0);
+    test_tls_link_certs(data);
 
     clientCreds = test_tls_creds_create(
         QCRYPTO_TLS_CREDS_ENDPOINT_CLIENT,
-        CLIENT_CERT_DIR);
+        CLIENT_CERT_DIR, false);
     g_assert(clientCreds != NULL);
 
     serverCreds = test_tls_creds_create(
         QCRYPTO_TLS_CREDS_ENDPOINT_SERVER,
-        SERVER_CERT_DIR);
+        SERVER_CERT_DIR, false);
     g_assert(serverCreds != NULL);
 
     auth = qauthz_list_new("channeltlsacl",
@@ -236,16 +263,7 @@ static void test_io_channel_tls(const void *opaque)
                                  QIO_CHANNEL(serverChanTLS));
     qio_channel_test_validate(test);
 
-    unlink(SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_CA_CERT);
-    unlink(SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_SERVER_CERT);
-    unlink(SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_SERVER_KEY);
-
-    unlink(CLIENT_CERT_DIR QCRYPTO_TLS_CREDS_X509_CA_CERT);
-    unlink(CLIENT_CERT_DIR QCRYPTO_TLS_CREDS_X509_CLIENT_CERT);
-    unlink(CLIENT_CERT_DIR QCRYPTO_TLS_CREDS_X509_CLIENT_KEY);
-
-    rmdir(CLIENT_CERT_DIR);
-    rmdir(SERVER_CERT_DIR);
+    test_tls_unlink_certs();
 
     object_unparent(OBJECT(serverCreds));
     object_unparent(OBJECT(clientCreds));
@@ -262,6 +280,221 @@ static void test_io_channel_tls(const void *opaque)
     close(channel[1]);
 }
 
+#ifdef HAVE_LINUX_TLS_H
+/* Following TLS 1.3 key updates needs Linux 6.14 or newer */
+static bool test_tls_ktls_has_rekey(void)
+{
+    struct utsname uts;
+    int major, minor;
+
+    if (GNUTLS_VERSION_NUMBER < 0x030700 || uname(&uts) < 0 ||
+        sscanf(uts.release, "%d.%d", &major, &minor) != 2) {
+        return false;
+    }
+    return major > 6 || (major == 6 && minor >= 14);
+}
+
+
+typedef struct QIOChannelTLSKTLSPair {
+    QCryptoTLSCreds *clientCreds;
+    QCryptoTLSCreds *serverCreds;
+    QIOChannelTLS *clientChanTLS;
+    QIOChannelTLS *serverChanTLS;
+    QIOChannelSocket *listenChanSock;
+    QIOChannelSocket *clientChanSock;
+    QIOChannelSocket *serverChanSock;
+    SocketAddress *connectAddr;
+    QAuthZList *auth;
+} QIOChannelTLSKTLSPair;
+
+/*
+ * Kernel TLS needs a TCP socket, so run the session over the loopback
+ * interface.  The server hands its records over to the kernel when it
+ * can, and so does the client if @clientOffload.
+ */
+static void test_tls_ktls_connect(const struct QIOChannelTLSTestData *data,
+                                  bool clientOffload,
+                                  QIOChannelTLSKTLSPair *p)
+{
+    SocketAddress listenAddr = {
+        .type = SOCKET_ADDRESS_TYPE_INET,
+        .u.inet = {
+            .host = (char *)"127.0.0.1",
+            .port = (char *)"0",
+        },
+    };
+    struct QIOChannelTLSHandshakeData clientHandshake = { false, false };
+    struct QIOChannelTLSHandshakeData serverHandshake = { false, false };
+    GMainContext *mainloop;
+
+    test_tls_link_certs(data);
+
+    p->clientCreds = test_tls_creds_create(
+        QCRYPTO_TLS_CREDS_ENDPOINT_CLIENT,
+        CLIENT_CERT_DIR, clientOffload);
+    p->serverCreds = test_tls_creds_create(
+        QCRYPTO_TLS_CREDS_ENDPOINT_SERVER,
+        SERVER_CERT_DIR, true);
+
+    p->auth = qauthz_list_new("channeltlsacl",
+                              QAUTHZ_LIST_POLICY_ALLOW,
+                              &error_abort);
+
+    p->listenChanSock = qio_channel_socket_new();
+    qio_channel_socket_listen_sync(p->listenChanSock, &listenAddr, 1,
+                                   &error_abort);
+    p->connectAddr = qio_channel_socket_get_local_address(p->listenChanSock,
+                                                          &error_abort);
+
+    p->clientChanSock = qio_channel_socket_new();
+    qio_channel_socket_connect_sync(p->clientChanSock, p->connectAddr,
+                                    &error_abort);
+    qio_channel_wait(QIO_CHANNEL(p->listenChanSock), G_IO_IN);
+    p->serverChanSock = qio_channel_socket_accept(p->listenChanSock,
+                                                  &error_abort);
+
+    qio_channel_set_blocking(QIO_CHANNEL(p->clientChanSock), false, NULL);
+    qio_channel_set_blocking(QIO_CHANNEL(p->serverChanSock), false, NULL);
+
+    p->clientChanTLS = qio_channel_tls_new_client(
+        QIO_CHANNEL(p->clientChanSock), p->clientCreds,
+        data->hostname, &error_abort);
+    p->serverChanTLS = qio_channel_tls_new_server(
+        QIO_CHANNEL(p->serverChanSock), p->serverCreds,
+        "channeltlsacl", &error_abort);
+
+    qio_channel_tls_handshake(p->clientChanTLS,
+                              test_tls_handshake_done,
+                              &clientHandshake,
+                              NULL,
+                              NULL);
+    qio_channel_tls_handshake(p->serverChanTLS,
+                              test_tls_handshake_done,
+                              &serverHandshake,
+                              NULL,
+                              NULL);
+
+    mainloop = g_main_context_default();
+    do {
+        g_main_context_iteration(mainloop, TRUE);
+    } while (!clientHandshake.finished ||
+             !serverHandshake.finished);
+
+    g_assert(!clientHandshake.failed);
+    g_assert(!serverHandshake.failed);
+}
+
+static void test_tls_ktls_disconnect(QIOChannelTLSKTLSPair *p)
+{
+    test_tls_unlink_certs();
+
+    object_unparent(OBJECT(p->serverCreds));
+    object_unparent(OBJECT(p->clientCreds));
+
+    object_unref(OBJECT(p->serverChanTLS));
+    object_unref(OBJECT(p->clientChanTLS));
+
+    object_unref(OBJECT(p->serverChanSock));
+    object_unref(OBJECT(p->clientChanSock));
+    object_unref(OBJECT(p->listenChanSock));
+    qapi_free_SocketAddress(p->connectAddr);
+
+    object_unparent(OBJECT(p->auth));
+}
+
+/*
+ * The client stays in GnuTLS, so that it can send a key update which
+ * the server must follow.
+ */
+static void test_io_channel_tls_ktls(const void *opaque)
+{
+    QIOChannelTLSKTLSPair p;
+    QIOChannelTest *test;
+    char buf[4];
+
+    test_tls_ktls_connect(opaque, false, &p);
+
+    if (!(p.serverChanTLS->ktls & QCRYPTO_TLS_KTLS_RECV)) {
+        g_test_skip("kernel TLS is not available");
+        goto cleanup;
+    }
+
+    test = qio_channel_test_new();
+    qio_channel_test_run_threads(test, false,
+                                 QIO_CHANNEL(p.clientChanTLS),
+                                 QIO_CHANNEL(p.serverChanTLS));
+    qio_channel_test_validate(test);
+
+    test = qio_channel_test_new();
+    qio_channel_test_run_threads(test, true,
+                                 QIO_CHANNEL(p.serverChanTLS),
+                                 QIO_CHANNEL(p.clientChanTLS));
+    qio_channel_test_validate(test);
+
+    if (!test_tls_ktls_has_rekey() ||
+        qcrypto_tls_session_update_key(p.clientChanTLS->session,
+                                       true, NULL) < 0) {
+        g_test_message("Skipping TLS 1.3 key update");
+        goto cleanup;
+    }
+
+    /*
+     * The server follows the client key update when receiving, then
+     * answers it with its own before sending.
+     */
+    qio_channel_set_blocking(QIO_CHANNEL(p.clientChanTLS), true, NULL);
+    qio_channel_set_blocking(QIO_CHANNEL(p.serverChanTLS), true, NULL);
+
+    qio_channel_write_all(QIO_CHANNEL(p.clientChanTLS), "ping", 4,
+                          &error_abort);
+    qio_channel_read_all(QIO_CHANNEL(p.serverChanTLS), buf, 4, &error_abort);
+    g_assert(memcmp(buf, "ping", 4) == 0);
+    g_assert(p.serverChanTLS->ktls_key_update);
+
+    qio_channel_write_all(QIO_CHANNEL(p.serverChanTLS), "pong", 4,
+                          &error_abort);
+    g_assert(!p.serverChanTLS->ktls_key_update);
+    qio_channel_read_all(QIO_CHANNEL(p.clientChanTLS), buf, 4, &error_abort);
+    g_assert(memcmp(buf, "pong", 4) == 0);
+
+ cleanup:
+    test_tls_ktls_disconnect(&p);
+}
+
+/*
+ * A TLS 1.3 server sends session tickets once the handshake is complete,
+ * so with kernel TLS on the client they are the first records that it
+ * receives.  Reading one byte at a time must skip them whole.
+ */
+static void test_io_channel_tls_ktls_ticket(const void *opaque)
+{
+    QIOChannelTLSKTLSPair p;
+    char buf[4];
+    size_t i;
+
+    test_tls_ktls_connect(opaque, true, &p);
+
+    if (!(p.clientChanTLS->ktls & QCRYPTO_TLS_KTLS_RECV)) {
+        g_test_skip("kernel TLS is not available");
+        goto cleanup;
+    }
+
+    qio_channel_set_blocking(QIO_CHANNEL(p.clientChanTLS), true, NULL);
+    qio_channel_set_blocking(QIO_CHANNEL(p.serverChanTLS), true, NULL);
+
+    qio_channel_write_all(QIO_CHANNEL(p.serverChanTLS), "ping", 4,
+                          &error_abort);
+    for (i = 0; i < sizeof(buf); i++) {
+        qio_channel_read_all(QIO_CHANNEL(p.clientChanTLS), buf + i, 1,
+                             &error_abort);
+    }
+    g_assert(memcmp(buf, "ping", 4) == 0);
+
+ cleanup:
+    test_tls_ktls_disconnect(&p);
+}
+#endif
+
 
 int main(int argc, char **argv)
 {
@@ -320,6 +553,12 @@ int main(int argc, char **argv)
     TEST_CHANNEL(basic, cacertreq.filename, servercertreq.filename,
                  clientcertreq.filename, false, false,
                  "qemu.org", wildcards);
+#ifdef HAVE_LINUX_TLS_H
+    g_test_add_data_func("/qio/channel/tls/ktls",
+                         &basic, test_io_channel_tls_ktls);
+    g_test_add_data_func("/qio/channel/tls/ktls/ticket",
+                         &basic, test_io_channel_tls_ktls_ticket);
+#endif
 
     ret = g_test_run();
 
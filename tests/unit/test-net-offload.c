@@ -0,0 +1,681 @@
+/*
+ * Unit tests for the software offloads of net/offload.c
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "block/aio.h"
+#include "exec/memory.h"
+#include "net/checksum.h"
+#include "net/eth.h"
+#include "standard-headers/linux/virtio_net.h"
+#include "../net/offload.h"
+
+#define TEST_MSS                1000
+#define TEST_TS_LEN             12      /* NOP, NOP, timestamp */
+
+/*
+ * NetTxPkt is also used by devices, which map guest memory and send
+ * through the net layer; net/offload.c does neither.
+ */
+void *address_space_map(AddressSpace *as, hwaddr addr,
+                        hwaddr *plen, bool is_write, MemTxAttrs attrs)
+{
+    g_assert_not_reached();
+}
+
+void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
+                         bool is_write, hwaddr access_len)
+{
+    g_assert_not_reached();
+}
+
+int qemu_get_vnet_hdr_len(NetClientState *nc)
+{
+    g_assert_not_reached();
+}
+
+ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
+                          int iovcnt)
+{
+    g_assert_not_reached();
+}
+
+typedef struct TestClient {
+    NetClientState nc;
+    NetOffloadState *s;
+    GPtrArray *pkts;            /* what was delivered or sent, as GBytes */
+    unsigned int room;          /* packets that can still be delivered */
+} TestClient;
+
+/* A TCP segment or UDP datagram between two fixed endpoints */
+typedef struct TestPacket {
+    uint16_t proto;             /* ETH_P_IP or ETH_P_IPV6 */
+    uint8_t l4proto;            /* IP_PROTO_TCP or IP_PROTO_UDP */
+    uint32_t seq;               /* also seeds the payload */
+    uint8_t flags;              /* in addition to ACK */
+    uint16_t ip_id;
+    uint16_t ip_off;
+    uint32_t tsval;             /* TCP timestamp option, if not 0 */
+    size_t payload;
+} TestPacket;
+
+static void test_record(TestClient *t, const struct iovec *iov, int iovcnt)
+{
+    size_t size = iov_size(iov, iovcnt);
+    uint8_t *buf = g_malloc(size);
+
+    iov_to_buf(iov, iovcnt, 0, buf, size);
+    g_ptr_array_add(t->pkts, g_bytes_new_take(buf, size));
+}
+
+static ssize_t test_deliver(NetClientState *nc,
+                            const struct iovec *iov, int iovcnt)
+{
+    TestClient *t = container_of(nc, TestClient, nc);
+
+    if (!t->room) {
+        return 0;
+    }
+    t->room--;
+    test_record(t, iov, iovcnt);
+    return iov_size(iov, iovcnt);
+}
+
+static ssize_t test_send(NetClientState *nc,
+                         const struct iovec *iov, int iovcnt,
+                         NetPacketSent *sent_cb)
+{
+    TestClient *t = container_of(nc, TestClient, nc);
+
+    test_record(t, iov, iovcnt);
+    return iov_size(iov, iovcnt);
+}
+
+static void test_client_init(TestClient *t)
+{
+    memset(t, 0, sizeof(*t));
+    t->nc.vnet_hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+    t->s = net_offload_new(&t->nc, test_send);
+    t->pkts = g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+    t->room = UINT_MAX;
+}
+
+static void test_client_cleanup(TestClient *t)
+{
+    net_offload_free(t->s);
+    g_ptr_array_unref(t->pkts);
+}
+
+static const uint8_t *test_pkt(TestClient *t, unsigned int i, size_t *size)
+{
+    g_assert_cmpuint(i, <, t->pkts->len);
+    return g_bytes_get_data(g_ptr_array_index(t->pkts, i), size);
+}
+
+/* Run the bottom half that flushes coalesced segments */
+static void test_flush(void)
+{
+    while (aio_poll(qemu_get_aio_context(), false)) {
+        /* nothing */
+    }
+}
+
+static size_t test_l3_hdrlen(uint16_t proto)
+{
+    return proto == ETH_P_IP ? sizeof(struct ip_header) :
+                               sizeof(struct ip6_header);
+}
+
+/* Folded sum of an L4 header, its payload and pseudo-header; 0 if valid */
+static uint16_t test_l4_sum(const uint8_t *frame, size_t size)
+{
+    uint16_t proto = lduw_be_p(frame + 12);
+    size_t l4_off = ETH_HLEN + test_l3_hdrlen(proto);
+    uint8_t *l3 = (uint8_t *)frame + ETH_HLEN;
+    uint32_t sum, cso;
+
+    if (proto == ETH_P_IP) {
+        sum = eth_calc_ip4_pseudo_hdr_csum((struct ip_header *)l3,
+                                           size - l4_off, &cso);
+    } else {
+        struct ip6_header *ip6 = (struct ip6_header *)l3;
+
+        sum = eth_calc_ip6_pseudo_hdr_csum(ip6, size - l4_off,
+                                           ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt,
+                                           &cso);
+    }
+    sum += net_checksum_add(size - l4_off, (uint8_t *)frame + l4_off);
+    return net_checksum_finish(sum);
+}
+
+static size_t test_l4_hdrlen(const TestPacket *p)
+{
+    if (p->l4proto == IP_PROTO_UDP) {
+        return sizeof(struct udp_header);
+    }
+    return sizeof(struct tcp_header) + (p->tsval ? TEST_TS_LEN : 0);
+}
+
+/* Build @p with valid checksums, returns the size of the frame */
+static size_t test_build(uint8_t *frame, const TestPacket *p)
+{
+    static const uint8_t macs[] = {
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x56,
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x57,
+    };
+    size_t l3_hdrlen = test_l3_hdrlen(p->proto);
+    size_t l4_hdrlen = test_l4_hdrlen(p);
+    size_t l4_off = ETH_HLEN + l3_hdrlen;
+    size_t size = l4_off + l4_hdrlen + p->payload;
+    uint8_t *l3 = frame + ETH_HLEN;
+    uint8_t *l4 = frame + l4_off;
+    size_t i;
+
+    memset(frame, 0, l4_off + l4_hdrlen);
+    memcpy(frame, macs, sizeof(macs));
+    stw_be_p(frame + 12, p->proto);
+
+    if (p->proto == ETH_P_IP) {
+        struct ip_header *ip = (struct ip_header *)l3;
+
+        ip->ip_ver_len = (IP_HEADER_VERSION_4 << 4) | (l3_hdrlen >> 2);
+        stw_be_p(&ip->ip_len, l3_hdrlen + l4_hdrlen + p->payload);
+        stw_be_p(&ip->ip_id, p->ip_id);
+        stw_be_p(&ip->ip_off, p->ip_off);
+        ip->ip_ttl = 64;
+        ip->ip_p = p->l4proto;
+        stl_be_p(&ip->ip_src, 0x0a000001);
+        stl_be_p(&ip->ip_dst, 0x0a000002);
+        eth_fix_ip4_checksum(ip, l3_hdrlen);
+    } else {
+        struct ip6_header *ip6 = (struct ip6_header *)l3;
+
+        l3[0] = IP_HEADER_VERSION_6 << 4;
+        stw_be_p(&ip6->ip6_ctlun.ip6_un1.ip6_un1_plen, l4_hdrlen + p->payload);
+        ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt = p->l4proto;
+        ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim = 64;
+        ip6->ip6_src.s6_addr[0] = ip6->ip6_dst.s6_addr[0] = 0xfe;
+        ip6->ip6_src.s6_addr[1] = ip6->ip6_dst.s6_addr[1] = 0x80;
+        ip6->ip6_src.s6_addr[15] = 1;
+        ip6->ip6_dst.s6_addr[15] = 2;
+    }
+
+    if (p->l4proto == IP_PROTO_TCP) {
+        struct tcp_header *tcp = (struct tcp_header *)l4;
+
+        stw_be_p(&tcp->th_sport, 1234);
+        stw_be_p(&tcp->th_dport, 80);
+        stl_be_p(&tcp->th_seq, p->seq);
+        stl_be_p(&tcp->th_ack, 1);
+        stw_be_p(&tcp->th_offset_flags,
+                 ((l4_hdrlen >> 2) << 12) | TH_ACK | p->flags);
+        stw_be_p(&tcp->th_win, 1000);
+        if (p->tsval) {
+            uint8_t *opt = (uint8_t *)(tcp + 1);
+
+            opt[0] = opt[1] = 1;
+            opt[2] = 8;
+            opt[3] = 10;
+            stl_be_p(opt + 4, p->tsval);
+        }
+    } else {
+        struct udp_header *udp = (struct udp_header *)l4;
+
+        stw_be_p(&udp->uh_sport, 1234);
+        stw_be_p(&udp->uh_dport, 80);
+        stw_be_p(&udp->uh_ulen, l4_hdrlen + p->payload);
+    }
+
+    for (i = 0; i < p->payload; i++) {
+        l4[l4_hdrlen + i] = p->seq + i;
+    }
+
+    stw_be_p(l4 + (p->l4proto == IP_PROTO_TCP ?
+                   offsetof(struct tcp_header, th_sum) :
+                   offsetof(struct udp_header, uh_sum)),
+             test_l4_sum(frame, size));
+    return size;
+}
+
+/*
+ * Check that @size bytes of @frame are the segment of @p at @offset.
+ * Coalesced packets keep the L4 checksum of their first segment, so
+ * @l4_csum is false for them.
+ */
+static void test_check_segment(const uint8_t *frame, size_t size,
+                               const TestPacket *p, size_t offset, size_t len,
+                               bool l4_csum)
+{
+    size_t l3_hdrlen = test_l3_hdrlen(p->proto);
+    size_t l4_hdrlen = test_l4_hdrlen(p);
+    size_t l4_off = ETH_HLEN + l3_hdrlen;
+    const uint8_t *l3 = frame + ETH_HLEN;
+    const uint8_t *l4 = frame + l4_off;
+    size_t i;
+
+    g_assert_cmpuint(size, ==, l4_off + l4_hdrlen + len);
+    g_assert_cmpuint(lduw_be_p(frame + 12), ==, p->proto);
+
+    if (p->proto == ETH_P_IP) {
+        const struct ip_header *ip = (const struct ip_header *)l3;
+
+        g_assert_cmpuint(lduw_be_p(&ip->ip_len), ==, size - ETH_HLEN);
+        g_assert_cmpuint(net_raw_checksum((uint8_t *)l3, l3_hdrlen), ==, 0);
+    } else {
+        const struct ip6_header *ip6 = (const struct ip6_header *)l3;
+
+        g_assert_cmpuint(lduw_be_p(&ip6->ip6_ctlun.ip6_un1.ip6_un1_plen), ==,
+                         size - l4_off);
+    }
+
+    if (p->l4proto == IP_PROTO_TCP) {
+        const struct tcp_header *tcp = (const struct tcp_header *)l4;
+
+        g_assert_cmpuint(ldl_be_p(&tcp->th_seq), ==,
+                         (uint32_t)(p->seq + offset));
+        g_assert_cmpuint(TCP_HEADER_DATA_OFFSET(tcp), ==, l4_hdrlen);
+    } else {
+        const struct udp_header *udp = (const struct udp_header *)l4;
+
+        g_assert_cmpuint(lduw_be_p(&udp->uh_ulen), ==, l4_hdrlen + len);
+    }
+    if (l4_csum) {
+        g_assert_cmpuint(test_l4_sum(frame, size), ==, 0);
+    }
+
+    for (i = 0; i < len; i++) {
+        g_assert_cmpuint(l4[l4_hdrlen + i], ==, (uint8_t)(p->seq + offset + i));
+    }
+}
+
+/*
+ * Packets from the peer: GSO packets are split into MSS-sized segments
+ * with their own lengths, IDs, sequence numbers and checksums.
+ */
+
+static ssize_t test_receive(TestClient *t, const TestPacket *p,
+                            uint8_t gso_type, uint8_t *frame)
+{
+    size_t l4_off = ETH_HLEN + test_l3_hdrlen(p->proto);
+    struct virtio_net_hdr_mrg_rxbuf hdr = {
+        .hdr = {
+            .flags = VIRTIO_NET_HDR_F_NEEDS_CSUM,
+            .gso_type = gso_type,
+            .hdr_len = l4_off + test_l4_hdrlen(p),
+            .gso_size = TEST_MSS,
+            .csum_start = l4_off,
+            .csum_offset = p->l4proto == IP_PROTO_TCP ?
+                           offsetof(struct tcp_header, th_sum) :
+                           offsetof(struct udp_header, uh_sum),
+        },
+    };
+    struct iovec iov[] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = frame, .iov_len = test_build(frame, p) },
+    };
+
+    return net_offload_receive_iov(t->s, iov, ARRAY_SIZE(iov), test_deliver);
+}
+
+static void test_check_split(TestClient *t, unsigned int first,
+                             const TestPacket *p)
+{
+    unsigned int n = DIV_ROUND_UP(p->payload, TEST_MSS);
+    unsigned int i;
+
+    g_assert_cmpuint(t->pkts->len, ==, first + n);
+    for (i = 0; i < n; i++) {
+        size_t offset = i * TEST_MSS;
+        size_t size;
+        const uint8_t *frame = test_pkt(t, first + i, &size);
+
+        test_check_segment(frame, size, p, offset,
+                           MIN(p->payload - offset, TEST_MSS), true);
+        if (p->proto == ETH_P_IP) {
+            const struct ip_header *ip =
+                (const struct ip_header *)(frame + ETH_HLEN);
+
+            g_assert_cmpuint(lduw_be_p(&ip->ip_id), ==,
+                             (uint16_t)(p->ip_id + i));
+        }
+    }
+}
+
+static void test_receive_gso(const TestPacket *p, uint8_t gso_type)
+{
+    g_autofree uint8_t *frame = g_malloc(NET_BUFSIZE);
+    TestClient t;
+    ssize_t ret;
+
+    test_client_init(&t);
+    ret = test_receive(&t, p, gso_type, frame);
+    g_assert_cmpint(ret, ==, sizeof(struct virtio_net_hdr_mrg_rxbuf) +
+                             ETH_HLEN + test_l3_hdrlen(p->proto) +
+                             test_l4_hdrlen(p) + p->payload);
+    test_check_split(&t, 0, p);
+    test_client_cleanup(&t);
+}
+
+static void test_receive_tcp4(void)
+{
+    TestPacket p = {
+        .proto = ETH_P_IP, .l4proto = IP_PROTO_TCP, .seq = 0xfffff000,
+        .ip_id = 0xfffe, .ip_off = IP_DF, .tsval = 1,
+        .payload = 3 * TEST_MSS + 500,
+    };
+
+    test_receive_gso(&p, VIRTIO_NET_HDR_GSO_TCPV4);
+}
+
+static void test_receive_tcp6(void)
+{
+    TestPacket p = {
+        .proto = ETH_P_IPV6, .l4proto = IP_PROTO_TCP, .seq = 1,
+        .payload = 4 * TEST_MSS,
+    };
+
+    test_receive_gso(&p, VIRTIO_NET_HDR_GSO_TCPV6);
+}
+
+static void test_receive_uso(void)
+{
+    TestPacket p = {
+        .proto = ETH_P_IP, .l4proto = IP_PROTO_UDP, .ip_id = 7,
+        .payload = 2 * TEST_MSS + 1,
+    };
+
+    test_receive_gso(&p, VIRTIO_NET_HDR_GSO_UDP_L4);
+}
+
+/* The net queue passes a packet again after the client blocked on it */
+static void test_receive_blocked(void)
+{
+    g_autofree uint8_t *frame = g_malloc(NET_BUFSIZE);
+    TestPacket p = {
+        .proto = ETH_P_IP, .l4proto = IP_PROTO_TCP, .seq = 1000, .ip_id = 1,
+        .payload = 4 * TEST_MSS,
+    };
+    TestPacket q = p;
+    TestClient t;
+
+    test_client_init(&t);
+
+    t.room = 2;
+    g_assert_cmpint(test_receive(&t, &p, VIRTIO_NET_HDR_GSO_TCPV4, frame),
+                    ==, 0);
+    g_assert_cmpuint(t.pkts->len, ==, 2);
+
+    /* Only the segments that were not accepted are delivered again */
+    t.room = 1;
+    g_assert_cmpint(test_receive(&t, &p, VIRTIO_NET_HDR_GSO_TCPV4, frame),
+                    ==, 0);
+    t.room = UINT_MAX;
+    g_assert_cmpint(test_receive(&t, &p, VIRTIO_NET_HDR_GSO_TCPV4, frame),
+                    >, 0);
+    test_check_split(&t, 0, &p);
+
+    /* A packet that replaces a purged one is delivered in full */
+    t.room = 1;
+    g_assert_cmpint(test_receive(&t, &p, VIRTIO_NET_HDR_GSO_TCPV4, frame),
+                    ==, 0);
+    q.seq += p.payload;
+    t.room = UINT_MAX;
+    g_assert_cmpint(test_receive(&t, &q, VIRTIO_NET_HDR_GSO_TCPV4, frame),
+                    >, 0);
+    test_check_split(&t, 5, &q);
+
+    test_client_cleanup(&t);
+}
+
+/*
+ * Packets to the peer: in-order TCP segments are coalesced into GSO
+ * packets, following the rules of Linux GRO.
+ */
+
+static void test_send_segment(TestClient *t, const TestPacket *p)
+{
+    g_autofree uint8_t *frame = g_malloc(NET_BUFSIZE);
+    struct iovec iov = { .iov_base = frame };
+
+    iov.iov_len = test_build(frame, p);
+    g_assert_cmpint(net_offload_send_iov(t->s, &iov, 1, NULL), ==,
+                    iov.iov_len);
+}
+
+/* Send @n segments of @p, which is updated to the next one */
+static void test_send_segments(TestClient *t, TestPacket *p, unsigned int n)
+{
+    while (n--) {
+        test_send_segment(t, p);
+        p->seq += p->payload;
+        p->ip_id++;
+    }
+}
+
+/* Check that packet @i coalesces @segments segments from @p on */
+static void test_check_coalesced(TestClient *t, unsigned int i,
+                                 const TestPacket *p, unsigned int segments)
+{
+    size_t size, hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+    const uint8_t *pkt = test_pkt(t, i, &size);
+    const struct virtio_net_hdr *hdr = (const struct virtio_net_hdr *)pkt;
+
+    g_assert_cmpuint(hdr->flags, ==, VIRTIO_NET_HDR_F_DATA_VALID);
+    if (segments > 1) {
+        g_assert_cmpuint(hdr->gso_type, ==,
+                         p->proto == ETH_P_IP ? VIRTIO_NET_HDR_GSO_TCPV4 :
+                                                VIRTIO_NET_HDR_GSO_TCPV6);
+        g_assert_cmpuint(hdr->gso_size, ==, p->payload);
+        g_assert_cmpuint(hdr->hdr_len, ==, ETH_HLEN +
+                         test_l3_hdrlen(p->proto) + test_l4_hdrlen(p));
+    } else {
+        g_assert_cmpuint(hdr->gso_type, ==, VIRTIO_NET_HDR_GSO_NONE);
+    }
+    test_check_segment(pkt + hdr_len, size - hdr_len, p, 0,
+                       segments * p->payload, segments == 1);
+}
+
+static void test_send_init(TestClient *t)
+{
+    test_client_init(t);
+    net_offload_set_offload(t->s, 1, 1, 1, 0, 0, 0, 0);
+}
+
+static void test_send_gro(uint16_t proto)
+{
+    TestPacket p = {
+        .proto = proto, .l4proto = IP_PROTO_TCP, .seq = 0xfffffc00,
+        .ip_id = 0xffff, .tsval = 1, .payload = TEST_MSS,
+    };
+    TestPacket first = p;
+    TestClient t;
+
+    test_send_init(&t);
+    test_send_segments(&t, &p, 3);
+    g_assert_cmpuint(t.pkts->len, ==, 0);
+    test_flush();
+    g_assert_cmpuint(t.pkts->len, ==, 1);
+    test_check_coalesced(&t, 0, &first, 3);
+    test_client_cleanup(&t);
+}
+
+static void test_send_gro4(void)
+{
+    test_send_gro(ETH_P_IP);
+}
+
+static void test_send_gro6(void)
+{
+    test_send_gro(ETH_P_IPV6);
+}
+
+/* PSH ends the coalesced packet right away */
+static void test_send_push(void)
+{
+    TestPacket p = {
+        .proto = ETH_P_IP, .l4proto = IP_PROTO_TCP, .payload = TEST_MSS,
+    };
+    TestPacket first = p;
+    const struct tcp_header *tcp;
+    const uint8_t *pkt;
+    TestClient t;
+    size_t size;
+
+    test_send_init(&t);
+    test_send_segments(&t, &p, 2);
+    p.flags = TH_PUSH;
+    test_send_segments(&t, &p, 1);
+    g_assert_cmpuint(t.pkts->len, ==, 1);
+    test_check_coalesced(&t, 0, &first, 3);
+
+    pkt = test_pkt(&t, 0, &size);
+    tcp = (const struct tcp_header *)(pkt +
+                                      sizeof(struct virtio_net_hdr_mrg_rxbuf) +
+                                      ETH_HLEN + sizeof(struct ip_header));
+    g_assert_cmpuint(lduw_be_p(&tcp->th_offset_flags) & TH_PUSH, ==, TH_PUSH);
+
+    /* A PSH segment that starts a flow is sent alone */
+    test_send_segments(&t, &p, 1);
+    g_assert_cmpuint(t.pkts->len, ==, 2);
+    test_flush();
+    g_assert_cmpuint(t.pkts->len, ==, 2);
+    test_client_cleanup(&t);
+}
+
+static void test_send_out_of_order(void)
+{
+    TestPacket p = {
+        .proto = ETH_P_IP, .l4proto = IP_PROTO_TCP, .payload = TEST_MSS,
+    };
+    TestPacket first = p, second;
+    TestClient t;
+
+    test_send_init(&t);
+    test_send_segments(&t, &p, 1);
+    p.seq += TEST_MSS;
+    second = p;
+    test_send_segments(&t, &p, 1);
+    test_flush();
+
+    g_assert_cmpuint(t.pkts->len, ==, 2);
+    test_check_coalesced(&t, 0, &first, 1);
+    test_check_coalesced(&t, 1, &second, 1);
+    test_client_cleanup(&t);
+}
+
+/* Segments with different TCP options are not coalesced */
+static void test_send_options(void)
+{
+    TestPacket p = {
+        .proto = ETH_P_IP, .l4proto = IP_PROTO_TCP, .tsval = 1,
+        .payload = TEST_MSS,
+    };
+    TestPacket first = p, second;
+    TestClient t;
+
+    test_send_init(&t);
+    test_send_segments(&t, &p, 1);
+    p.tsval = 2;
+    second = p;
+    test_send_segments(&t, &p, 1);
+    test_flush();
+
+    g_assert_cmpuint(t.pkts->len, ==, 2);
+    test_check_coalesced(&t, 0, &first, 1);
+    test_check_coalesced(&t, 1, &second, 1);
+    test_client_cleanup(&t);
+}
+
+/* Coalesced packets never exceed the maximum IP datagram */
+static void test_send_64k(void)
+{
+    TestPacket p = {
+        .proto = ETH_P_IP, .l4proto = IP_PROTO_TCP, .tsval = 1,
+        .payload = TEST_MSS,
+    };
+    TestPacket first = p, second;
+    size_t hdrlen = sizeof(struct ip_header) + test_l4_hdrlen(&p);
+    unsigned int max = (ETH_MAX_IP_DGRAM_LEN - hdrlen) / TEST_MSS;
+    TestClient t;
+
+    test_send_init(&t);
+    test_send_segments(&t, &p, max);
+    second = p;
+    test_send_segments(&t, &p, 5);
+    test_flush();
+
+    g_assert_cmpuint(t.pkts->len, ==, 2);
+    test_check_coalesced(&t, 0, &first, max);
+    test_check_coalesced(&t, 1, &second, 5);
+    test_client_cleanup(&t);
+}
+
+/*
+ * IPv4 IDs go up by one with each segment, or stay the same when DF is
+ * set; DF must be the same for all segments.
+ */
+static void test_send_ip_id(void)
+{
+    TestPacket p = {
+        .proto = ETH_P_IP, .l4proto = IP_PROTO_TCP, .ip_id = 7,
+        .ip_off = IP_DF, .payload = TEST_MSS,
+    };
+    TestPacket fixed, incr, no_df, no_df_fixed;
+    TestClient t;
+
+    test_send_init(&t);
+
+    /* Fixed IDs with DF, then an ID that goes up */
+    fixed = p;
+    test_send_segment(&t, &p);
+    p.seq += TEST_MSS;
+    test_send_segment(&t, &p);
+    p.seq += TEST_MSS;
+    p.ip_id += 2;
+    incr = p;
+    test_send_segments(&t, &p, 2);
+
+    /* DF changes */
+    p.ip_off = 0;
+    no_df = p;
+    test_send_segments(&t, &p, 1);
+
+    /* Fixed IDs without DF */
+    p.ip_id = no_df.ip_id;
+    no_df_fixed = p;
+    test_send_segment(&t, &p);
+    test_flush();
+
+    g_assert_cmpuint(t.pkts->len, ==, 4);
+    test_check_coalesced(&t, 0, &fixed, 2);
+    test_check_coalesced(&t, 1, &incr, 2);
+    test_check_coalesced(&t, 2, &no_df, 1);
+    test_check_coalesced(&t, 3, &no_df_fixed, 1);
+    test_client_cleanup(&t);
+}
+
+int main(int argc, char **argv)
+{
+    qemu_init_main_loop(&error_abort);
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/net-offload/receive/tcp4", test_receive_tcp4);
+    g_test_add_func("/net-offload/receive/tcp6", test_receive_tcp6);
+    g_test_add_func("/net-offload/receive/uso", test_receive_uso);
+    g_test_add_func("/net-offload/receive/blocked", test_receive_blocked);
+    g_test_add_func("/net-offload/send/gro4", test_send_gro4);
+    g_test_add_func("/net-offload/send/gro6", test_send_gro6);
+    g_test_add_func("/net-offload/send/push", test_send_push);
+    g_test_add_func("/net-offload/send/out-of-order", test_send_out_of_order);
+    g_test_add_func("/net-offload/send/options", test_send_options);
+    g_test_add_func("/net-offload/send/64k", test_send_64k);
+    g_test_add_func("/net-offload/send/ip-id", test_send_ip_id);
+
+    return g_test_run();
+}